@@ -6,8 +6,10 @@
 #include "common.h"
 #include "log.h"
 #include "args.h"
+#include "convert.h"
+#include "source.h"
 
-const char short_options[] = "d:?iP:F:w:h:f:c:D:b";
+const char short_options[] = "d:?iP:F:w:h:f:c:D:bn:q:k:SZR:WI:T:M:o:x:GYs:UB:L";
 
 const struct option
         long_options[] = {
@@ -22,6 +24,24 @@ const struct option
         { "count",  required_argument, NULL, 'c' },
         { "debug",  required_argument, NULL, 'D' },
         { "background",  required_argument, NULL, 'b' },
+        { "nv12-bufs",   required_argument, NULL, 'n' },
+        { "txq-frames",  required_argument, NULL, 'q' },
+        { "txq-kbytes",  required_argument, NULL, 'k' },
+        { "tx-split",    no_argument,       NULL, 'S' },
+        { "zerocopy",    no_argument,       NULL, 'Z' },
+        { "rtp",         required_argument, NULL, 'R' },
+        { "persistent",  no_argument,       NULL, 'W' },
+        { "isa",         required_argument, NULL, 'I' },
+        { "threads",     required_argument, NULL, 'T' },
+        { "mjpeg",       required_argument, NULL, 'M' },
+        { "out-size",    required_argument, NULL, 'o' },
+        { "scale",       required_argument, NULL, 'x' },
+        { "staged",      no_argument,       NULL, 'G' },
+        { "dma-sync",    no_argument,       NULL, 'Y' },
+        { "source",      required_argument, NULL, 's' },
+        { "unpaced",     no_argument,       NULL, 'U' },
+        { "cam-bufs",    required_argument, NULL, 'B' },
+        { "latest",      no_argument,       NULL, 'L' },
         { 0, 0, 0, 0 }
 };
 
@@ -33,13 +53,20 @@ static void set_defaults(struct Webcam_inst *wcam_i,
     wcam_i->height = 600;
     wcam_i->frame_rate = 10;
     wcam_i->frame_count = 100;
+    wcam_i->conv_isa = CONV_ISA_AUTO;
+    wcam_i->conv_threads = 1;
+    wcam_i->conv_scale = CONV_SCALE_AUTO;
+    wcam_i->req_buffers = REQ_BUFF;
 
     strcpy(srv_i->string, "loopback");
     srv_i->port = 5100;
     srv_i->run_mode = FOREGROUND;
+    srv_i->txq_max_frames = SRV_TXQ_FRAMES;
+    srv_i->txq_max_bytes = SRV_TXQ_KBYTES * 1024;
 
     strcpy(coda_i->coda_name, "/dev/video0");
     coda_i->bitrate = 0;
+    coda_i->nv12_req_cnt = NV12_REQBUF_CNT;
     //coda_i->num_bframes = 10;
 }
 
@@ -61,9 +88,30 @@ void usage(char **argv,
     fprintf(stderr, "\t-F | --file          Output stream to file \n");
     fprintf(stderr, "\t-w | --width         Frame width resolution [320..1920] \n");
     fprintf(stderr, "\t-h | --height        Frame height resolution [240..1080]\n");
-    fprintf(stderr, "\t-f | --frate         Framerate [5..30] \n");
+    fprintf(stderr, "\t-f | --frate         Framerate [5..60] \n");
     fprintf(stderr, "\t-c | --count         Number of frames to grab [0 - run forever] \n");
     fprintf(stderr, "\t-b | --background    Run in background mode \n");
+    fprintf(stderr, "\t-n | --nv12-bufs     Number of Coda NV12 buffers [1..%d] \n",
+            CODA_MAX_BUFF);
+    fprintf(stderr, "\t-q | --txq-frames    Max frames queued for a slow client [1..%d] \n",
+            SRV_TXQ_LEN);
+    fprintf(stderr, "\t-k | --txq-kbytes    Max kbytes queued for a slow client [64..65536] \n");
+    fprintf(stderr, "\t-S | --tx-split      Send frame header and data by separate syscalls \n");
+    fprintf(stderr, "\t-Z | --zerocopy      Send h264 frames with MSG_ZEROCOPY \n");
+    fprintf(stderr, "\t-R | --rtp           Stream RTP/UDP to [ip:port] \n");
+    fprintf(stderr, "\t-W | --persistent    Keep devices streaming between client sessions \n");
+    fprintf(stderr, "\t-I | --isa           YUYV conversion backend [auto|scalar|neon|sse2|avx2] \n");
+    fprintf(stderr, "\t-T | --threads       YUYV conversion threads [0 - one per core, 1..%d] \n",
+            CONV_THREADS_MAX);
+    fprintf(stderr, "\t-M | --mjpeg         Capture MJPEG, decode with [sw|/dev/videoN] \n");
+    fprintf(stderr, "\t-o | --out-size      Encode at WxH, scaled from the capture size \n");
+    fprintf(stderr, "\t-x | --scale         Scaling filter [auto|box|bilinear] \n");
+    fprintf(stderr, "\t-G | --staged        Write Coda's buffers by whole lines (uncached memory) \n");
+    fprintf(stderr, "\t-Y | --dma-sync      Export buffers, bracket CPU access with dma-buf sync \n");
+    fprintf(stderr, "\t-s | --source        Frames from [file:name.yuy2|pattern] instead of -d \n");
+    fprintf(stderr, "\t-U | --unpaced       File or pattern frames as fast as they are taken \n");
+    fprintf(stderr, "\t-B | --cam-bufs      Number of camera buffers [2..%d] \n", WCAM_MAX_BUFF);
+    fprintf(stderr, "\t-L | --latest        Encode the newest ready frame only, skip older ones \n");
     fprintf(stderr, "\t-D | --debug         Debug level [0..6] \n");
 }
 
@@ -151,7 +199,7 @@ int pars_args(int argc, char **argv, struct Webcam_inst* wcam_i,
 
             case 'f':
                 wcam_i->frame_rate = strtol(optarg, NULL, 10);
-                if( wcam_i->frame_rate < 5 || wcam_i->frame_rate > 30 ) {
+                if( wcam_i->frame_rate < 5 || wcam_i->frame_rate > 60 ) {
                     log_fatal("A problem with parameter '--frate'");
                     return -1;
                 }
@@ -179,6 +227,144 @@ int pars_args(int argc, char **argv, struct Webcam_inst* wcam_i,
                 //log_set_quiet(BACKGROUND);
                 break;
 
+            case 'n':
+                coda_i->nv12_req_cnt = strtol(optarg, NULL, 10);
+                if( coda_i->nv12_req_cnt < 1 ||
+                    coda_i->nv12_req_cnt > CODA_MAX_BUFF ) {
+                    log_fatal("A problem with parameter '--nv12-bufs'");
+                    return -1;
+                }
+                break;
+
+            case 'q':
+                srv_i->txq_max_frames = strtol(optarg, NULL, 10);
+                if( srv_i->txq_max_frames < 1 ||
+                    srv_i->txq_max_frames > SRV_TXQ_LEN ) {
+                    log_fatal("A problem with parameter '--txq-frames'");
+                    return -1;
+                }
+                break;
+
+            case 'k': {
+                long kbytes = strtol(optarg, NULL, 10);
+                if( kbytes < 64 || kbytes > 65536 ) {
+                    log_fatal("A problem with parameter '--txq-kbytes'");
+                    return -1;
+                }
+                srv_i->txq_max_bytes = kbytes * 1024;
+                break;
+            }
+
+            case 'S':
+                srv_i->tx_split = 1;
+                break;
+
+            case 'Z':
+                srv_i->zerocopy = 1;
+                break;
+
+            case 'I':
+                wcam_i->conv_isa = conv_isa_by_name(optarg);
+                if( wcam_i->conv_isa == CONV_ISA_INVALID ) {
+                    log_fatal("A problem with parameter '--isa'");
+                    return -1;
+                }
+                break;
+
+            case 'T':
+                wcam_i->conv_threads = strtol(optarg, NULL, 10);
+                if( wcam_i->conv_threads < 0 ||
+                    wcam_i->conv_threads > CONV_THREADS_MAX ) {
+                    log_fatal("A problem with parameter '--threads'");
+                    return -1;
+                }
+                break;
+
+            case 'M':
+                if( strlen(optarg) >= sizeof(wcam_i->mjpeg_dec) ) {
+                    log_fatal("A problem with parameter '--mjpeg'");
+                    return -1;
+                }
+                strcpy(wcam_i->mjpeg_dec, optarg);
+                break;
+
+            case 'o': {
+                char *x_ptr;
+
+                coda_i->out_width = strtol(optarg, &x_ptr, 10);
+                coda_i->out_height = *x_ptr == 'x' ? strtol(x_ptr + 1, NULL, 10) : 0;
+                if( coda_i->out_width < 64 || coda_i->out_width > 1920 ||
+                    coda_i->out_height < 64 || coda_i->out_height > 1080 ||
+                    coda_i->out_width % 2 || coda_i->out_height % 2 ) {
+                    log_fatal("A problem with parameter '--out-size'");
+                    return -1;
+                }
+                break;
+            }
+
+            case 'x':
+                wcam_i->conv_scale = conv_scale_by_name(optarg);
+                if( wcam_i->conv_scale == CONV_SCALE_INVALID ) {
+                    log_fatal("A problem with parameter '--scale'");
+                    return -1;
+                }
+                break;
+
+            case 'G':
+                wcam_i->conv_staged = 1;
+                break;
+
+            case 'Y':
+                wcam_i->dma_sync = 1;
+                coda_i->dma_sync = 1;
+                break;
+
+            case 'W':
+                srv_i->persistent = 1;
+                break;
+
+            case 's':
+                if( source_parse(wcam_i, optarg) != 0 ) {
+                    log_fatal("A problem with parameter '--source'");
+                    return -1;
+                }
+                break;
+
+            case 'U':
+                wcam_i->src_unpaced = 1;
+                break;
+
+            case 'B':
+                wcam_i->req_buffers = strtol(optarg, NULL, 10);
+                if( wcam_i->req_buffers < 2 ||
+                    wcam_i->req_buffers > WCAM_MAX_BUFF ) {
+                    log_fatal("A problem with parameter '--cam-bufs'");
+                    return -1;
+                }
+                break;
+
+            case 'L':
+                wcam_i->latest = 1;
+                break;
+
+            case 'R': {
+                char *colon_ptr = strchr(optarg, ':');
+
+                if( !colon_ptr || colon_ptr - optarg >= (int)sizeof(srv_i->rtp.host) ) {
+                    log_fatal("A problem with parameter '--rtp'");
+                    return -1;
+                }
+                *colon_ptr = '\0';
+                strcpy(srv_i->rtp.host, optarg);
+                srv_i->rtp.port = strtol(colon_ptr + 1, NULL, 10);
+                if( srv_i->rtp.port <= 0 || srv_i->rtp.port > 65535 ) {
+                    log_fatal("A problem with parameter '--rtp'");
+                    return -1;
+                }
+                srv_i->rtp_on = 1;
+                break;
+            }
+
             default:
                 usage(argv, wcam_i, srv_i);
                 exit(0);
@@ -0,0 +1,402 @@
+/* Conversion microbenchmark. Every backend with the fused and the legacy
+ * kernel, staged writes, the worker pool and the fused scaler convert the
+ * sample picture and synthetic frames of the usual sizes. The results go
+ * out as JSON, one object per case: median and p99 time of a frame, CPU
+ * cycles per pixel and bytes moved per second, so releases can be
+ * compared against each other */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "../convert.h"
+#include "../log.h"
+
+#define RUNS_DEFAULT    200
+#define RUNS_WARMUP     5
+#define CASES_MAX       32
+
+#ifndef BENCH_SAMPLE
+#define BENCH_SAMPLE    "pic-800x600-color.yuy2"
+#endif
+#define SAMPLE_WIDTH    800
+#define SAMPLE_HEIGHT   600
+
+// One YUYV picture to convert
+struct Bench_frame {
+    const char     *name;
+    unsigned int    width;
+    unsigned int    height;
+    uint8_t        *yuyv;
+    size_t          sz;
+};
+
+// One way to convert it
+struct Bench_case {
+    const char     *variant;
+    int             isa;
+    int             chroma;         // CONV_CHROMA_*
+    int             threads;
+    int             write_mode;     // CONV_WRITE_*
+    int             scale;          // CONV_SCALE_*
+    unsigned int    dst_width;
+    unsigned int    dst_height;
+};
+
+// Timings of one case
+struct Bench_result {
+    uint64_t        median_ns;
+    uint64_t        p99_ns;
+    double          cycles_px;      // < 0 when not measured
+    double          gb_s;
+};
+
+static const struct {
+    const char     *name;
+    unsigned int    width;
+    unsigned int    height;
+} synthetic[] = {
+    { "synthetic", 640, 480 },
+    { "synthetic", 1280, 720 },
+    { "synthetic", 1920, 1080 },
+};
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-n runs] [-t threads] [-f sample.yuy2] [-o out.json]\n", name);
+    fprintf(stderr, "\t-n  frames timed per case (default: %d) \n", RUNS_DEFAULT);
+    fprintf(stderr, "\t-t  threads of the pool cases, 0 - one per core (default: 0) \n");
+    fprintf(stderr, "\t-f  %ux%u YUYV sample picture (default: %s) \n",
+            SAMPLE_WIDTH, SAMPLE_HEIGHT, BENCH_SAMPLE);
+    fprintf(stderr, "\t-o  write JSON to a file instead of stdout \n");
+}
+
+
+/* CPU cycles of this thread from the PMU, -1 when it is not available */
+static int cycles_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+
+static uint64_t cycles_read(int fd)
+{
+    uint64_t cnt = 0;
+
+    if( fd < 0 || read(fd, &cnt, sizeof(cnt)) != sizeof(cnt) )
+        return 0;
+
+    return cnt;
+}
+
+
+static uint64_t time_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static int frame_load(struct Bench_frame *f, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    FILE *fp;
+
+    f->name = slash ? slash + 1 : path;
+    f->width = SAMPLE_WIDTH;
+    f->height = SAMPLE_HEIGHT;
+    f->sz = (size_t)f->width * f->height * 2;
+    f->yuyv = malloc(f->sz);
+    if( !f->yuyv ) {
+        log_fatal("malloc(%zu) [%m]", f->sz);
+        return -1;
+    }
+
+    fp = fopen(path, "rb");
+    if( !fp || fread(f->yuyv, f->sz, 1, fp) != 1 ) {
+        log_warn("Can't read %ux%u picture '%s', it is skipped",
+                 f->width, f->height, path);
+        if( fp )
+            fclose(fp);
+        free(f->yuyv);
+        f->yuyv = NULL;
+        return 1;
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+
+static int frame_make(struct Bench_frame *f, const char *name,
+                      unsigned int width, unsigned int height)
+{
+    size_t n;
+
+    f->name = name;
+    f->width = width;
+    f->height = height;
+    f->sz = (size_t)width * height * 2;
+    f->yuyv = malloc(f->sz);
+    if( !f->yuyv ) {
+        log_fatal("malloc(%zu) [%m]", f->sz);
+        return -1;
+    }
+
+    for( n = 0; n < f->sz; n++ )
+        f->yuyv[n] = rand();
+
+    return 0;
+}
+
+
+/* Every variant for a frame: both kernels on all backends, then the best
+ * backend with staged writes, the pool and both scaling filters */
+static int cases_of(const struct Bench_frame *f, int threads,
+                    struct Bench_case *c)
+{
+    const int best = conv_isa();
+    int isa, n = 0;
+
+    for( isa = 0; isa < CONV_ISA_N; isa++ ) {
+        if( !conv_isa_supported(isa) )
+            continue;
+
+        c[n++] = (struct Bench_case){ "fused", isa, CONV_CHROMA_AVG, 1,
+                                      CONV_WRITE_DIRECT, CONV_SCALE_NONE,
+                                      f->width, f->height };
+        c[n++] = (struct Bench_case){ "legacy", isa, CONV_CHROMA_DROP, 1,
+                                      CONV_WRITE_DIRECT, CONV_SCALE_NONE,
+                                      f->width, f->height };
+    }
+
+    c[n++] = (struct Bench_case){ "staged", best, CONV_CHROMA_AVG, 1,
+                                  CONV_WRITE_STAGED, CONV_SCALE_NONE,
+                                  f->width, f->height };
+    if( threads > 1 )
+        c[n++] = (struct Bench_case){ "threads", best, CONV_CHROMA_AVG, threads,
+                                      CONV_WRITE_DIRECT, CONV_SCALE_NONE,
+                                      f->width, f->height };
+
+    // Halved with the box filter, two thirds of the size with the bilinear one
+    c[n++] = (struct Bench_case){ "scale-box", best, CONV_CHROMA_AVG, 1,
+                                  CONV_WRITE_DIRECT, CONV_SCALE_BOX,
+                                  f->width / 2, f->height / 2 };
+    c[n++] = (struct Bench_case){ "scale-bilinear", best, CONV_CHROMA_AVG, 1,
+                                  CONV_WRITE_DIRECT, CONV_SCALE_BILINEAR,
+                                  f->width * 2 / 3 & ~1u, f->height * 2 / 3 & ~1u };
+
+    return n;
+}
+
+
+static int run_case(const struct Bench_frame *f, const struct Bench_case *c,
+                    int runs, int cyc_fd, uint64_t *ns, struct Bench_result *r)
+{
+    struct Conv_layout l;
+    uint64_t t, cyc, *cycles;
+    size_t out_sz;
+    uint8_t *out;
+    int run, ret = -1;
+
+    conv_layout_packed(&l, f->width, f->height);
+    conv_layout_dst(&l, CONV_FMT_NV12, c->dst_width,
+                    (size_t)c->dst_width * c->dst_height);
+    if( conv_layout_scale(&l, c->dst_width, c->dst_height, c->scale) != 0 )
+        return -1;
+    l.write_mode = c->write_mode;
+
+    out_sz = (size_t)c->dst_width * c->dst_height * 3 / 2;
+    out = malloc(out_sz);
+    cycles = malloc(runs * sizeof(*cycles));
+    if( !out || !cycles ) {
+        log_fatal("malloc() [%m]");
+        goto out;
+    }
+
+    if( conv_pool_threads() != c->threads && conv_pool_start(c->threads) != 0 )
+        goto out;
+
+    for( run = -RUNS_WARMUP; run < runs; run++ ) {
+        cyc = cycles_read(cyc_fd);
+        t = time_now_ns();
+        if( conv_frame_mt(c->isa, c->chroma, &l, f->yuyv, f->sz, out, out_sz) != 0 )
+            goto out;
+        t = time_now_ns() - t;
+        cyc = cycles_read(cyc_fd) - cyc;
+
+        if( run >= 0 ) {
+            ns[run] = t;
+            cycles[run] = cyc;
+        }
+    }
+
+    qsort(ns, runs, sizeof(*ns), cmp_u64);
+    qsort(cycles, runs, sizeof(*cycles), cmp_u64);
+
+    // The cycle counter sees the calling thread only
+    r->median_ns = ns[runs / 2];
+    r->p99_ns = ns[(runs * 99 + 99) / 100 - 1];
+    r->cycles_px = cyc_fd < 0 || c->threads > 1 ? -1 :
+                   (double)cycles[runs / 2] / ((double)f->width * f->height);
+    r->gb_s = (double)(f->sz + out_sz) / r->median_ns;
+    ret = 0;
+
+out:
+    free(out);
+    free(cycles);
+    return ret;
+}
+
+
+static void json_result(FILE *fp, int first, const struct Bench_frame *f,
+                        const struct Bench_case *c, const struct Bench_result *r)
+{
+    fprintf(fp, "%s    { \"input\": \"%s\", \"src\": \"%ux%u\", \"dst\": \"%ux%u\", "
+                "\"variant\": \"%s\", \"isa\": \"%s\", \"threads\": %d, "
+                "\"scale\": \"%s\",\n",
+            first ? "" : ",\n", f->name, f->width, f->height,
+            c->dst_width, c->dst_height, c->variant, conv_isa_name(c->isa),
+            c->threads, conv_scale_name(c->scale));
+    fprintf(fp, "      \"median_ns\": %llu, \"p99_ns\": %llu, ",
+            (unsigned long long)r->median_ns, (unsigned long long)r->p99_ns);
+    if( r->cycles_px < 0 )
+        fprintf(fp, "\"cycles_per_px\": null, ");
+    else
+        fprintf(fp, "\"cycles_per_px\": %.3f, ", r->cycles_px);
+    fprintf(fp, "\"gb_s\": %.3f }", r->gb_s);
+}
+
+
+int main(int argc, char **argv)
+{
+    struct Bench_frame frames[1 + sizeof(synthetic) / sizeof(synthetic[0])];
+    struct Bench_case cases[CASES_MAX];
+    struct Bench_result r;
+    const char *sample = BENCH_SAMPLE, *out_name = NULL;
+    FILE *fp = stdout;
+    uint64_t *ns = NULL;
+    int runs = RUNS_DEFAULT, threads = 0;
+    int frames_n = 0, cases_n, cyc_fd, f, c, s, opt, first = 1, ret = 1;
+
+    while( (opt = getopt(argc, argv, "n:t:f:o:")) != -1 ) {
+        switch( opt ) {
+            case 'n':
+                runs = strtol(optarg, NULL, 10);
+                break;
+            case 't':
+                threads = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                sample = optarg;
+                break;
+            case 'o':
+                out_name = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if( runs < 1 || threads < 0 ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Only problems go to stderr, stdout is for the JSON
+    log_set_level(LOG_WARN);
+
+    if( threads == 0 )
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if( threads > CONV_THREADS_MAX )
+        threads = CONV_THREADS_MAX;
+    if( conv_init(CONV_ISA_AUTO) != 0 )
+        return 1;
+
+    ret = frame_load(&frames[frames_n], sample);
+    if( ret < 0 )
+        goto out;
+    if( ret == 0 )
+        frames_n++;
+    for( s = 0; s < (int)(sizeof(synthetic) / sizeof(synthetic[0])); s++ ) {
+        if( frame_make(&frames[frames_n], synthetic[s].name,
+                       synthetic[s].width, synthetic[s].height) != 0 )
+            goto out;
+        frames_n++;
+    }
+    ret = 1;
+
+    ns = malloc(runs * sizeof(*ns));
+    if( !ns ) {
+        log_fatal("malloc() [%m]");
+        goto out;
+    }
+
+    if( out_name ) {
+        fp = fopen(out_name, "w");
+        if( !fp ) {
+            log_fatal("Can't create '%s' [%m]", out_name);
+            fp = stdout;
+            goto out;
+        }
+    }
+
+    cyc_fd = cycles_open();
+    if( cyc_fd < 0 )
+        log_warn("No CPU cycle counter (perf_event_open), cycles_per_px is null");
+
+    fprintf(fp, "{\n  \"runs\": %d,\n  \"cpus\": %ld,\n  \"isa\": \"%s\",\n  \"results\": [\n",
+            runs, sysconf(_SC_NPROCESSORS_ONLN), conv_isa_name(conv_isa()));
+
+    for( f = 0; f < frames_n; f++ ) {
+        cases_n = cases_of(&frames[f], threads, cases);
+
+        for( c = 0; c < cases_n; c++ ) {
+            if( run_case(&frames[f], &cases[c], runs, cyc_fd, ns, &r) != 0 )
+                goto out;
+            json_result(fp, first, &frames[f], &cases[c], &r);
+            first = 0;
+        }
+    }
+
+    fprintf(fp, "\n  ]\n}\n");
+    if( cyc_fd >= 0 )
+        close(cyc_fd);
+    ret = 0;
+
+out:
+    conv_pool_stop();
+    if( fp != stdout )
+        fclose(fp);
+    for( f = 0; f < frames_n; f++ )
+        free(frames[f].yuyv);
+    free(ns);
+
+    return ret;
+}
@@ -11,6 +11,7 @@
 #include <errno.h>
 
 #include "coda960.h"
+#include "dmabuf.h"
 #include "log.h"
 
 static char *dbg_type[2] = {"NV12", "H264"};
@@ -85,7 +86,9 @@ int coda_open(struct Coda_inst *i)
 
     //dbg("'%s': try to open video encoder device: ", i->coda_name);
 
-    i->coda_fd = open(i->coda_name, O_RDWR, 0);
+    // Non-blocking: mainloop() waits for Coda with select() and drains
+    // finished buffers until DQBUF reports EAGAIN
+    i->coda_fd = open(i->coda_name, O_RDWR | O_NONBLOCK, 0);
     if( i->coda_fd < 0 ) {
         log_fatal("'%s': failed to open video device", i->coda_name);
         return -1;
@@ -102,12 +105,39 @@ int coda_open(struct Coda_inst *i)
 
 void coda_close(struct Coda_inst *i)
 {
+    if( i->coda_fd < 0 )
+        return;
+
     close(i->coda_fd);
+    i->coda_fd = -1;
 
     log_info("Coda closed successful");
 }
 
 
+/* Raw formats the encoder takes on its OUTPUT queue. Returns their number */
+int coda_enum_formats(struct Coda_inst *i, uint32_t *fmts, int max)
+{
+    struct v4l2_fmtdesc desc;
+    int n;
+
+    for( n = 0; n < max; n++ ) {
+        MEMZERO(desc);
+        desc.index = n;
+        desc.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+        if( ioctl(i->coda_fd, VIDIOC_ENUM_FMT, &desc) != 0 )
+            break;
+
+        fmts[n] = desc.pixelformat;
+        log_debug("'%s' takes %.4s (%s)", i->coda_name,
+                  (char *)&desc.pixelformat, desc.description);
+    }
+
+    return n;
+}
+
+
 int coda_init_nv12(struct Coda_inst *i)
         //unsigned long codec, unsigned int size, unsigned int count)
 {
@@ -117,12 +147,16 @@ int coda_init_nv12(struct Coda_inst *i)
     struct v4l2_buffer buf;
     int ret;
     int iter;
+    unsigned int plane_h;
+
+    if( !i->pixelformat )
+        i->pixelformat = V4L2_PIX_FMT_NV12;
 
     MEMZERO(try_fmt);
     try_fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     try_fmt.fmt.pix.width = i->width;
     try_fmt.fmt.pix.height = i->height;
-    try_fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+    try_fmt.fmt.pix.pixelformat = i->pixelformat;
 
     ret = ioctl(i->coda_fd, VIDIOC_TRY_FMT, &try_fmt);
     if( ret == -1 ) {
@@ -139,7 +173,7 @@ int coda_init_nv12(struct Coda_inst *i)
     fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     fmt.fmt.pix.width = i->width;
     fmt.fmt.pix.height = i->height;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+    fmt.fmt.pix.pixelformat = i->pixelformat;
 
     ret = ioctl(i->coda_fd, VIDIOC_S_FMT, &fmt);
     if( ret == -1 ) {
@@ -155,7 +189,7 @@ int coda_init_nv12(struct Coda_inst *i)
 
     MEMZERO(get_fmt);
     get_fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-    get_fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+    get_fmt.fmt.pix.pixelformat = i->pixelformat;
 
     ret = ioctl(i->coda_fd, VIDIOC_G_FMT, &get_fmt);
     if (ret) {
@@ -168,12 +202,35 @@ int coda_init_nv12(struct Coda_inst *i)
          get_fmt.fmt.pix.sizeimage,
          get_fmt.fmt.pix.bytesperline);
 
-    //i->nv_12_w = get_fmt.fmt.pix.width;
-    //i->nv_12_w  = get_fmt.fmt.pix.height;
-    //i->nv_12_w  = get_fmt.fmt.pix.bytesperline;
+    // The driver aligns the luma stride (and may align the plane height),
+    // chroma follows the whole luma plane: one CbCr plane of the same
+    // stride for NV12, Cb and Cr planes of half the stride for I420
+    i->nv_12_w   = get_fmt.fmt.pix.width;
+    i->nv_12_h   = get_fmt.fmt.pix.height;
+    i->nv_12_bpl = get_fmt.fmt.pix.bytesperline;
+    if( i->nv_12_bpl < i->nv_12_w )
+        i->nv_12_bpl = i->nv_12_w;
+
+    // CODA pads the luma plane to a multiple of 16 lines, anything past
+    // the chroma planes in 'sizeimage' is a tail that does not move them
+    plane_h = (i->nv_12_h + CODA_PLANE_ALIGN - 1) & ~(CODA_PLANE_ALIGN - 1u);
+    if( (size_t)i->nv_12_bpl * plane_h * 3 / 2 > get_fmt.fmt.pix.sizeimage ) {
+        log_warn("Init_NV12: sizeimage %u is too small for %u padded lines "
+                 "of %u bytes, assume unpadded planes",
+                 get_fmt.fmt.pix.sizeimage, plane_h, i->nv_12_bpl);
+        plane_h = i->nv_12_h;
+    }
+    i->nv_12_uv_offset = (size_t)i->nv_12_bpl * plane_h;
+
+    if( i->nv_12_w != i->width || i->nv_12_h != i->height )
+        log_info("Init_NV12: driver aligned the frame %dx%d to %dx%d",
+                 i->width, i->height, i->nv_12_w, i->nv_12_h);
+
+    if( i->nv12_req_cnt < 1 || i->nv12_req_cnt > CODA_MAX_BUFF )
+        i->nv12_req_cnt = NV12_REQBUF_CNT;
 
     MEMZERO(reqbuf);
-    reqbuf.count = NV12_REQBUF_CNT;
+    reqbuf.count = i->nv12_req_cnt;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
     reqbuf.memory = V4L2_MEMORY_MMAP;
 
@@ -183,10 +240,12 @@ int coda_init_nv12(struct Coda_inst *i)
         return -1;
     }
 
+    if( reqbuf.count > CODA_MAX_BUFF )
+        reqbuf.count = CODA_MAX_BUFF;
     i->buff_nv12_n = reqbuf.count;
 
     log_info("Init_NV12: Number of buffers %d (requested %d)",
-         i->buff_nv12_n, NV12_REQBUF_CNT);
+         i->buff_nv12_n, i->nv12_req_cnt);
 
     for( iter = 0; iter < i->buff_nv12_n; iter++) {
         MEMZERO(buf);
@@ -213,8 +272,19 @@ int coda_init_nv12(struct Coda_inst *i)
             return -1;
         }
 
+        // Cached NV12 buffers are flushed by the sync brackets in main.c
+        i->buff_nv12[iter].dmabuf_fd = -1;
+        if( i->dma_sync )
+            i->buff_nv12[iter].dmabuf_fd = dmabuf_export(i->coda_fd,
+                                                         V4L2_BUF_TYPE_VIDEO_OUTPUT, iter);
+
     }
 
+    // All NV12 buffers are free until mainloop() fills and queues them
+    i->nv12_free_n = 0;
+    for( iter = 0; iter < i->buff_nv12_n; iter++)
+        coda_put_free_nv12(i, iter);
+
     log_info("Init_NV12: Succesfully m-mapped %d buffer(s)", i->buff_nv12_n);
 
     return 0;
@@ -254,8 +324,11 @@ int coda_init_h264(struct Coda_inst *i)
     vid->cap_buf_queued = 0;
 */
 
+    if( i->h264_req_cnt < 1 || i->h264_req_cnt > CODA_MAX_BUFF )
+        i->h264_req_cnt = H264_REQBUF_CNT;
+
     MEMZERO(reqbuf);
-    reqbuf.count = H264_REQBUF_CNT;
+    reqbuf.count = i->h264_req_cnt;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     reqbuf.memory = V4L2_MEMORY_MMAP;
 
@@ -265,10 +338,14 @@ int coda_init_h264(struct Coda_inst *i)
         return -1;
     }
 
+    if( reqbuf.count > CODA_MAX_BUFF )
+        reqbuf.count = CODA_MAX_BUFF;
     i->buff_264_n = reqbuf.count;
 
+    i->buff_264_held = 0;
+
     log_info("Init_h264: Number of buffers %u (requested %u)",
-         i->buff_264_n, H264_REQBUF_CNT);
+         i->buff_264_n, i->h264_req_cnt);
 
     for( iter = 0; iter < i->buff_264_n; iter++) {
         MEMZERO(buf);
@@ -301,6 +378,33 @@ int coda_init_h264(struct Coda_inst *i)
 }
 
 
+/* Unmap all buffers, must be done before coda_close() lets the
+ * driver free them */
+void coda_uninit(struct Coda_inst *i)
+{
+    int iter;
+
+    for( iter = 0; iter < i->buff_nv12_n; iter++ ) {
+        dmabuf_close(&i->buff_nv12[iter].dmabuf_fd);
+        if( i->buff_nv12[iter].start && i->buff_nv12[iter].start != MAP_FAILED &&
+            munmap(i->buff_nv12[iter].start, i->buff_nv12[iter].length) == -1 )
+            log_fatal("Coda: munmap(NV12) [%m]");
+        i->buff_nv12[iter].start = NULL;
+    }
+
+    for( iter = 0; iter < i->buff_264_n; iter++ ) {
+        if( i->buff_264[iter].start && i->buff_264[iter].start != MAP_FAILED &&
+            munmap(i->buff_264[iter].start, i->buff_264[iter].length) == -1 )
+            log_fatal("Coda: munmap(h264) [%m]");
+        i->buff_264[iter].start = NULL;
+    }
+
+    i->buff_nv12_n = 0;
+    i->buff_264_n = 0;
+    i->nv12_free_n = 0;
+}
+
+
 int coda_set_control(struct Coda_inst *i)
 {
     struct v4l2_streamparm parm;
@@ -376,41 +480,47 @@ int coda_set_control(struct Coda_inst *i)
 }
 
 
+/* Ask Coda to encode the next frame as IDR, e.g. for a new client.
+ * Not every driver version has this control, then the client waits
+ * for the next regular keyframe */
+int coda_force_idr(struct Coda_inst *i)
+{
+    struct v4l2_control cntrl;
+    int ret;
+
+    MEMZERO(cntrl);
+    cntrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    cntrl.value = 1;
+
+    ret = ioctl(i->coda_fd, VIDIOC_S_CTRL, &cntrl);
+    if( ret == -1 ) {
+        log_warn("Force IDR is not supported by '%s' [%m]", i->coda_name);
+        return -1;
+    }
+
+    log_debug("Forced IDR on the next frame");
+    return 0;
+}
+
+
+/* 'ts_us' goes with an NV12 buffer, Coda copies it to the h264 buffer
+ * of the frame (V4L2_BUF_FLAG_TIMESTAMP_COPY) */
 static int coda_queue_buf(struct Coda_inst *i,
-        unsigned int index, unsigned int type)
+        unsigned int index, unsigned int type, uint64_t ts_us)
 {
     struct v4l2_buffer buf;
-    struct timeval tv;
     int ret;
 
-//    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-//    buf.memory = V4L2_MEMORY_MMAP;
-//    buf.index = iter;
-
     MEMZERO(buf);
     buf.type = type;
     buf.memory = V4L2_MEMORY_MMAP;
     buf.index = index;
-    //buf.length = nplanes;
-    //buf.m.bytesused = l1;
-    //buf.m.offset = 0;
-/*
-    if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
-        buf.length = vid->cap_buf_size;
-    } else {
-        buf.length = vid->out_buf_size;
-        if (l1 == 0) {
-            buf.bytesused = 1;
-            buf.flags |= V4L2_BUF_FLAG_LAST;
-        }
-
-        ret = gettimeofday(&tv, NULL);
-        if (ret)
-            err("getting timeofday (%s)", strerror(errno));
 
-        buf.timestamp = tv;
+    if( type == V4L2_BUF_TYPE_VIDEO_OUTPUT ) {
+        buf.timestamp.tv_sec = ts_us / 1000000;
+        buf.timestamp.tv_usec = ts_us % 1000000;
     }
-*/
+
     ret = ioctl(i->coda_fd, VIDIOC_QBUF, &buf);
     if( ret == -1 ) {
         log_fatal("Failed to queue buffer[%d] on %s [%m]",
@@ -433,7 +543,7 @@ int coda_queue_buf_h264(struct Coda_inst *i, unsigned int index)
         return -1;
     }
 
-    int ret = coda_queue_buf(i, index, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+    int ret = coda_queue_buf(i, index, V4L2_BUF_TYPE_VIDEO_CAPTURE, 0);
     if( ret == -1 )
         return -1;
 
@@ -441,14 +551,14 @@ int coda_queue_buf_h264(struct Coda_inst *i, unsigned int index)
 }
 
 
-int coda_queue_buf_nv12(struct Coda_inst *i, unsigned int index)
+int coda_queue_buf_nv12(struct Coda_inst *i, unsigned int index, uint64_t ts_us)
 {
     if( index >= i->buff_nv12_n) {
         log_fatal("Tried to queue a non exisiting buffer");
         return -1;
     }
 
-    int ret = coda_queue_buf(i, index, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+    int ret = coda_queue_buf(i, index, V4L2_BUF_TYPE_VIDEO_OUTPUT, ts_us);
     if( ret == -1 )
         return -1;
 
@@ -457,6 +567,32 @@ int coda_queue_buf_nv12(struct Coda_inst *i, unsigned int index)
 
 
 
+/* Take a buffer from the NV12 free-list.
+ * Returns 1 if all NV12 buffers are still owned by Coda */
+int coda_get_free_nv12(struct Coda_inst *i, unsigned int *indx)
+{
+    if( i->nv12_free_n == 0 )
+        return 1;
+
+    *indx = i->nv12_free[0];
+    i->nv12_free_n--;
+    memmove(&i->nv12_free[0], &i->nv12_free[1], i->nv12_free_n);
+
+    return 0;
+}
+
+
+void coda_put_free_nv12(struct Coda_inst *i, unsigned int indx)
+{
+    if( indx >= i->buff_nv12_n || i->nv12_free_n >= i->buff_nv12_n ) {
+        log_error("NV12 free-list: bad buffer index %d", indx);
+        return;
+    }
+
+    i->nv12_free[i->nv12_free_n++] = indx;
+}
+
+
 int coda_stream_act(struct Coda_inst *i, unsigned int type,
                     unsigned int action)
 {
@@ -473,16 +609,37 @@ int coda_stream_act(struct Coda_inst *i, unsigned int type,
     log_info("Stream %s on %s queue", dbg_status[action == VIDIOC_STREAMOFF],
         dbg_type[type == V4L2_BUF_TYPE_VIDEO_CAPTURE]);
 
+    if( action == VIDIOC_STREAMON )
+        i->seq_valid[type == V4L2_BUF_TYPE_VIDEO_CAPTURE] = 0;
+
     return 0;
 }
 
 
+/* Coda numbers the frames of both queues, a gap is a frame it skipped */
+static void coda_check_seq(struct Coda_inst *i, const struct v4l2_buffer *buf)
+{
+    int q = buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if( i->seq_valid[q] && (int32_t)(buf->sequence - i->seq_next[q]) > 0 ) {
+        i->lost_frames += buf->sequence - i->seq_next[q];
+        log_debug("%u frame(s) lost on %s queue before #%u",
+                  buf->sequence - i->seq_next[q], dbg_type[q], buf->sequence);
+    }
+    i->seq_next[q] = buf->sequence + 1;
+    i->seq_valid[q] = 1;
+}
+
+
 static int coda_dequeue_buf(struct Coda_inst *i, struct v4l2_buffer *buf)
 {
     int ret;
 
     ret = ioctl(i->coda_fd, VIDIOC_DQBUF, buf);
     if (ret < 0) {
+        if( errno == EAGAIN )
+            return 1;
+
         log_fatal("Failed to dequeue buffer [%m]");
         return -1;
     }
@@ -491,6 +648,7 @@ static int coda_dequeue_buf(struct Coda_inst *i, struct v4l2_buffer *buf)
         dbg_type[buf->type == V4L2_BUF_TYPE_VIDEO_CAPTURE],
         buf->index, buf->flags, buf->bytesused);
 
+    coda_check_seq(i, buf);
     return 0;
 }
 
@@ -505,17 +663,19 @@ int coda_dequeue_nv12(struct Coda_inst *i, unsigned int *indx)
     buf.memory = V4L2_MEMORY_MMAP;
 
     ret = coda_dequeue_buf(i, &buf);
-    if (ret < 0)
-        return -1;
+    if( ret != 0 )
+        return ret;
 
     *indx = buf.index;
 
     return 0;
 }
 
+/* 'ts_us' is the capture time given with the NV12 buffer, 0 if the driver
+ * does not copy timestamps */
 int coda_dequeue_h264(struct Coda_inst *i, unsigned int *indx,
                     unsigned int *finished, unsigned int *bytesused,
-                    unsigned int *buf_flags)
+                    unsigned int *buf_flags, uint64_t *ts_us)
 {
     int ret;
     struct v4l2_buffer buf;
@@ -525,13 +685,15 @@ int coda_dequeue_h264(struct Coda_inst *i, unsigned int *indx,
     buf.memory = V4L2_MEMORY_MMAP;
 
     ret = coda_dequeue_buf(i, &buf);
-    if( ret < 0 )
-        return -1;
+    if( ret != 0 )
+        return ret;
 
     *finished = 0;
 
     if( buf.flags & V4L2_BUF_FLAG_LAST || buf.bytesused == 0 )
         *finished = 1;
+    else if( buf.flags & V4L2_BUF_FLAG_ERROR )
+        i->bad_frames++;
 
     *bytesused = buf.bytesused;
     *indx = buf.index;
@@ -540,6 +702,10 @@ int coda_dequeue_h264(struct Coda_inst *i, unsigned int *indx,
     if (buf_flags)
         *buf_flags = buf.flags;
 
+    *ts_us = 0;
+    if( (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_COPY )
+        *ts_us = (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+
     return 0;
 }
 
@@ -7,28 +7,50 @@
 
 #include "common.h"
 
-#define NV12_REQBUF_CNT  1
+#define NV12_REQBUF_CNT  4
 #define H264_REQBUF_CNT  2
+#define H264_ZC_REQBUF_CNT  CODA_MAX_BUFF  // buffers held by zero-copy sends
+#define CODA_MAX_BUFF   10
+#define CODA_PLANE_ALIGN  16   // CODA rounds the luma plane height up to this
 
 
 struct Coda_inst {
     char             coda_name[128];
     int              coda_fd;
 
-    struct Buffer    buff_nv12[10];
+    struct Buffer    buff_nv12[CODA_MAX_BUFF];
     uint8_t          buff_nv12_n;
+    int              nv12_req_cnt;
+
+    // Free-list of NV12 buffers owned by userspace (not queued in Coda)
+    uint8_t          nv12_free[CODA_MAX_BUFF];
+    uint8_t          nv12_free_n;
+    uint32_t         pixelformat;    // OUTPUT queue V4L2_PIX_FMT_*, 0 - NV12
     int              nv_12_w;
     int              nv_12_h;
-    int              nv_12_bpl;
+    int              nv_12_bpl;      // luma line stride, bytes
+    size_t           nv_12_uv_offset; // chroma planes from the buffer start
 
-    struct Buffer    buff_264[10];
+    struct Buffer    buff_264[CODA_MAX_BUFF];
     uint8_t          buff_264_n;
+    int              h264_req_cnt;
+    int              buff_264_held;  // dequeued, still referenced by peers
 
     int              width;
     int              height;
+    int              out_width;      // encode scaled to this, 0 - the capture size
+    int              out_height;
     int              framerate;
     int              bitrate;
     int              num_bframes;
+    int              dma_sync;       // export NV12 buffers, sync CPU writes, see dmabuf.h
+
+    // buf.sequence expected next on the OUTPUT [0] and CAPTURE [1] queues,
+    // checks are counted up to the next stats report
+    uint32_t         seq_next[2];
+    int              seq_valid[2];
+    uint32_t         lost_frames;    // sequence gaps on either queue
+    uint32_t         bad_frames;     // h264 buffers flagged with V4L2_BUF_FLAG_ERROR
 };
 
 
@@ -36,18 +58,25 @@ struct Coda_inst {
 int coda_open(struct Coda_inst *i);
 void coda_close(struct Coda_inst *i);
 
+int coda_enum_formats(struct Coda_inst *i, uint32_t *fmts, int max);
 int coda_init_nv12(struct Coda_inst *i);
 int coda_init_h264(struct Coda_inst *i);
+void coda_uninit(struct Coda_inst *i);
 int coda_set_control(struct Coda_inst *i);
+int coda_force_idr(struct Coda_inst *i);
 
 int coda_queue_buf_h264(struct Coda_inst *i, unsigned int index);
-int coda_queue_buf_nv12(struct Coda_inst *i, unsigned int index);
+int coda_queue_buf_nv12(struct Coda_inst *i, unsigned int index, uint64_t ts_us);
 
 int coda_stream_act(struct Coda_inst *i, unsigned int type, unsigned int action);
 
+int coda_get_free_nv12(struct Coda_inst *i, unsigned int *indx);
+void coda_put_free_nv12(struct Coda_inst *i, unsigned int indx);
+
+/* Dequeue functions return 1 if Coda has no finished buffer yet */
 int coda_dequeue_nv12(struct Coda_inst *i, unsigned int *indx);
 int coda_dequeue_h264(struct Coda_inst *i, unsigned int *indx,
                       unsigned int *finished, unsigned int *bytesused,
-                      unsigned int *buf_flags);
+                      unsigned int *buf_flags, uint64_t *ts_us);
 
 #endif /* INCLUDE_CODA960_H */
\ No newline at end of file
@@ -28,6 +28,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 
 #define VERSION      "0.3.a"
 #define TIMEOUT_SEC  5
@@ -75,12 +76,22 @@
 
 #define MEMZERO(x)	memset(&(x), 0, sizeof (x));
 
+/* Monotonic time in microseconds, used for per-stage timings */
+static inline uint64_t time_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 
 
 struct Buffer {
     void   *start;
     size_t  length;
     size_t  bytesused;
+    int     dmabuf_fd;      // exported with VIDIOC_EXPBUF, -1 if not, see dmabuf.h
 };
 
 #endif /* INCLUDE_COMMON_H */
@@ -0,0 +1,674 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(CONV_HAVE_NEON) && defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "log.h"
+#include "convert.h"
+#include "convert_impl.h"
+
+static const char *isa_names[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = "scalar",
+    [CONV_ISA_NEON]   = "neon",
+    [CONV_ISA_SSE2]   = "sse2",
+    [CONV_ISA_AVX2]   = "avx2",
+};
+
+static const char *fmt_names[CONV_FMT_N] = {
+    [CONV_FMT_YUYV] = "yuyv",
+    [CONV_FMT_UYVY] = "uyvy",
+    [CONV_FMT_NV12] = "nv12",
+    [CONV_FMT_I420] = "i420",
+};
+
+static const char *scale_names[CONV_SCALE_N] = {
+    [CONV_SCALE_NONE]     = "none",
+    [CONV_SCALE_BOX]      = "box",
+    [CONV_SCALE_BILINEAR] = "bilinear",
+};
+
+static const char *route_names[] = {
+    [CONV_ROUTE_COPY]       = "plane copy",
+    [CONV_ROUTE_INTERLEAVE] = "chroma interleave",
+    [CONV_ROUTE_REPACK]     = "4:2:2 repack",
+};
+
+// Packed kernels by source format: [CONV_FMT_YUYV] and [CONV_FMT_UYVY]
+const conv_yuyv_row_fn conv_packed_rows[2][CONV_ISA_N] = {
+    [CONV_FMT_YUYV] = {
+        [CONV_ISA_SCALAR] = conv_yuyv_row_scalar,
+#ifdef CONV_HAVE_NEON
+        [CONV_ISA_NEON]   = conv_yuyv_row_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+        [CONV_ISA_SSE2]   = conv_yuyv_row_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+        [CONV_ISA_AVX2]   = conv_yuyv_row_avx2,
+#endif
+    },
+    [CONV_FMT_UYVY] = {
+        [CONV_ISA_SCALAR] = conv_uyvy_row_scalar,
+#ifdef CONV_HAVE_NEON
+        [CONV_ISA_NEON]   = conv_uyvy_row_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+        [CONV_ISA_SSE2]   = conv_uyvy_row_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+        [CONV_ISA_AVX2]   = conv_uyvy_row_avx2,
+#endif
+    },
+};
+
+const conv_yuyv_rows2_fn conv_packed_rows2[2][CONV_ISA_N] = {
+    [CONV_FMT_YUYV] = {
+        [CONV_ISA_SCALAR] = conv_yuyv_rows2_scalar,
+#ifdef CONV_HAVE_NEON
+        [CONV_ISA_NEON]   = conv_yuyv_rows2_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+        [CONV_ISA_SSE2]   = conv_yuyv_rows2_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+        [CONV_ISA_AVX2]   = conv_yuyv_rows2_avx2,
+#endif
+    },
+    [CONV_FMT_UYVY] = {
+        [CONV_ISA_SCALAR] = conv_uyvy_rows2_scalar,
+#ifdef CONV_HAVE_NEON
+        [CONV_ISA_NEON]   = conv_uyvy_rows2_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+        [CONV_ISA_SSE2]   = conv_uyvy_rows2_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+        [CONV_ISA_AVX2]   = conv_uyvy_rows2_avx2,
+#endif
+    },
+};
+
+const conv_uv_merge_fn conv_uv_merges[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = conv_uv_merge_scalar,
+#ifdef CONV_HAVE_NEON
+    [CONV_ISA_NEON]   = conv_uv_merge_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+    [CONV_ISA_SSE2]   = conv_uv_merge_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+    [CONV_ISA_AVX2]   = conv_uv_merge_avx2,
+#endif
+};
+
+static int cur_isa = CONV_ISA_AUTO;
+
+
+/* The backend has been built and the CPU can run it */
+int conv_isa_supported(int isa)
+{
+    if( isa < 0 || isa >= CONV_ISA_N || !conv_packed_rows[CONV_FMT_YUYV][isa] )
+        return 0;
+
+    switch( isa ) {
+#if defined(CONV_HAVE_NEON) && defined(__arm__)
+        case CONV_ISA_NEON:
+            return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+        case CONV_ISA_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case CONV_ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 1;
+    }
+}
+
+
+/* Choose the backend, CONV_ISA_AUTO takes the fastest one available */
+int conv_init(int isa)
+{
+    if( isa == CONV_ISA_AUTO ) {
+        for( isa = CONV_ISA_N - 1; isa > CONV_ISA_SCALAR; isa-- )
+            if( conv_isa_supported(isa) )
+                break;
+    } else if( !conv_isa_supported(isa) ) {
+        log_fatal("Conversion backend '%s' is not supported here",
+                  conv_isa_name(isa));
+        return -1;
+    }
+
+    cur_isa = isa;
+    log_info("YUYV to NV12 conversion: %s", conv_isa_name(cur_isa));
+
+    return 0;
+}
+
+
+int conv_isa(void)
+{
+    if( cur_isa == CONV_ISA_AUTO )
+        conv_init(CONV_ISA_AUTO);
+
+    return cur_isa;
+}
+
+
+const char *conv_isa_name(int isa)
+{
+    if( isa < 0 || isa >= CONV_ISA_N )
+        return "unknown";
+
+    return isa_names[isa];
+}
+
+
+int conv_isa_by_name(const char *name)
+{
+    int isa;
+
+    if( strcasecmp(name, "auto") == 0 )
+        return CONV_ISA_AUTO;
+
+    for( isa = 0; isa < CONV_ISA_N; isa++ )
+        if( strcasecmp(name, isa_names[isa]) == 0 )
+            return isa;
+
+    return CONV_ISA_INVALID;
+}
+
+
+const char *conv_fmt_name(int fmt)
+{
+    if( fmt < 0 || fmt >= CONV_FMT_N )
+        return "unknown";
+
+    return fmt_names[fmt];
+}
+
+
+int conv_fmt_by_name(const char *name)
+{
+    int fmt;
+
+    for( fmt = 0; fmt < CONV_FMT_N; fmt++ )
+        if( strcasecmp(name, fmt_names[fmt]) == 0 )
+            return fmt;
+
+    return CONV_FMT_INVALID;
+}
+
+
+/* How 'src_fmt' frames become 'dst_fmt' ones. The route numbers grow
+ * with their cost, so the smallest one is the cheapest */
+int conv_route(int src_fmt, int dst_fmt)
+{
+    if( src_fmt < 0 || src_fmt >= CONV_FMT_N )
+        return CONV_ROUTE_NONE;
+
+    if( src_fmt == dst_fmt &&
+        (dst_fmt == CONV_FMT_NV12 || dst_fmt == CONV_FMT_I420) )
+        return CONV_ROUTE_COPY;
+
+    if( dst_fmt != CONV_FMT_NV12 )
+        return CONV_ROUTE_NONE;
+
+    if( src_fmt == CONV_FMT_I420 )
+        return CONV_ROUTE_INTERLEAVE;
+    if( src_fmt == CONV_FMT_YUYV || src_fmt == CONV_FMT_UYVY )
+        return CONV_ROUTE_REPACK;
+
+    return CONV_ROUTE_NONE;
+}
+
+
+const char *conv_route_name(int route)
+{
+    if( route < 0 || route > CONV_ROUTE_REPACK )
+        return "none";
+
+    return route_names[route];
+}
+
+
+const char *conv_scale_name(int mode)
+{
+    if( mode == CONV_SCALE_AUTO )
+        return "auto";
+    if( mode < 0 || mode >= CONV_SCALE_N )
+        return "unknown";
+
+    return scale_names[mode];
+}
+
+
+int conv_scale_by_name(const char *name)
+{
+    int mode;
+
+    if( strcasecmp(name, "auto") == 0 )
+        return CONV_SCALE_AUTO;
+
+    for( mode = 0; mode < CONV_SCALE_N; mode++ )
+        if( strcasecmp(name, scale_names[mode]) == 0 )
+            return mode;
+
+    return CONV_SCALE_INVALID;
+}
+
+
+/* 2 or 4 when the box filter fits the sizes, 0 otherwise */
+static unsigned int box_factor(unsigned int width, unsigned int height,
+                               unsigned int dst_width, unsigned int dst_height)
+{
+    unsigned int f;
+
+    for( f = 2; f <= 4; f *= 2 )
+        if( dst_width * f == width && dst_height * f == height )
+            return f;
+
+    return 0;
+}
+
+
+/* Tightly packed YUYV to NV12: no padding, CbCr right after the luma */
+void conv_layout_packed(struct Conv_layout *l,
+                        unsigned int width, unsigned int height)
+{
+    l->width = width;
+    l->height = height;
+    l->dst_width = width;
+    l->dst_height = height;
+    l->scale = CONV_SCALE_NONE;
+    l->write_mode = CONV_WRITE_DIRECT;
+    conv_layout_src(l, CONV_FMT_YUYV, width * 2, 0);
+    conv_layout_dst(l, CONV_FMT_NV12, width, (size_t)width * height);
+}
+
+
+/* Single-plane V4L2 layouts: chroma follows a luma plane of 'luma_sz'
+ * bytes, I420 chroma lines are half as long as the luma ones */
+void conv_layout_src(struct Conv_layout *l, int fmt,
+                     unsigned int stride, size_t luma_sz)
+{
+    l->src_fmt = fmt;
+    l->src_stride = stride;
+    l->src_uv_stride = fmt == CONV_FMT_I420 ? stride / 2 : stride;
+    l->src_uv_offset = luma_sz;
+    l->src_v_offset = luma_sz + luma_sz / 4;
+}
+
+
+void conv_layout_dst(struct Conv_layout *l, int fmt,
+                     unsigned int stride, size_t luma_sz)
+{
+    l->dst_fmt = fmt;
+    l->y_stride = stride;
+    l->uv_stride = fmt == CONV_FMT_I420 ? stride / 2 : stride;
+    l->uv_offset = luma_sz;
+    l->v_offset = luma_sz + luma_sz / 4;
+}
+
+
+/* Scale the picture to 'dst_width' x 'dst_height'. Call it after
+ * conv_layout_dst(): the destination plane sizes follow the new size */
+int conv_layout_scale(struct Conv_layout *l, unsigned int dst_width,
+                      unsigned int dst_height, int mode)
+{
+    const unsigned int f = box_factor(l->width, l->height, dst_width, dst_height);
+
+    if( mode == CONV_SCALE_INVALID || mode >= CONV_SCALE_N )
+        return -1;
+
+    if( dst_width == l->width && dst_height == l->height ) {
+        mode = CONV_SCALE_NONE;
+    } else if( mode == CONV_SCALE_AUTO ) {
+        mode = f ? CONV_SCALE_BOX : CONV_SCALE_BILINEAR;
+    } else if( mode == CONV_SCALE_NONE || (mode == CONV_SCALE_BOX && !f) ) {
+        log_fatal("Can't scale %ux%u to %ux%u with '%s'", l->width, l->height,
+                  dst_width, dst_height, conv_scale_name(mode));
+        return -1;
+    }
+
+    l->dst_width = dst_width;
+    l->dst_height = dst_height;
+    l->scale = mode;
+
+    return 0;
+}
+
+
+/* Bytes a plane of 'lines' lines of 'len' bytes takes up from its start */
+static size_t plane_end(size_t offset, unsigned int stride,
+                        unsigned int lines, unsigned int len)
+{
+    return offset + (size_t)stride * (lines - 1) + len;
+}
+
+
+/* Can the frame be converted at all: sizes, strides and the backend */
+int conv_layout_check(int isa, const struct Conv_layout *l,
+                      size_t in_buff_sz, size_t out_buff_sz)
+{
+    const unsigned int width = l->width;
+    const unsigned int height = l->height;
+    const unsigned int dst_width = l->dst_width;
+    const unsigned int dst_height = l->dst_height;
+    unsigned int src_len, src_c_len, dst_c_len;
+    size_t src_sz, dst_sz;
+    int route;
+
+    // The kernels work on pairs of Y, the last vector step of a line
+    // overlaps the one before it
+    if( width % 2 != 0 || width == 0 ) {
+        log_fatal("Frame width must be a non-zero multiple of 2!");
+        return -1;
+    }
+    if( height % 2 != 0 || height == 0 ) {
+        log_fatal("Frame height must be a non-zero multiple of 2!");
+        return -1;
+    }
+
+    route = conv_route(l->src_fmt, l->dst_fmt);
+    if( route == CONV_ROUTE_NONE ) {
+        log_fatal("No conversion from %s to %s",
+                  conv_fmt_name(l->src_fmt), conv_fmt_name(l->dst_fmt));
+        return -1;
+    }
+
+    if( l->write_mode == CONV_WRITE_STAGED && width > CONV_LINE_MAX ) {
+        log_fatal("Frames wider than %u are not staged", CONV_LINE_MAX);
+        return -1;
+    }
+
+    if( l->scale == CONV_SCALE_NONE ) {
+        if( dst_width != width || dst_height != height ) {
+            log_fatal("Frame is %ux%u, but %ux%u is expected",
+                      width, height, dst_width, dst_height);
+            return -1;
+        }
+    } else {
+        if( dst_width % 2 != 0 || dst_width == 0 ||
+            dst_height % 2 != 0 || dst_height == 0 ) {
+            log_fatal("Scaled frame size must be a non-zero multiple of 2!");
+            return -1;
+        }
+        if( width > CONV_LINE_MAX || dst_width > CONV_LINE_MAX ) {
+            log_fatal("Frames wider than %u are not scaled", CONV_LINE_MAX);
+            return -1;
+        }
+        if( l->dst_fmt != CONV_FMT_NV12 ) {
+            log_fatal("Scaled frames are written as NV12 only");
+            return -1;
+        }
+        if( l->scale == CONV_SCALE_BOX &&
+            !box_factor(width, height, dst_width, dst_height) ) {
+            log_fatal("Box filter can't scale %ux%u to %ux%u",
+                      width, height, dst_width, dst_height);
+            return -1;
+        }
+    }
+
+    // Line lengths in bytes
+    src_len = route == CONV_ROUTE_REPACK ? width * 2 : width;
+    src_c_len = l->src_fmt == CONV_FMT_I420 ? width / 2 : width;
+    dst_c_len = l->dst_fmt == CONV_FMT_I420 ? dst_width / 2 : dst_width;
+
+    if( l->src_stride < src_len || l->y_stride < dst_width || l->uv_stride < dst_c_len ||
+        (route != CONV_ROUTE_REPACK && l->src_uv_stride < src_c_len) ) {
+        log_fatal("Line stride is shorter than the line: src %u/%u, dst %u/%u, width %u/%u",
+                  l->src_stride, l->src_uv_stride, l->y_stride, l->uv_stride,
+                  width, dst_width);
+        return -1;
+    }
+
+    if( l->uv_offset < (size_t)l->y_stride * dst_height ||
+        (l->dst_fmt == CONV_FMT_I420 &&
+         l->v_offset < plane_end(l->uv_offset, l->uv_stride, dst_height / 2, dst_c_len)) ) {
+        log_fatal("Chroma plane offset %zu overlaps another plane", l->uv_offset);
+        return -1;
+    }
+
+    src_sz = plane_end(0, l->src_stride, height, src_len);
+    if( l->src_fmt == CONV_FMT_NV12 )
+        src_sz = plane_end(l->src_uv_offset, l->src_uv_stride, height / 2, src_c_len);
+    if( l->src_fmt == CONV_FMT_I420 )
+        src_sz = plane_end(l->src_v_offset, l->src_uv_stride, height / 2, src_c_len);
+
+    dst_sz = plane_end(l->dst_fmt == CONV_FMT_I420 ? l->v_offset : l->uv_offset,
+                       l->uv_stride, dst_height / 2, dst_c_len);
+
+    if( in_buff_sz < src_sz ) {
+        log_fatal("Input buffer size must be at least %zu bytes", src_sz);
+        return -1;
+    }
+    if( out_buff_sz < dst_sz ) {
+        log_fatal("Output buffer size must be at least %zu bytes", dst_sz);
+        return -1;
+    }
+    if( !conv_isa_supported(isa) ) {
+        log_fatal("Conversion backend '%s' is not supported here",
+                  conv_isa_name(isa));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Lines of 'len' bytes, at once when both planes have the same stride */
+static void copy_plane(uint8_t *dst, unsigned int dst_stride,
+                       const uint8_t *src, unsigned int src_stride,
+                       unsigned int len, unsigned int lines)
+{
+    unsigned int line_n;
+
+    if( !lines )
+        return;
+
+    if( dst_stride == src_stride ) {
+        memcpy(dst, src, (size_t)src_stride * (lines - 1) + len);
+        return;
+    }
+
+    for( line_n = 0; line_n < lines; line_n++ ) {
+        memcpy(dst, src, len);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+
+/* Copy or merge the planes of planar frames */
+static void planar_lines(int isa, const struct Conv_layout *l,
+                         const uint8_t *in, uint8_t *out,
+                         unsigned int first, unsigned int count)
+{
+    const unsigned int c_first = first / 2;
+    const unsigned int c_count = count / 2;
+    const uint8_t *u = in + l->src_uv_offset + (size_t)l->src_uv_stride * c_first;
+    const uint8_t *v = in + l->src_v_offset + (size_t)l->src_uv_stride * c_first;
+    uint8_t *uv = out + l->uv_offset + (size_t)l->uv_stride * c_first;
+    uint8_t uv_buf[CONV_LINE_MAX] __attribute__((aligned(64)));
+    conv_uv_merge_fn uv_merge;
+    unsigned int line_n;
+
+    copy_plane(out + (size_t)l->y_stride * first, l->y_stride,
+               in + (size_t)l->src_stride * first, l->src_stride,
+               l->width, count);
+
+    if( l->src_fmt == CONV_FMT_NV12 ) {
+        copy_plane(uv, l->uv_stride, u, l->src_uv_stride, l->width, c_count);
+        return;
+    }
+
+    if( l->dst_fmt == CONV_FMT_I420 ) {
+        copy_plane(uv, l->uv_stride, u, l->src_uv_stride, l->width / 2, c_count);
+        copy_plane(out + l->v_offset + (size_t)l->uv_stride * c_first, l->uv_stride,
+                   v, l->src_uv_stride, l->width / 2, c_count);
+        return;
+    }
+
+    uv_merge = conv_uv_merges[isa];
+
+    for( line_n = 0; line_n < c_count; line_n++ ) {
+        if( l->write_mode == CONV_WRITE_STAGED ) {
+            uv_merge(u, v, uv_buf, l->width);
+            memcpy(uv, uv_buf, l->width);
+        } else {
+            uv_merge(u, v, uv, l->width);
+        }
+        u += l->src_uv_stride;
+        v += l->src_uv_stride;
+        uv += l->uv_stride;
+    }
+}
+
+
+/* Uncached and write-combined memory gets full bursts only from stores
+ * that fill its cache-line sized chunks in order. The kernels write three
+ * lines at once in 16 or 32 byte pieces, so here they write lines that
+ * stay in the cache and memcpy() moves every finished line out in one run */
+static void staged_lines(int isa, int chroma, const struct Conv_layout *l,
+                         const uint8_t *src, uint8_t *y_plane, uint8_t *uv_plane,
+                         unsigned int count)
+{
+    const unsigned int width = l->width;
+    uint8_t y_buf[2][CONV_LINE_MAX] __attribute__((aligned(64)));
+    uint8_t uv_buf[CONV_LINE_MAX] __attribute__((aligned(64)));
+    conv_yuyv_row_fn yuyv_row = conv_packed_rows[l->src_fmt][isa];
+    conv_yuyv_rows2_fn yuyv_pair = conv_packed_rows2[l->src_fmt][isa];
+    unsigned int line_n;
+
+    for( line_n = 0; line_n < count; line_n += 2 ) {
+        if( chroma == CONV_CHROMA_AVG ) {
+            yuyv_pair(src, src + l->src_stride, y_buf[0], y_buf[1], uv_buf, width);
+        } else {
+            yuyv_row(src, y_buf[0], uv_buf, width);
+            yuyv_row(src + l->src_stride, y_buf[1], NULL, width);
+        }
+
+        memcpy(y_plane, y_buf[0], width);
+        memcpy(y_plane + l->y_stride, y_buf[1], width);
+        memcpy(uv_plane, uv_buf, width);
+
+        src += l->src_stride * 2;
+        y_plane += l->y_stride * 2;
+        uv_plane += l->uv_stride;
+    }
+}
+
+
+/* Convert 'count' lines starting from the even line 'first', both count
+ * lines of the destination frame. NV12 has one CbCr line per two lines of
+ * the picture: a packed 4:2:2 source gives either their average
+ * (CONV_CHROMA_AVG), or the even line's one as the old kernel did
+ * (CONV_CHROMA_DROP). Padding bytes at the end of the lines are not
+ * touched. CONV_WRITE_STAGED layouts go through staged_lines(), the
+ * scaler writes whole lines anyway. No checks here, see conv_layout_check() */
+void conv_lines(int isa, int chroma, const struct Conv_layout *l,
+                const void *in_buff, void *out_buff,
+                unsigned int first, unsigned int count)
+{
+    const unsigned int width = l->width;
+    const uint8_t *src = (const uint8_t *)in_buff + (size_t)l->src_stride * first;
+    uint8_t *y_plane = (uint8_t *)out_buff + (size_t)l->y_stride * first;
+    uint8_t *uv_plane = (uint8_t *)out_buff + l->uv_offset +
+                        (size_t)l->uv_stride * (first / 2);
+    conv_yuyv_row_fn yuyv_row;
+    conv_yuyv_rows2_fn yuyv_pair;
+    unsigned int line_n;
+
+    if( l->scale != CONV_SCALE_NONE ) {
+        conv_scale_lines(isa, chroma, l, in_buff, out_buff, first, count);
+        return;
+    }
+
+    if( l->src_fmt == CONV_FMT_NV12 || l->src_fmt == CONV_FMT_I420 ) {
+        planar_lines(isa, l, in_buff, out_buff, first, count);
+        return;
+    }
+
+    if( l->write_mode == CONV_WRITE_STAGED ) {
+        staged_lines(isa, chroma, l, src, y_plane, uv_plane, count);
+        return;
+    }
+
+    if( chroma == CONV_CHROMA_AVG ) {
+        yuyv_pair = conv_packed_rows2[l->src_fmt][isa];
+
+        for( line_n = 0; line_n < count; line_n += 2 ) {
+            yuyv_pair(src, src + l->src_stride, y_plane, y_plane + l->y_stride,
+                      uv_plane, width);
+            src += l->src_stride * 2;
+            y_plane += l->y_stride * 2;
+            uv_plane += l->uv_stride;
+        }
+
+        return;
+    }
+
+    yuyv_row = conv_packed_rows[l->src_fmt][isa];
+
+    for( line_n = 0; line_n < count; line_n += 2 ) {
+        yuyv_row(src, y_plane, uv_plane, width);
+        src += l->src_stride;
+        y_plane += l->y_stride;
+
+        yuyv_row(src, y_plane, NULL, width);
+        src += l->src_stride;
+        y_plane += l->y_stride;
+
+        uv_plane += l->uv_stride;
+    }
+}
+
+
+int conv_frame(int isa, int chroma, const struct Conv_layout *l,
+               const void *in_buff, size_t in_buff_sz,
+               void *out_buff, size_t out_buff_sz)
+{
+    if( conv_layout_check(isa, l, in_buff_sz, out_buff_sz) != 0 )
+        return -1;
+
+    conv_lines(isa, chroma, l, in_buff, out_buff, 0, l->dst_height);
+
+    return 0;
+}
+
+
+/* One NV12 CbCr line of 'width' bytes from Cb and Cr lines of width / 2,
+ * for decoders that have planar chroma at hand */
+void conv_uv_merge(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                   unsigned int width)
+{
+    conv_uv_merges[conv_isa()](u, v, uv, width);
+}
+
+
+int conv_yuyv_to_nv12_isa(int isa, int chroma,
+                          const void *in_buff, size_t in_buff_sz,
+                          void *out_buff, size_t out_buff_sz,
+                          unsigned int width, unsigned int height)
+{
+    struct Conv_layout l;
+
+    conv_layout_packed(&l, width, height);
+
+    return conv_frame(isa, chroma, &l, in_buff, in_buff_sz, out_buff, out_buff_sz);
+}
+
+
+int conv_yuyv_to_nv12(const void *in_buff, size_t in_buff_sz,
+                      void *out_buff, size_t out_buff_sz,
+                      unsigned int width, unsigned int height)
+{
+    return conv_yuyv_to_nv12_isa(conv_isa(), CONV_CHROMA_AVG, in_buff, in_buff_sz,
+                                 out_buff, out_buff_sz, width, height);
+}
@@ -0,0 +1,34 @@
+# YUYV to NV12 conversion library, see convert.h.
+# Every SIMD backend gets its own compile flags, so the rest of the code
+# stays runnable on CPUs without them; convert.c picks one at runtime.
+# Paths are relative to this file, so sub-projects can include it too.
+# Targets link ${CONV_LIBS} for the worker pool of convert_pool.c.
+
+set(CONV_DIR ${CMAKE_CURRENT_LIST_DIR})
+set(CONV_SOURCE ${CONV_DIR}/convert.c ${CONV_DIR}/convert_scalar.c
+                ${CONV_DIR}/convert_scale.c
+                ${CONV_DIR}/convert_pool.c)
+set(CONV_HEADER ${CONV_DIR}/convert.h ${CONV_DIR}/convert_impl.h)
+
+if(CMAKE_SYSTEM_PROCESSOR MATCHES "^(arm|ARM)$|^armv7")
+    list(APPEND CONV_SOURCE ${CONV_DIR}/convert_neon.c)
+    set_source_files_properties(${CONV_DIR}/convert_neon.c PROPERTIES
+            COMPILE_FLAGS "-mfpu=neon")
+    add_definitions(-DCONV_HAVE_NEON)
+
+elseif(CMAKE_SYSTEM_PROCESSOR MATCHES "^(aarch64|arm64)")
+    list(APPEND CONV_SOURCE ${CONV_DIR}/convert_neon.c)
+    add_definitions(-DCONV_HAVE_NEON)
+
+elseif(CMAKE_SYSTEM_PROCESSOR MATCHES "^(x86_64|AMD64|i.86)")
+    list(APPEND CONV_SOURCE ${CONV_DIR}/convert_sse2.c ${CONV_DIR}/convert_avx2.c)
+    set_source_files_properties(${CONV_DIR}/convert_sse2.c PROPERTIES
+            COMPILE_FLAGS "-msse2")
+    set_source_files_properties(${CONV_DIR}/convert_avx2.c PROPERTIES
+            COMPILE_FLAGS "-mavx2")
+    add_definitions(-DCONV_HAVE_SSE2 -DCONV_HAVE_AVX2)
+endif()
+
+set(THREADS_PREFER_PTHREAD_FLAG ON)
+find_package(Threads REQUIRED)
+set(CONV_LIBS Threads::Threads)
@@ -0,0 +1,137 @@
+#ifndef INCLUDE_CONVERT_H
+#define INCLUDE_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Camera frame to encoder frame conversion, mostly YUYV (YUY2) to NV12.
+ * Every backend is built only where the compiler can make it, the best
+ * one the CPU supports is chosen at startup by conv_init() */
+
+// Conversion backends
+#define CONV_ISA_AUTO    -1
+#define CONV_ISA_SCALAR   0
+#define CONV_ISA_NEON     1
+#define CONV_ISA_SSE2     2
+#define CONV_ISA_AVX2     3
+#define CONV_ISA_N        4
+#define CONV_ISA_INVALID -2     // conv_isa_by_name() does not know the name
+
+// How a CbCr line of NV12 is made from two YUYV lines
+#define CONV_CHROMA_AVG   0     // rounded average of both, the default
+#define CONV_CHROMA_DROP  1     // the even line only, the legacy kernel
+
+// Frame formats. Packed 4:2:2 and planar 4:2:0 camera formats are taken,
+// NV12 and I420 are written
+#define CONV_FMT_YUYV     0
+#define CONV_FMT_UYVY     1
+#define CONV_FMT_NV12     2
+#define CONV_FMT_I420     3
+#define CONV_FMT_N        4
+#define CONV_FMT_INVALID -1
+
+// How a frame gets from one format to another, cheapest first
+#define CONV_ROUTE_COPY        0    // same format, planes are copied as they are
+#define CONV_ROUTE_INTERLEAVE  1    // I420 Cb and Cr planes merged into NV12 CbCr
+#define CONV_ROUTE_REPACK      2    // packed 4:2:2 split into NV12 planes
+#define CONV_ROUTE_NONE       -1
+
+// Scaling on the way to the encoder, see conv_layout_scale()
+#define CONV_SCALE_AUTO      -1     // box when halved or quartered, bilinear otherwise
+#define CONV_SCALE_NONE       0
+#define CONV_SCALE_BOX        1     // 2x or 4x decimation, mean of 2x2 or 4x4 pixels
+#define CONV_SCALE_BILINEAR   2     // any size
+#define CONV_SCALE_N          3
+#define CONV_SCALE_INVALID   -2
+
+// How the destination frame is written, see conv_lines()
+#define CONV_WRITE_DIRECT     0     // the kernels store straight into it
+#define CONV_WRITE_STAGED     1     // lines are made in the cache, then copied out whole
+
+#define CONV_LINE_MAX         4096  // widest picture scaled or staged, pixels
+
+// Worker pool, the calling thread converts the first band itself
+#define CONV_THREADS_MAX  8
+
+/* Where the lines of a frame live. The drivers may pad every line and
+ * put the chroma planes after an aligned luma plane, all in bytes.
+ * For I420 'uv' is the Cb plane and 'v' the Cr one */
+struct Conv_layout {
+    unsigned int     width;
+    unsigned int     height;
+    unsigned int     dst_width;     // the picture after scaling
+    unsigned int     dst_height;
+    int              scale;         // CONV_SCALE_*
+
+    int              src_fmt;       // CONV_FMT_*
+    unsigned int     src_stride;    // packed or luma line
+    unsigned int     src_uv_stride; // chroma line of planar formats
+    size_t           src_uv_offset;
+    size_t           src_v_offset;
+
+    int              dst_fmt;       // CONV_FMT_NV12 or CONV_FMT_I420
+    unsigned int     y_stride;      // luma line, at least dst_width
+    unsigned int     uv_stride;     // chroma line
+    size_t           uv_offset;     // chroma plane from the start of the buffer
+    size_t           v_offset;
+    int              write_mode;    // CONV_WRITE_*, STAGED for uncached buffers
+};
+
+// Timing of one band of the worker pool
+struct Conv_band_stats {
+    int              cpu;           // pinned core, -1 for the calling thread
+    unsigned int     first;         // lines of the last frame
+    unsigned int     count;
+    uint32_t         runs;
+    uint64_t         busy_ns;
+    uint64_t         max_ns;
+};
+
+
+int conv_init(int isa);
+int conv_isa(void);
+int conv_isa_supported(int isa);
+int conv_isa_by_name(const char *name);
+const char *conv_isa_name(int isa);
+
+int conv_fmt_by_name(const char *name);
+const char *conv_fmt_name(int fmt);
+int conv_route(int src_fmt, int dst_fmt);
+const char *conv_route_name(int route);
+
+void conv_layout_packed(struct Conv_layout *l,
+                        unsigned int width, unsigned int height);
+void conv_layout_src(struct Conv_layout *l, int fmt,
+                     unsigned int stride, size_t luma_sz);
+void conv_layout_dst(struct Conv_layout *l, int fmt,
+                     unsigned int stride, size_t luma_sz);
+int conv_layout_scale(struct Conv_layout *l, unsigned int dst_width,
+                      unsigned int dst_height, int mode);
+int conv_scale_by_name(const char *name);
+const char *conv_scale_name(int mode);
+
+int conv_yuyv_to_nv12(const void *in_buff, size_t in_buff_sz,
+                      void *out_buff, size_t out_buff_sz,
+                      unsigned int width, unsigned int height);
+int conv_yuyv_to_nv12_isa(int isa, int chroma,
+                          const void *in_buff, size_t in_buff_sz,
+                          void *out_buff, size_t out_buff_sz,
+                          unsigned int width, unsigned int height);
+int conv_frame(int isa, int chroma, const struct Conv_layout *l,
+               const void *in_buff, size_t in_buff_sz,
+               void *out_buff, size_t out_buff_sz);
+void conv_uv_merge(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                   unsigned int width);
+
+/* Band-parallel conversion. Only one thread may drive the pool,
+ * conv_frame_mt() converts in the caller when it is not started */
+int conv_pool_start(int threads);
+void conv_pool_stop(void);
+int conv_pool_threads(void);
+int conv_pool_stats(struct Conv_band_stats *st, int reset);
+void conv_pool_report(void);
+int conv_frame_mt(int isa, int chroma, const struct Conv_layout *l,
+                  const void *in_buff, size_t in_buff_sz,
+                  void *out_buff, size_t out_buff_sz);
+
+#endif /* INCLUDE_CONVERT_H */
@@ -0,0 +1,287 @@
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "convert_impl.h"
+
+/* Same as SSE2 with 32 pixels per step, the tail is one more step over
+ * the last 32 pixels. packus works inside 128-bit lanes, so the 64-bit
+ * quarters are put back in order afterwards */
+
+
+static inline __m256i pack_lo(__m256i in0, __m256i in1)
+{
+    const __m256i lo_mask = _mm256_set1_epi16(0x00ff);
+
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(in0, lo_mask),
+                                                        _mm256_and_si256(in1, lo_mask)),
+                                    0xd8);
+}
+
+
+static inline __m256i pack_hi(__m256i in0, __m256i in1)
+{
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(in0, 8),
+                                                        _mm256_srli_epi16(in1, 8)),
+                                    0xd8);
+}
+
+
+// Luma is the low byte of every 16-bit word of YUYV, the high one of UYVY
+static inline void row_step(const uint8_t *src, uint8_t *y, uint8_t *uv, int uyvy)
+{
+    __m256i in0, in1;
+
+    in0 = _mm256_loadu_si256((const __m256i *)(src + 0));
+    in1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+
+    _mm256_storeu_si256((__m256i *)y, uyvy ? pack_hi(in0, in1) : pack_lo(in0, in1));
+    if( uv )
+        _mm256_storeu_si256((__m256i *)uv, uyvy ? pack_lo(in0, in1) : pack_hi(in0, in1));
+}
+
+
+static inline void pair_step(const uint8_t *src0, const uint8_t *src1,
+                             uint8_t *y0, uint8_t *y1, uint8_t *uv, int uyvy)
+{
+    __m256i a0, a1, b0, b1, c0, c1;
+
+    a0 = _mm256_loadu_si256((const __m256i *)(src0 + 0));
+    a1 = _mm256_loadu_si256((const __m256i *)(src0 + 32));
+    b0 = _mm256_loadu_si256((const __m256i *)(src1 + 0));
+    b1 = _mm256_loadu_si256((const __m256i *)(src1 + 32));
+    c0 = _mm256_avg_epu8(a0, b0);
+    c1 = _mm256_avg_epu8(a1, b1);
+
+    _mm256_storeu_si256((__m256i *)y0, uyvy ? pack_hi(a0, a1) : pack_lo(a0, a1));
+    _mm256_storeu_si256((__m256i *)y1, uyvy ? pack_hi(b0, b1) : pack_lo(b0, b1));
+    _mm256_storeu_si256((__m256i *)uv, uyvy ? pack_lo(c0, c1) : pack_hi(c0, c1));
+}
+
+
+/* unpack works inside 128-bit lanes too, the lane halves are swapped
+ * back into order by permute2x128 */
+static inline void uv_merge_step(const uint8_t *u, const uint8_t *v, uint8_t *uv)
+{
+    __m256i cb, cr, lo, hi;
+
+    cb = _mm256_loadu_si256((const __m256i *)u);
+    cr = _mm256_loadu_si256((const __m256i *)v);
+
+    lo = _mm256_unpacklo_epi8(cb, cr);
+    hi = _mm256_unpackhi_epi8(cb, cr);
+    _mm256_storeu_si256((__m256i *)(uv + 0), _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(uv + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+
+void conv_yuyv_row_avx2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 32 ) {
+        conv_yuyv_row_scalar(src, y, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 32 <= width; n += 32 ) {
+        conv_prefetch(src + 2 * n + CONV_PREFETCH_AHEAD);
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 0);
+    }
+
+    if( n < width ) {
+        n = width - 32;
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 0);
+    }
+}
+
+
+void conv_yuyv_rows2_avx2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 32 ) {
+        conv_yuyv_rows2_scalar(src0, src1, y0, y1, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 32 <= width; n += 32 ) {
+        conv_prefetch(src0 + 2 * n + CONV_PREFETCH_AHEAD);
+        conv_prefetch(src1 + 2 * n + CONV_PREFETCH_AHEAD);
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 0);
+    }
+
+    if( n < width ) {
+        n = width - 32;
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 0);
+    }
+}
+
+
+void conv_uyvy_row_avx2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 32 ) {
+        conv_uyvy_row_scalar(src, y, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 32 <= width; n += 32 ) {
+        conv_prefetch(src + 2 * n + CONV_PREFETCH_AHEAD);
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 1);
+    }
+
+    if( n < width ) {
+        n = width - 32;
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 1);
+    }
+}
+
+
+void conv_uyvy_rows2_avx2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 32 ) {
+        conv_uyvy_rows2_scalar(src0, src1, y0, y1, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 32 <= width; n += 32 ) {
+        conv_prefetch(src0 + 2 * n + CONV_PREFETCH_AHEAD);
+        conv_prefetch(src1 + 2 * n + CONV_PREFETCH_AHEAD);
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 1);
+    }
+
+    if( n < width ) {
+        n = width - 32;
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 1);
+    }
+}
+
+
+void conv_uv_merge_avx2(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 64 ) {
+        conv_uv_merge_scalar(u, v, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 64 <= width; n += 64 ) {
+        conv_prefetch(u + n / 2 + CONV_PREFETCH_AHEAD);
+        conv_prefetch(v + n / 2 + CONV_PREFETCH_AHEAD);
+        uv_merge_step(u + n / 2, v + n / 2, uv + n);
+    }
+
+    if( n < width ) {
+        n = width - 64;
+        uv_merge_step(u + n / 2, v + n / 2, uv + n);
+    }
+}
+
+
+/* The scaling kernels below may run in place, so their tails stay
+ * scalar, see convert_sse2.c */
+
+void conv_avg_line_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                        unsigned int n)
+{
+    unsigned int i;
+
+    for( i = 0; i + 32 <= n; i += 32 )
+        _mm256_storeu_si256((__m256i *)(out + i),
+                            _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                            _mm256_loadu_si256((const __m256i *)(b + i))));
+
+    if( i < n )
+        conv_avg_line_scalar(a + i, b + i, out + i, n - i);
+}
+
+
+void conv_half_y_avx2(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    const __m256i lo_mask = _mm256_set1_epi16(0x00ff);
+    __m256i in0, in1;
+    unsigned int i;
+
+    for( i = 0; i + 32 <= n; i += 32 ) {
+        in0 = _mm256_loadu_si256((const __m256i *)(src + 0));
+        in1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+
+        in0 = _mm256_avg_epu16(_mm256_and_si256(in0, lo_mask), _mm256_srli_epi16(in0, 8));
+        in1 = _mm256_avg_epu16(_mm256_and_si256(in1, lo_mask), _mm256_srli_epi16(in1, 8));
+        _mm256_storeu_si256((__m256i *)(dst + i),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(in0, in1), 0xd8));
+
+        src += 64;
+    }
+
+    if( i < n )
+        conv_half_y_scalar(src, dst + i, n - i);
+}
+
+
+static inline __m256i half_uv_avx2(__m256i in)
+{
+    in = _mm256_avg_epu8(in, _mm256_srli_epi32(in, 16));
+    return _mm256_srai_epi32(_mm256_slli_epi32(in, 16), 16);
+}
+
+
+void conv_half_uv_avx2(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    __m256i in0, in1, out;
+    unsigned int i;
+
+    for( i = 0; i + 32 <= n; i += 32 ) {
+        in0 = _mm256_loadu_si256((const __m256i *)(src + 0));
+        in1 = _mm256_loadu_si256((const __m256i *)(src + 32));
+
+        out = _mm256_packs_epi32(half_uv_avx2(in0), half_uv_avx2(in1));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(out, 0xd8));
+
+        src += 64;
+    }
+
+    if( i < n )
+        conv_half_uv_scalar(src, dst + i, n - i);
+}
+
+
+void conv_blend_line_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n, unsigned int frac)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i wa = _mm256_set1_epi16(128 - frac);
+    const __m256i wb = _mm256_set1_epi16(frac);
+    const __m256i round = _mm256_set1_epi16(64);
+    __m256i va, vb, lo, hi;
+    unsigned int i;
+
+    // unpack and packus both stay inside the lanes, so the order holds
+    for( i = 0; i + 32 <= n; i += 32 ) {
+        va = _mm256_loadu_si256((const __m256i *)(a + i));
+        vb = _mm256_loadu_si256((const __m256i *)(b + i));
+
+        lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), wa),
+                              _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), wb));
+        hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), wa),
+                              _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), wb));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, round), 7);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, round), 7);
+
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_packus_epi16(lo, hi));
+    }
+
+    if( i < n )
+        conv_blend_line_scalar(a + i, b + i, out + i, n - i, frac);
+}
@@ -0,0 +1,154 @@
+#ifndef INCLUDE_CONVERT_IMPL_H
+#define INCLUDE_CONVERT_IMPL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "convert.h"
+
+/* The packed and merge kernels prefetch their source lines this many bytes
+ * ahead of the step, PLD on ARM. Camera frames are read only once, so the
+ * prefetched lines need not stay in the cache */
+#define CONV_PREFETCH_AHEAD  256
+#define conv_prefetch(p)     __builtin_prefetch((p), 0, 0)
+
+/* Backend kernels of convert.c, not for use outside of it.
+ * A row kernel splits one YUYV (UYVY) line of 'width' pixels into its luma
+ * line and, when 'uv' is not NULL, its interleaved CbCr line.
+ * A row pair kernel takes two lines at once and writes both luma lines
+ * and one CbCr line averaged over them with rounding, (a + b + 1) / 2.
+ * A merge kernel interleaves width / 2 bytes of Cb and Cr into a CbCr
+ * line of 'width' bytes.
+ * Scaling kernels work on planes: an average line kernel gives the rounded
+ * mean of two lines of 'n' bytes, a half kernel writes 'n' bytes out of
+ * 2 * n averaging neighbour luma bytes (half_y) or CbCr pairs (half_uv),
+ * a blend kernel mixes two lines as (a * (128 - frac) + b * frac + 64) >> 7.
+ * A filter kernel does the same across a line: output 'n' of filter_y mixes
+ * src[xs[n]] and the byte after it by fx[n], filter_uv mixes the CbCr
+ * pairs xs[n] and xs[n] + 1. 'n' counts bytes for luma, pairs for CbCr */
+
+typedef void (*conv_yuyv_row_fn)(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                                 unsigned int width);
+typedef void (*conv_yuyv_rows2_fn)(const uint8_t *src0, const uint8_t *src1,
+                                   uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                                   unsigned int width);
+typedef void (*conv_uv_merge_fn)(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                                 unsigned int width);
+typedef void (*conv_avg_line_fn)(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                                 unsigned int n);
+typedef void (*conv_half_fn)(const uint8_t *src, uint8_t *dst, unsigned int n);
+typedef void (*conv_blend_line_fn)(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                                   unsigned int n, unsigned int frac);
+typedef void (*conv_filter_fn)(const uint8_t *src, uint8_t *dst, unsigned int n,
+                               const uint16_t *xs, const uint8_t *fx);
+
+void conv_yuyv_row_scalar(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                          unsigned int width);
+void conv_yuyv_rows2_scalar(const uint8_t *src0, const uint8_t *src1,
+                            uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                            unsigned int width);
+void conv_uyvy_row_scalar(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                          unsigned int width);
+void conv_uyvy_rows2_scalar(const uint8_t *src0, const uint8_t *src1,
+                            uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                            unsigned int width);
+void conv_uv_merge_scalar(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                          unsigned int width);
+void conv_avg_line_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n);
+void conv_half_y_scalar(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_half_uv_scalar(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_blend_line_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                            unsigned int n, unsigned int frac);
+void conv_filter_y_scalar(const uint8_t *src, uint8_t *dst, unsigned int n,
+                          const uint16_t *xs, const uint8_t *fx);
+void conv_filter_uv_scalar(const uint8_t *src, uint8_t *dst, unsigned int n,
+                           const uint16_t *xs, const uint8_t *fx);
+
+#ifdef CONV_HAVE_NEON
+void conv_yuyv_row_neon(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width);
+void conv_yuyv_rows2_neon(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width);
+void conv_uyvy_row_neon(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width);
+void conv_uyvy_rows2_neon(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width);
+void conv_uv_merge_neon(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        unsigned int width);
+void conv_avg_line_neon(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                        unsigned int n);
+void conv_half_y_neon(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_half_uv_neon(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_blend_line_neon(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n, unsigned int frac);
+void conv_filter_y_neon(const uint8_t *src, uint8_t *dst, unsigned int n,
+                        const uint16_t *xs, const uint8_t *fx);
+void conv_filter_uv_neon(const uint8_t *src, uint8_t *dst, unsigned int n,
+                         const uint16_t *xs, const uint8_t *fx);
+#endif
+
+#ifdef CONV_HAVE_SSE2
+void conv_yuyv_row_sse2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width);
+void conv_yuyv_rows2_sse2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width);
+void conv_uyvy_row_sse2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width);
+void conv_uyvy_rows2_sse2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width);
+void conv_uv_merge_sse2(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        unsigned int width);
+void conv_avg_line_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                        unsigned int n);
+void conv_half_y_sse2(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_half_uv_sse2(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_blend_line_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n, unsigned int frac);
+void conv_filter_y_sse2(const uint8_t *src, uint8_t *dst, unsigned int n,
+                        const uint16_t *xs, const uint8_t *fx);
+void conv_filter_uv_sse2(const uint8_t *src, uint8_t *dst, unsigned int n,
+                         const uint16_t *xs, const uint8_t *fx);
+#endif
+
+#ifdef CONV_HAVE_AVX2
+void conv_yuyv_row_avx2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width);
+void conv_yuyv_rows2_avx2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width);
+void conv_uyvy_row_avx2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width);
+void conv_uyvy_rows2_avx2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width);
+void conv_uv_merge_avx2(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        unsigned int width);
+void conv_avg_line_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                        unsigned int n);
+void conv_half_y_avx2(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_half_uv_avx2(const uint8_t *src, uint8_t *dst, unsigned int n);
+void conv_blend_line_avx2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n, unsigned int frac);
+#endif
+
+// Kernel tables of convert.c, by source format and backend
+extern const conv_yuyv_row_fn conv_packed_rows[2][CONV_ISA_N];
+extern const conv_yuyv_rows2_fn conv_packed_rows2[2][CONV_ISA_N];
+extern const conv_uv_merge_fn conv_uv_merges[CONV_ISA_N];
+
+// Shared by convert.c, convert_scale.c and the pool of convert_pool.c
+int conv_layout_check(int isa, const struct Conv_layout *l,
+                      size_t in_buff_sz, size_t out_buff_sz);
+void conv_lines(int isa, int chroma, const struct Conv_layout *l,
+                const void *in_buff, void *out_buff,
+                unsigned int first, unsigned int count);
+void conv_scale_lines(int isa, int chroma, const struct Conv_layout *l,
+                      const void *in_buff, void *out_buff,
+                      unsigned int first, unsigned int count);
+
+#endif /* INCLUDE_CONVERT_IMPL_H */
@@ -0,0 +1,337 @@
+#include <stdint.h>
+#include <string.h>
+#include <arm_neon.h>
+
+#include "convert_impl.h"
+
+/* 16 pixels per step. A line that is not a multiple of 16 ends with one
+ * more step over its last 16 pixels, overlapping the previous one, see
+ * convert_sse2.c */
+
+
+/* vld2q_u8 splits 16 YUYV pixels into 16 Y and 8 CbCr pairs at once,
+ * UYVY has them the other way round */
+static inline void row_step(const uint8_t *src, uint8_t *y, uint8_t *uv, int uyvy)
+{
+    uint8x16x2_t chunk_128x2 = vld2q_u8(src);
+
+    vst1q_u8(y, chunk_128x2.val[uyvy]);
+    if( uv )
+        vst1q_u8(uv, chunk_128x2.val[!uyvy]);
+}
+
+
+/* Both lines are loaded once, vrhaddq_u8 gives the rounded chroma mean */
+static inline void pair_step(const uint8_t *src0, const uint8_t *src1,
+                             uint8_t *y0, uint8_t *y1, uint8_t *uv, int uyvy)
+{
+    uint8x16x2_t line0 = vld2q_u8(src0);
+    uint8x16x2_t line1 = vld2q_u8(src1);
+
+    vst1q_u8(y0, line0.val[uyvy]);
+    vst1q_u8(y1, line1.val[uyvy]);
+    vst1q_u8(uv, vrhaddq_u8(line0.val[!uyvy], line1.val[!uyvy]));
+}
+
+
+/* vst2q_u8 interleaves 16 Cb and 16 Cr bytes on the way out */
+static inline void uv_merge_step(const uint8_t *u, const uint8_t *v, uint8_t *uv)
+{
+    uint8x16x2_t chunk_128x2;
+
+    chunk_128x2.val[0] = vld1q_u8(u);
+    chunk_128x2.val[1] = vld1q_u8(v);
+    vst2q_u8(uv, chunk_128x2);
+}
+
+
+void conv_yuyv_row_neon(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_yuyv_row_scalar(src, y, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src + 2 * n + CONV_PREFETCH_AHEAD);
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 0);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 0);
+    }
+}
+
+
+void conv_yuyv_rows2_neon(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_yuyv_rows2_scalar(src0, src1, y0, y1, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src0 + 2 * n + CONV_PREFETCH_AHEAD);
+        conv_prefetch(src1 + 2 * n + CONV_PREFETCH_AHEAD);
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 0);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 0);
+    }
+}
+
+
+void conv_uyvy_row_neon(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_uyvy_row_scalar(src, y, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src + 2 * n + CONV_PREFETCH_AHEAD);
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 1);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 1);
+    }
+}
+
+
+void conv_uyvy_rows2_neon(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_uyvy_rows2_scalar(src0, src1, y0, y1, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src0 + 2 * n + CONV_PREFETCH_AHEAD);
+        conv_prefetch(src1 + 2 * n + CONV_PREFETCH_AHEAD);
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 1);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 1);
+    }
+}
+
+
+void conv_uv_merge_neon(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 32 ) {
+        conv_uv_merge_scalar(u, v, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 32 <= width; n += 32 ) {
+        conv_prefetch(u + n / 2 + CONV_PREFETCH_AHEAD);
+        conv_prefetch(v + n / 2 + CONV_PREFETCH_AHEAD);
+        uv_merge_step(u + n / 2, v + n / 2, uv + n);
+    }
+
+    if( n < width ) {
+        n = width - 32;
+        uv_merge_step(u + n / 2, v + n / 2, uv + n);
+    }
+}
+
+
+/* The scaling kernels below may run in place, so their tails stay
+ * scalar, see convert_sse2.c */
+
+void conv_avg_line_neon(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                        unsigned int n)
+{
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 )
+        vst1q_u8(out + i, vrhaddq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+
+    if( i < n )
+        conv_avg_line_scalar(a + i, b + i, out + i, n - i);
+}
+
+
+/* vld2q_u8 puts even and odd neighbours into different registers */
+void conv_half_y_neon(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    uint8x16x2_t chunk_128x2;
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 ) {
+        chunk_128x2 = vld2q_u8(src);
+        vst1q_u8(dst + i, vrhaddq_u8(chunk_128x2.val[0], chunk_128x2.val[1]));
+
+        src += 32;
+    }
+
+    if( i < n )
+        conv_half_y_scalar(src, dst + i, n - i);
+}
+
+
+/* Cb, Cr of even pairs and Cb, Cr of odd pairs come in four registers */
+void conv_half_uv_neon(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    uint8x16x4_t chunk_128x4;
+    uint8x16x2_t uv_128x2;
+    unsigned int i;
+
+    for( i = 0; i + 32 <= n; i += 32 ) {
+        chunk_128x4 = vld4q_u8(src);
+        uv_128x2.val[0] = vrhaddq_u8(chunk_128x4.val[0], chunk_128x4.val[2]);
+        uv_128x2.val[1] = vrhaddq_u8(chunk_128x4.val[1], chunk_128x4.val[3]);
+        vst2q_u8(dst + i, uv_128x2);
+
+        src += 64;
+    }
+
+    if( i < n )
+        conv_half_uv_scalar(src, dst + i, n - i);
+}
+
+
+/* vrshrn_n_u16 does the (x + 64) >> 7 rounding and narrowing at once */
+void conv_blend_line_neon(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n, unsigned int frac)
+{
+    const uint8x8_t wa = vdup_n_u8(128 - frac);
+    const uint8x8_t wb = vdup_n_u8(frac);
+    uint8x16_t va, vb;
+    uint16x8_t lo, hi;
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 ) {
+        va = vld1q_u8(a + i);
+        vb = vld1q_u8(b + i);
+
+        lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+        hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb), wb);
+
+        vst1q_u8(out + i, vcombine_u8(vrshrn_n_u16(lo, 7), vrshrn_n_u16(hi, 7)));
+    }
+
+    if( i < n )
+        conv_blend_line_scalar(a + i, b + i, out + i, n - i, frac);
+}
+
+
+static inline uint16_t load16(const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static inline uint32_t load32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+/* One 16-bit load takes a pixel and its right neighbour, vmovn_u16 and
+ * vshrn_n_u16 split them. There is no gather, lanes are set one by one */
+void conv_filter_y_neon(const uint8_t *src, uint8_t *dst, unsigned int n,
+                        const uint16_t *xs, const uint8_t *fx)
+{
+    const uint8x8_t full = vdup_n_u8(128);
+    uint16x8_t in = vdupq_n_u16(0);
+    uint8x8_t w;
+    unsigned int i;
+
+    for( i = 0; i + 8 <= n; i += 8 ) {
+        in = vsetq_lane_u16(load16(src + xs[i + 0]), in, 0);
+        in = vsetq_lane_u16(load16(src + xs[i + 1]), in, 1);
+        in = vsetq_lane_u16(load16(src + xs[i + 2]), in, 2);
+        in = vsetq_lane_u16(load16(src + xs[i + 3]), in, 3);
+        in = vsetq_lane_u16(load16(src + xs[i + 4]), in, 4);
+        in = vsetq_lane_u16(load16(src + xs[i + 5]), in, 5);
+        in = vsetq_lane_u16(load16(src + xs[i + 6]), in, 6);
+        in = vsetq_lane_u16(load16(src + xs[i + 7]), in, 7);
+        w = vld1_u8(fx + i);
+
+        vst1_u8(dst + i, vrshrn_n_u16(vmlal_u8(vmull_u8(vmovn_u16(in), vsub_u8(full, w)),
+                                               vshrn_n_u16(in, 8), w), 7));
+    }
+
+    if( i < n )
+        conv_filter_y_scalar(src, dst + i, n - i, xs + i, fx + i);
+}
+
+
+/* A 32-bit load takes a CbCr pair and its right neighbour, the halves
+ * of the words are split the same way as luma bytes */
+static inline uint32x4_t gather_uv(const uint8_t *src, const uint16_t *xs)
+{
+    uint32x4_t in = vdupq_n_u32(0);
+
+    in = vsetq_lane_u32(load32(src + 2 * xs[0]), in, 0);
+    in = vsetq_lane_u32(load32(src + 2 * xs[1]), in, 1);
+    in = vsetq_lane_u32(load32(src + 2 * xs[2]), in, 2);
+    in = vsetq_lane_u32(load32(src + 2 * xs[3]), in, 3);
+
+    return in;
+}
+
+
+void conv_filter_uv_neon(const uint8_t *src, uint8_t *dst, unsigned int n,
+                         const uint16_t *xs, const uint8_t *fx)
+{
+    const uint8x8_t full = vdup_n_u8(128);
+    uint32x4_t in0, in1;
+    uint8x16_t a, b;
+    uint8x8x2_t w;
+    uint16x8_t lo, hi;
+    unsigned int i;
+
+    for( i = 0; i + 8 <= n; i += 8 ) {
+        in0 = gather_uv(src, xs + i);
+        in1 = gather_uv(src, xs + i + 4);
+        a = vcombine_u8(vreinterpret_u8_u16(vmovn_u32(in0)),
+                        vreinterpret_u8_u16(vmovn_u32(in1)));
+        b = vcombine_u8(vreinterpret_u8_u16(vshrn_n_u32(in0, 16)),
+                        vreinterpret_u8_u16(vshrn_n_u32(in1, 16)));
+
+        // Cb and Cr of a pair share the weight
+        w = vzip_u8(vld1_u8(fx + i), vld1_u8(fx + i));
+
+        lo = vmlal_u8(vmull_u8(vget_low_u8(a), vsub_u8(full, w.val[0])),
+                      vget_low_u8(b), w.val[0]);
+        hi = vmlal_u8(vmull_u8(vget_high_u8(a), vsub_u8(full, w.val[1])),
+                      vget_high_u8(b), w.val[1]);
+
+        vst1q_u8(dst + 2 * i, vcombine_u8(vrshrn_n_u16(lo, 7), vrshrn_n_u16(hi, 7)));
+    }
+
+    if( i < n )
+        conv_filter_uv_scalar(src, dst + 2 * i, n - i, xs + i, fx + i);
+}
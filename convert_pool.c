@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "log.h"
+#include "convert.h"
+#include "convert_impl.h"
+
+/* A frame is cut into horizontal bands of even line count, one per thread.
+ * The caller publishes the job by bumping 'gen', converts band 0 and waits
+ * until the workers have counted 'left' down to zero. Nothing but these
+ * two words is shared, sleeping and waking is done with futexes */
+
+struct Conv_worker {
+    pthread_t               thread;
+    int                     band;
+    int                     started;
+    struct Conv_band_stats  st;
+};
+
+static struct {
+    int                     threads;    // bands per frame, caller included
+    int                     gen;        // job number
+    int                     left;       // bands not done yet
+    int                     quit;
+
+    // The job, valid while 'left' is not zero
+    int                     isa;
+    int                     chroma;
+    const struct Conv_layout *l;
+    const void              *in;
+    void                    *out;
+
+    struct Conv_worker      w[CONV_THREADS_MAX];
+} pool = { .threads = 1 };
+
+
+static void futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+
+static void futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void run_band(struct Conv_worker *w)
+{
+    const struct Conv_layout *l = pool.l;
+    unsigned int band_h, first, count;
+    uint64_t t;
+
+    band_h = (l->dst_height / 2 + pool.threads - 1) / pool.threads * 2;
+    first = band_h * w->band;
+    count = 0;
+    if( first < l->dst_height )
+        count = l->dst_height - first < band_h ? l->dst_height - first : band_h;
+
+    t = now_ns();
+    if( count )
+        conv_lines(pool.isa, pool.chroma, l, pool.in, pool.out, first, count);
+    t = now_ns() - t;
+
+    w->st.first = first;
+    w->st.count = count;
+    w->st.runs++;
+    w->st.busy_ns += t;
+    if( t > w->st.max_ns )
+        w->st.max_ns = t;
+}
+
+
+static void *worker_main(void *arg)
+{
+    struct Conv_worker *w = arg;
+    int seen = 0;
+    int gen;
+
+    for(;;) {
+        while( (gen = __atomic_load_n(&pool.gen, __ATOMIC_ACQUIRE)) == seen )
+            futex_wait(&pool.gen, seen);
+        seen = gen;
+
+        if( __atomic_load_n(&pool.quit, __ATOMIC_ACQUIRE) )
+            break;
+
+        run_band(w);
+
+        if( __atomic_sub_fetch(&pool.left, 1, __ATOMIC_ACQ_REL) == 0 )
+            futex_wake(&pool.left);
+    }
+
+    return NULL;
+}
+
+
+/* Start 'threads' - 1 workers, 0 takes one per online core. Workers are
+ * pinned to cores 1, 2, ... The calling thread converts band 0 wherever
+ * the scheduler runs it: pinning it would pin every thread it starts
+ * later too */
+int conv_pool_start(int threads)
+{
+    long cpu_n = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    int n, ret;
+
+    if( cpu_n < 1 )
+        cpu_n = 1;
+    if( threads == 0 )
+        threads = cpu_n;
+    if( threads > CONV_THREADS_MAX )
+        threads = CONV_THREADS_MAX;
+    if( threads < 1 ) {
+        log_fatal("Wrong number of conversion threads %d", threads);
+        return -1;
+    }
+
+    conv_pool_stop();
+
+    memset(pool.w, 0, sizeof(pool.w));
+    pool.gen = 0;
+    pool.left = 0;
+    pool.quit = 0;
+    pool.threads = threads;
+    pool.w[0].st.cpu = -1;
+
+    for( n = 1; n < threads; n++ ) {
+        struct Conv_worker *w = &pool.w[n];
+
+        w->band = n;
+        w->st.cpu = -1;
+
+        ret = pthread_create(&w->thread, NULL, worker_main, w);
+        if( ret != 0 ) {
+            errno = ret;
+            log_fatal("Can't start conversion thread %d [%m]", n);
+            conv_pool_stop();
+            return -1;
+        }
+        w->started = 1;
+
+        if( cpu_n > 1 ) {
+            CPU_ZERO(&cpus);
+            CPU_SET(n % cpu_n, &cpus);
+            ret = pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus);
+            if( ret == 0 )
+                w->st.cpu = n % cpu_n;
+            else
+                log_warn("Can't pin conversion thread %d to core %ld",
+                         n, n % cpu_n);
+        }
+    }
+
+    log_info("YUYV to NV12 conversion: %d thread(s) on %ld core(s)",
+             threads, cpu_n);
+
+    return 0;
+}
+
+
+void conv_pool_stop(void)
+{
+    int n;
+
+    __atomic_store_n(&pool.quit, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pool.gen, 1, __ATOMIC_RELEASE);
+    futex_wake(&pool.gen);
+
+    for( n = 1; n < CONV_THREADS_MAX; n++ ) {
+        if( !pool.w[n].started )
+            continue;
+        pthread_join(pool.w[n].thread, NULL);
+        pool.w[n].started = 0;
+    }
+
+    pool.threads = 1;
+}
+
+
+int conv_pool_threads(void)
+{
+    return pool.threads;
+}
+
+
+int conv_frame_mt(int isa, int chroma, const struct Conv_layout *l,
+                  const void *in_buff, size_t in_buff_sz,
+                  void *out_buff, size_t out_buff_sz)
+{
+    int left;
+
+    if( conv_layout_check(isa, l, in_buff_sz, out_buff_sz) != 0 )
+        return -1;
+
+    pool.isa = isa;
+    pool.chroma = chroma;
+    pool.l = l;
+    pool.in = in_buff;
+    pool.out = out_buff;
+
+    // Wake the workers, band 0 is ours
+    if( pool.threads > 1 ) {
+        __atomic_store_n(&pool.left, pool.threads - 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pool.gen, 1, __ATOMIC_RELEASE);
+        futex_wake(&pool.gen);
+    }
+
+    run_band(&pool.w[0]);
+
+    while( (left = __atomic_load_n(&pool.left, __ATOMIC_ACQUIRE)) != 0 )
+        futex_wait(&pool.left, left);
+
+    return 0;
+}
+
+
+/* Copy out the band timings, returns the number of bands */
+int conv_pool_stats(struct Conv_band_stats *st, int reset)
+{
+    int n;
+
+    for( n = 0; n < pool.threads; n++ ) {
+        st[n] = pool.w[n].st;
+        if( reset ) {
+            pool.w[n].st.runs = 0;
+            pool.w[n].st.busy_ns = 0;
+            pool.w[n].st.max_ns = 0;
+        }
+    }
+
+    return pool.threads;
+}
+
+
+void conv_pool_report(void)
+{
+    struct Conv_band_stats st[CONV_THREADS_MAX];
+    int n, bands;
+
+    bands = conv_pool_stats(st, 1);
+
+    for( n = 0; n < bands; n++ ) {
+        if( !st[n].runs )
+            continue;
+        log_info("Convert band %d (core %d): lines %u-%u, avg %llu us, max %llu us",
+                 n, st[n].cpu, st[n].first, st[n].first + st[n].count,
+                 (unsigned long long)(st[n].busy_ns / st[n].runs / 1000),
+                 (unsigned long long)(st[n].max_ns / 1000));
+    }
+}
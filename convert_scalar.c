@@ -0,0 +1,163 @@
+#include <stdint.h>
+
+#include "convert_impl.h"
+
+
+void conv_yuyv_row_scalar(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    for( n = 0; n < width; n += 2 ) {
+        y[n + 0] = src[0];
+        y[n + 1] = src[2];
+
+        if( uv ) {
+            uv[n + 0] = src[1];
+            uv[n + 1] = src[3];
+        }
+
+        src += 4;
+    }
+}
+
+
+void conv_yuyv_rows2_scalar(const uint8_t *src0, const uint8_t *src1,
+                            uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                            unsigned int width)
+{
+    unsigned int n;
+
+    for( n = 0; n < width; n += 2 ) {
+        y0[n + 0] = src0[0];
+        y0[n + 1] = src0[2];
+        y1[n + 0] = src1[0];
+        y1[n + 1] = src1[2];
+
+        uv[n + 0] = (src0[1] + src1[1] + 1) >> 1;
+        uv[n + 1] = (src0[3] + src1[3] + 1) >> 1;
+
+        src0 += 4;
+        src1 += 4;
+    }
+}
+
+
+void conv_uyvy_row_scalar(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    for( n = 0; n < width; n += 2 ) {
+        y[n + 0] = src[1];
+        y[n + 1] = src[3];
+
+        if( uv ) {
+            uv[n + 0] = src[0];
+            uv[n + 1] = src[2];
+        }
+
+        src += 4;
+    }
+}
+
+
+void conv_uyvy_rows2_scalar(const uint8_t *src0, const uint8_t *src1,
+                            uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                            unsigned int width)
+{
+    unsigned int n;
+
+    for( n = 0; n < width; n += 2 ) {
+        y0[n + 0] = src0[1];
+        y0[n + 1] = src0[3];
+        y1[n + 0] = src1[1];
+        y1[n + 1] = src1[3];
+
+        uv[n + 0] = (src0[0] + src1[0] + 1) >> 1;
+        uv[n + 1] = (src0[2] + src1[2] + 1) >> 1;
+
+        src0 += 4;
+        src1 += 4;
+    }
+}
+
+
+void conv_uv_merge_scalar(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    for( n = 0; n < width; n += 2 ) {
+        uv[n + 0] = *u++;
+        uv[n + 1] = *v++;
+    }
+}
+
+
+void conv_avg_line_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n)
+{
+    unsigned int i;
+
+    for( i = 0; i < n; i++ )
+        out[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+
+void conv_half_y_scalar(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    unsigned int i;
+
+    for( i = 0; i < n; i++ )
+        dst[i] = (src[2 * i] + src[2 * i + 1] + 1) >> 1;
+}
+
+
+void conv_half_uv_scalar(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    unsigned int i;
+
+    for( i = 0; i < n; i += 2 ) {
+        dst[i + 0] = (src[2 * i + 0] + src[2 * i + 2] + 1) >> 1;
+        dst[i + 1] = (src[2 * i + 1] + src[2 * i + 3] + 1) >> 1;
+    }
+}
+
+
+void conv_blend_line_scalar(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                            unsigned int n, unsigned int frac)
+{
+    const unsigned int wa = 128 - frac;
+    unsigned int i;
+
+    for( i = 0; i < n; i++ )
+        out[i] = (a[i] * wa + b[i] * frac + 64) >> 7;
+}
+
+
+void conv_filter_y_scalar(const uint8_t *src, uint8_t *dst, unsigned int n,
+                          const uint16_t *xs, const uint8_t *fx)
+{
+    unsigned int i;
+    const uint8_t *p;
+
+    for( i = 0; i < n; i++ ) {
+        p = src + xs[i];
+        dst[i] = (p[0] * (128 - fx[i]) + p[1] * fx[i] + 64) >> 7;
+    }
+}
+
+
+void conv_filter_uv_scalar(const uint8_t *src, uint8_t *dst, unsigned int n,
+                           const uint16_t *xs, const uint8_t *fx)
+{
+    unsigned int i;
+    const uint8_t *p;
+
+    for( i = 0; i < n; i++ ) {
+        p = src + 2 * xs[i];
+        dst[2 * i + 0] = (p[0] * (128 - fx[i]) + p[2] * fx[i] + 64) >> 7;
+        dst[2 * i + 1] = (p[1] * (128 - fx[i]) + p[3] * fx[i] + 64) >> 7;
+    }
+}
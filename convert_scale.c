@@ -0,0 +1,370 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "convert.h"
+#include "convert_impl.h"
+
+/* Scaling is fused into the conversion. Camera lines are split into luma
+ * and CbCr lines of small buffers that stay in the cache, filtered there
+ * and written to the encoder frame once. The box filter is a cascade of
+ * rounded means, lines first, so every backend gives the same bytes.
+ * The bilinear one blends lines and then neighbour pixels from a table
+ * with the SIMD kernels, both with 7-bit weights */
+
+#define BOX_MAX     4
+#define LINE_SLOTS  4   // source lines kept split for the bilinear filter
+
+static const conv_avg_line_fn avg_lines[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = conv_avg_line_scalar,
+#ifdef CONV_HAVE_NEON
+    [CONV_ISA_NEON]   = conv_avg_line_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+    [CONV_ISA_SSE2]   = conv_avg_line_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+    [CONV_ISA_AVX2]   = conv_avg_line_avx2,
+#endif
+};
+
+static const conv_half_fn half_ys[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = conv_half_y_scalar,
+#ifdef CONV_HAVE_NEON
+    [CONV_ISA_NEON]   = conv_half_y_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+    [CONV_ISA_SSE2]   = conv_half_y_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+    [CONV_ISA_AVX2]   = conv_half_y_avx2,
+#endif
+};
+
+static const conv_half_fn half_uvs[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = conv_half_uv_scalar,
+#ifdef CONV_HAVE_NEON
+    [CONV_ISA_NEON]   = conv_half_uv_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+    [CONV_ISA_SSE2]   = conv_half_uv_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+    [CONV_ISA_AVX2]   = conv_half_uv_avx2,
+#endif
+};
+
+static const conv_blend_line_fn blend_lines[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = conv_blend_line_scalar,
+#ifdef CONV_HAVE_NEON
+    [CONV_ISA_NEON]   = conv_blend_line_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+    [CONV_ISA_SSE2]   = conv_blend_line_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+    [CONV_ISA_AVX2]   = conv_blend_line_avx2,
+#endif
+};
+
+/* Gathering neighbours from the table leaves little for 256-bit lanes,
+ * AVX2 CPUs run the SSE2 filters */
+static const conv_filter_fn filter_ys[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = conv_filter_y_scalar,
+#ifdef CONV_HAVE_NEON
+    [CONV_ISA_NEON]   = conv_filter_y_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+    [CONV_ISA_SSE2]   = conv_filter_y_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+    [CONV_ISA_AVX2]   = conv_filter_y_sse2,
+#endif
+};
+
+static const conv_filter_fn filter_uvs[CONV_ISA_N] = {
+    [CONV_ISA_SCALAR] = conv_filter_uv_scalar,
+#ifdef CONV_HAVE_NEON
+    [CONV_ISA_NEON]   = conv_filter_uv_neon,
+#endif
+#ifdef CONV_HAVE_SSE2
+    [CONV_ISA_SSE2]   = conv_filter_uv_sse2,
+#endif
+#ifdef CONV_HAVE_AVX2
+    [CONV_ISA_AVX2]   = conv_filter_uv_sse2,
+#endif
+};
+
+// Two source lines: luma of both and their 4:2:0 CbCr line
+struct Src_pair {
+    const uint8_t   *y0;
+    const uint8_t   *y1;
+    const uint8_t   *uv;
+};
+
+// Source lines split for the bilinear filter, the least used is replaced
+struct Line_cache {
+    int              isa;
+    const struct Conv_layout *l;
+    const uint8_t   *in;
+    int              line[LINE_SLOTS];  // -1 - empty slot
+    unsigned int     used[LINE_SLOTS];
+    unsigned int     clock;
+    uint8_t          y[LINE_SLOTS][CONV_LINE_MAX];
+    uint8_t          uv[LINE_SLOTS][CONV_LINE_MAX];
+};
+
+
+static int is_packed(int fmt)
+{
+    return fmt == CONV_FMT_YUYV || fmt == CONV_FMT_UYVY;
+}
+
+
+/* Lines 'line' and 'line + 1' of the source, 'line' is even. Packed lines
+ * are split into the buffers, planar ones are taken in place and only the
+ * I420 chroma is merged */
+static void src_pair(int isa, int chroma, const struct Conv_layout *l,
+                     const uint8_t *in, unsigned int line,
+                     uint8_t *y0, uint8_t *y1, uint8_t *uv, struct Src_pair *p)
+{
+    const uint8_t *src = in + (size_t)l->src_stride * line;
+    const size_t c_pos = (size_t)l->src_uv_stride * (line / 2);
+
+    if( is_packed(l->src_fmt) ) {
+        if( chroma == CONV_CHROMA_AVG ) {
+            conv_packed_rows2[l->src_fmt][isa](src, src + l->src_stride,
+                                               y0, y1, uv, l->width);
+        } else {
+            conv_packed_rows[l->src_fmt][isa](src, y0, uv, l->width);
+            conv_packed_rows[l->src_fmt][isa](src + l->src_stride, y1, NULL, l->width);
+        }
+        p->y0 = y0;
+        p->y1 = y1;
+        p->uv = uv;
+        return;
+    }
+
+    p->y0 = src;
+    p->y1 = src + l->src_stride;
+
+    if( l->src_fmt == CONV_FMT_NV12 ) {
+        p->uv = in + l->src_uv_offset + c_pos;
+        return;
+    }
+
+    conv_uv_merges[isa](in + l->src_uv_offset + c_pos, in + l->src_v_offset + c_pos,
+                        uv, l->width);
+    p->uv = uv;
+}
+
+
+/* Means of f x f pixels, f is 2 or 4. A luma line of the destination is
+ * made of f source lines, a CbCr line of f CbCr lines of 4:2:0 */
+static void box_lines(int isa, int chroma, const struct Conv_layout *l,
+                      const uint8_t *in, uint8_t *out,
+                      unsigned int first, unsigned int count)
+{
+    const unsigned int f = l->width / l->dst_width;
+    const unsigned int width = l->width;
+    const conv_avg_line_fn avg_line = avg_lines[isa];
+    const conv_half_fn half_y = half_ys[isa];
+    const conv_half_fn half_uv = half_uvs[isa];
+    uint8_t y_buf[2][CONV_LINE_MAX];
+    uint8_t sum[BOX_MAX / 2][CONV_LINE_MAX];
+    uint8_t c_buf[BOX_MAX][CONV_LINE_MAX];
+    const uint8_t *c_line[BOX_MAX];
+    struct Src_pair p;
+    uint8_t *y_plane, *uv_plane;
+    unsigned int line_n, r, k, w;
+
+    for( line_n = first; line_n < first + count; line_n += 2 ) {
+        y_plane = out + (size_t)l->y_stride * line_n;
+        uv_plane = out + l->uv_offset + (size_t)l->uv_stride * (line_n / 2);
+
+        for( r = 0; r < 2; r++ ) {
+            for( k = 0; k < f / 2; k++ ) {
+                src_pair(isa, chroma, l, in, (line_n + r) * f + 2 * k,
+                         y_buf[0], y_buf[1], c_buf[r * f / 2 + k], &p);
+                avg_line(p.y0, p.y1, sum[k], width);
+                c_line[r * f / 2 + k] = p.uv;
+            }
+            if( f == 4 )
+                avg_line(sum[0], sum[1], sum[0], width);
+
+            for( w = width / 2; w > l->dst_width; w /= 2 )
+                half_y(sum[0], sum[0], w);
+            half_y(sum[0], y_plane + (size_t)l->y_stride * r, l->dst_width);
+        }
+
+        avg_line(c_line[0], c_line[1], c_buf[0], width);
+        if( f == 4 ) {
+            avg_line(c_line[2], c_line[3], c_buf[1], width);
+            avg_line(c_buf[0], c_buf[1], c_buf[0], width);
+        }
+
+        for( w = width / 2; w > l->dst_width; w /= 2 )
+            half_uv(c_buf[0], c_buf[0], w);
+        half_uv(c_buf[0], uv_plane, l->dst_width);
+    }
+}
+
+
+/* Where the centre of the destination pixel 'n' falls in the source,
+ * 'frac' is the weight of the next source pixel in 1/128 */
+static unsigned int src_coord(unsigned int n, unsigned int src, unsigned int dst,
+                              unsigned int *frac)
+{
+    uint64_t pos = ((uint64_t)(2 * n + 1) * src << 16) / (2 * dst);
+
+    pos = pos > 0x8000 ? pos - 0x8000 : 0;
+    *frac = (pos >> 9) & 127;
+
+    return pos >> 16;
+}
+
+
+/* Neighbour indices and weights of a destination line. The last source
+ * pixel is taken as the full weight of the one before it, so nothing is
+ * read past the line */
+static void coord_table(uint16_t *xs, uint8_t *fx, unsigned int src, unsigned int dst)
+{
+    unsigned int n, x, frac;
+
+    for( n = 0; n < dst; n++ ) {
+        x = src_coord(n, src, dst, &frac);
+        if( x >= src - 1 ) {
+            x = src - 2;
+            frac = 128;
+        }
+        xs[n] = x;
+        fx[n] = frac;
+    }
+}
+
+
+/* Slot of a split packed line, or of a merged I420 CbCr line */
+static int cache_slot(struct Line_cache *c, unsigned int line)
+{
+    const struct Conv_layout *l = c->l;
+    const uint8_t *src;
+    int n, slot = 0;
+
+    for( n = 0; n < LINE_SLOTS; n++ ) {
+        if( c->line[n] == (int)line ) {
+            c->used[n] = ++c->clock;
+            return n;
+        }
+        if( c->used[n] < c->used[slot] )
+            slot = n;
+    }
+
+    if( is_packed(l->src_fmt) ) {
+        src = c->in + (size_t)l->src_stride * line;
+        conv_packed_rows[l->src_fmt][c->isa](src, c->y[slot], c->uv[slot], l->width);
+    } else {
+        src = c->in + (size_t)l->src_uv_stride * line;
+        conv_uv_merges[c->isa](src + l->src_uv_offset, src + l->src_v_offset,
+                               c->uv[slot], l->width);
+    }
+
+    c->line[slot] = line;
+    c->used[slot] = ++c->clock;
+
+    return slot;
+}
+
+
+static const uint8_t *luma_line(struct Line_cache *c, unsigned int line)
+{
+    if( !is_packed(c->l->src_fmt) )
+        return c->in + (size_t)c->l->src_stride * line;
+
+    return c->y[cache_slot(c, line)];
+}
+
+
+// Packed sources have a CbCr line for every line, planar ones for two
+static const uint8_t *chroma_line(struct Line_cache *c, unsigned int line)
+{
+    if( c->l->src_fmt == CONV_FMT_NV12 )
+        return c->in + c->l->src_uv_offset + (size_t)c->l->src_uv_stride * line;
+
+    return c->uv[cache_slot(c, line)];
+}
+
+
+/* Line 'n' of 'dst' lines: blended in 'tmp' or taken as it is */
+static const uint8_t *src_blend(struct Line_cache *c, int is_uv,
+                                unsigned int n, unsigned int src, unsigned int dst,
+                                uint8_t *tmp)
+{
+    const uint8_t *a, *b;
+    unsigned int line, frac;
+
+    line = src_coord(n, src, dst, &frac);
+    if( line >= src - 1 ) {
+        line = src - 1;
+        frac = 0;
+    }
+
+    a = is_uv ? chroma_line(c, line) : luma_line(c, line);
+    if( frac == 0 )
+        return a;
+
+    b = is_uv ? chroma_line(c, line + 1) : luma_line(c, line + 1);
+    blend_lines[c->isa](a, b, tmp, c->l->width, frac);
+
+    return tmp;
+}
+
+
+static void bilinear_lines(int isa, const struct Conv_layout *l,
+                           const uint8_t *in, uint8_t *out,
+                           unsigned int first, unsigned int count)
+{
+    const unsigned int c_height = is_packed(l->src_fmt) ? l->height : l->height / 2;
+    struct Line_cache c;
+    uint16_t xs_y[CONV_LINE_MAX], xs_c[CONV_LINE_MAX / 2];
+    uint8_t fx_y[CONV_LINE_MAX], fx_c[CONV_LINE_MAX / 2];
+    uint8_t tmp[CONV_LINE_MAX];
+    const uint8_t *line;
+    unsigned int line_n;
+    int n;
+
+    c.isa = isa;
+    c.l = l;
+    c.in = in;
+    c.clock = 0;
+    for( n = 0; n < LINE_SLOTS; n++ ) {
+        c.line[n] = -1;
+        c.used[n] = 0;
+    }
+
+    coord_table(xs_y, fx_y, l->width, l->dst_width);
+    coord_table(xs_c, fx_c, l->width / 2, l->dst_width / 2);
+
+    for( line_n = first; line_n < first + count; line_n++ ) {
+        line = src_blend(&c, 0, line_n, l->height, l->dst_height, tmp);
+        filter_ys[isa](line, out + (size_t)l->y_stride * line_n, l->dst_width, xs_y, fx_y);
+
+        if( line_n % 2 == 0 )
+            continue;
+
+        line = src_blend(&c, 1, line_n / 2, c_height, l->dst_height / 2, tmp);
+        filter_uvs[isa](line, out + l->uv_offset + (size_t)l->uv_stride * (line_n / 2),
+                        l->dst_width / 2, xs_c, fx_c);
+    }
+}
+
+
+/* Scaled counterpart of conv_lines(), NV12 out only. 'first' and 'count'
+ * are even lines of the destination. No checks here either */
+void conv_scale_lines(int isa, int chroma, const struct Conv_layout *l,
+                      const void *in_buff, void *out_buff,
+                      unsigned int first, unsigned int count)
+{
+    if( l->scale == CONV_SCALE_BOX )
+        box_lines(isa, chroma, l, in_buff, out_buff, first, count);
+    else
+        bilinear_lines(isa, l, in_buff, out_buff, first, count);
+}
@@ -0,0 +1,400 @@
+#include <stdint.h>
+#include <string.h>
+#include <emmintrin.h>
+
+#include "convert_impl.h"
+
+/* Every kernel works on 16 pixels per step. A line that is not a multiple
+ * of that ends with one more step placed over the last 16 pixels: it
+ * overlaps the previous one and writes the same bytes again, so only
+ * lines shorter than a step go to the scalar code. The source is
+ * prefetched a few cache lines ahead of the steps */
+
+
+static inline __m128i pack_lo(__m128i in0, __m128i in1)
+{
+    const __m128i lo_mask = _mm_set1_epi16(0x00ff);
+
+    return _mm_packus_epi16(_mm_and_si128(in0, lo_mask), _mm_and_si128(in1, lo_mask));
+}
+
+
+static inline __m128i pack_hi(__m128i in0, __m128i in1)
+{
+    return _mm_packus_epi16(_mm_srli_epi16(in0, 8), _mm_srli_epi16(in1, 8));
+}
+
+
+/* Luma is the low byte of every 16-bit word, CbCr the high one, both are
+ * narrowed back with packus. UYVY is YUYV with the bytes of every pair
+ * swapped, luma is the high byte there */
+static inline void row_step(const uint8_t *src, uint8_t *y, uint8_t *uv, int uyvy)
+{
+    __m128i in0, in1;
+
+    in0 = _mm_loadu_si128((const __m128i *)(src + 0));
+    in1 = _mm_loadu_si128((const __m128i *)(src + 16));
+
+    _mm_storeu_si128((__m128i *)y, uyvy ? pack_hi(in0, in1) : pack_lo(in0, in1));
+    if( uv )
+        _mm_storeu_si128((__m128i *)uv, uyvy ? pack_lo(in0, in1) : pack_hi(in0, in1));
+}
+
+
+/* _mm_avg_epu8 rounds up like (a + b + 1) >> 1. It averages luma bytes
+ * too, they are just thrown away by the shift or the mask */
+static inline void pair_step(const uint8_t *src0, const uint8_t *src1,
+                             uint8_t *y0, uint8_t *y1, uint8_t *uv, int uyvy)
+{
+    __m128i a0, a1, b0, b1, c0, c1;
+
+    a0 = _mm_loadu_si128((const __m128i *)(src0 + 0));
+    a1 = _mm_loadu_si128((const __m128i *)(src0 + 16));
+    b0 = _mm_loadu_si128((const __m128i *)(src1 + 0));
+    b1 = _mm_loadu_si128((const __m128i *)(src1 + 16));
+    c0 = _mm_avg_epu8(a0, b0);
+    c1 = _mm_avg_epu8(a1, b1);
+
+    _mm_storeu_si128((__m128i *)y0, uyvy ? pack_hi(a0, a1) : pack_lo(a0, a1));
+    _mm_storeu_si128((__m128i *)y1, uyvy ? pack_hi(b0, b1) : pack_lo(b0, b1));
+    _mm_storeu_si128((__m128i *)uv, uyvy ? pack_lo(c0, c1) : pack_hi(c0, c1));
+}
+
+
+// 16 Cb and 16 Cr bytes make 32 bytes of CbCr
+static inline void uv_merge_step(const uint8_t *u, const uint8_t *v, uint8_t *uv)
+{
+    __m128i cb, cr;
+
+    cb = _mm_loadu_si128((const __m128i *)u);
+    cr = _mm_loadu_si128((const __m128i *)v);
+
+    _mm_storeu_si128((__m128i *)(uv + 0), _mm_unpacklo_epi8(cb, cr));
+    _mm_storeu_si128((__m128i *)(uv + 16), _mm_unpackhi_epi8(cb, cr));
+}
+
+
+void conv_yuyv_row_sse2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_yuyv_row_scalar(src, y, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src + 2 * n + CONV_PREFETCH_AHEAD);
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 0);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 0);
+    }
+}
+
+
+void conv_yuyv_rows2_sse2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_yuyv_rows2_scalar(src0, src1, y0, y1, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src0 + 2 * n + CONV_PREFETCH_AHEAD);
+        conv_prefetch(src1 + 2 * n + CONV_PREFETCH_AHEAD);
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 0);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 0);
+    }
+}
+
+
+void conv_uyvy_row_sse2(const uint8_t *src, uint8_t *y, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_uyvy_row_scalar(src, y, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src + 2 * n + CONV_PREFETCH_AHEAD);
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 1);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        row_step(src + 2 * n, y + n, uv ? uv + n : NULL, 1);
+    }
+}
+
+
+void conv_uyvy_rows2_sse2(const uint8_t *src0, const uint8_t *src1,
+                          uint8_t *y0, uint8_t *y1, uint8_t *uv,
+                          unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 16 ) {
+        conv_uyvy_rows2_scalar(src0, src1, y0, y1, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 16 <= width; n += 16 ) {
+        conv_prefetch(src0 + 2 * n + CONV_PREFETCH_AHEAD);
+        conv_prefetch(src1 + 2 * n + CONV_PREFETCH_AHEAD);
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 1);
+    }
+
+    if( n < width ) {
+        n = width - 16;
+        pair_step(src0 + 2 * n, src1 + 2 * n, y0 + n, y1 + n, uv + n, 1);
+    }
+}
+
+
+void conv_uv_merge_sse2(const uint8_t *u, const uint8_t *v, uint8_t *uv,
+                        unsigned int width)
+{
+    unsigned int n;
+
+    if( width < 32 ) {
+        conv_uv_merge_scalar(u, v, uv, width);
+        return;
+    }
+
+    for( n = 0; n + 32 <= width; n += 32 ) {
+        conv_prefetch(u + n / 2 + CONV_PREFETCH_AHEAD);
+        conv_prefetch(v + n / 2 + CONV_PREFETCH_AHEAD);
+        uv_merge_step(u + n / 2, v + n / 2, uv + n);
+    }
+
+    if( n < width ) {
+        n = width - 32;
+        uv_merge_step(u + n / 2, v + n / 2, uv + n);
+    }
+}
+
+
+/* The scaling kernels below may run in place, dst over src, where an
+ * overlapping step would read bytes already written. Their tails stay
+ * scalar */
+
+void conv_avg_line_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                        unsigned int n)
+{
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 )
+        _mm_storeu_si128((__m128i *)(out + i),
+                         _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                      _mm_loadu_si128((const __m128i *)(b + i))));
+
+    if( i < n )
+        conv_avg_line_scalar(a + i, b + i, out + i, n - i);
+}
+
+
+/* Neighbours are the low and high bytes of a 16-bit word, avg_epu16
+ * rounds the same way as avg_epu8 */
+void conv_half_y_sse2(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    const __m128i lo_mask = _mm_set1_epi16(0x00ff);
+    __m128i in0, in1;
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 ) {
+        in0 = _mm_loadu_si128((const __m128i *)(src + 0));
+        in1 = _mm_loadu_si128((const __m128i *)(src + 16));
+
+        in0 = _mm_avg_epu16(_mm_and_si128(in0, lo_mask), _mm_srli_epi16(in0, 8));
+        in1 = _mm_avg_epu16(_mm_and_si128(in1, lo_mask), _mm_srli_epi16(in1, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(in0, in1));
+
+        src += 32;
+    }
+
+    if( i < n )
+        conv_half_y_scalar(src, dst + i, n - i);
+}
+
+
+/* CbCr pairs are 16-bit words, neighbours share a 32-bit one. The averaged
+ * pair is left in the low word, sign extension lets packs_epi32 keep it */
+static inline __m128i half_uv_sse2(__m128i in)
+{
+    in = _mm_avg_epu8(in, _mm_srli_epi32(in, 16));
+    return _mm_srai_epi32(_mm_slli_epi32(in, 16), 16);
+}
+
+
+void conv_half_uv_sse2(const uint8_t *src, uint8_t *dst, unsigned int n)
+{
+    __m128i in0, in1;
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 ) {
+        in0 = _mm_loadu_si128((const __m128i *)(src + 0));
+        in1 = _mm_loadu_si128((const __m128i *)(src + 16));
+
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packs_epi32(half_uv_sse2(in0), half_uv_sse2(in1)));
+
+        src += 32;
+    }
+
+    if( i < n )
+        conv_half_uv_scalar(src, dst + i, n - i);
+}
+
+
+/* Weights add up to 128, so a * wa + b * wb never leaves 16 bits */
+void conv_blend_line_sse2(const uint8_t *a, const uint8_t *b, uint8_t *out,
+                          unsigned int n, unsigned int frac)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(128 - frac);
+    const __m128i wb = _mm_set1_epi16(frac);
+    const __m128i round = _mm_set1_epi16(64);
+    __m128i va, vb, lo, hi;
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 ) {
+        va = _mm_loadu_si128((const __m128i *)(a + i));
+        vb = _mm_loadu_si128((const __m128i *)(b + i));
+
+        lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                           _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                           _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 7);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 7);
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+
+    if( i < n )
+        conv_blend_line_scalar(a + i, b + i, out + i, n - i, frac);
+}
+
+
+static inline int load16(const uint8_t *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+static inline int load32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return (int)v;
+}
+
+
+/* Per-lane weights, otherwise the same sums as conv_blend_line_sse2() */
+static inline __m128i blend_w16(__m128i a, __m128i b, __m128i wb)
+{
+    const __m128i wa = _mm_sub_epi16(_mm_set1_epi16(128), wb);
+
+    return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(a, wa),
+                                                      _mm_mullo_epi16(b, wb)),
+                                        _mm_set1_epi16(64)), 7);
+}
+
+
+/* One 16-bit load takes a pixel and its right neighbour, low and high
+ * byte of the word. SSE2 has no gather, the words are inserted one by one */
+static inline __m128i filter_y_step(const uint8_t *src, const uint16_t *xs,
+                                    const uint8_t *fx)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i in, w;
+
+    in = _mm_set_epi16(load16(src + xs[7]), load16(src + xs[6]),
+                       load16(src + xs[5]), load16(src + xs[4]),
+                       load16(src + xs[3]), load16(src + xs[2]),
+                       load16(src + xs[1]), load16(src + xs[0]));
+    w = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)fx), zero);
+
+    return blend_w16(_mm_and_si128(in, _mm_set1_epi16(0x00ff)),
+                     _mm_srli_epi16(in, 8), w);
+}
+
+
+void conv_filter_y_sse2(const uint8_t *src, uint8_t *dst, unsigned int n,
+                        const uint16_t *xs, const uint8_t *fx)
+{
+    unsigned int i;
+
+    for( i = 0; i + 16 <= n; i += 16 )
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packus_epi16(filter_y_step(src, xs + i, fx + i),
+                                          filter_y_step(src, xs + i + 8, fx + i + 8)));
+
+    if( i < n )
+        conv_filter_y_scalar(src, dst + i, n - i, xs + i, fx + i);
+}
+
+
+/* A 32-bit load takes a CbCr pair and its right neighbour. The pairs go
+ * to the 16-bit halves of the words, sign extended so packs keeps them
+ * as they are: 'a' gets 8 left pairs, 'b' their neighbours */
+static inline void gather_uv(const uint8_t *src, const uint16_t *xs,
+                             __m128i *a, __m128i *b)
+{
+    __m128i in0, in1;
+
+    in0 = _mm_set_epi32(load32(src + 2 * xs[3]), load32(src + 2 * xs[2]),
+                        load32(src + 2 * xs[1]), load32(src + 2 * xs[0]));
+    in1 = _mm_set_epi32(load32(src + 2 * xs[7]), load32(src + 2 * xs[6]),
+                        load32(src + 2 * xs[5]), load32(src + 2 * xs[4]));
+
+    *a = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(in0, 16), 16),
+                         _mm_srai_epi32(_mm_slli_epi32(in1, 16), 16));
+    *b = _mm_packs_epi32(_mm_srai_epi32(in0, 16), _mm_srai_epi32(in1, 16));
+}
+
+
+void conv_filter_uv_sse2(const uint8_t *src, uint8_t *dst, unsigned int n,
+                         const uint16_t *xs, const uint8_t *fx)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a, b, w, lo, hi;
+    unsigned int i;
+
+    for( i = 0; i + 8 <= n; i += 8 ) {
+        gather_uv(src, xs + i, &a, &b);
+
+        // Cb and Cr of a pair share the weight
+        w = _mm_loadl_epi64((const __m128i *)(fx + i));
+        w = _mm_unpacklo_epi8(w, w);
+
+        lo = blend_w16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero),
+                       _mm_unpacklo_epi8(w, zero));
+        hi = blend_w16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero),
+                       _mm_unpackhi_epi8(w, zero));
+
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_packus_epi16(lo, hi));
+    }
+
+    if( i < n )
+        conv_filter_uv_scalar(src, dst + 2 * i, n - i, xs + i, fx + i);
+}
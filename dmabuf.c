@@ -0,0 +1,75 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "log.h"
+#include "dmabuf.h"
+
+
+/* dma-buf fd of the MMAP buffer 'index' of the 'type' queue, -1 when the
+ * driver can not export it */
+int dmabuf_export(int dev_fd, uint32_t type, unsigned int index)
+{
+    struct v4l2_exportbuffer expbuf;
+
+    memset(&expbuf, 0, sizeof(expbuf));
+    expbuf.type = type;
+    expbuf.index = index;
+    expbuf.flags = O_RDWR | O_CLOEXEC;
+
+    if( ioctl(dev_fd, VIDIOC_EXPBUF, &expbuf) != 0 ) {
+        log_warn("EXPBUF of buffer %u failed [%m]", index);
+        return -1;
+    }
+
+    return expbuf.fd;
+}
+
+
+void dmabuf_close(int *fd)
+{
+    if( *fd >= 0 && close(*fd) == -1 )
+        log_fatal("dma-buf close [%m]");
+    *fd = -1;
+}
+
+
+static int dmabuf_sync(int fd, uint64_t flags)
+{
+    struct dma_buf_sync sync;
+    int ret;
+
+    if( fd < 0 )
+        return 0;
+
+    sync.flags = flags;
+    do {
+        ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while( ret == -1 && (errno == EINTR || errno == EAGAIN) );
+
+    if( ret == -1 ) {
+        log_fatal("DMA_BUF_IOCTL_SYNC(%s) [%m]",
+                  flags & DMA_BUF_SYNC_END ? "end" : "start");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* The CPU is going to read (DMABUF_READ) or write (DMABUF_WRITE) the buffer
+ * of 'fd' */
+int dmabuf_begin(int fd, uint64_t access)
+{
+    return dmabuf_sync(fd, DMA_BUF_SYNC_START | access);
+}
+
+
+/* The CPU is done with the buffer, 'access' is the one given to dmabuf_begin() */
+int dmabuf_end(int fd, uint64_t access)
+{
+    return dmabuf_sync(fd, DMA_BUF_SYNC_END | access);
+}
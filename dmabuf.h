@@ -0,0 +1,21 @@
+#ifndef INCLUDE_DMABUF_H
+#define INCLUDE_DMABUF_H
+
+#include <stdint.h>
+#include <linux/dma-buf.h>
+
+/* CPU access to V4L2 buffers through their dma-buf. VIDIOC_EXPBUF gives
+ * an MMAP buffer a dma-buf fd, DMA_BUF_IOCTL_SYNC brackets around the CPU
+ * access let the exporter invalidate the cache before reading and flush
+ * it after writing. Buffers that are not exported have fd -1, the calls
+ * do nothing then and the driver's own sync on QBUF and DQBUF is left */
+#define DMABUF_READ   DMA_BUF_SYNC_READ
+#define DMABUF_WRITE  DMA_BUF_SYNC_WRITE
+
+
+int dmabuf_export(int dev_fd, uint32_t type, unsigned int index);
+void dmabuf_close(int *fd);
+int dmabuf_begin(int fd, uint64_t access);
+int dmabuf_end(int fd, uint64_t access);
+
+#endif /* INCLUDE_DMABUF_H */
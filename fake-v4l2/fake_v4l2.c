@@ -0,0 +1,1368 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/time.h>
+
+#include <linux/videodev2.h>
+#include <linux/v4l2-controls.h>
+
+/* Camera and encoder without hardware, LD_PRELOAD'ed into webcam_x264:
+ *
+ *   FAKEV4L2_FILE=pre-converter/pic-800x600-color.yuy2 \
+ *   LD_PRELOAD=fake-v4l2/libfakev4l2.so ./webcam_x264 -w 800 -h 600 ...
+ *
+ * open() of the camera path (FAKEV4L2_CAMERA, /dev/video2) or of the
+ * encoder path (FAKEV4L2_ENCODER, /dev/video0) gives an eventfd instead of
+ * a device. ioctl(), mmap(), munmap(), fstat() and close() on it are
+ * served here, everything else goes to libc. The eventfd is readable while
+ * some buffer waits for DQBUF, so epoll and select see it like a device.
+ *
+ * The camera gives YUYV at the rate of S_PARM, every frame is the next one
+ * of FAKEV4L2_FILE, or moving colour bars when the file does not hold
+ * frames of the size asked for. The encoder takes NV12 and after
+ * FAKEV4L2_LATENCY_MS (default 10) returns an H.264 access unit: real SPS
+ * and PPS for the frame size, then one slice with a real header and
+ * filler instead of macroblocks. Sizes follow the bitrate control, IDR
+ * frames come every FAKEV4L2_GOP frames (default 30) or when forced. The
+ * stream parses, it does not decode */
+
+#define FAKE_MAX_FD      1024
+#define FAKE_MAX_BUFS    VIDEO_MAX_FRAME
+#define FAKE_MAX_SIDE    4096
+
+#define FAKE_CAMERA      1
+#define FAKE_ENCODER     2
+
+#define ALIGN16(x)       (((x) + 15) & ~15u)
+
+#define fake_err(fmt, ...) fprintf(stderr, "fake-v4l2: " fmt "\n", ##__VA_ARGS__)
+
+
+struct Fake_buf {
+    uint8_t *mem;
+    size_t length;              // mapped length, page aligned
+    uint32_t bytesused;
+    uint32_t flags;
+    uint32_t sequence;
+    struct timeval timestamp;
+    int queued;
+};
+
+struct Fake_queue {
+    uint32_t type;
+    struct Fake_buf bufs[FAKE_MAX_BUFS];
+    unsigned int bufs_n;
+    unsigned int todo[FAKE_MAX_BUFS];   // queued by the application
+    unsigned int todo_n;
+    unsigned int done[FAKE_MAX_BUFS];   // waiting for DQBUF
+    unsigned int done_n;
+    int streaming;
+    struct v4l2_pix_format pix;
+};
+
+struct Fake_dev {
+    int fd;                     // eventfd the application holds
+    int kind;
+    int nonblock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int quit;
+    int raised;
+    unsigned int fps;
+    struct Fake_queue cap;
+    struct Fake_queue out;
+
+    // Camera
+    const uint8_t *file;
+    size_t file_size;
+    uint8_t *pattern;
+    size_t pattern_size;
+    uint32_t sequence;
+    unsigned int frame_n;
+
+    // Encoder
+    unsigned int latency_us;
+    unsigned int gop;
+    unsigned int bitrate;
+    unsigned int frame_num;
+    uint32_t rand;
+    int force_key;
+    int busy;
+};
+
+static struct Fake_dev *devs[FAKE_MAX_FD];
+static pthread_mutex_t devs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * libc
+ */
+
+static void *real_sym(const char *name)
+{
+    void *sym = dlsym(RTLD_NEXT, name);
+
+    if( !sym )
+        fake_err("no %s() in libc", name);
+    return sym;
+}
+
+#define REAL(name, type, ...) \
+    static type (*real_##name)(__VA_ARGS__); \
+    if( !real_##name ) \
+        real_##name = (type (*)(__VA_ARGS__))real_sym(#name)
+
+
+static const char *env_str(const char *name, const char *def)
+{
+    const char *val = getenv(name);
+
+    return val && *val ? val : def;
+}
+
+
+static unsigned int env_uint(const char *name, unsigned int def)
+{
+    const char *val = getenv(name);
+
+    return val && *val ? (unsigned int)strtoul(val, NULL, 0) : def;
+}
+
+
+static struct Fake_dev *fake_dev(int fd)
+{
+    struct Fake_dev *d;
+
+    if( fd < 0 || fd >= FAKE_MAX_FD )
+        return NULL;
+
+    pthread_mutex_lock(&devs_lock);
+    d = devs[fd];
+    pthread_mutex_unlock(&devs_lock);
+
+    return d;
+}
+
+
+/* The eventfd is readable while something waits for DQBUF. Called with
+ * the device locked */
+static void fake_signal(struct Fake_dev *d)
+{
+    int ready = d->cap.done_n > 0 || d->out.done_n > 0;
+    uint64_t val = 1;
+
+    if( ready && !d->raised ) {
+        if( write(d->fd, &val, sizeof(val)) == sizeof(val) )
+            d->raised = 1;
+    } else if( !ready && d->raised ) {
+        if( read(d->fd, &val, sizeof(val)) == sizeof(val) )
+            d->raised = 0;
+    }
+
+    pthread_cond_broadcast(&d->cond);
+}
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ * Buffer queues
+ */
+
+static struct Fake_queue *fake_queue(struct Fake_dev *d, uint32_t type)
+{
+    if( type == V4L2_BUF_TYPE_VIDEO_CAPTURE )
+        return &d->cap;
+    if( type == V4L2_BUF_TYPE_VIDEO_OUTPUT && d->kind == FAKE_ENCODER )
+        return &d->out;
+    return NULL;
+}
+
+
+static void fifo_push(unsigned int *fifo, unsigned int *n, unsigned int index)
+{
+    fifo[(*n)++] = index;
+}
+
+
+static unsigned int fifo_pop(unsigned int *fifo, unsigned int *n)
+{
+    unsigned int index = fifo[0];
+
+    (*n)--;
+    memmove(&fifo[0], &fifo[1], *n * sizeof(*fifo));
+    return index;
+}
+
+
+/* mmap() offset of a buffer: queue and index in page units */
+static off_t buf_offset(struct Fake_dev *d, struct Fake_queue *q, unsigned int index)
+{
+    unsigned int qid = q == &d->out;
+
+    return (off_t)(qid * FAKE_MAX_BUFS + index) * sysconf(_SC_PAGESIZE);
+}
+
+
+static void queue_free(struct Fake_queue *q)
+{
+    REAL(munmap, int, void *, size_t);
+    unsigned int n;
+
+    for( n = 0; n < q->bufs_n; n++ )
+        real_munmap(q->bufs[n].mem, q->bufs[n].length);
+
+    memset(q->bufs, 0, sizeof(q->bufs));
+    q->bufs_n = 0;
+    q->todo_n = 0;
+    q->done_n = 0;
+}
+
+
+static int queue_alloc(struct Fake_queue *q, unsigned int count)
+{
+    REAL(mmap, void *, void *, size_t, int, int, int, off_t);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = (q->pix.sizeimage + page - 1) / page * page;
+    unsigned int n;
+
+    for( n = 0; n < count; n++ ) {
+        q->bufs[n].mem = real_mmap(NULL, length, PROT_READ | PROT_WRITE,
+                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( q->bufs[n].mem == MAP_FAILED ) {
+            q->bufs_n = n;
+            queue_free(q);
+            return -1;
+        }
+        q->bufs[n].length = length;
+        q->bufs_n = n + 1;
+    }
+
+    return 0;
+}
+
+
+/* Buffers go back to the application without being DQBUF'ed */
+static void queue_stop(struct Fake_dev *d, struct Fake_queue *q)
+{
+    unsigned int n;
+
+    q->streaming = 0;
+    while( d->busy )
+        pthread_cond_wait(&d->cond, &d->lock);
+
+    for( n = 0; n < q->bufs_n; n++ )
+        q->bufs[n].queued = 0;
+    q->todo_n = 0;
+    q->done_n = 0;
+}
+
+
+/*
+ * Camera
+ */
+
+static void pix_yuyv(struct v4l2_pix_format *pix)
+{
+    if( pix->width < 2 || pix->width > FAKE_MAX_SIDE )
+        pix->width = 640;
+    if( pix->height < 1 || pix->height > FAKE_MAX_SIDE )
+        pix->height = 480;
+    pix->width &= ~1u;
+
+    pix->pixelformat = V4L2_PIX_FMT_YUYV;
+    pix->field = V4L2_FIELD_NONE;
+    pix->bytesperline = pix->width * 2;
+    pix->sizeimage = pix->bytesperline * pix->height;
+    pix->colorspace = V4L2_COLORSPACE_SRGB;
+}
+
+
+/* Eight bars of 75% colour, scrolled by a few pixels every frame */
+static int make_pattern(struct Fake_dev *d)
+{
+    static const uint8_t bars[8][3] = {
+        {180, 128, 128}, {162,  44, 142}, {131, 156,  44}, {112,  72,  58},
+        { 84, 184, 198}, { 65, 100, 212}, { 35, 212, 114}, { 16, 128, 128},
+    };
+    const struct v4l2_pix_format *pix = &d->cap.pix;
+    unsigned int x, y, bar;
+    uint8_t *line;
+
+    free(d->pattern);
+    d->pattern_size = pix->sizeimage;
+    d->pattern = malloc(d->pattern_size);
+    if( !d->pattern )
+        return -1;
+
+    for( y = 0; y < pix->height; y++ ) {
+        line = d->pattern + (size_t)y * pix->bytesperline;
+        for( x = 0; x < pix->width; x += 2 ) {
+            bar = x * 8 / pix->width;
+            line[2 * x + 0] = bars[bar][0];
+            line[2 * x + 1] = bars[bar][1];
+            line[2 * x + 2] = bars[bar][0];
+            line[2 * x + 3] = bars[bar][2];
+        }
+    }
+
+    return 0;
+}
+
+
+static void camera_fill(struct Fake_dev *d, struct Fake_buf *b)
+{
+    const struct v4l2_pix_format *pix = &d->cap.pix;
+    size_t frame = pix->sizeimage;
+    size_t shift, bpl = pix->bytesperline;
+    unsigned int frames, y;
+    const uint8_t *line;
+
+    if( d->file && d->file_size >= frame && d->file_size % frame == 0 ) {
+        frames = d->file_size / frame;
+        memcpy(b->mem, d->file + (d->frame_n % frames) * frame, frame);
+    } else {
+        shift = (d->frame_n * 8) % pix->width * 2;
+        for( y = 0; y < pix->height; y++ ) {
+            line = d->pattern + y * bpl;
+            memcpy(b->mem + y * bpl, line + shift, bpl - shift);
+            memcpy(b->mem + y * bpl + bpl - shift, line, shift);
+        }
+    }
+
+    b->bytesused = frame;
+    d->frame_n++;
+}
+
+
+/* One frame every period, the oldest queued buffer gets it. Without a
+ * queued buffer the frame is lost and its sequence number skipped, the
+ * way real drivers do */
+static void *camera_thread(void *arg)
+{
+    struct Fake_dev *d = arg;
+    struct Fake_buf *b;
+    struct timespec ts;
+    uint64_t next = 0, now, period;
+    unsigned int index;
+
+    pthread_mutex_lock(&d->lock);
+    while( !d->quit ) {
+        if( !d->cap.streaming ) {
+            pthread_cond_wait(&d->cond, &d->lock);
+            next = now_ns();
+            continue;
+        }
+
+        period = 1000000000ull / d->fps;
+        next += period;
+        now = now_ns();
+        if( now > next + period )
+            next = now;
+
+        pthread_mutex_unlock(&d->lock);
+        ts.tv_sec = next / 1000000000;
+        ts.tv_nsec = next % 1000000000;
+        while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR )
+            ;
+        pthread_mutex_lock(&d->lock);
+
+        if( !d->cap.streaming )
+            continue;
+
+        d->sequence++;
+        if( d->cap.todo_n == 0 )
+            continue;
+
+        index = fifo_pop(d->cap.todo, &d->cap.todo_n);
+        b = &d->cap.bufs[index];
+        camera_fill(d, b);
+        b->sequence = d->sequence - 1;
+        b->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+        now = now_ns();
+        b->timestamp.tv_sec = now / 1000000000;
+        b->timestamp.tv_usec = now % 1000000000 / 1000;
+
+        fifo_push(d->cap.done, &d->cap.done_n, index);
+        fake_signal(d);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+
+static void camera_open(struct Fake_dev *d)
+{
+    REAL(open, int, const char *, int, ...);
+    REAL(mmap, void *, void *, size_t, int, int, int, off_t);
+    REAL(close, int, int);
+    const char *name = getenv("FAKEV4L2_FILE");
+    struct stat st;
+    void *file;
+    int fd;
+
+    d->fps = 30;
+    d->cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    pix_yuyv(&d->cap.pix);
+
+    if( !name || !*name )
+        return;
+
+    fd = real_open(name, O_RDONLY | O_CLOEXEC);
+    if( fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0 ) {
+        fake_err("can not read '%s' [%m], colour bars instead", name);
+        if( fd >= 0 )
+            real_close(fd);
+        return;
+    }
+
+    file = real_mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    real_close(fd);
+    if( file == MAP_FAILED ) {
+        fake_err("mmap of '%s' failed [%m]", name);
+        return;
+    }
+
+    d->file = file;
+    d->file_size = st.st_size;
+}
+
+
+static int camera_streamon(struct Fake_dev *d)
+{
+    size_t frame = d->cap.pix.sizeimage;
+
+    if( d->file && (d->file_size < frame || d->file_size % frame) )
+        fake_err("%zu bytes of the file are no %ux%u YUYV frames, colour bars instead",
+                 d->file_size, d->cap.pix.width, d->cap.pix.height);
+
+    return make_pattern(d);
+}
+
+
+/*
+ * Encoder
+ */
+
+static void pix_nv12(struct v4l2_pix_format *pix)
+{
+    if( pix->width < 16 || pix->width > FAKE_MAX_SIDE )
+        pix->width = 640;
+    if( pix->height < 16 || pix->height > FAKE_MAX_SIDE )
+        pix->height = 480;
+
+    // Like CODA: 16-aligned stride, chroma after a 16-aligned luma plane
+    pix->pixelformat = V4L2_PIX_FMT_NV12;
+    pix->field = V4L2_FIELD_NONE;
+    pix->bytesperline = ALIGN16(pix->width);
+    pix->sizeimage = pix->bytesperline * ALIGN16(pix->height) * 3 / 2;
+    pix->colorspace = V4L2_COLORSPACE_REC709;
+}
+
+
+static void pix_h264(struct v4l2_pix_format *pix)
+{
+    if( pix->width < 16 || pix->width > FAKE_MAX_SIDE )
+        pix->width = 640;
+    if( pix->height < 16 || pix->height > FAKE_MAX_SIDE )
+        pix->height = 480;
+
+    pix->pixelformat = V4L2_PIX_FMT_H264;
+    pix->field = V4L2_FIELD_NONE;
+    pix->bytesperline = 0;
+    pix->sizeimage = pix->width * pix->height * 3 / 2;
+    if( pix->sizeimage < 65536 )
+        pix->sizeimage = 65536;
+}
+
+
+/* RBSP writer with emulation prevention */
+struct Bits {
+    uint8_t *p;
+    size_t n;
+    size_t max;
+    unsigned int acc;
+    int acc_n;
+    int zeros;
+};
+
+
+static void put_byte(struct Bits *b, uint8_t byte)
+{
+    if( b->n + 2 > b->max )
+        return;
+
+    if( b->zeros >= 2 && byte <= 3 ) {
+        b->p[b->n++] = 3;
+        b->zeros = 0;
+    }
+    b->p[b->n++] = byte;
+    b->zeros = byte ? 0 : b->zeros + 1;
+}
+
+
+static void put_bits(struct Bits *b, uint32_t val, int n)
+{
+    while( n-- > 0 ) {
+        b->acc = b->acc << 1 | ((val >> n) & 1);
+        if( ++b->acc_n == 8 ) {
+            put_byte(b, b->acc);
+            b->acc = 0;
+            b->acc_n = 0;
+        }
+    }
+}
+
+
+static void put_ue(struct Bits *b, uint32_t val)
+{
+    int len = 0;
+
+    val++;
+    while( (val >> len) > 1 )
+        len++;
+    put_bits(b, 0, len);
+    put_bits(b, val, len + 1);
+}
+
+
+static void put_trailing(struct Bits *b)
+{
+    put_bits(b, 1, 1);
+    while( b->acc_n )
+        put_bits(b, 0, 1);
+}
+
+
+static void put_nal(struct Bits *b, uint8_t header)
+{
+    static const uint8_t start[4] = {0, 0, 0, 1};
+
+    if( b->n + sizeof(start) + 1 > b->max )
+        return;
+
+    memcpy(b->p + b->n, start, sizeof(start));
+    b->n += sizeof(start);
+    b->p[b->n++] = header;
+    b->zeros = 0;
+}
+
+
+/* Baseline, level 4.0, POC type 2, 4-bit frame_num, one reference */
+static void put_sps(struct Bits *b, unsigned int width, unsigned int height)
+{
+    unsigned int mb_w = (width + 15) / 16, mb_h = (height + 15) / 16;
+
+    put_nal(b, 0x67);
+    put_bits(b, 66, 8);                 // profile_idc
+    put_bits(b, 0xc0, 8);               // constraint_set0/1
+    put_bits(b, 40, 8);                 // level_idc
+    put_ue(b, 0);                       // seq_parameter_set_id
+    put_ue(b, 0);                       // log2_max_frame_num_minus4
+    put_ue(b, 2);                       // pic_order_cnt_type
+    put_ue(b, 1);                       // max_num_ref_frames
+    put_bits(b, 0, 1);                  // gaps_in_frame_num_allowed
+    put_ue(b, mb_w - 1);
+    put_ue(b, mb_h - 1);
+    put_bits(b, 1, 1);                  // frame_mbs_only
+    put_bits(b, 1, 1);                  // direct_8x8_inference
+    if( mb_w * 16 != width || mb_h * 16 != height ) {
+        put_bits(b, 1, 1);              // frame_cropping, in 2-pixel units
+        put_ue(b, 0);
+        put_ue(b, (mb_w * 16 - width) / 2);
+        put_ue(b, 0);
+        put_ue(b, (mb_h * 16 - height) / 2);
+    } else {
+        put_bits(b, 0, 1);
+    }
+    put_bits(b, 0, 1);                  // vui_parameters_present
+    put_trailing(b);
+}
+
+
+static void put_pps(struct Bits *b)
+{
+    put_nal(b, 0x68);
+    put_ue(b, 0);                       // pic_parameter_set_id
+    put_ue(b, 0);                       // seq_parameter_set_id
+    put_bits(b, 0, 1);                  // entropy_coding_mode (CAVLC)
+    put_bits(b, 0, 1);                  // bottom_field_pic_order
+    put_ue(b, 0);                       // num_slice_groups_minus1
+    put_ue(b, 0);                       // num_ref_idx_l0_default_minus1
+    put_ue(b, 0);                       // num_ref_idx_l1_default_minus1
+    put_bits(b, 0, 1);                  // weighted_pred
+    put_bits(b, 0, 2);                  // weighted_bipred_idc
+    put_ue(b, 0);                       // pic_init_qp_minus26 (se 0)
+    put_ue(b, 0);                       // pic_init_qs_minus26 (se 0)
+    put_ue(b, 0);                       // chroma_qp_index_offset (se 0)
+    put_bits(b, 1, 1);                  // deblocking_filter_control_present
+    put_bits(b, 0, 1);                  // constrained_intra_pred
+    put_bits(b, 0, 1);                  // redundant_pic_cnt_present
+    put_trailing(b);
+}
+
+
+/* Access unit of about 'size' bytes. Filler bytes have the high bit set,
+ * so they never look like a start code */
+static size_t make_au(struct Fake_dev *d, uint8_t *dst, size_t max,
+                      unsigned int width, unsigned int height, int key, size_t size)
+{
+    struct Bits b;
+
+    memset(&b, 0, sizeof(b));
+    b.p = dst;
+    b.max = max;
+
+    if( key ) {
+        d->frame_num = 0;
+        put_sps(&b, width, height);
+        put_pps(&b);
+    }
+
+    put_nal(&b, key ? 0x65 : 0x41);
+    put_ue(&b, 0);                      // first_mb_in_slice
+    put_ue(&b, key ? 7 : 5);            // slice_type I or P, all slices
+    put_ue(&b, 0);                      // pic_parameter_set_id
+    put_bits(&b, d->frame_num++ & 15, 4);
+    if( key )
+        put_ue(&b, 0);                  // idr_pic_id
+    put_trailing(&b);
+
+    while( b.n < size && b.n + 2 < max ) {
+        d->rand = d->rand * 1103515245 + 12345;
+        put_byte(&b, 0x80 | (d->rand >> 16));
+    }
+
+    return b.n;
+}
+
+
+/* Frames are encoded one by one: the oldest NV12 buffer and the oldest
+ * h264 buffer are taken together, after the latency both come back with
+ * the NV12 timestamp copied to the h264 one */
+static void *encoder_thread(void *arg)
+{
+    struct Fake_dev *d = arg;
+    struct Fake_buf *ob, *cb;
+    unsigned int o, c, width, height;
+    size_t size, bytes;
+    int key;
+
+    pthread_mutex_lock(&d->lock);
+    while( !d->quit ) {
+        if( !d->out.streaming || !d->cap.streaming ||
+            d->out.todo_n == 0 || d->cap.todo_n == 0 ) {
+            pthread_cond_wait(&d->cond, &d->lock);
+            continue;
+        }
+
+        o = fifo_pop(d->out.todo, &d->out.todo_n);
+        c = fifo_pop(d->cap.todo, &d->cap.todo_n);
+        ob = &d->out.bufs[o];
+        cb = &d->cap.bufs[c];
+
+        key = d->force_key || d->gop == 0 || d->frame_n % d->gop == 0;
+        if( key )
+            d->frame_n = 0;
+        d->frame_n++;
+        d->force_key = 0;
+
+        // Size around bitrate / fps, IDR frames four times the rest
+        size = (size_t)d->bitrate / 8 / d->fps;
+        d->rand = d->rand * 1103515245 + 12345;
+        size = size * (7 + (d->rand >> 16) % 3) / 8;
+        if( key )
+            size *= 4;
+
+        width = d->cap.pix.width;
+        height = d->cap.pix.height;
+        d->busy = 1;
+        pthread_mutex_unlock(&d->lock);
+
+        usleep(d->latency_us);
+        bytes = make_au(d, cb->mem, cb->length, width, height, key, size);
+
+        pthread_mutex_lock(&d->lock);
+        d->busy = 0;
+
+        cb->bytesused = bytes;
+        cb->flags = V4L2_BUF_FLAG_TIMESTAMP_COPY |
+                    (key ? V4L2_BUF_FLAG_KEYFRAME : V4L2_BUF_FLAG_PFRAME);
+        cb->timestamp = ob->timestamp;
+        cb->sequence = d->sequence;
+        ob->flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+        ob->sequence = d->sequence++;
+
+        fifo_push(d->out.done, &d->out.done_n, o);
+        fifo_push(d->cap.done, &d->cap.done_n, c);
+        fake_signal(d);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
+
+
+static void encoder_open(struct Fake_dev *d)
+{
+    const char *latency = getenv("FAKEV4L2_LATENCY_MS");
+
+    d->fps = 30;
+    d->bitrate = 2000000;
+    d->gop = env_uint("FAKEV4L2_GOP", 30);
+    d->latency_us = latency && *latency ? strtod(latency, NULL) * 1000 : 10000;
+    d->rand = 1;
+
+    d->out.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    d->cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    pix_nv12(&d->out.pix);
+    pix_h264(&d->cap.pix);
+}
+
+
+/*
+ * ioctl
+ */
+
+static int fake_querycap(struct Fake_dev *d, struct v4l2_capability *cap)
+{
+    memset(cap, 0, sizeof(*cap));
+    strcpy((char *)cap->driver, "fake-v4l2");
+    strcpy((char *)cap->card, d->kind == FAKE_CAMERA ? "Fake camera" : "Fake CODA960");
+    strcpy((char *)cap->bus_info, "platform:fake-v4l2");
+    cap->version = 0x050a00;
+    cap->device_caps = V4L2_CAP_STREAMING |
+                       (d->kind == FAKE_CAMERA ? V4L2_CAP_VIDEO_CAPTURE : V4L2_CAP_VIDEO_M2M);
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    return 0;
+}
+
+
+static int fake_enum_fmt(struct Fake_dev *d, struct v4l2_fmtdesc *desc)
+{
+    struct Fake_queue *q = fake_queue(d, desc->type);
+
+    if( !q || desc->index > 0 ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(desc->description, 0, sizeof(desc->description));
+    desc->flags = 0;
+    if( q == &d->out ) {
+        desc->pixelformat = V4L2_PIX_FMT_NV12;
+        strcpy((char *)desc->description, "Y/CbCr 4:2:0");
+    } else if( d->kind == FAKE_ENCODER ) {
+        desc->pixelformat = V4L2_PIX_FMT_H264;
+        desc->flags = V4L2_FMT_FLAG_COMPRESSED;
+        strcpy((char *)desc->description, "H.264");
+    } else {
+        desc->pixelformat = V4L2_PIX_FMT_YUYV;
+        strcpy((char *)desc->description, "YUYV 4:2:2");
+    }
+    return 0;
+}
+
+
+static int fake_fmt(struct Fake_dev *d, unsigned int request, struct v4l2_format *fmt)
+{
+    struct Fake_queue *q = fake_queue(d, fmt->type);
+    struct v4l2_pix_format pix;
+
+    if( !q ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if( request == VIDIOC_G_FMT ) {
+        fmt->fmt.pix = q->pix;
+        return 0;
+    }
+
+    pix = fmt->fmt.pix;
+    if( d->kind == FAKE_CAMERA )
+        pix_yuyv(&pix);
+    else if( q == &d->out )
+        pix_nv12(&pix);
+    else
+        pix_h264(&pix);
+    fmt->fmt.pix = pix;
+
+    if( request == VIDIOC_TRY_FMT )
+        return 0;
+
+    if( q->bufs_n ) {
+        errno = EBUSY;
+        return -1;
+    }
+    q->pix = pix;
+    return 0;
+}
+
+
+static int fake_parm(struct Fake_dev *d, unsigned int request, struct v4l2_streamparm *parm)
+{
+    struct v4l2_fract *tpf;
+
+    if( !fake_queue(d, parm->type) ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    tpf = parm->type == V4L2_BUF_TYPE_VIDEO_CAPTURE ? &parm->parm.capture.timeperframe
+                                                    : &parm->parm.output.timeperframe;
+    if( request == VIDIOC_S_PARM && tpf->numerator && tpf->denominator ) {
+        d->fps = tpf->denominator / tpf->numerator;
+        if( d->fps < 1 )
+            d->fps = 1;
+        if( d->fps > 240 )
+            d->fps = 240;
+    }
+
+    memset(&parm->parm, 0, sizeof(parm->parm));
+    if( parm->type == V4L2_BUF_TYPE_VIDEO_CAPTURE )
+        parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+    else
+        parm->parm.output.capability = V4L2_CAP_TIMEPERFRAME;
+    tpf->numerator = 1;
+    tpf->denominator = d->fps;
+    return 0;
+}
+
+
+static int fake_ctrl(struct Fake_dev *d, struct v4l2_control *ctrl)
+{
+    if( d->kind != FAKE_ENCODER ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    switch( ctrl->id ) {
+    case V4L2_CID_MPEG_VIDEO_BITRATE:
+        if( ctrl->value > 0 )
+            d->bitrate = ctrl->value;
+        return 0;
+    case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
+        if( ctrl->value >= 0 )
+            d->gop = ctrl->value;
+        return 0;
+    case V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME:
+        d->force_key = 1;
+        return 0;
+    case V4L2_CID_MPEG_VIDEO_H264_PROFILE:
+    case V4L2_CID_MPEG_VIDEO_H264_LEVEL:
+    case V4L2_CID_MPEG_VIDEO_B_FRAMES:
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+
+static int fake_reqbufs(struct Fake_dev *d, struct v4l2_requestbuffers *req)
+{
+    struct Fake_queue *q = fake_queue(d, req->type);
+
+    if( !q || req->memory != V4L2_MEMORY_MMAP ) {
+        errno = EINVAL;
+        return -1;
+    }
+    if( q->streaming ) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    queue_free(q);
+    if( req->count == 0 )
+        return 0;
+
+    if( req->count < 2 )
+        req->count = 2;
+    if( req->count > FAKE_MAX_BUFS )
+        req->count = FAKE_MAX_BUFS;
+
+    if( queue_alloc(q, req->count) != 0 ) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+
+static void buf_info(struct Fake_dev *d, struct Fake_queue *q, struct v4l2_buffer *buf)
+{
+    struct Fake_buf *b = &q->bufs[buf->index];
+
+    buf->memory = V4L2_MEMORY_MMAP;
+    buf->m.offset = buf_offset(d, q, buf->index);
+    buf->length = b->length;
+    buf->bytesused = b->bytesused;
+    buf->flags = b->flags | V4L2_BUF_FLAG_MAPPED;
+    if( b->queued )
+        buf->flags |= V4L2_BUF_FLAG_QUEUED;
+    buf->field = V4L2_FIELD_NONE;
+    buf->sequence = b->sequence;
+    buf->timestamp = b->timestamp;
+}
+
+
+static int fake_buf(struct Fake_dev *d, unsigned int request, struct v4l2_buffer *buf)
+{
+    struct Fake_queue *q = fake_queue(d, buf->type);
+    struct Fake_buf *b;
+
+    if( !q || buf->memory != V4L2_MEMORY_MMAP ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if( request == VIDIOC_DQBUF ) {
+        while( q->done_n == 0 ) {
+            if( d->nonblock || !q->streaming ) {
+                errno = q->streaming ? EAGAIN : EINVAL;
+                return -1;
+            }
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+
+        buf->index = fifo_pop(q->done, &q->done_n);
+        q->bufs[buf->index].queued = 0;
+        buf_info(d, q, buf);
+        fake_signal(d);
+        return 0;
+    }
+
+    if( buf->index >= q->bufs_n ) {
+        errno = EINVAL;
+        return -1;
+    }
+    b = &q->bufs[buf->index];
+
+    if( request == VIDIOC_QBUF ) {
+        if( b->queued ) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        // Raw frames keep what the application said about them
+        if( q == &d->out ) {
+            b->bytesused = buf->bytesused ? buf->bytesused : q->pix.sizeimage;
+            b->timestamp = buf->timestamp;
+        }
+        b->queued = 1;
+        fifo_push(q->todo, &q->todo_n, buf->index);
+        pthread_cond_broadcast(&d->cond);
+    }
+
+    buf_info(d, q, buf);
+    return 0;
+}
+
+
+static int fake_stream(struct Fake_dev *d, unsigned int request, const int *type)
+{
+    struct Fake_queue *q = fake_queue(d, *type);
+
+    if( !q ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if( request == VIDIOC_STREAMOFF ) {
+        queue_stop(d, q);
+    } else if( !q->streaming ) {
+        if( q->bufs_n == 0 ) {
+            errno = EINVAL;
+            return -1;
+        }
+        if( d->kind == FAKE_CAMERA && camera_streamon(d) != 0 ) {
+            errno = ENOMEM;
+            return -1;
+        }
+        q->streaming = 1;
+    }
+
+    fake_signal(d);
+    return 0;
+}
+
+
+static int fake_ioctl(struct Fake_dev *d, unsigned int request, void *arg)
+{
+    int ret;
+
+    pthread_mutex_lock(&d->lock);
+
+    switch( request ) {
+    case VIDIOC_QUERYCAP:
+        ret = fake_querycap(d, arg);
+        break;
+    case VIDIOC_ENUM_FMT:
+        ret = fake_enum_fmt(d, arg);
+        break;
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT:
+        ret = fake_fmt(d, request, arg);
+        break;
+    case VIDIOC_G_PARM:
+    case VIDIOC_S_PARM:
+        ret = fake_parm(d, request, arg);
+        break;
+    case VIDIOC_S_CTRL:
+        ret = fake_ctrl(d, arg);
+        break;
+    case VIDIOC_REQBUFS:
+        ret = fake_reqbufs(d, arg);
+        break;
+    case VIDIOC_QUERYBUF:
+    case VIDIOC_QBUF:
+    case VIDIOC_DQBUF:
+        ret = fake_buf(d, request, arg);
+        break;
+    case VIDIOC_STREAMON:
+    case VIDIOC_STREAMOFF:
+        ret = fake_stream(d, request, arg);
+        break;
+    default:
+        // EXPBUF included: the buffers have no dma-buf
+        errno = ENOTTY;
+        ret = -1;
+        break;
+    }
+
+    pthread_mutex_unlock(&d->lock);
+    return ret;
+}
+
+
+/*
+ * Open and close
+ */
+
+static int fake_kind(const char *path)
+{
+    if( !path )
+        return 0;
+    if( strcmp(path, env_str("FAKEV4L2_CAMERA", "/dev/video2")) == 0 )
+        return FAKE_CAMERA;
+    if( strcmp(path, env_str("FAKEV4L2_ENCODER", "/dev/video0")) == 0 )
+        return FAKE_ENCODER;
+    return 0;
+}
+
+
+static int fake_open(int kind, int flags)
+{
+    struct Fake_dev *d;
+    int ret;
+
+    d = calloc(1, sizeof(*d));
+    if( !d ) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    d->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( d->fd < 0 || d->fd >= FAKE_MAX_FD ) {
+        if( d->fd >= 0 )
+            close(d->fd);
+        free(d);
+        errno = EMFILE;
+        return -1;
+    }
+
+    d->kind = kind;
+    d->nonblock = !!(flags & O_NONBLOCK);
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+
+    if( kind == FAKE_CAMERA )
+        camera_open(d);
+    else
+        encoder_open(d);
+
+    ret = pthread_create(&d->thread, NULL,
+                         kind == FAKE_CAMERA ? camera_thread : encoder_thread, d);
+    if( ret != 0 ) {
+        close(d->fd);
+        free(d);
+        errno = ret;
+        return -1;
+    }
+
+    pthread_mutex_lock(&devs_lock);
+    devs[d->fd] = d;
+    pthread_mutex_unlock(&devs_lock);
+
+    return d->fd;
+}
+
+
+static void fake_close(struct Fake_dev *d)
+{
+    REAL(munmap, int, void *, size_t);
+
+    pthread_mutex_lock(&devs_lock);
+    devs[d->fd] = NULL;
+    pthread_mutex_unlock(&devs_lock);
+
+    pthread_mutex_lock(&d->lock);
+    d->quit = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    queue_free(&d->cap);
+    queue_free(&d->out);
+    if( d->file )
+        real_munmap((void *)d->file, d->file_size);
+    free(d->pattern);
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+
+/* Buffer of a fake device mapped at 'addr', the device stays locked */
+static struct Fake_buf *fake_mapping(void *addr, struct Fake_dev **dev)
+{
+    struct Fake_queue *q;
+    unsigned int fd, n;
+
+    pthread_mutex_lock(&devs_lock);
+    for( fd = 0; fd < FAKE_MAX_FD; fd++ ) {
+        if( !devs[fd] )
+            continue;
+
+        pthread_mutex_lock(&devs[fd]->lock);
+        for( q = &devs[fd]->cap; q; q = q == &devs[fd]->cap ? &devs[fd]->out : NULL )
+            for( n = 0; n < q->bufs_n; n++ )
+                if( q->bufs[n].mem == addr ) {
+                    *dev = devs[fd];
+                    pthread_mutex_unlock(&devs_lock);
+                    return &q->bufs[n];
+                }
+        pthread_mutex_unlock(&devs[fd]->lock);
+    }
+    pthread_mutex_unlock(&devs_lock);
+
+    return NULL;
+}
+
+
+/*
+ * Interposed libc calls
+ */
+
+int open(const char *path, int flags, ...)
+{
+    REAL(open, int, const char *, int, ...);
+    mode_t mode = 0;
+    va_list ap;
+    int kind;
+
+    if( (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE ) {
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+
+    kind = fake_kind(path);
+    if( kind )
+        return fake_open(kind, flags);
+
+    return real_open(path, flags, mode);
+}
+
+
+int open64(const char *path, int flags, ...)
+{
+    REAL(open64, int, const char *, int, ...);
+    mode_t mode = 0;
+    va_list ap;
+    int kind;
+
+    if( (flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE ) {
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+
+    kind = fake_kind(path);
+    if( kind )
+        return fake_open(kind, flags);
+
+    return real_open64(path, flags, mode);
+}
+
+
+int close(int fd)
+{
+    REAL(close, int, int);
+    struct Fake_dev *d = fake_dev(fd);
+
+    if( d )
+        fake_close(d);
+
+    return real_close(fd);
+}
+
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    REAL(ioctl, int, int, unsigned long, ...);
+    struct Fake_dev *d = fake_dev(fd);
+    va_list ap;
+    void *arg;
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    // Callers pass the request as int, only its low 32 bits mean something
+    if( d )
+        return fake_ioctl(d, (unsigned int)request, arg);
+
+    return real_ioctl(fd, request, arg);
+}
+
+
+static void *fake_mmap(struct Fake_dev *d, size_t length, off_t offset)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned int id = offset / page;
+    struct Fake_queue *q;
+    void *addr = MAP_FAILED;
+
+    pthread_mutex_lock(&d->lock);
+    q = id < FAKE_MAX_BUFS ? &d->cap : &d->out;
+    id %= FAKE_MAX_BUFS;
+    if( offset % page == 0 && id < q->bufs_n && length <= q->bufs[id].length )
+        addr = q->bufs[id].mem;
+    else
+        errno = EINVAL;
+    pthread_mutex_unlock(&d->lock);
+
+    return addr;
+}
+
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    REAL(mmap, void *, void *, size_t, int, int, int, off_t);
+    struct Fake_dev *d = fake_dev(fd);
+
+    if( d )
+        return fake_mmap(d, length, offset);
+
+    return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off64_t offset)
+{
+    REAL(mmap64, void *, void *, size_t, int, int, int, off64_t);
+    struct Fake_dev *d = fake_dev(fd);
+
+    if( d )
+        return fake_mmap(d, length, offset);
+
+    return real_mmap64(addr, length, prot, flags, fd, offset);
+}
+
+
+/* The buffers live until REQBUFS(0) or close(), like the driver's */
+int munmap(void *addr, size_t length)
+{
+    REAL(munmap, int, void *, size_t);
+    struct Fake_dev *d;
+
+    if( fake_mapping(addr, &d) ) {
+        pthread_mutex_unlock(&d->lock);
+        return 0;
+    }
+
+    return real_munmap(addr, length);
+}
+
+
+static void fake_stat(struct Fake_dev *d, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFCHR | 0660;
+    st->st_rdev = makedev(81, d->kind == FAKE_CAMERA ? 2 : 0);
+    st->st_blksize = 4096;
+}
+
+
+int fstat(int fd, struct stat *st)
+{
+    REAL(fstat, int, int, struct stat *);
+    struct Fake_dev *d = fake_dev(fd);
+
+    if( d ) {
+        fake_stat(d, st);
+        return 0;
+    }
+
+    return real_fstat(fd, st);
+}
+
+
+int fstat64(int fd, struct stat64 *st)
+{
+    REAL(fstat64, int, int, struct stat64 *);
+    struct Fake_dev *d = fake_dev(fd);
+    struct stat st32;
+
+    if( d ) {
+        fake_stat(d, &st32);
+        memset(st, 0, sizeof(*st));
+        st->st_mode = st32.st_mode;
+        st->st_rdev = st32.st_rdev;
+        st->st_blksize = st32.st_blksize;
+        return 0;
+    }
+
+    return real_fstat64(fd, st);
+}
+
+
+/* glibc before 2.33 has fstat() call this one */
+int __fxstat(int ver, int fd, struct stat *st)
+{
+    REAL(__fxstat, int, int, int, struct stat *);
+    struct Fake_dev *d = fake_dev(fd);
+
+    if( d ) {
+        fake_stat(d, st);
+        return 0;
+    }
+
+    return real___fxstat(ver, fd, st);
+}
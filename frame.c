@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "frame.h"
+
+
+struct Frame* frame_new(void *data, size_t len, uint32_t flags)
+{
+    struct Frame *f;
+
+    f = calloc(1, sizeof(struct Frame));
+    if( !f ) {
+        log_fatal("calloc(Frame) [%m]");
+        return NULL;
+    }
+
+    f->refcnt = 1;
+    f->data = data;
+    f->len = len;
+    f->flags = flags;
+
+    return f;
+}
+
+
+/* Frame with its own copy of the data, so the source buffer
+ * can be reused right away */
+struct Frame* frame_new_copy(const void *data, size_t len, uint32_t flags)
+{
+    struct Frame *f;
+
+    f = calloc(1, sizeof(struct Frame) + len);
+    if( !f ) {
+        log_fatal("calloc(Frame, %zu) [%m]", len);
+        return NULL;
+    }
+
+    f->refcnt = 1;
+    f->data = (uint8_t *)(f + 1);
+    f->len = len;
+    f->flags = flags;
+    if( len > 0 )
+        memcpy(f->data, data, len);
+
+    return f;
+}
+
+
+struct Frame* frame_get(struct Frame *f)
+{
+    f->refcnt++;
+
+    return f;
+}
+
+
+void frame_put(struct Frame *f)
+{
+    if( --f->refcnt > 0 )
+        return;
+
+    if( f->release )
+        f->release(f);
+
+    free(f);
+}
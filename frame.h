@@ -0,0 +1,33 @@
+#ifndef INCLUDE_FRAME_H
+#define INCLUDE_FRAME_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Encoded access unit shared between all peers.
+ * The frame lives until the last reference is dropped, then 'release'
+ * gives the underlying buffer back to its owner */
+struct Frame {
+    int         refcnt;
+
+    uint8_t    *data;
+    size_t      len;
+    uint32_t    flags;          // V4L2_BUF_FLAG_* of the h264 buffer
+    uint64_t    ts_us;          // capture time, CLOCK_MONOTONIC
+    uint64_t    enc_us;         // time the encoder has finished the frame
+    uint32_t    seq;            // number of the encoded frame
+
+    void      (*release)(struct Frame *f);
+    void       *owner;
+    unsigned int index;
+};
+
+
+struct Frame* frame_new(void *data, size_t len, uint32_t flags);
+struct Frame* frame_new_copy(const void *data, size_t len, uint32_t flags);
+struct Frame* frame_get(struct Frame *f);
+void frame_put(struct Frame *f);
+
+#endif /* INCLUDE_FRAME_H */
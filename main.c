@@ -2,7 +2,9 @@
 #include <string.h>
 #include <errno.h>
 #include <linux/videodev2.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -14,6 +16,11 @@
 #include "server.h"
 #include "coda960.h"
 #include "proto.h"
+#include "frame.h"
+#include "convert.h"
+#include "dmabuf.h"
+#include "mjpeg.h"
+#include "stats.h"
 
 
 double stopwatch(char* label, double timebegin) {
@@ -99,266 +106,1008 @@ int run_as_daemon(void) {
 
 
 
-int mainloop(struct Webcam_inst* wcam_i,
-             struct Srv_inst* srv_i,
-             struct Coda_inst* coda_i,
-             struct Proto_inst* proto_i)
+#define STATS_INTERVAL_SEC  5
+#define ENC_RING_SZ         (CODA_MAX_BUFF + 1)
+#define MAX_EVENTS          (SRV_MAX_PEERS + 3)
+
+struct Pipe_stats {
+    uint64_t    period_start;
+    uint32_t    captured;
+    uint32_t    encoded;
+    uint32_t    dropped;
+
+    uint64_t    convert_us;
+    uint64_t    encode_us;
+    uint64_t    send_us;
+
+    // Per frame latency of the stages: capture to dequeue, conversion
+    // (or MJPEG decoding), encoding. Sending is in Srv_inst
+    struct Stats_hist   lat_dequeue;
+    struct Stats_hist   lat_convert;
+    struct Stats_hist   lat_encode;
+
+    struct Stats_cpu    cpu;
+
+    // Time when NV12 buffers were queued to Coda (Coda keeps FIFO order)
+    // and capture time of those frames
+    uint64_t    enc_start[ENC_RING_SZ];
+    uint64_t    cap_ts[ENC_RING_SZ];
+    uint32_t    enc_seq;
+
+    // Startup time: pipeline start up to the first keyframe
+    uint64_t    t_start;
+    int         first_idr;
+    uint8_t     enc_head;
+    uint8_t     enc_tail;
+};
+
+// Capture/encode pipeline shared by all clients
+struct Pipe_inst {
+    int                 running;
+    int                 frames;
+    struct Conv_layout  layout;     // camera lines into Coda's NV12 buffers
+    int                 mjpeg_on;   // the camera sends MJPEG, see mjpeg.h
+    struct Mjpeg_inst   mjpeg;
+    struct Pipe_stats   stats;
+};
+
+
+static void print_stats(struct Pipe_stats *st, struct Webcam_inst* wcam_i,
+                        struct Coda_inst* coda_i, struct Srv_inst* srv_i,
+                        uint64_t now)
 {
-    struct timeval tv;
+    double period = (double)(now - st->period_start) / 1000000;
+    unsigned int cpu_sys, cpu_self;
+    int n;
+
+    if( period < STATS_INTERVAL_SEC )
+        return;
+
+    log_info("Stats: capture %.1f fps, encode %.1f fps, dropped %u | "
+             "avg convert %llu us, encode %llu us, send %llu us",
+             st->captured / period, st->encoded / period, st->dropped,
+             (unsigned long long)(st->captured ? st->convert_us / st->captured : 0),
+             (unsigned long long)(st->encoded ? st->encode_us / st->encoded : 0),
+             (unsigned long long)(st->encoded ? st->send_us / st->encoded : 0));
+
+    // Frames lost on the way, side by side with the load they happened under
+    if( stats_cpu_load(&st->cpu, &cpu_sys, &cpu_self) == 0 )
+        log_info("Stats: CPU %u%% (own %u%%) | camera lost %u, torn %u, stale %u | "
+                 "encoder lost %u, failed %u", cpu_sys, cpu_self,
+                 wcam_i->lost_frames, wcam_i->short_frames, wcam_i->stale_frames,
+                 coda_i->lost_frames, coda_i->bad_frames);
+    wcam_i->lost_frames = wcam_i->short_frames = wcam_i->stale_frames = 0;
+    coda_i->lost_frames = coda_i->bad_frames = 0;
+
+    if( srv_i->drop_frames )
+        log_info("Stats: %u frames (%llu bytes) dropped for slow clients so far",
+                 srv_i->drop_frames, (unsigned long long)srv_i->drop_bytes);
+
+    for( n = 0; n < srv_i->peers_n; n++ )
+        srv_peer_tx_report(&srv_i->peers[n]);
+    if( srv_i->rtp_on )
+        rtp_report(&srv_i->rtp);
+    if( conv_pool_threads() > 1 )
+        conv_pool_report();
+
+    stats_log("capture-dequeue", &st->lat_dequeue);
+    stats_log("convert", &st->lat_convert);
+    stats_log("encode", &st->lat_encode);
+    stats_log("encode-send", &srv_i->lat_send);
+    stats_log("capture-send", &srv_i->lat_total);
+    stats_reset(&st->lat_dequeue);
+    stats_reset(&st->lat_convert);
+    stats_reset(&st->lat_encode);
+    stats_reset(&srv_i->lat_send);
+    stats_reset(&srv_i->lat_total);
+
+    st->period_start = now;
+    st->captured = st->encoded = st->dropped = 0;
+    st->convert_us = st->encode_us = st->send_us = 0;
+}
 
-    int iter;
-    int ret;
-    int fds_max = 0;
-    int total_frames = 0;
-    int frame_count;
 
+// Take a camera frame and push it into a free NV12 buffer of Coda
+static int capture_frame(struct Webcam_inst* wcam_i,
+                         struct Coda_inst* coda_i,
+                         struct Pipe_inst* pipe_i,
+                         int encode)
+{
+    struct Pipe_stats *st = &pipe_i->stats;
+    const struct Buffer *cam_b, *nv12_b;
     unsigned int yuy2_buf_indx;
+    unsigned int nv12_buf_indx;
+    uint64_t t_start, t_end, ts_us;
+    int ret;
 
-    frame_count = (wcam_i->frame_count == 0) ?  10 : wcam_i->frame_count;
+    // 1. Извлекаю YUY2 буфер из Web-камеры
+    ret = wcam_dequeue_buf(wcam_i, &yuy2_buf_indx, &ts_us);
+    if (ret == -1)
+        return -1;
+    if (ret == 1)
+        return 0;
+    if( encode )
+        stats_add(&st->lat_dequeue, time_now_us() - ts_us);
+
+    // Nobody watches a warm pipeline: give the buffer back to the camera
+    if( !encode )
+        return wcam_queue_buf(wcam_i, yuy2_buf_indx);
+
+    // 2. Беру свободный NV12 буфер. Если все буферы заняты Coda,
+    //    пробую забрать уже обработанные, иначе пропускаю кадр
+    ret = coda_get_free_nv12(coda_i, &nv12_buf_indx);
+    if( ret == 1 ) {
+        while( (ret = coda_dequeue_nv12(coda_i, &nv12_buf_indx)) == 0 )
+            coda_put_free_nv12(coda_i, nv12_buf_indx);
+        if( ret == -1 )
+            return -1;
+
+        ret = coda_get_free_nv12(coda_i, &nv12_buf_indx);
+    }
+
+    cam_b = &wcam_i->buffers[yuy2_buf_indx];
+    nv12_b = ret == 0 ? &coda_i->buff_nv12[nv12_buf_indx] : NULL;
+
+    if( ret == 1 ) {
+        st->dropped++;
+        log_debug("No free NV12 buffer, drop camera frame");
+    } else if( pipe_i->mjpeg_on ) {
+        // 3. MJPEG уходит в поток декодера, NV12 буфер встанет в очередь
+        //    Coda в decoded_frames(), до тех пор запись в него не закрыта
+        if( dmabuf_begin(cam_b->dmabuf_fd, DMABUF_READ) != 0 ||
+            dmabuf_begin(nv12_b->dmabuf_fd, DMABUF_WRITE) != 0 )
+            return -1;
+        ret = mjpeg_submit(&pipe_i->mjpeg, cam_b->start, cam_b->bytesused,
+                           nv12_b->start, nv12_b->length,
+                           nv12_buf_indx, ts_us);
+        if( dmabuf_end(cam_b->dmabuf_fd, DMABUF_READ) != 0 )
+            return -1;
+        if( ret == -1 )
+            return -1;
+        if( ret == 1 ) {
+            if( dmabuf_end(nv12_b->dmabuf_fd, DMABUF_WRITE) != 0 )
+                return -1;
+            coda_put_free_nv12(coda_i, nv12_buf_indx);
+            st->dropped++;
+            log_debug("MJPEG decoder is busy, drop camera frame");
+        }
+    } else {
+        // 3. Конвертирую буфер Web-камеры в NV12 буфер Coda
+        t_start = time_now_us();
+        if( dmabuf_begin(cam_b->dmabuf_fd, DMABUF_READ) != 0 ||
+            dmabuf_begin(nv12_b->dmabuf_fd, DMABUF_WRITE) != 0 )
+            return -1;
+        ret = conv_frame_mt(conv_isa(), CONV_CHROMA_AVG, &pipe_i->layout,
+                            cam_b->start, cam_b->length,
+                            nv12_b->start, nv12_b->length);
+        if( dmabuf_end(nv12_b->dmabuf_fd, DMABUF_WRITE) != 0 ||
+            dmabuf_end(cam_b->dmabuf_fd, DMABUF_READ) != 0 )
+            return -1;
+        if( ret == -1 )
+            return -1;
 
-    while( frame_count-- ) {
-        if( wcam_i->frame_count == 0 )
-            frame_count = 10;
+        // 4. Ставлю входной буфер NV12 Coda в очередь на обработку
+        t_end = time_now_us();
+        ret = coda_queue_buf_nv12(coda_i, nv12_buf_indx, ts_us);
+        if (ret == -1)
+            return -1;
 
+        st->enc_start[st->enc_tail] = t_end;
+        st->cap_ts[st->enc_tail] = ts_us;
+        st->enc_tail = (st->enc_tail + 1) % ENC_RING_SZ;
+        st->convert_us += t_end - t_start;
+        stats_add(&st->lat_convert, t_end - t_start);
+        st->captured++;
+    }
 
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
+    // 5. Возвращаю буфер Web-камеры в очередь
+    ret = wcam_queue_buf(wcam_i, yuy2_buf_indx);
+    if (ret == -1)
+        return -1;
 
-        FD_SET(wcam_i->wcam_fd, &read_fds);
-        if( fds_max < wcam_i->wcam_fd )
-            fds_max = wcam_i->wcam_fd;
+    return 0;
+}
 
-        FD_SET(srv_i->peer_fd, &read_fds);
-        if( fds_max < srv_i->peer_fd )
-            fds_max = srv_i->peer_fd;
 
+// The MJPEG decode thread has finished some frames: hand them to Coda
+static int decoded_frames(struct Coda_inst* coda_i, struct Pipe_inst* pipe_i)
+{
+    struct Pipe_stats *st = &pipe_i->stats;
+    struct Mjpeg_job job;
+    eventfd_t cnt;
+    int ret;
 
-        /* Timeout. */
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
+    eventfd_read(pipe_i->mjpeg.efd, &cnt);
 
-        ret = select(fds_max + 1, &read_fds, NULL, NULL, &tv);
-        if( ret == -1 ) {
-            log_fatal("select() [%m]");
+    while( mjpeg_complete(&pipe_i->mjpeg, &job) == 0 ) {
+        if( dmabuf_end(coda_i->buff_nv12[job.tag].dmabuf_fd, DMABUF_WRITE) != 0 )
             return -1;
-        } else if( ret == 0 ) {
-            log_fatal("select() timeout");
+
+        if( job.status == MJPEG_DEC_FAILED ) {
+            coda_put_free_nv12(coda_i, job.tag);
+            log_fatal("MJPEG decoder is out of order, stop the pipeline");
             return -1;
         }
+        if( job.status != 0 ) {
+            coda_put_free_nv12(coda_i, job.tag);
+            st->dropped++;
+            continue;
+        }
 
-        // Read data from client
-        if( FD_ISSET(srv_i->peer_fd, &read_fds) ) {
-            ret = get_peer_msg(srv_i, proto_i);
-            if (ret)
-                return -1;
+        ret = coda_queue_buf_nv12(coda_i, job.tag, job.ts_us);
+        if( ret == -1 )
+            return -1;
+
+        st->enc_start[st->enc_tail] = time_now_us();
+        st->cap_ts[st->enc_tail] = job.ts_us;
+        st->enc_tail = (st->enc_tail + 1) % ENC_RING_SZ;
+        st->convert_us += job.dec_us;
+        stats_add(&st->lat_convert, job.dec_us);
+        st->captured++;
+    }
+
+    return 0;
+}
+
+
+// Send one encoded frame to every streaming peer.
+// A peer that can not take the frame is disconnected
+static void fanout_frame(struct Srv_inst* srv_i, struct Frame *frm)
+{
+    struct Srv_peer *peer;
+    int n;
+
+    for( n = srv_i->peers_n - 1; n >= 0; n-- ) {
+        peer = &srv_i->peers[n];
+        if( peer->state != PEER_STREAMING )
+            continue;
+
+        // A new peer has to start with a keyframe
+        if( peer->wait_idr ) {
+            if( !(frm->flags & V4L2_BUF_FLAG_KEYFRAME) )
+                continue;
+            peer->wait_idr = 0;
+            log_info("Peer [fd=%d] first frame %llu us after connect",
+                     peer->fd, (unsigned long long)(time_now_us() - peer->t_accept));
         }
 
-        //
-        // Read data from webcam
-        //
-        if( FD_ISSET(wcam_i->wcam_fd, &read_fds) ) {
-            //double time_start = stopwatch(NULL, 0);
+        if( proto_send_frame(srv_i, peer, frm) == 0 )
+            peer->frames_sent++;
+        else
+            srv_peer_stop(srv_i, peer);
+    }
+}
 
-            // 1. Извлекаю YUY2 буфер из Web-камеры
-            ret = wcam_dequeue_buf(wcam_i, &yuy2_buf_indx);
-            if (ret == -1)
-                return -1;
 
-            // 2. Конвертирую буфер Web-камеры в NV12 буфер Coda
-            ret = yuyv_to_nv12_neon(wcam_i->buffers[yuy2_buf_indx].start,
-                                    wcam_i->buffers[yuy2_buf_indx].length,
-                                    coda_i->buff_nv12[0].start,
-                                    coda_i->buff_nv12[0].length,
-                                    wcam_i->width, wcam_i->height);
-            if( ret == -1 )
-                return -1;
+// h264 buffers lent to peers for zero-copy sending
+static struct Frame *h264_lent[CODA_MAX_BUFF];
 
-            // 3. Ставлю входной буфер NV12 Coda в очередь на обработку
-            ret = coda_queue_buf_nv12(coda_i, 0);
-            if (ret == -1)
-                return -1;
 
-            // 4. Возвращаю буфер Web-камеры в очередь
-            ret = wcam_queue_buf(wcam_i, yuy2_buf_indx);
-            if (ret == -1)
-                return -1;
+// The last peer has sent the frame, its buffer goes back to Coda
+static void h264_frame_release(struct Frame *frm)
+{
+    struct Coda_inst *coda_i = frm->owner;
 
-            // 5. Извлекаю h264 буфер из Coda
-            unsigned int h264_buf_indx;
-            unsigned int h264_finished;
-            unsigned int h264_bytesused;
-            unsigned int h264_buf_flags;
+    h264_lent[frm->index] = NULL;
+    coda_i->buff_264_held--;
 
-            ret = coda_dequeue_h264(coda_i, &h264_buf_indx,
-                    &h264_finished, &h264_bytesused,
-                    &h264_buf_flags);
-            if (ret == -1)
-                return -1;
+    if( coda_queue_buf_h264(coda_i, frm->index) != 0 )
+        log_warn("Can't return h264 buffer %u to Coda", frm->index);
+}
+
+
+// Forget the lent buffers when the encoder goes away, peers still
+// holding such frames just drop them
+static void h264_frames_detach(struct Coda_inst* coda_i)
+{
+    int n;
+
+    for( n = 0; n < CODA_MAX_BUFF; n++ ) {
+        if( h264_lent[n] ) {
+            h264_lent[n]->release = NULL;
+            h264_lent[n] = NULL;
+        }
+    }
+    coda_i->buff_264_held = 0;
+}
 
-            // 5.1 Пересылаю h264 данные клиенту
-            // Send h264 DATA
-            memset(proto_i, 0, sizeof(struct Proto_inst));
-            proto_i->cmd = PROTO_CMD_DATA;
-            proto_i->status = PROTO_STS_OK;
 
-            proto_i->data = coda_i->buff_264[h264_buf_indx].start;
-            proto_i->data_len = h264_bytesused;
-            ret = send_peer_msg(srv_i, proto_i);
-            if (ret)
+// Drain all finished buffers from Coda: send h264 data to the clients
+// and return used NV12 buffers to the free-list
+static int drain_encoder(struct Srv_inst* srv_i,
+                         struct Coda_inst* coda_i,
+                         struct Pipe_stats *st)
+{
+    struct Frame *frm;
+    unsigned int nv12_buf_indx;
+    unsigned int h264_buf_indx;
+    unsigned int h264_finished;
+    unsigned int h264_bytesused;
+    unsigned int h264_buf_flags;
+    uint64_t t_start, ts_us, buf_ts_us;
+    int ret;
+
+    // 6. Извлекаю h264 буферы из Coda
+    while( (ret = coda_dequeue_h264(coda_i, &h264_buf_indx,
+                &h264_finished, &h264_bytesused,
+                &h264_buf_flags, &buf_ts_us)) == 0 ) {
+        t_start = time_now_us();
+        ts_us = 0;
+        if( st->enc_head != st->enc_tail ) {
+            st->encode_us += t_start - st->enc_start[st->enc_head];
+            stats_add(&st->lat_encode, t_start - st->enc_start[st->enc_head]);
+            ts_us = st->cap_ts[st->enc_head];
+            st->enc_head = (st->enc_head + 1) % ENC_RING_SZ;
+        }
+        // Coda gives back the capture time queued with the NV12 buffer,
+        // the ring is only a fallback for drivers that do not
+        if( buf_ts_us )
+            ts_us = buf_ts_us;
+
+        // Coda could not encode the frame: the buffer goes back unsent and
+        // an IDR lets the decoders resync, if the driver can do that
+        if( h264_buf_flags & V4L2_BUF_FLAG_ERROR ) {
+            st->dropped++;
+            if( coda_queue_buf_h264(coda_i, h264_buf_indx) != 0 )
                 return -1;
+            coda_force_idr(coda_i);
+            continue;
+        }
 
+        // An empty or end-of-stream buffer carries no access unit,
+        // peers must not get a 0-byte frame
+        if( h264_finished || h264_bytesused == 0 ) {
+            st->dropped++;
+            log_debug("Coda returned h264 buffer %u with %u bytes, not sent",
+                      h264_buf_indx, h264_bytesused);
+            if( coda_queue_buf_h264(coda_i, h264_buf_indx) != 0 )
+                return -1;
+            continue;
+        }
 
-            // 6. Извлекаю NV12 буфер из очереди Coda
-            unsigned int nv12_buf_indx;
-            ret = coda_dequeue_nv12(coda_i, &nv12_buf_indx);
-            if( ret == -1 )
+        if( srv_i->zerocopy &&
+            coda_i->buff_264_held < coda_i->buff_264_n - H264_REQBUF_CNT ) {
+            // Peers send straight from the h264 buffer, it goes back to
+            // Coda when the last of them is done with it
+            frm = frame_new(coda_i->buff_264[h264_buf_indx].start,
+                            h264_bytesused, h264_buf_flags);
+            if( !frm )
                 return -1;
 
-            // 7. Возвращаю использованный h264 буфер обратно в очередь Coda
+            frm->release = h264_frame_release;
+            frm->owner = coda_i;
+            frm->index = h264_buf_indx;
+            h264_lent[h264_buf_indx] = frm;
+            coda_i->buff_264_held++;
+        } else {
+            // Peers may need some time to take the frame, so it gets its
+            // own copy and the h264 buffer goes back to Coda at once
+            frm = frame_new_copy(coda_i->buff_264[h264_buf_indx].start,
+                                 h264_bytesused, h264_buf_flags);
+
+            // 6.1 Возвращаю использованный h264 буфер обратно в очередь Coda
             ret = coda_queue_buf_h264(coda_i, h264_buf_indx);
-            if (ret == -1)
+            if( ret == -1 || !frm ) {
+                if( frm )
+                    frame_put(frm);
                 return -1;
+            }
         }
 
-        if( srv_i->run_mode == FOREGROUND ) {
-            fprintf(stdout, "%05d\b\b\b\b\b", ++total_frames);
-            if (total_frames > 99999)
-                total_frames = 0;
-            fflush(stdout);
+        frm->ts_us = ts_us;
+        frm->enc_us = t_start;
+        frm->seq = st->enc_seq++;
+
+        if( !st->first_idr && (frm->flags & V4L2_BUF_FLAG_KEYFRAME) ) {
+            st->first_idr = 1;
+            log_info("Startup: first IDR %llu us after pipeline start",
+                     (unsigned long long)(t_start - st->t_start));
+        }
+
+        // 6.2 Пересылаю h264 данные всем клиентам
+        if( srv_i->rtp_on ) {
+            if( rtp_send_frame(&srv_i->rtp, frm) != 0 ) {
+                frame_put(frm);
+                return -1;
+            }
+            srv_sent_frame(srv_i, frm);
         }
+        fanout_frame(srv_i, frm);
+        frame_put(frm);
 
+        st->send_us += time_now_us() - t_start;
+        st->encoded++;
     }
+    if( ret == -1 )
+        return -1;
+
+    // 7. Возвращаю обработанные NV12 буферы в список свободных
+    while( (ret = coda_dequeue_nv12(coda_i, &nv12_buf_indx)) == 0 )
+        coda_put_free_nv12(coda_i, nv12_buf_indx);
+    if( ret == -1 )
+        return -1;
 
     return 0;
 }
 
 
-int main(int argc, char **argv) {
-    struct Webcam_inst wcam_inst;
-    MEMZERO(wcam_inst);
-    struct Srv_inst srv_inst;
-    MEMZERO(srv_inst);
-    struct Coda_inst coda_inst;
-    MEMZERO(coda_inst);
-    struct Proto_inst proto_inst;
-    MEMZERO(proto_inst);
+// Log how long one step of the pipeline start took
+static uint64_t startup_stage(const char *stage, uint64_t t_prev)
+{
+    uint64_t now = time_now_us();
+
+    log_info("Startup: %s %llu us", stage, (unsigned long long)(now - t_prev));
+    return now;
+}
+
+
+// V4L2 formats the conversion library knows
+static const struct {
+    uint32_t    fourcc;
+    int         fmt;
+} pix_fmts[] = {
+    { V4L2_PIX_FMT_NV12,   CONV_FMT_NV12 },
+    { V4L2_PIX_FMT_YUV420, CONV_FMT_I420 },
+    { V4L2_PIX_FMT_YUYV,   CONV_FMT_YUYV },
+    { V4L2_PIX_FMT_UYVY,   CONV_FMT_UYVY },
+};
+
+#define PIX_FMTS_MAX  32
+
+static int conv_fmt_of(uint32_t fourcc)
+{
+    unsigned int n;
 
+    for( n = 0; n < sizeof(pix_fmts) / sizeof(pix_fmts[0]); n++ )
+        if( pix_fmts[n].fourcc == fourcc )
+            return pix_fmts[n].fmt;
+
+    return CONV_FMT_INVALID;
+}
+
+
+/* Choose camera and encoder formats with the cheapest route between them:
+ * the same format on both sides is only copied, I420 to NV12 merges the
+ * chroma planes, packed 4:2:2 is repacked. Devices that enumerate nothing
+ * get the old YUYV to NV12 pair */
+static int negotiate_formats(struct Webcam_inst* wcam_i,
+                             struct Coda_inst* coda_i,
+                             struct Conv_layout* l)
+{
+    uint32_t cam[PIX_FMTS_MAX], enc[PIX_FMTS_MAX];
+    int cam_n, enc_n, c, e;
+    int route, best = CONV_ROUTE_NONE;
+
+    cam_n = wcam_enum_formats(wcam_i, cam, PIX_FMTS_MAX);
+    if( cam_n == 0 )
+        cam[cam_n++] = V4L2_PIX_FMT_YUYV;
+
+    enc_n = coda_enum_formats(coda_i, enc, PIX_FMTS_MAX);
+    if( enc_n == 0 )
+        enc[enc_n++] = V4L2_PIX_FMT_NV12;
+
+    // Driver order breaks ties, it lists the preferred formats first
+    for( c = 0; c < cam_n; c++ ) {
+        for( e = 0; e < enc_n; e++ ) {
+            route = conv_route(conv_fmt_of(cam[c]), conv_fmt_of(enc[e]));
+            if( route == CONV_ROUTE_NONE )
+                continue;
+            if( best != CONV_ROUTE_NONE && route >= best )
+                continue;
+
+            best = route;
+            wcam_i->pixelformat = cam[c];
+            coda_i->pixelformat = enc[e];
+        }
+    }
+
+    if( best == CONV_ROUTE_NONE ) {
+        log_fatal("No way from formats of '%s' to formats of '%s'",
+                  wcam_i->wcam_name, coda_i->coda_name);
+        return -1;
+    }
+
+    l->src_fmt = conv_fmt_of(wcam_i->pixelformat);
+    l->dst_fmt = conv_fmt_of(coda_i->pixelformat);
+    log_info("Capture %s, encode %s: %s", conv_fmt_name(l->src_fmt),
+             conv_fmt_name(l->dst_fmt), conv_route_name(best));
+
+    return 0;
+}
+
+
+static int pipeline_start(struct Webcam_inst* wcam_i,
+                          struct Srv_inst* srv_i,
+                          struct Coda_inst* coda_i,
+                          struct Pipe_inst* pipe_i,
+                          struct Srv_peer* peer)
+{
+    unsigned int cpu_sys, cpu_self;
+    uint64_t t_stage;
     int ret;
 
-    ret = pars_args(argc, argv, &wcam_inst, &srv_inst, &coda_inst);
-    if( ret != 0 )
-        goto err_1;
+    // Even a failed start has to be cleaned up by pipeline_stop()
+    pipe_i->running = 1;
+    pipe_i->frames = 0;
+    MEMZERO(pipe_i->stats);
+    pipe_i->stats.period_start = time_now_us();
+    pipe_i->stats.t_start = pipe_i->stats.period_start;
+    t_stage = pipe_i->stats.t_start;
+
+    // The first report compares with the load from here on
+    stats_cpu_load(&pipe_i->stats.cpu, &cpu_sys, &cpu_self);
+    wcam_i->lost_frames = wcam_i->short_frames = wcam_i->stale_frames = 0;
+    coda_i->lost_frames = coda_i->bad_frames = 0;
+
+    // The first client sets stream parameters, others join it later.
+    // A scaled stream keeps the capture size and changes the output one
+    if( peer && peer->width && peer->height && peer->frame_rate ) {
+        if( coda_i->out_width ) {
+            coda_i->out_width = peer->width;
+            coda_i->out_height = peer->height;
+        } else {
+            wcam_i->width = peer->width;
+            wcam_i->height = peer->height;
+        }
+        wcam_i->frame_rate = peer->frame_rate;
+    }
 
-    if( srv_inst.run_mode == BACKGROUND) {
-        ret = run_as_daemon();
+    {
+        ret = wcam_open(wcam_i);
         if (ret != 0)
-            goto err_1;
-    }
+            return -1;
 
-    ret = srv_srv_start(&srv_inst);
-    if( ret != 0 )
-        goto err_1;
+        ret = coda_open(coda_i);
+        if (ret != 0)
+            return -1;
 
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wmissing-noreturn"
-    while(1) {
-        ret = srv_peer_accept(&srv_inst);
-        if (ret)
-            goto err;
+        // MJPEG is decoded to NV12, raw formats are negotiated
+        pipe_i->mjpeg_on = wcam_i->mjpeg_dec[0] != '\0';
+        if( pipe_i->mjpeg_on ) {
+            wcam_i->pixelformat = V4L2_PIX_FMT_MJPEG;
+            coda_i->pixelformat = V4L2_PIX_FMT_NV12;
+            pipe_i->layout.src_fmt = CONV_FMT_INVALID;
+            pipe_i->layout.dst_fmt = CONV_FMT_NV12;
+        } else {
+            ret = negotiate_formats(wcam_i, coda_i, &pipe_i->layout);
+        }
+        if (ret != 0)
+            return -1;
+        t_stage = startup_stage("wcam_open + coda_open + formats", t_stage);
 
-        ret = proto_handshake(&srv_inst, &proto_inst, &wcam_inst);
-        if (ret)
-            goto err;
+        ret = wcam_init(wcam_i);
+        if (ret != 0)
+            return -1;
+        t_stage = startup_stage("wcam_init", t_stage);
 
-        {
-            ret = wcam_open(&wcam_inst);
-            if (ret != 0)
-                goto err;
+        ret = wcam_start_capturing(wcam_i);
+        if (ret != 0)
+            return -1;
+        t_stage = startup_stage("wcam_start_capturing", t_stage);
+    }
 
-            ret = wcam_init(&wcam_inst);
-            if (ret != 0)
-                goto err;
+    {
+        coda_i->width = coda_i->out_width ? coda_i->out_width : wcam_i->width;
+        coda_i->height = coda_i->out_height ? coda_i->out_height : wcam_i->height;
+        coda_i->framerate = wcam_i->frame_rate;
 
-            ret = wcam_start_capturing(&wcam_inst);
+        ret = coda_init_nv12(coda_i);
+        if (ret != 0)
+            return -1;
+        t_stage = startup_stage("coda_init_nv12", t_stage);
+
+        // Convert straight into the driver's padded layout
+        pipe_i->layout.width = wcam_i->width;
+        pipe_i->layout.height = wcam_i->height;
+        conv_layout_src(&pipe_i->layout, pipe_i->layout.src_fmt,
+                        wcam_i->bytesperline,
+                        (size_t)wcam_i->bytesperline * wcam_i->height);
+        conv_layout_dst(&pipe_i->layout, pipe_i->layout.dst_fmt,
+                        coda_i->nv_12_bpl, coda_i->nv_12_uv_offset);
+        ret = conv_layout_scale(&pipe_i->layout, coda_i->width, coda_i->height,
+                                wcam_i->conv_scale);
+        if (ret != 0)
+            return -1;
+        pipe_i->layout.write_mode = wcam_i->conv_staged ? CONV_WRITE_STAGED
+                                                        : CONV_WRITE_DIRECT;
+        log_info("Convert %ux%u to %ux%u (%s): src stride %u, dst stride %u, chroma at %zu",
+                 pipe_i->layout.width, pipe_i->layout.height,
+                 pipe_i->layout.dst_width, pipe_i->layout.dst_height,
+                 conv_scale_name(pipe_i->layout.scale),
+                 pipe_i->layout.src_stride, pipe_i->layout.y_stride,
+                 pipe_i->layout.uv_offset);
+
+        if( pipe_i->mjpeg_on ) {
+            strcpy(pipe_i->mjpeg.dec_name, wcam_i->mjpeg_dec);
+            ret = mjpeg_open(&pipe_i->mjpeg, &pipe_i->layout);
             if (ret != 0)
-                goto err;
+                return -1;
+            t_stage = startup_stage("mjpeg_open", t_stage);
         }
 
-        {
-            coda_inst.width = wcam_inst.width;
-            coda_inst.height = wcam_inst.height;
-            coda_inst.framerate = wcam_inst.frame_rate;
+        // Zero-copy keeps some h264 buffers busy while peers send them
+        coda_i->h264_req_cnt = srv_i->zerocopy ? H264_ZC_REQBUF_CNT
+                                               : H264_REQBUF_CNT;
+        ret = coda_init_h264(coda_i);
+        if (ret != 0)
+            return -1;
+        t_stage = startup_stage("coda_init_h264", t_stage);
 
-            ret = coda_open(&coda_inst);
-            if (ret != 0)
-                goto err;
+        ret = coda_set_control(coda_i);
+        if (ret != 0)
+            return -1;
 
-            ret = coda_init_nv12(&coda_inst);
+        int indx;
+        for (indx = 0; indx < coda_i->buff_264_n; indx++) {
+            ret = coda_queue_buf_h264(coda_i, indx);
             if (ret != 0)
-                goto err;
+                return -1;
+        }
 
-            ret = coda_init_h264(&coda_inst);
-            if (ret != 0)
-                goto err;
+        ret = coda_stream_act(coda_i, V4L2_BUF_TYPE_VIDEO_CAPTURE, VIDIOC_STREAMON);
+        if (ret != 0)
+            return -1;
 
-            ret = coda_set_control(&coda_inst);
-            if (ret != 0)
-                goto err;
+        ret = coda_stream_act(coda_i, V4L2_BUF_TYPE_VIDEO_OUTPUT, VIDIOC_STREAMON);
+        if (ret != 0)
+            return -1;
+        t_stage = startup_stage("coda_set_control + STREAMON", t_stage);
+    }
+
+    ret = srv_poll_add(srv_i, wcam_i->wcam_fd, EPOLLIN);
+    if (ret != 0)
+        return -1;
+
+    ret = srv_poll_add(srv_i, coda_i->coda_fd, EPOLLIN);
+    if (ret != 0)
+        return -1;
+
+    if( pipe_i->mjpeg_on ) {
+        ret = srv_poll_add(srv_i, pipe_i->mjpeg.efd, EPOLLIN);
+        if (ret != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+
+static void pipeline_stop(struct Webcam_inst* wcam_i,
+                          struct Srv_inst* srv_i,
+                          struct Coda_inst* coda_i,
+                          struct Pipe_inst* pipe_i)
+{
+    if( !pipe_i->running )
+        return;
+
+    printf("\n");
+    epoll_ctl(srv_i->epoll_fd, EPOLL_CTL_DEL, wcam_i->wcam_fd, NULL);
+    epoll_ctl(srv_i->epoll_fd, EPOLL_CTL_DEL, coda_i->coda_fd, NULL);
+
+    // The decode thread writes into Coda's buffers, stop it first
+    if( pipe_i->mjpeg_on ) {
+        if( pipe_i->mjpeg.efd >= 0 )
+            epoll_ctl(srv_i->epoll_fd, EPOLL_CTL_DEL, pipe_i->mjpeg.efd, NULL);
+        mjpeg_close(&pipe_i->mjpeg);
+        pipe_i->mjpeg_on = 0;
+    }
+
+    wcam_stop_capturing(wcam_i);
+    wcam_uninit(wcam_i);
+    wcam_close(wcam_i);
+
+    coda_stream_act(coda_i, V4L2_BUF_TYPE_VIDEO_CAPTURE, VIDIOC_STREAMOFF);
+    coda_stream_act(coda_i, V4L2_BUF_TYPE_VIDEO_OUTPUT, VIDIOC_STREAMOFF);
+    h264_frames_detach(coda_i);
+    coda_uninit(coda_i);
+    coda_close(coda_i);
+
+    pipe_i->running = 0;
+}
+
+
+static int streaming_peers(struct Srv_inst* srv_i)
+{
+    int n, cnt = 0;
+
+    for( n = 0; n < srv_i->peers_n; n++ )
+        if( srv_i->peers[n].state == PEER_STREAMING )
+            cnt++;
+
+    return cnt;
+}
+
+
+// Peer has finished the handshake: start streaming for it.
+// Returns -1 if the pipeline failed and all peers were stopped
+static int peer_streaming(struct Webcam_inst* wcam_i,
+                           struct Srv_inst* srv_i,
+                           struct Coda_inst* coda_i,
+                           struct Pipe_inst* pipe_i,
+                           struct Srv_peer* peer)
+{
+    int mismatch;
+
+    // The stream size is the encoded one, scaled or not
+    mismatch = peer->width && peer->height && peer->frame_rate &&
+               (peer->width != coda_i->width || peer->height != coda_i->height ||
+                peer->frame_rate != wcam_i->frame_rate);
+
+    // Devices are reconfigured only if nobody else watches the stream,
+    // RTP receivers count as a viewer too
+    if( pipe_i->running && mismatch && !srv_i->rtp_on &&
+        streaming_peers(srv_i) == 1 ) {
+        log_info("Client asked for %dx%d@%d, reconfigure the stream",
+                 peer->width, peer->height, peer->frame_rate);
+        pipeline_stop(wcam_i, srv_i, coda_i, pipe_i);
+    }
+
+    if( !pipe_i->running ) {
+        if( pipeline_start(wcam_i, srv_i, coda_i, pipe_i, peer) != 0 ) {
+            srv_peer_stop_all(srv_i);
+            pipeline_stop(wcam_i, srv_i, coda_i, pipe_i);
+            return -1;
+        }
+        return 0;
+    }
+
+    if( mismatch )
+        log_warn("Client asked for %dx%d@%d, but stream runs at %dx%d@%d",
+                 peer->width, peer->height, peer->frame_rate,
+                 coda_i->width, coda_i->height, wcam_i->frame_rate);
+
+    // The stream is warm, the new peer only needs a keyframe
+    coda_force_idr(coda_i);
+    return 0;
+}
+
+
+// Handle all complete messages received from the peer
+static void read_peer(struct Webcam_inst* wcam_i,
+                      struct Srv_inst* srv_i,
+                      struct Coda_inst* coda_i,
+                      struct Pipe_inst* pipe_i,
+                      struct Srv_peer* peer)
+{
+    struct Proto_inst msg_in;
+    struct Proto_inst msg_out;
+    int n_bytes;
+    int ret;
+
+    if( srv_peer_recv(peer) != 0 ) {
+        srv_peer_stop(srv_i, peer);
+        return;
+    }
+
+    while( (n_bytes = proto_parse_msg(peer->rx_buff, peer->rx_len,
+                                      &msg_in)) > 0 ) {
+        peer->rx_len -= n_bytes;
+        memmove(peer->rx_buff, peer->rx_buff + n_bytes, peer->rx_len);
+        print_peer_msg("Peer <---", &msg_in);
+
+        ret = proto_peer_msg(peer, &msg_in, &msg_out);
+        if( ret != 0 ) {
+            srv_peer_stop(srv_i, peer);
+            return;
+        }
+
+        print_peer_msg("     --->", &msg_out);
+        if( proto_send_msg(srv_i, peer, &msg_out) != 0 ) {
+            srv_peer_stop(srv_i, peer);
+            return;
+        }
+
+        if( msg_out.cmd == PROTO_CMD_START || msg_out.cmd == PROTO_CMD_CONNECT ) {
+            log_info("Peer [fd=%d] handshake took %llu us", peer->fd,
+                     (unsigned long long)(time_now_us() - peer->t_accept));
+            // 'peer' is gone with all the others if the pipeline failed
+            if( peer_streaming(wcam_i, srv_i, coda_i, pipe_i, peer) != 0 )
+                return;
+        }
+    }
+
+    if( n_bytes == -1 )
+        srv_peer_stop(srv_i, peer);
+}
+
+
+static void peer_event(struct Webcam_inst* wcam_i,
+                       struct Srv_inst* srv_i,
+                       struct Coda_inst* coda_i,
+                       struct Pipe_inst* pipe_i,
+                       struct epoll_event *ev)
+{
+    struct Srv_peer *peer;
+
+    peer = srv_peer_find(srv_i, ev->data.fd);
+    if( !peer ) {
+        srv_closing_event(srv_i, ev->data.fd);
+        return;
+    }
 
-            int indx;
-            for (indx = 0; indx < coda_inst.buff_264_n; indx++) {
-                ret = coda_queue_buf_h264(&coda_inst, indx);
-                if (ret != 0)
-                    goto err;
+    // Zero-copy completions are reported through the error queue too
+    if( ev->events & EPOLLHUP ||
+        (ev->events & EPOLLERR && srv_peer_error(peer) != 0) ) {
+        srv_peer_stop(srv_i, peer);
+        return;
+    }
+
+    if( ev->events & EPOLLOUT ) {
+        if( srv_peer_flush(srv_i, peer) != 0 ) {
+            srv_peer_stop(srv_i, peer);
+            return;
+        }
+    }
+
+    if( ev->events & (EPOLLIN | EPOLLRDHUP) )
+        read_peer(wcam_i, srv_i, coda_i, pipe_i, peer);
+}
+
+
+int mainloop(struct Webcam_inst* wcam_i,
+             struct Srv_inst* srv_i,
+             struct Coda_inst* coda_i)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct Pipe_inst pipe_inst;
+
+    int ret;
+    int n, n_events;
+
+    MEMZERO(pipe_inst);
+    pipe_inst.mjpeg.efd = -1;
+
+    for(;;) {
+        // RTP output does not wait for clients, it streams all the time.
+        // A warm pipeline keeps devices streaming between client sessions
+        if( (srv_i->rtp_on || srv_i->persistent) && !pipe_inst.running ) {
+            if( pipeline_start(wcam_i, srv_i, coda_i, &pipe_inst, NULL) != 0 ) {
+                srv_peer_stop_all(srv_i);
+                pipeline_stop(wcam_i, srv_i, coda_i, &pipe_inst);
+                return -1;
             }
-/*
-            for( indx = 0; indx < coda_inst.buff_nv12_n; indx++ ) {
-                ret = coda_queue_buf_nv12(&coda_inst, indx);
-                if (ret != 0)
-                    goto err;
+        }
+
+        // Without streaming there is nothing to wait for but clients, and
+        // the completions of closed peers
+        n_events = epoll_wait(srv_i->epoll_fd, events, MAX_EVENTS,
+                              pipe_inst.running ? 2000 : srv_i->closing_n ? 500 : -1);
+        if( n_events == -1 ) {
+            if( errno == EINTR )
+                continue;
+
+            log_fatal("epoll_wait() [%m]");
+            return -1;
+        }
+
+        srv_closing_sweep(srv_i, time_now_us());
+        if( n_events == 0 && !pipe_inst.running ) {
+            continue;
+        } else if( n_events == 0 ) {
+            log_fatal("epoll_wait() timeout, no frames from devices");
+            srv_peer_stop_all(srv_i);
+            pipeline_stop(wcam_i, srv_i, coda_i, &pipe_inst);
+            continue;
+        }
+
+        for( n = 0; n < n_events; n++ ) {
+            int fd = events[n].data.fd;
+            ret = 0;
+
+            // New client connects
+            if( fd == srv_i->srv_fd ) {
+                srv_peer_accept(srv_i);
+
+            // Coda has finished some buffers. Drain it first, so the freed
+            // NV12 buffers are ready for the next camera frame
+            } else if( pipe_inst.running && fd == coda_i->coda_fd ) {
+                ret = drain_encoder(srv_i, coda_i, &pipe_inst.stats);
+
+            // MJPEG frames decoded
+            } else if( pipe_inst.running && pipe_inst.mjpeg_on &&
+                       fd == pipe_inst.mjpeg.efd ) {
+                ret = decoded_frames(coda_i, &pipe_inst);
+
+            // Read data from webcam
+            } else if( pipe_inst.running && fd == wcam_i->wcam_fd ) {
+                ret = capture_frame(wcam_i, coda_i, &pipe_inst,
+                                    srv_i->rtp_on || streaming_peers(srv_i) > 0);
+                pipe_inst.frames++;
+
+                if( srv_i->run_mode == FOREGROUND ) {
+                    fprintf(stdout, "%05d\b\b\b\b\b", pipe_inst.frames % 100000);
+                    fflush(stdout);
+                }
+
+            // Data from clients or room in their sockets
+            } else {
+                peer_event(wcam_i, srv_i, coda_i, &pipe_inst, &events[n]);
             }
-*/
 
-            ret = coda_stream_act(&coda_inst, V4L2_BUF_TYPE_VIDEO_CAPTURE, VIDIOC_STREAMON);
-            if (ret != 0)
-                goto err;
+            if( ret != 0 ) {
+                srv_peer_stop_all(srv_i);
+                pipeline_stop(wcam_i, srv_i, coda_i, &pipe_inst);
+            }
+        }
 
-            ret = coda_stream_act(&coda_inst, V4L2_BUF_TYPE_VIDEO_OUTPUT, VIDIOC_STREAMON);
-            if (ret != 0)
-                goto err;
+        if( !pipe_inst.running )
+            continue;
 
+        // The pipeline runs as long as somebody is watching
+        if( !srv_i->rtp_on && !srv_i->persistent && streaming_peers(srv_i) == 0 ) {
+            log_info("No clients left, stop streaming");
+            pipeline_stop(wcam_i, srv_i, coda_i, &pipe_inst);
+            continue;
         }
 
-        // Main loop start here!!!
-        ret = mainloop(&wcam_inst, &srv_inst, &coda_inst, &proto_inst);
-        if (ret != 0)
-            goto err;
+        if( wcam_i->frame_count > 0 && pipe_inst.frames >= wcam_i->frame_count ) {
+            log_info("%d frames are grabbed, stop streaming", pipe_inst.frames);
+            srv_peer_stop_all(srv_i);
+            pipeline_stop(wcam_i, srv_i, coda_i, &pipe_inst);
+            if( srv_i->rtp_on || srv_i->persistent )
+                return 0;
+            continue;
+        }
 
+        print_stats(&pipe_inst.stats, wcam_i, coda_i, srv_i, time_now_us());
+    }
 
-        err:
-        printf("\n");
-        wcam_stop_capturing(&wcam_inst);
-        wcam_uninit(&wcam_inst);
-        wcam_close(&wcam_inst);
+    return 0;
+}
 
-        coda_stream_act(&coda_inst, V4L2_BUF_TYPE_VIDEO_CAPTURE, VIDIOC_STREAMOFF);
-        coda_stream_act(&coda_inst, V4L2_BUF_TYPE_VIDEO_OUTPUT, VIDIOC_STREAMOFF);
-        coda_close(&coda_inst);
 
-        srv_peer_stop(&srv_inst);
+int main(int argc, char **argv) {
+    struct Webcam_inst wcam_inst;
+    MEMZERO(wcam_inst);
+    struct Srv_inst srv_inst;
+    MEMZERO(srv_inst);
+    struct Coda_inst coda_inst;
+    MEMZERO(coda_inst);
+
+    int ret;
+
+    // Devices are opened only while somebody is watching
+    wcam_inst.wcam_fd = -1;
+    coda_inst.coda_fd = -1;
+    srv_inst.rtp.fd = -1;
+
+    ret = pars_args(argc, argv, &wcam_inst, &srv_inst, &coda_inst);
+    if( ret != 0 )
+        goto err_1;
+
+    ret = conv_init(wcam_inst.conv_isa);
+    if( ret != 0 )
+        goto err_1;
+
+    if( srv_inst.run_mode == BACKGROUND) {
+        ret = run_as_daemon();
+        if (ret != 0)
+            goto err_1;
     }
-#pragma clang diagnostic pop
 
-err_1:
-    printf("\n");
-    wcam_stop_capturing(&wcam_inst);
-    wcam_uninit(&wcam_inst);
-    wcam_close(&wcam_inst);
+    // Threads do not survive the fork() of run_as_daemon()
+    ret = conv_pool_start(wcam_inst.conv_threads);
+    if( ret != 0 )
+        goto err_1;
+
+    ret = srv_srv_start(&srv_inst);
+    if( ret != 0 )
+        goto err_1;
+
+    if( srv_inst.rtp_on ) {
+        ret = rtp_open(&srv_inst.rtp);
+        if( ret != 0 )
+            goto err_1;
+    }
 
-    coda_stream_act(&coda_inst, V4L2_BUF_TYPE_VIDEO_OUTPUT, VIDIOC_STREAMOFF);
-    coda_stream_act(&coda_inst, V4L2_BUF_TYPE_VIDEO_OUTPUT, VIDIOC_STREAMOFF);
-    coda_close(&coda_inst);
+    // Main loop start here!!!
+    ret = mainloop(&wcam_inst, &srv_inst, &coda_inst);
 
+err_1:
+    printf("\n");
+    srv_peer_stop_all(&srv_inst);
     srv_srv_stop(&srv_inst);
+    rtp_close(&srv_inst.rtp);
+    conv_pool_stop();
     return -1;
-}
\ No newline at end of file
+}
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "log.h"
+#include "mjpeg.h"
+#include "mjpeg_impl.h"
+
+
+static const struct Mjpeg_decoder *decoder_by_name(const char *name)
+{
+    if( strcmp(name, MJPEG_DEC_SW) == 0 ) {
+#ifdef MJPEG_HAVE_LIBJPEG
+        return &mjpeg_dec_sw;
+#else
+        log_fatal("Built without libjpeg, use a V4L2 JPEG decoder device");
+        return NULL;
+#endif
+    }
+
+    return &mjpeg_dec_v4l2;
+}
+
+
+static void *decode_main(void *arg)
+{
+    struct Mjpeg_inst *i = arg;
+    struct Mjpeg_job *job;
+    uint64_t t_start;
+
+    pthread_mutex_lock(&i->lock);
+
+    for(;;) {
+        while( !i->quit && i->done == i->tail )
+            pthread_cond_wait(&i->cond, &i->lock);
+        if( i->quit )
+            break;
+
+        // The slot is ours until 'done' moves past it
+        job = &i->jobs[i->done % MJPEG_JOBS];
+        pthread_mutex_unlock(&i->lock);
+
+        t_start = time_now_us();
+        job->status = i->dec->decode(i, job->jpg, job->len, job->out, job->out_sz);
+        job->dec_us = time_now_us() - t_start;
+
+        pthread_mutex_lock(&i->lock);
+        i->done++;
+        if( job->status == 0 )
+            i->decoded++;
+        else
+            i->broken++;
+
+        eventfd_write(i->efd, 1);
+    }
+
+    pthread_mutex_unlock(&i->lock);
+    return NULL;
+}
+
+
+/* Start the decoder and its thread. The thread goes to the last core,
+ * away from the conversion workers on cores 1, 2, ... If the workers
+ * take every core, it is left unpinned */
+int mjpeg_open(struct Mjpeg_inst *i, const struct Conv_layout *l)
+{
+    long cpu_n = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    int ret;
+
+    i->efd = -1;
+    i->dec = decoder_by_name(i->dec_name);
+    if( !i->dec )
+        return -1;
+
+    i->layout = *l;
+    i->head = i->done = i->tail = 0;
+    i->quit = 0;
+    i->decoded = i->broken = 0;
+    i->thread_on = 0;
+    i->priv = NULL;
+
+    if( l->dst_fmt != CONV_FMT_NV12 ) {
+        log_fatal("MJPEG is decoded to NV12 only, not %s", conv_fmt_name(l->dst_fmt));
+        return -1;
+    }
+
+    i->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( i->efd < 0 ) {
+        log_fatal("eventfd() [%m]");
+        return -1;
+    }
+
+    ret = i->dec->open(i);
+    if( ret != 0 )
+        return -1;
+
+    pthread_mutex_init(&i->lock, NULL);
+    pthread_cond_init(&i->cond, NULL);
+
+    ret = pthread_create(&i->thread, NULL, decode_main, i);
+    if( ret != 0 ) {
+        errno = ret;
+        log_fatal("Can't start MJPEG decode thread [%m]");
+        pthread_mutex_destroy(&i->lock);
+        pthread_cond_destroy(&i->cond);
+        if( i->dec->close )
+            i->dec->close(i);
+        i->dec = NULL;
+        return -1;
+    }
+    i->thread_on = 1;
+
+    if( cpu_n > 1 && conv_pool_threads() < cpu_n ) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu_n - 1, &cpus);
+        if( pthread_setaffinity_np(i->thread, sizeof(cpus), &cpus) != 0 )
+            log_warn("Can't pin MJPEG decode thread to core %ld", cpu_n - 1);
+    }
+
+    log_info("MJPEG decoder '%s' for %ux%u", i->dec->name, l->width, l->height);
+
+    return 0;
+}
+
+
+void mjpeg_close(struct Mjpeg_inst *i)
+{
+    int n;
+
+    if( i->thread_on ) {
+        pthread_mutex_lock(&i->lock);
+        i->quit = 1;
+        pthread_cond_signal(&i->cond);
+        pthread_mutex_unlock(&i->lock);
+
+        pthread_join(i->thread, NULL);
+        pthread_mutex_destroy(&i->lock);
+        pthread_cond_destroy(&i->cond);
+        i->thread_on = 0;
+
+        log_info("MJPEG: %u frames decoded, %u broken", i->decoded, i->broken);
+    }
+
+    if( i->dec && i->dec->close )
+        i->dec->close(i);
+    i->dec = NULL;
+
+    for( n = 0; n < MJPEG_JOBS; n++ ) {
+        free(i->jobs[n].jpg);
+        i->jobs[n].jpg = NULL;
+        i->jobs[n].jpg_sz = 0;
+    }
+
+    if( i->efd >= 0 )
+        close(i->efd);
+    i->efd = -1;
+}
+
+
+/* Queue a frame for decoding into 'out'. The bitstream is copied, so the
+ * camera buffer can go back at once. Returns 1 when the queue is full */
+int mjpeg_submit(struct Mjpeg_inst *i, const void *jpg, size_t len,
+                 void *out, size_t out_sz, uint32_t tag, uint64_t ts_us)
+{
+    struct Mjpeg_job *job;
+    uint8_t *p;
+
+    pthread_mutex_lock(&i->lock);
+    if( i->tail - i->head == MJPEG_JOBS ) {
+        pthread_mutex_unlock(&i->lock);
+        return 1;
+    }
+    job = &i->jobs[i->tail % MJPEG_JOBS];
+    pthread_mutex_unlock(&i->lock);
+
+    // The free slot is not seen by the thread till 'tail' moves
+    if( job->jpg_sz < len ) {
+        p = realloc(job->jpg, len);
+        if( !p ) {
+            log_fatal("realloc(%zu) [%m]", len);
+            return -1;
+        }
+        job->jpg = p;
+        job->jpg_sz = len;
+    }
+
+    memcpy(job->jpg, jpg, len);
+    job->len = len;
+    job->out = out;
+    job->out_sz = out_sz;
+    job->tag = tag;
+    job->ts_us = ts_us;
+    job->status = -1;
+
+    pthread_mutex_lock(&i->lock);
+    i->tail++;
+    pthread_cond_signal(&i->cond);
+    pthread_mutex_unlock(&i->lock);
+
+    return 0;
+}
+
+
+/* Take the oldest decoded frame, in the order they were submitted.
+ * Returns 1 when there is none. Read i->efd before calling it until 1,
+ * so a frame finished meanwhile wakes the main loop again */
+int mjpeg_complete(struct Mjpeg_inst *i, struct Mjpeg_job *job)
+{
+    pthread_mutex_lock(&i->lock);
+    if( i->head == i->done ) {
+        pthread_mutex_unlock(&i->lock);
+        return 1;
+    }
+
+    *job = i->jobs[i->head % MJPEG_JOBS];
+    i->head++;
+    pthread_mutex_unlock(&i->lock);
+
+    return 0;
+}
+
+
+/* Decode in the calling thread, for tools that go frame by frame.
+ * Not to be mixed with mjpeg_submit() */
+int mjpeg_decode(struct Mjpeg_inst *i, const void *jpg, size_t len,
+                 void *out, size_t out_sz)
+{
+    int ret;
+
+    ret = i->dec->decode(i, jpg, len, out, out_sz);
+    if( ret == 0 )
+        i->decoded++;
+    else
+        i->broken++;
+
+    return ret;
+}
@@ -0,0 +1,18 @@
+# MJPEG decoders, see mjpeg.h. The software one needs libjpeg(-turbo),
+# the V4L2 mem2mem one is always there. Paths are relative to this file,
+# so sub-projects can include it too. Targets link ${MJPEG_LIBS}.
+
+set(MJPEG_DIR ${CMAKE_CURRENT_LIST_DIR})
+set(MJPEG_SOURCE ${MJPEG_DIR}/mjpeg.c ${MJPEG_DIR}/mjpeg_v4l2.c)
+set(MJPEG_HEADER ${MJPEG_DIR}/mjpeg.h ${MJPEG_DIR}/mjpeg_impl.h)
+set(MJPEG_LIBS)
+
+find_package(JPEG)
+if(JPEG_FOUND)
+    list(APPEND MJPEG_SOURCE ${MJPEG_DIR}/mjpeg_sw.c)
+    include_directories(${JPEG_INCLUDE_DIRS})
+    list(APPEND MJPEG_LIBS ${JPEG_LIBRARIES})
+    add_definitions(-DMJPEG_HAVE_LIBJPEG)
+else()
+    message(STATUS "No libjpeg, MJPEG capture needs a V4L2 JPEG decoder")
+endif()
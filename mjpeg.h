@@ -0,0 +1,65 @@
+#ifndef INCLUDE_MJPEG_H
+#define INCLUDE_MJPEG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "convert.h"
+
+/* MJPEG to NV12 decoding for cameras that can only do high resolutions
+ * compressed. The decoder is pluggable: "sw" is libjpeg(-turbo) on the
+ * CPU, a device name like "/dev/video3" is a V4L2 mem2mem JPEG decoder.
+ * Frames are decoded by a thread of their own, so the main loop keeps
+ * capturing and encoding meanwhile */
+
+#define MJPEG_JOBS       4          // frames queued to the decode thread
+#define MJPEG_DEC_SW     "sw"
+#define MJPEG_DEC_FAILED (-2)       // decode(): the decoder is out of order
+
+struct Mjpeg_decoder;
+
+// A frame on its way through the decode thread
+struct Mjpeg_job {
+    uint8_t         *jpg;           // copy of the camera buffer
+    size_t           jpg_sz;        // allocated
+    size_t           len;           // used
+    void            *out;           // NV12 buffer to decode into
+    size_t           out_sz;
+    uint32_t         tag;           // caller's cookie, e.g. the buffer index
+    uint64_t         ts_us;         // capture time
+    uint64_t         dec_us;        // decode time
+    int              status;        // 0, -1 for a broken frame or MJPEG_DEC_FAILED
+};
+
+struct Mjpeg_inst {
+    char             dec_name[128]; // MJPEG_DEC_SW or a device name
+    const struct Mjpeg_decoder *dec;
+    void            *priv;          // decoder state
+    struct Conv_layout layout;      // destination layout, src_* unused
+
+    // Jobs go round the ring: head..done-1 are decoded, done..tail-1 wait
+    struct Mjpeg_job jobs[MJPEG_JOBS];
+    unsigned int     head;
+    unsigned int     done;
+    unsigned int     tail;
+    int              quit;
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    pthread_t        thread;
+    int              thread_on;
+    int              efd;           // eventfd, readable when jobs are done
+
+    uint32_t         decoded;
+    uint32_t         broken;
+};
+
+int mjpeg_open(struct Mjpeg_inst *i, const struct Conv_layout *l);
+void mjpeg_close(struct Mjpeg_inst *i);
+int mjpeg_submit(struct Mjpeg_inst *i, const void *jpg, size_t len,
+                 void *out, size_t out_sz, uint32_t tag, uint64_t ts_us);
+int mjpeg_complete(struct Mjpeg_inst *i, struct Mjpeg_job *job);
+int mjpeg_decode(struct Mjpeg_inst *i, const void *jpg, size_t len,
+                 void *out, size_t out_sz);
+
+#endif /* INCLUDE_MJPEG_H */
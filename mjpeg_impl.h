@@ -0,0 +1,23 @@
+#ifndef INCLUDE_MJPEG_IMPL_H
+#define INCLUDE_MJPEG_IMPL_H
+
+#include "mjpeg.h"
+
+/* Decoder backends of mjpeg.c, not for use outside of it. decode() turns
+ * one JPEG into a frame of the i->layout destination layout, -1 is a
+ * broken frame, MJPEG_DEC_FAILED a decoder that can not go on. It runs on
+ * the decode thread only, open() and close() on the caller's */
+struct Mjpeg_decoder {
+    const char      *name;
+    int            (*open)(struct Mjpeg_inst *i);
+    int            (*decode)(struct Mjpeg_inst *i, const uint8_t *jpg, size_t len,
+                             uint8_t *out, size_t out_sz);
+    void           (*close)(struct Mjpeg_inst *i);
+};
+
+#ifdef MJPEG_HAVE_LIBJPEG
+extern const struct Mjpeg_decoder mjpeg_dec_sw;
+#endif
+extern const struct Mjpeg_decoder mjpeg_dec_v4l2;
+
+#endif /* INCLUDE_MJPEG_IMPL_H */
@@ -0,0 +1,229 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "log.h"
+#include "mjpeg.h"
+#include "mjpeg_impl.h"
+
+/* libjpeg(-turbo) decoder. Raw data output skips libjpeg's upsampling
+ * and colour conversion: Y, Cb and Cr come as planes straight from the
+ * IDCT, luma is copied, chroma is merged into NV12 CbCr lines. Camera
+ * MJPEG is 4:2:2 (every chroma line pair is averaged) or 4:2:0.
+ * Streams without Huffman tables, as many cameras send them, are fine
+ * with libjpeg-turbo, it falls back to the standard tables.
+ * A scaled stream is decoded into a frame of the full size first */
+
+#define SW_MCU_LINES  (2 * DCTSIZE)     // luma lines of one iMCU row, at most
+
+struct Sw_err {
+    struct jpeg_error_mgr   pub;
+    jmp_buf                 jmp;
+};
+
+struct Sw_dec {
+    struct jpeg_decompress_struct cinfo;
+    struct Sw_err           err;
+
+    uint8_t                *rows;       // one iMCU row of Y, Cb and Cr
+    size_t                  rows_sz;
+    JSAMPROW                y[SW_MCU_LINES];
+    JSAMPROW                cb[SW_MCU_LINES];
+    JSAMPROW                cr[SW_MCU_LINES];
+
+    uint8_t                *frame;      // full size NV12, when scaled
+    size_t                  frame_sz;
+    struct Conv_layout      full;       // JPEG to 'frame'
+    struct Conv_layout      scaled;     // 'frame' to the output
+};
+
+
+static void sw_error_exit(j_common_ptr cinfo)
+{
+    struct Sw_err *err = (struct Sw_err *)cinfo->err;
+
+    longjmp(err->jmp, 1);
+}
+
+
+// Corrupt data warnings are common with USB cameras, keep them quiet
+static void sw_output_message(j_common_ptr cinfo)
+{
+    char msg[JMSG_LENGTH_MAX];
+
+    cinfo->err->format_message(cinfo, msg);
+    log_debug("libjpeg: %s", msg);
+}
+
+
+static int sw_open(struct Mjpeg_inst *i)
+{
+    struct Sw_dec *d;
+
+    d = calloc(1, sizeof(*d));
+    if( !d ) {
+        log_fatal("calloc() [%m]");
+        return -1;
+    }
+
+    d->cinfo.err = jpeg_std_error(&d->err.pub);
+    d->err.pub.error_exit = sw_error_exit;
+    d->err.pub.output_message = sw_output_message;
+    jpeg_create_decompress(&d->cinfo);
+    i->priv = d;
+
+    if( i->layout.scale != CONV_SCALE_NONE ) {
+        conv_layout_packed(&d->full, i->layout.width, i->layout.height);
+        conv_layout_src(&d->full, CONV_FMT_INVALID, 0, 0);
+
+        d->scaled = i->layout;
+        conv_layout_src(&d->scaled, CONV_FMT_NV12, i->layout.width,
+                        (size_t)i->layout.width * i->layout.height);
+
+        d->frame_sz = (size_t)i->layout.width * i->layout.height * 3 / 2;
+        d->frame = malloc(d->frame_sz);
+        if( !d->frame ) {
+            log_fatal("malloc(%zu) [%m]", d->frame_sz);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void sw_close(struct Mjpeg_inst *i)
+{
+    struct Sw_dec *d = i->priv;
+
+    if( !d )
+        return;
+
+    jpeg_destroy_decompress(&d->cinfo);
+    free(d->rows);
+    free(d->frame);
+    free(d);
+    i->priv = NULL;
+}
+
+
+// Row buffers for the padded width of the picture
+static int sw_rows(struct Sw_dec *d, unsigned int y_w, unsigned int c_w)
+{
+    size_t need = (size_t)(y_w + 2 * c_w) * SW_MCU_LINES;
+    uint8_t *p;
+    int n;
+
+    if( d->rows_sz < need ) {
+        p = realloc(d->rows, need);
+        if( !p ) {
+            log_fatal("realloc(%zu) [%m]", need);
+            return -1;
+        }
+        d->rows = p;
+        d->rows_sz = need;
+    }
+
+    p = d->rows;
+    for( n = 0; n < SW_MCU_LINES; n++, p += y_w )
+        d->y[n] = p;
+    for( n = 0; n < SW_MCU_LINES; n++, p += c_w )
+        d->cb[n] = p;
+    for( n = 0; n < SW_MCU_LINES; n++, p += c_w )
+        d->cr[n] = p;
+
+    return 0;
+}
+
+
+static int sw_decode(struct Mjpeg_inst *i, const uint8_t *jpg, size_t len,
+                     uint8_t *out, size_t out_sz)
+{
+    struct Sw_dec *d = i->priv;
+    struct jpeg_decompress_struct *cinfo = &d->cinfo;
+    const struct Conv_layout *l = d->frame ? &d->full : &i->layout;
+    uint8_t *dst = d->frame ? d->frame : out;
+    JSAMPARRAY planes[3] = { d->y, d->cb, d->cr };
+    unsigned int mcu_lines, line, n, k, c_line;
+    int v_samp;
+
+    if( setjmp(d->err.jmp) ) {
+        char msg[JMSG_LENGTH_MAX];
+
+        cinfo->err->format_message((j_common_ptr)cinfo, msg);
+        log_debug("MJPEG frame dropped: %s", msg);
+        jpeg_abort_decompress(cinfo);
+        return -1;
+    }
+
+    jpeg_mem_src(cinfo, (unsigned char *)jpg, len);
+    jpeg_read_header(cinfo, TRUE);
+
+    v_samp = cinfo->comp_info[0].v_samp_factor;
+    if( cinfo->num_components != 3 || cinfo->image_width != l->width ||
+        cinfo->image_height != l->height ||
+        cinfo->comp_info[0].h_samp_factor != 2 || (v_samp != 1 && v_samp != 2) ||
+        cinfo->comp_info[1].h_samp_factor != 1 || cinfo->comp_info[1].v_samp_factor != 1 ||
+        cinfo->comp_info[2].h_samp_factor != 1 || cinfo->comp_info[2].v_samp_factor != 1 ) {
+        log_debug("MJPEG frame %ux%u, %d components: not 4:2:2 or 4:2:0 of %ux%u",
+                  cinfo->image_width, cinfo->image_height, cinfo->num_components,
+                  l->width, l->height);
+        jpeg_abort_decompress(cinfo);
+        return -1;
+    }
+
+    cinfo->raw_data_out = TRUE;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->dct_method = JDCT_IFAST;
+    jpeg_start_decompress(cinfo);
+
+    if( sw_rows(d, cinfo->comp_info[0].width_in_blocks * DCTSIZE,
+                cinfo->comp_info[1].width_in_blocks * DCTSIZE) != 0 ) {
+        jpeg_abort_decompress(cinfo);
+        return -1;
+    }
+
+    mcu_lines = DCTSIZE * v_samp;
+
+    for( line = 0; line < l->height; line += mcu_lines ) {
+        jpeg_read_raw_data(cinfo, planes, mcu_lines);
+
+        for( n = 0; n < mcu_lines && line + n < l->height; n++ )
+            memcpy(dst + (size_t)l->y_stride * (line + n), d->y[n], l->width);
+
+        // 4:2:0 has a chroma line per NV12 one, 4:2:2 two of them
+        for( n = 0; n < DCTSIZE; n += 3 - v_samp ) {
+            c_line = (line + n * v_samp) / 2;
+            if( c_line >= l->height / 2 )
+                break;
+
+            if( v_samp == 1 ) {
+                for( k = 0; k < l->width / 2; k++ ) {
+                    d->cb[n][k] = (d->cb[n][k] + d->cb[n + 1][k] + 1) >> 1;
+                    d->cr[n][k] = (d->cr[n][k] + d->cr[n + 1][k] + 1) >> 1;
+                }
+            }
+
+            conv_uv_merge(d->cb[n], d->cr[n],
+                          dst + l->uv_offset + (size_t)l->uv_stride * c_line, l->width);
+        }
+    }
+
+    jpeg_finish_decompress(cinfo);
+
+    if( d->frame )
+        return conv_frame(conv_isa(), CONV_CHROMA_AVG, &d->scaled,
+                          d->frame, d->frame_sz, out, out_sz);
+
+    return 0;
+}
+
+
+const struct Mjpeg_decoder mjpeg_dec_sw = {
+    .name   = MJPEG_DEC_SW,
+    .open   = sw_open,
+    .decode = sw_decode,
+    .close  = sw_close,
+};
@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "common.h"
+#include "log.h"
+#include "mjpeg.h"
+#include "mjpeg_impl.h"
+
+/* V4L2 mem2mem JPEG decoder, e.g. the i.MX6 VPU one. One buffer on each
+ * queue: the JPEG goes to OUTPUT, the picture comes back on CAPTURE and
+ * is copied into the destination layout by the conversion library */
+
+#define V4L2_DEC_TIMEOUT_MS  1000
+
+struct V4l2_dec {
+    int                 fd;
+    struct Buffer       in;         // OUTPUT, JPEG
+    struct Buffer       out;        // CAPTURE, raw picture
+    struct Conv_layout  layout;     // CAPTURE buffer to i->layout
+    int                 streaming;
+    int                 failed;     // buffers could not be taken back
+};
+
+
+static int v4l2_map(struct V4l2_dec *d, enum v4l2_buf_type type, struct Buffer *b)
+{
+    struct v4l2_requestbuffers reqbuf;
+    struct v4l2_buffer buf;
+
+    MEMZERO(reqbuf);
+    reqbuf.count = 1;
+    reqbuf.type = type;
+    reqbuf.memory = V4L2_MEMORY_MMAP;
+    if( ioctl(d->fd, VIDIOC_REQBUFS, &reqbuf) != 0 || reqbuf.count < 1 ) {
+        log_fatal("MJPEG decoder: REQBUFS failed [%m]");
+        return -1;
+    }
+
+    MEMZERO(buf);
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    if( ioctl(d->fd, VIDIOC_QUERYBUF, &buf) != 0 ) {
+        log_fatal("MJPEG decoder: QUERYBUF failed [%m]");
+        return -1;
+    }
+
+    b->length = buf.length;
+    b->start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    d->fd, buf.m.offset);
+    if( b->start == MAP_FAILED ) {
+        b->start = NULL;
+        log_fatal("MJPEG decoder: mmap failed [%m]");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int v4l2_open(struct Mjpeg_inst *i)
+{
+    const struct Conv_layout *l = &i->layout;
+    struct v4l2_capability cap;
+    struct v4l2_format fmt;
+    struct V4l2_dec *d;
+    enum v4l2_buf_type type;
+    int src_fmt;
+
+    d = calloc(1, sizeof(*d));
+    if( !d ) {
+        log_fatal("calloc() [%m]");
+        return -1;
+    }
+    i->priv = d;
+
+    d->fd = open(i->dec_name, O_RDWR | O_NONBLOCK, 0);
+    if( d->fd < 0 ) {
+        log_fatal("'%s': failed to open JPEG decoder [%m]", i->dec_name);
+        return -1;
+    }
+
+    MEMZERO(cap);
+    if( ioctl(d->fd, VIDIOC_QUERYCAP, &cap) != 0 ||
+        !(cap.capabilities & V4L2_CAP_VIDEO_M2M) ) {
+        log_fatal("'%s' is not a mem2mem device", i->dec_name);
+        return -1;
+    }
+
+    MEMZERO(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    fmt.fmt.pix.width = l->width;
+    fmt.fmt.pix.height = l->height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
+    fmt.fmt.pix.sizeimage = l->width * l->height;
+    if( ioctl(d->fd, VIDIOC_S_FMT, &fmt) != 0 ||
+        fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG ) {
+        log_fatal("'%s' does not decode JPEG [%m]", i->dec_name);
+        return -1;
+    }
+
+    // NV12 is best, I420 is merged into it
+    MEMZERO(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = l->width;
+    fmt.fmt.pix.height = l->height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+    if( ioctl(d->fd, VIDIOC_S_FMT, &fmt) != 0 ) {
+        log_fatal("'%s': S_FMT of the picture failed [%m]", i->dec_name);
+        return -1;
+    }
+
+    if( fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_NV12 )
+        src_fmt = CONV_FMT_NV12;
+    else if( fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUV420 )
+        src_fmt = CONV_FMT_I420;
+    else {
+        log_fatal("'%s' gives %.4s pictures, not NV12 or I420", i->dec_name,
+                  (char *)&fmt.fmt.pix.pixelformat);
+        return -1;
+    }
+
+    d->layout = *l;
+    conv_layout_src(&d->layout, src_fmt, fmt.fmt.pix.bytesperline,
+                    (size_t)fmt.fmt.pix.bytesperline * fmt.fmt.pix.height);
+
+    if( v4l2_map(d, V4L2_BUF_TYPE_VIDEO_OUTPUT, &d->in) != 0 ||
+        v4l2_map(d, V4L2_BUF_TYPE_VIDEO_CAPTURE, &d->out) != 0 )
+        return -1;
+
+    type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    if( ioctl(d->fd, VIDIOC_STREAMON, &type) != 0 ) {
+        log_fatal("'%s': STREAMON failed [%m]", i->dec_name);
+        return -1;
+    }
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if( ioctl(d->fd, VIDIOC_STREAMON, &type) != 0 ) {
+        log_fatal("'%s': STREAMON failed [%m]", i->dec_name);
+        return -1;
+    }
+    d->streaming = 1;
+
+    log_info("'%s': JPEG to %s, bpl %u", i->dec_name, conv_fmt_name(src_fmt),
+             fmt.fmt.pix.bytesperline);
+
+    return 0;
+}
+
+
+static void v4l2_close(struct Mjpeg_inst *i)
+{
+    struct V4l2_dec *d = i->priv;
+    enum v4l2_buf_type type;
+
+    if( !d )
+        return;
+
+    if( d->streaming ) {
+        type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        ioctl(d->fd, VIDIOC_STREAMOFF, &type);
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        ioctl(d->fd, VIDIOC_STREAMOFF, &type);
+    }
+
+    if( d->in.start )
+        munmap(d->in.start, d->in.length);
+    if( d->out.start )
+        munmap(d->out.start, d->out.length);
+    if( d->fd >= 0 )
+        close(d->fd);
+
+    free(d);
+    i->priv = NULL;
+}
+
+
+static int v4l2_qbuf(struct V4l2_dec *d, enum v4l2_buf_type type, size_t used)
+{
+    struct v4l2_buffer buf;
+
+    MEMZERO(buf);
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    buf.bytesused = used;
+
+    return ioctl(d->fd, VIDIOC_QBUF, &buf);
+}
+
+
+static int v4l2_dqbuf(struct V4l2_dec *d, enum v4l2_buf_type type,
+                      struct v4l2_buffer *buf)
+{
+    MEMZERO(*buf);
+    buf->type = type;
+    buf->memory = V4L2_MEMORY_MMAP;
+
+    return ioctl(d->fd, VIDIOC_DQBUF, buf);
+}
+
+
+/* A buffer the driver still holds can not be queued again. STREAMOFF
+ * gives back all buffers of a queue, STREAMON makes it ready for the
+ * next frame */
+static int v4l2_reclaim(struct Mjpeg_inst *i, struct V4l2_dec *d)
+{
+    enum v4l2_buf_type type;
+
+    type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    if( ioctl(d->fd, VIDIOC_STREAMOFF, &type) == 0 &&
+        ioctl(d->fd, VIDIOC_STREAMON, &type) == 0 ) {
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if( ioctl(d->fd, VIDIOC_STREAMOFF, &type) == 0 &&
+            ioctl(d->fd, VIDIOC_STREAMON, &type) == 0 )
+            return 0;
+    }
+
+    log_fatal("'%s': buffers can not be taken back, decoder stopped [%m]",
+              i->dec_name);
+    d->failed = 1;
+    return MJPEG_DEC_FAILED;
+}
+
+
+static int v4l2_decode(struct Mjpeg_inst *i, const uint8_t *jpg, size_t len,
+                       uint8_t *out, size_t out_sz)
+{
+    struct V4l2_dec *d = i->priv;
+    struct pollfd pfd = { .fd = d->fd, .events = POLLIN };
+    struct v4l2_buffer buf;
+    int ret, out_ret, cap_ret;
+
+    if( d->failed )
+        return MJPEG_DEC_FAILED;
+
+    if( len > d->in.length ) {
+        log_debug("MJPEG frame of %zu bytes does not fit %zu", len, d->in.length);
+        return -1;
+    }
+    memcpy(d->in.start, jpg, len);
+
+    if( v4l2_qbuf(d, V4L2_BUF_TYPE_VIDEO_CAPTURE, 0) != 0 ) {
+        log_error("MJPEG decoder: QBUF failed [%m]");
+        return v4l2_reclaim(i, d) == 0 ? -1 : MJPEG_DEC_FAILED;
+    }
+    if( v4l2_qbuf(d, V4L2_BUF_TYPE_VIDEO_OUTPUT, len) != 0 ) {
+        log_error("MJPEG decoder: QBUF failed [%m]");
+        return v4l2_reclaim(i, d) == 0 ? -1 : MJPEG_DEC_FAILED;
+    }
+
+    ret = poll(&pfd, 1, V4L2_DEC_TIMEOUT_MS);
+    if( ret <= 0 )
+        log_error("MJPEG decoder: no picture in %d ms [%m]", V4L2_DEC_TIMEOUT_MS);
+
+    // Both buffers have to come back whatever happened: the fd does not
+    // block, those the driver still holds are taken back by a restart
+    out_ret = v4l2_dqbuf(d, V4L2_BUF_TYPE_VIDEO_OUTPUT, &buf);
+    cap_ret = v4l2_dqbuf(d, V4L2_BUF_TYPE_VIDEO_CAPTURE, &buf);
+    if( out_ret != 0 || cap_ret != 0 )
+        return v4l2_reclaim(i, d) == 0 ? -1 : MJPEG_DEC_FAILED;
+
+    if( ret <= 0 || (buf.flags & V4L2_BUF_FLAG_ERROR) )
+        return -1;
+
+    return conv_frame(conv_isa(), CONV_CHROMA_AVG, &d->layout,
+                      d->out.start, buf.bytesused ? buf.bytesused : d->out.length,
+                      out, out_sz);
+}
+
+
+const struct Mjpeg_decoder mjpeg_dec_v4l2 = {
+    .name   = "v4l2",
+    .open   = v4l2_open,
+    .decode = v4l2_decode,
+    .close  = v4l2_close,
+};
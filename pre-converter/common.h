@@ -94,9 +94,23 @@ struct _instance {
 
     uint16_t    width;
     uint16_t    height;
+    uint16_t    out_width;  // scaled picture, the input size by default
+    uint16_t    out_height;
+    int         scale;      // CONV_SCALE_*
 
     uint16_t    n_frames_to_convert;
     char        *n_frames_to_conv_str;
+
+    int         isa;        // CONV_ISA_*, see ../convert.h
+    int         chroma;     // CONV_CHROMA_*
+    int         src_fmt;    // CONV_FMT_* of the input file
+    int         bench;
+    int         conform;
+    int         mem_bench;  // time the ways of writing into the encoder's buffer
+    char        enc_dev[128]; // m2m encoder for mem_bench, none - cached memory only
+    int         threads;    // conversion threads, 0 - one per core
+    int         mjpeg;      // the input file is a recorded MJPEG stream
+    char        mjpeg_dec[128]; // MJPEG decoder, see ../mjpeg.h
 };
 
 
@@ -31,13 +31,24 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <sys/time.h>
-#include <arm_neon.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/videodev2.h>
 
 #include "common.h"
+#include "../convert.h"
+#include "../dmabuf.h"
+#include "../mjpeg.h"
+#include "../log.h"
 
 int clear_all(struct _instance *i) {
 
+    conv_pool_stop();
+
     if (i->in_file.ptr)
         fclose(i->in_file.ptr);
 
@@ -63,6 +74,17 @@ void print_usage(char *name)
     printf("\t-w  frame width\n");
     printf("\t-h  frame height\n");
     printf("\t-n  number of frames to convert (default: all) \n");
+    printf("\t-i  conversion backend: auto|scalar|neon|sse2|avx2 (default: auto) \n");
+    printf("\t-s  input format: yuyv|uyvy|i420|nv12|mjpeg (default: yuyv) \n");
+    printf("\t-j  MJPEG decoder: sw|/dev/videoN (default: sw) \n");
+    printf("\t-o  scale to WxH \n");
+    printf("\t-x  scaling filter: auto|box|bilinear (default: auto) \n");
+    printf("\t-l  legacy kernel: chroma of even lines only, no averaging \n");
+    printf("\t-t  conversion threads, 0 - one per core (default: 1) \n");
+    printf("\t-B  benchmark all backends and kernels on 1..t threads, no files needed \n");
+    printf("\t-m  benchmark direct, staged and copied writes, no files needed \n");
+    printf("\t-e  encoder device whose NV12 buffer -m writes too, e.g. /dev/video1 \n");
+    printf("\t-C  check all backends against plain C for widths 320..1920, no files needed \n");
     printf("\n");
 }
 
@@ -73,8 +95,13 @@ int parse_args(struct _instance *inst, int argc, char **argv)
     int f = -1;
     int d = -1;
     inst->n_frames_to_convert = 0;
+    inst->isa = CONV_ISA_AUTO;
+    inst->threads = 1;
+    inst->src_fmt = CONV_FMT_YUYV;
+    strcpy(inst->mjpeg_dec, MJPEG_DEC_SW);
+    inst->scale = CONV_SCALE_AUTO;
 
-    while ((c = getopt(argc, argv, "f:d:w:h:n:")) != -1) {
+    while ((c = getopt(argc, argv, "f:d:w:h:n:i:s:j:o:x:lt:BCme:")) != -1) {
         switch (c) {
             case 'f':
                 f = 1;
@@ -94,12 +121,84 @@ int parse_args(struct _instance *inst, int argc, char **argv)
                 inst->n_frames_to_convert = strtol(optarg, NULL, 10);
                 inst->n_frames_to_conv_str = optarg;
                 break;
+            case 's':
+                if( strcmp(optarg, "mjpeg") == 0 ) {
+                    inst->mjpeg = 1;
+                    break;
+                }
+                inst->src_fmt = conv_fmt_by_name(optarg);
+                if( conv_route(inst->src_fmt, CONV_FMT_NV12) == CONV_ROUTE_NONE ) {
+                    err("Unknown input format '%s'", optarg);
+                    return -1;
+                }
+                break;
+            case 'j':
+                if( strlen(optarg) >= sizeof(inst->mjpeg_dec) ) {
+                    err("Too long MJPEG decoder name '%s'", optarg);
+                    return -1;
+                }
+                strcpy(inst->mjpeg_dec, optarg);
+                break;
+            case 'o': {
+                char *x_ptr;
+
+                inst->out_width = strtol(optarg, &x_ptr, 10);
+                inst->out_height = *x_ptr == 'x' ? strtol(x_ptr + 1, NULL, 10) : 0;
+                if( inst->out_width < 2 || inst->out_height < 2 ) {
+                    err("Wrong output size '%s'", optarg);
+                    return -1;
+                }
+                break;
+            }
+            case 'x':
+                inst->scale = conv_scale_by_name(optarg);
+                if( inst->scale == CONV_SCALE_INVALID ) {
+                    err("Unknown scaling filter '%s'", optarg);
+                    return -1;
+                }
+                break;
+            case 'l':
+                inst->chroma = CONV_CHROMA_DROP;
+                break;
+            case 't':
+                inst->threads = strtol(optarg, NULL, 10);
+                if( inst->threads < 0 || inst->threads > CONV_THREADS_MAX ) {
+                    err("Wrong number of threads '%s'", optarg);
+                    return -1;
+                }
+                break;
+            case 'B':
+                inst->bench = 1;
+                break;
+            case 'C':
+                inst->conform = 1;
+                break;
+            case 'm':
+                inst->mem_bench = 1;
+                break;
+            case 'e':
+                if( strlen(optarg) >= sizeof(inst->enc_dev) ) {
+                    err("Too long encoder device name '%s'", optarg);
+                    return -1;
+                }
+                strcpy(inst->enc_dev, optarg);
+                break;
+            case 'i':
+                inst->isa = conv_isa_by_name(optarg);
+                if( inst->isa == CONV_ISA_INVALID ) {
+                    err("Unknown conversion backend '%s'", optarg);
+                    return -1;
+                }
+                break;
             default:
                 err("Bad argument");
                 return -1;
         }
     }
 
+    if( inst->bench || inst->conform || inst->mem_bench )
+        return 0;
+
     if ( f != 1 ) {
         err("Set correct file name");
         return -1;
@@ -114,9 +213,14 @@ int parse_args(struct _instance *inst, int argc, char **argv)
         return -1;
     }
 
+    if( !inst->out_width ) {
+        inst->out_width = inst->width;
+        inst->out_height = inst->height;
+    }
+
     if( d == 1)
         sprintf(inst->out_file.name, "%s/tmp-pic-%dx%d.nv12",
-            inst->out_file.name, inst->width, inst->height);
+            inst->out_file.name, inst->out_width, inst->out_height);
 
     return 0;
 }
@@ -132,21 +236,22 @@ int open_in_file(struct _instance *i) {
 }
 
 int prepare_buffs(struct _instance *i) {
-    // Размер картинки по ширине должен быть кратен 4
-    // Размер картинки по высоте должен быть кратен 2
+    // Размер картинки по ширине и по высоте должен быть кратен 2,
+    // значит width * height кратно 4, но не всегда кратно MACROPIX
 
-    uint32_t n_macro_pix = i->width * i->height / MACROPIX;
+    uint32_t n_pix = i->width * i->height;
 
-    uint32_t YCrCb_444 = n_macro_pix * MPIX444_SZ;
+    uint32_t YCrCb_444 = n_pix * MPIX444_SZ / MACROPIX;
     info("YCrCb 4:4:4 picture size = %d bytes", YCrCb_444);
 
-    uint32_t YCrCb_422 = n_macro_pix * MPIX422_SZ;
+    uint32_t YCrCb_422 = n_pix * MPIX422_SZ / MACROPIX;
     info("YCrCb 4:2:2 picture size = %d bytes", YCrCb_422);
 
-    uint32_t YCrCb_420 = n_macro_pix * MPIX420_SZ;
+    uint32_t YCrCb_420 = n_pix * MPIX420_SZ / MACROPIX;
     info("YCrCb 4:2:0 picture size = %d bytes", YCrCb_420);
 
-    i->in_buff_sz  = YCrCb_422;
+    i->in_buff_sz  = conv_route(i->src_fmt, CONV_FMT_NV12) == CONV_ROUTE_REPACK ?
+                     YCrCb_422 : YCrCb_420;
     i->in_buff_ptr = (char *)calloc(i->in_buff_sz, sizeof(char));
     if( !i->in_buff_ptr ) {
         perror("calloc()");
@@ -154,7 +259,7 @@ int prepare_buffs(struct _instance *i) {
     }
 
 
-    i->out_buff_sz = YCrCb_420;
+    i->out_buff_sz = (size_t)i->out_width * i->out_height * MPIX420_SZ / MACROPIX;
     i->out_buff_ptr = (char *)calloc(i->out_buff_sz, sizeof(char));
     if( !i->out_buff_ptr ) {
         perror("calloc()");
@@ -165,245 +270,727 @@ int prepare_buffs(struct _instance *i) {
 }
 
 
-int yuyv_to_nv12_neon(char *in_buff_ptr, size_t in_buff_sz,
-                 char *out_buff_ptr, size_t out_buff_sz,
-                 uint16_t width, uint16_t height)
-{
-    // Sanity checks first
-    {
-        if (width % 4 != 0) {
-            err("Frame width must be a multiple of 4!");
-            return -1;
-        }
-        if (height % 2 != 0) {
-            err("Frame height must be a multiple of 2!");
-            return -1;
-        }
+int read_data(struct _instance *i) {
+    uint32_t n_read;
 
-        u_int8_t macropix = 8;
-        uint32_t n_macro_pix = width * height / macropix;
+    n_read = fread(i->in_buff_ptr, i->in_buff_sz, 1, i->in_file.ptr);
+    if( feof(i->in_file.ptr) != 0 ) {
+        info("Get the End Of File");
+        return 1;
+    }
+    if( n_read != 1 ) {
+        err("fread() = %d. Error read of file", n_read);
+        return -1;
+    }
 
-        uint8_t mpix422_sz = 16;
-        uint32_t YCrCb_422_sz = n_macro_pix * mpix422_sz;
-        if (in_buff_sz != YCrCb_422_sz) {
-            err("Input buffer size must be exactly %d bytes", YCrCb_422_sz);
-            return -1;
-        }
+    dbg("Read from file: %ld bytes", i->in_buff_sz);
 
-        uint8_t mpix420_sz = 12;
-        uint32_t YCrCb_420_sz = n_macro_pix * mpix420_sz;
-        if (out_buff_sz < YCrCb_420_sz) {
-            err("Output buffer size must be at least %d bytes", YCrCb_420_sz);
+    return 0;
+}
+
+
+int save_to_file(struct _instance *i) {
+    size_t n_write;
+
+    if ( ! i->out_file.ptr ) {
+        i->out_file.ptr = fopen(i->out_file.name, "wb");
+        if (!i->out_file.ptr) {
+            err("Can not create file '%s'", i->out_file.name);
             return -1;
         }
     }
 
-    // Main converter body
-    int line_n, chunk_n;
 
-    uint8_t *Y_plane_start = (uint8_t*)out_buff_ptr;
-    size_t Y_offset = 0;
-    uint8_t *CbCr_plane_start = (uint8_t*)(out_buff_ptr + width * height);
-    size_t CbCr_offset = 0;
+    n_write = fwrite(i->out_buff_ptr, i->out_buff_sz, 1, i->out_file.ptr);
+    if (n_write != 1) {
+        err("Can not save data in file %s", i->out_file.name);
+        return -1;
+    }
+    dbg("Write to file: %ld bytes", i->out_buff_sz);
 
-    size_t in_buff_offset = 0;
+    return 0;
+}
 
-    int yuyv_line_len = (width / 2) * 4;
-    uint8x16x2_t chunk_128x2;
 
-    struct timeval  tv;
-    gettimeofday(&tv, NULL);
-    double time_begin = ((double)tv.tv_sec) * 1000 +
-                        ((double)tv.tv_usec) / 1000;
+/* CPU cycles of this thread from the PMU, -1 when it is not available */
+static int cycles_open(void)
+{
+    struct perf_event_attr attr;
 
-    for( line_n = 0; line_n < height; line_n++ ) {
-        for( chunk_n = 0; chunk_n < yuyv_line_len / 32 ; chunk_n++)
-        {
-            in_buff_offset = yuyv_line_len * line_n + 32 * chunk_n;
-            chunk_128x2 = vld2q_u8( (uint8_t*)in_buff_ptr + in_buff_offset);
+    memzero(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
 
-            vst1q_u8(Y_plane_start + Y_offset, chunk_128x2.val[0]);
-            Y_offset += 16;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
 
-            if( line_n % 2 == 0 ) {
-                vst1q_u8(CbCr_plane_start + CbCr_offset, chunk_128x2.val[1]);
-                CbCr_offset += 16;
-            }
 
-        }
+static uint64_t cycles_read(int fd)
+{
+    uint64_t cnt = 0;
 
-        if( yuyv_line_len % 32 != 0 ) {
-            uint8_t bytes_left = yuyv_line_len % 32;
-            in_buff_offset += 32;
+    if( fd < 0 || read(fd, &cnt, sizeof(cnt)) != sizeof(cnt) )
+        return 0;
 
-            for( uint8_t iter = 0; iter < bytes_left; iter += 4 ) {
+    return cnt;
+}
 
-                Y_plane_start[Y_offset] = in_buff_ptr[in_buff_offset + 0];
-                Y_offset++;
 
-                Y_plane_start[Y_offset] = in_buff_ptr[in_buff_offset + 2];
-                Y_offset++;
+static double time_ms(void)
+{
+    struct timeval  tv;
 
-                if (line_n % 2 == 0) {
-                    CbCr_plane_start[CbCr_offset] = in_buff_ptr[in_buff_offset + 1];
-                    CbCr_offset++;
-                    CbCr_plane_start[CbCr_offset] = in_buff_ptr[in_buff_offset + 3];
-                    CbCr_offset++;
+    gettimeofday(&tv, NULL);
+    return ((double)tv.tv_sec) * 1000 + ((double)tv.tv_usec) / 1000;
+}
+
+
+/* Old (even line chroma) against fused two-row kernel of every backend,
+ * on 1 up to 'threads' threads of the worker pool. The best of BENCH_RUNS
+ * frames is taken, as the least disturbed one. The cycle counter sees the
+ * calling thread only, so it is shown for one thread */
+#define BENCH_RUNS  50
+
+static void bench_bands(void)
+{
+    struct Conv_band_stats st[CONV_THREADS_MAX];
+    int n, bands;
+
+    bands = conv_pool_stats(st, 1);
+
+    printf("%-7s", "");
+    for( n = 0; n < bands; n++ )
+        printf(" band%d(core %d) %.3f ms", n, st[n].cpu,
+               st[n].runs ? (double)st[n].busy_ns / st[n].runs / 1e6 : 0);
+    printf("\n");
+}
+
+
+int bench(int threads)
+{
+    static const uint16_t sizes[][2] = { {640, 480}, {1280, 720}, {1920, 1080} };
+    static const char *kernels[] = { "fused", "legacy" };
+    struct Conv_layout layout;
+    uint8_t *in, *out;
+    size_t in_sz, out_sz, n;
+    double t, t_best;
+    uint64_t c, c_best;
+    int cyc_fd;
+    int s, isa, chroma, thr, run;
+
+    cyc_fd = cycles_open();
+    if( cyc_fd < 0 )
+        info("No CPU cycle counter (perf_event_open), only time is measured");
+
+    for( thr = 1; thr <= threads; thr++ ) {
+      if( conv_pool_start(thr) != 0 )
+          return -1;
+
+      printf("%-7s %-7s %-10s %3s %10s %10s\n", "isa", "kernel", "size", "thr",
+             "cycles/px", "ns/px");
+
+      for( s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++ ) {
+        in_sz = (size_t)sizes[s][0] * sizes[s][1] * 2;
+        out_sz = (size_t)sizes[s][0] * sizes[s][1] * 3 / 2;
+        in = malloc(in_sz);
+        out = malloc(out_sz);
+        if( !in || !out ) {
+            err("malloc() failed");
+            free(in);
+            free(out);
+            return -1;
+        }
+        for( n = 0; n < in_sz; n++ )
+            in[n] = rand();
+        conv_layout_packed(&layout, sizes[s][0], sizes[s][1]);
+
+        for( isa = 0; isa < CONV_ISA_N; isa++ ) {
+            if( !conv_isa_supported(isa) )
+                continue;
+
+            for( chroma = CONV_CHROMA_AVG; chroma <= CONV_CHROMA_DROP; chroma++ ) {
+                t_best = 1e9;
+                c_best = UINT64_MAX;
+
+                for( run = 0; run < BENCH_RUNS; run++ ) {
+                    c = cycles_read(cyc_fd);
+                    t = time_ms();
+                    conv_frame_mt(isa, chroma, &layout, in, in_sz, out, out_sz);
+                    t = time_ms() - t;
+                    c = cycles_read(cyc_fd) - c;
+
+                    if( t < t_best )
+                        t_best = t;
+                    if( c < c_best )
+                        c_best = c;
                 }
 
-                in_buff_offset += 4;
+                n = (size_t)sizes[s][0] * sizes[s][1];
+                printf("%-7s %-7s %4ux%-5u %3d ", conv_isa_name(isa),
+                       kernels[chroma], sizes[s][0], sizes[s][1], thr);
+                if( cyc_fd < 0 || thr > 1 )
+                    printf("%10s", "n/a");
+                else
+                    printf("%10.3f", (double)c_best / n);
+                printf(" %10.3f\n", t_best * 1e6 / n);
+
+                if( thr > 1 )
+                    bench_bands();
             }
         }
 
+        free(in);
+        free(out);
+      }
     }
 
-    gettimeofday(&tv, NULL);
-    double time_end = ((double)tv.tv_sec) * 1000 +
-                      ((double)tv.tv_usec) / 1000 ;
-    dbg("Execute time 'yuyv_to_nv12()' = %f(ms)", time_end - time_begin);
+    conv_pool_stop();
 
-    dbg("Total lines in picture = %d", line_n);
-    dbg("Y' plane start pos: 0, end pos: %d [0x%x]", Y_offset - 1, Y_offset - 1);
-    dbg("CbCr plane start pos: %d, end pos: %d [0x%x]",
-        width * height, width * height + CbCr_offset - 1,
-        width * height + CbCr_offset - 1);
+    if( cyc_fd >= 0 )
+        close(cyc_fd);
 
     return 0;
 }
 
 
-int yuyv_to_nv12(char *in_buff_ptr, size_t in_buff_sz,
-        char *out_buff_ptr, size_t out_buff_sz,
-        uint16_t width, uint16_t height)
+/* How the frame gets into the encoder's buffer. Coda's NV12 buffers are
+ * write-combined on i.MX6, a cached heap buffer is the reference. Every
+ * strategy is timed on both:
+ *   direct - the kernels store into the buffer,
+ *   staged - lines are made in the cache and copied out, CONV_WRITE_STAGED,
+ *   copy   - the frame is made in a cached buffer and copied out at once.
+ * The encoder buffer is an OUTPUT buffer of the m2m device given with -e,
+ * synced with DMA_BUF_IOCTL_SYNC as the server does with --dma-sync */
+#define MEM_DIRECT  0
+#define MEM_STAGED  1
+#define MEM_COPY    2
+#define MEM_N       3
+
+#define ENC_PLANE_ALIGN  16     // CODA_PLANE_ALIGN of coda960.h
+
+static const char *mem_strategies[MEM_N] = { "direct", "staged", "copy" };
+
+// One NV12 OUTPUT buffer of the encoder
+struct Enc_buffer {
+    int             fd;
+    int             dmabuf_fd;
+    uint8_t        *start;
+    size_t          length;
+    unsigned int    bpl;
+    size_t          luma_sz;
+};
+
+
+static void enc_buffer_close(struct Enc_buffer *b)
 {
-    // Sanity checks first
-    {
-        if (width % 4 != 0) {
-            err("Frame width must be a multiple of 4!");
-            return -1;
-        }
-        if (height % 2 != 0) {
-            err("Frame height must be a multiple of 2!");
-            return -1;
-        }
+    struct v4l2_requestbuffers reqbuf;
+
+    if( b->start != MAP_FAILED )
+        munmap(b->start, b->length);
+    b->start = MAP_FAILED;
+    dmabuf_close(&b->dmabuf_fd);
+
+    if( b->fd >= 0 ) {
+        memzero(reqbuf);
+        reqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        reqbuf.memory = V4L2_MEMORY_MMAP;
+        ioctl(b->fd, VIDIOC_REQBUFS, &reqbuf);
+        close(b->fd);
+    }
+    b->fd = -1;
+}
+
+
+static int enc_buffer_open(struct Enc_buffer *b, const char *dev,
+                           unsigned int width, unsigned int height)
+{
+    struct v4l2_format fmt;
+    struct v4l2_requestbuffers reqbuf;
+    struct v4l2_buffer buf;
+    unsigned int plane_h;
+
+    b->start = MAP_FAILED;
+    b->dmabuf_fd = -1;
+    b->fd = open(dev, O_RDWR);
+    if( b->fd < 0 ) {
+        err("Can not open '%s': %s", dev, strerror(errno));
+        return -1;
+    }
+
+    memzero(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_NV12;
+    if( ioctl(b->fd, VIDIOC_S_FMT, &fmt) != 0 ||
+        fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_NV12 ) {
+        err("'%s' does not take NV12 %ux%u", dev, width, height);
+        return -1;
+    }
+    b->bpl = fmt.fmt.pix.bytesperline;
+
+    // CbCr goes where coda_init_nv12() of the server puts it: after the
+    // luma plane padded to a multiple of ENC_PLANE_ALIGN lines
+    plane_h = (fmt.fmt.pix.height + ENC_PLANE_ALIGN - 1) & ~(ENC_PLANE_ALIGN - 1u);
+    if( (size_t)b->bpl * plane_h * 3 / 2 > fmt.fmt.pix.sizeimage ) {
+        info("'%s': sizeimage %u is too small for %u padded lines, "
+             "assume unpadded planes", dev, fmt.fmt.pix.sizeimage, plane_h);
+        plane_h = fmt.fmt.pix.height;
+    }
+    b->luma_sz = (size_t)b->bpl * plane_h;
+
+    memzero(reqbuf);
+    reqbuf.count = 1;
+    reqbuf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    reqbuf.memory = V4L2_MEMORY_MMAP;
+    if( ioctl(b->fd, VIDIOC_REQBUFS, &reqbuf) != 0 || reqbuf.count < 1 ) {
+        err("'%s': REQBUFS failed: %s", dev, strerror(errno));
+        return -1;
+    }
+
+    memzero(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if( ioctl(b->fd, VIDIOC_QUERYBUF, &buf) != 0 ) {
+        err("'%s': QUERYBUF failed: %s", dev, strerror(errno));
+        return -1;
+    }
+
+    b->length = buf.length;
+    b->start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    b->fd, buf.m.offset);
+    if( b->start == MAP_FAILED ) {
+        err("'%s': mmap failed: %s", dev, strerror(errno));
+        return -1;
+    }
+
+    b->dmabuf_fd = dmabuf_export(b->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, 0);
 
-        u_int8_t macropix = 8;
-        uint32_t n_macro_pix = width * height / macropix;
+    return 0;
+}
+
+
+/* Best of BENCH_RUNS frames into 'out', ms. 'stage' is a cached buffer
+ * with the same layout for MEM_COPY */
+static double mem_run(int strategy, const struct Conv_layout *l,
+                      const uint8_t *in, size_t in_sz,
+                      uint8_t *out, size_t out_sz, int dmabuf_fd, uint8_t *stage)
+{
+    const size_t frame_sz = l->uv_offset + (size_t)l->uv_stride * l->dst_height / 2;
+    struct Conv_layout layout = *l;
+    double t, t_best = 1e9;
+    int run;
+
+    layout.write_mode = strategy == MEM_STAGED ? CONV_WRITE_STAGED : CONV_WRITE_DIRECT;
 
-        uint8_t mpix422_sz = 16;
-        uint32_t YCrCb_422_sz = n_macro_pix * mpix422_sz;
-        if (in_buff_sz != YCrCb_422_sz) {
-            err("Input buffer size must be exactly %d bytes", YCrCb_422_sz);
+    for( run = 0; run < BENCH_RUNS; run++ ) {
+        t = time_ms();
+        if( dmabuf_begin(dmabuf_fd, DMABUF_WRITE) != 0 )
             return -1;
+
+        if( strategy == MEM_COPY ) {
+            conv_frame_mt(conv_isa(), CONV_CHROMA_AVG, &layout, in, in_sz, stage, out_sz);
+            memcpy(out, stage, frame_sz);
+        } else {
+            conv_frame_mt(conv_isa(), CONV_CHROMA_AVG, &layout, in, in_sz, out, out_sz);
         }
 
-        uint8_t mpix420_sz = 12;
-        uint32_t YCrCb_420_sz = n_macro_pix * mpix420_sz;
-        if (out_buff_sz < YCrCb_420_sz) {
-            err("Output buffer size must be at least %d bytes", YCrCb_420_sz);
+        if( dmabuf_end(dmabuf_fd, DMABUF_WRITE) != 0 )
             return -1;
-        }
+        t = time_ms() - t;
+
+        if( t < t_best )
+            t_best = t;
     }
 
+    return t_best;
+}
 
-    size_t iter;
 
-    uint16_t yuyv_line_len = (width / 2) * 4;
-    uint16_t curr_line_n = 0;
+int mem_bench(const char *enc_dev, int threads)
+{
+    static const uint16_t sizes[][2] = { {640, 480}, {1280, 720}, {1920, 1080} };
+    struct Enc_buffer enc;
+    struct Conv_layout layout;
+    uint8_t *in = NULL, *out = NULL, *stage = NULL;
+    size_t in_sz, out_sz, n;
+    double t;
+    int s, strategy, ret = -1;
+
+    if( conv_pool_start(threads) != 0 )
+        return -1;
 
-    size_t Y_offset = 0;
-    size_t CbCr_offset = width * height;
+    enc.fd = -1;
+    enc.dmabuf_fd = -1;
+    enc.start = MAP_FAILED;
+
+    printf("%-8s %-8s %-10s %10s %10s\n", "memory", "write", "size", "ms", "MB/s");
+
+    for( s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++ ) {
+        in_sz = (size_t)sizes[s][0] * sizes[s][1] * 2;
+        out_sz = (size_t)sizes[s][0] * sizes[s][1] * 3 / 2;
+        in = malloc(in_sz);
+        out = malloc(out_sz);
+        stage = malloc(out_sz);
+        if( !in || !out || !stage ) {
+            err("malloc() failed");
+            goto out;
+        }
+        for( n = 0; n < in_sz; n++ )
+            in[n] = rand();
+
+        conv_layout_packed(&layout, sizes[s][0], sizes[s][1]);
+        for( strategy = 0; strategy < MEM_N; strategy++ ) {
+            t = mem_run(strategy, &layout, in, in_sz, out, out_sz, -1, stage);
+            printf("%-8s %-8s %4ux%-5u %10.3f %10.1f\n", "cached",
+                   mem_strategies[strategy], sizes[s][0], sizes[s][1],
+                   t, out_sz / t / 1e3);
+        }
 
-    struct timeval  tv;
-    gettimeofday(&tv, NULL);
-    double time_begin = ((double)tv.tv_sec) * 1000 +
-                        ((double)tv.tv_usec) / 1000;
+        if( enc_dev[0] ) {
+            if( enc_buffer_open(&enc, enc_dev, sizes[s][0], sizes[s][1]) != 0 )
+                goto out;
 
-    for (iter = 0; iter < in_buff_sz; iter += 4) {
-        out_buff_ptr[Y_offset++] = in_buff_ptr[iter + 0];
-        out_buff_ptr[Y_offset++] = in_buff_ptr[iter + 2];
+            conv_layout_dst(&layout, CONV_FMT_NV12, enc.bpl, enc.luma_sz);
+            free(stage);
+            stage = malloc(enc.length);
+            if( !stage ) {
+                err("malloc() failed");
+                goto out;
+            }
 
-        if( iter % yuyv_line_len == 0)
-            curr_line_n++;
+            for( strategy = 0; strategy < MEM_N; strategy++ ) {
+                t = mem_run(strategy, &layout, in, in_sz, enc.start, enc.length,
+                            enc.dmabuf_fd, stage);
+                if( t < 0 )
+                    goto out;
+                printf("%-8s %-8s %4ux%-5u %10.3f %10.1f\n",
+                       enc.dmabuf_fd >= 0 ? "encoder" : "enc-nosync",
+                       mem_strategies[strategy], sizes[s][0], sizes[s][1],
+                       t, out_sz / t / 1e3);
+            }
 
-        if (curr_line_n % 2 == 1) {
-            out_buff_ptr[CbCr_offset++] = in_buff_ptr[iter + 1];
-            out_buff_ptr[CbCr_offset++] = in_buff_ptr[iter + 3];
+            enc_buffer_close(&enc);
         }
 
+        free(in);
+        free(out);
+        free(stage);
+        in = out = stage = NULL;
     }
-    gettimeofday(&tv, NULL);
-    double time_end = ((double)tv.tv_sec) * 1000 +
-                      ((double)tv.tv_usec) / 1000 ;
-    dbg("Execute time 'yuyv_to_nv12()' = %f(ms)", time_end - time_begin);
+    ret = 0;
 
-    dbg("Total lines in picture = %d", curr_line_n);
-    dbg("Y' plane start pos: 0, end pos: %ld", Y_offset - 1);
-    dbg("CbCr plane start pos: %d, end pos: %ld",
-            width * height, CbCr_offset - 1);
+out:
+    enc_buffer_close(&enc);
+    free(in);
+    free(out);
+    free(stage);
+    conv_pool_stop();
 
-    return 0;
+    return ret;
 }
 
 
+/* Plain C picture of what conv_frame() must write, one byte at a time */
+static uint8_t ref_luma(const struct Conv_layout *l, const uint8_t *in,
+                        unsigned int x, unsigned int y)
+{
+    const uint8_t *line = in + (size_t)l->src_stride * y;
 
-int read_data(struct _instance *i) {
-    uint32_t n_read;
+    if( l->src_fmt == CONV_FMT_YUYV )
+        return line[2 * x];
+    if( l->src_fmt == CONV_FMT_UYVY )
+        return line[2 * x + 1];
 
-    n_read = fread(i->in_buff_ptr, i->in_buff_sz, 1, i->in_file.ptr);
-    if( feof(i->in_file.ptr) != 0 ) {
-        info("Get the End Of File");
-        return 1;
-    }
-    if( n_read != 1 ) {
-        err("fread() = %d. Error read of file", n_read);
-        return -1;
+    return line[x];
+}
+
+
+// Byte 'b' of the NV12 CbCr line 'k', or of the I420 plane 'c'
+static uint8_t ref_chroma(const struct Conv_layout *l, int chroma, const uint8_t *in,
+                          unsigned int b, unsigned int k)
+{
+    const unsigned int pair = b / 2, c = b % 2;
+    const uint8_t *l0, *l1;
+    size_t pos;
+
+    if( l->src_fmt == CONV_FMT_YUYV || l->src_fmt == CONV_FMT_UYVY ) {
+        pos = 4 * pair + (l->src_fmt == CONV_FMT_YUYV ? 1 + 2 * c : 2 * c);
+        l0 = in + (size_t)l->src_stride * 2 * k;
+        l1 = l0 + l->src_stride;
+        if( chroma == CONV_CHROMA_DROP )
+            return l0[pos];
+        return (l0[pos] + l1[pos] + 1) >> 1;
     }
 
-    dbg("Read from file: %ld bytes", i->in_buff_sz);
+    if( l->src_fmt == CONV_FMT_NV12 )
+        return in[l->src_uv_offset + (size_t)l->src_uv_stride * k + b];
 
-    return 0;
+    return in[(c ? l->src_v_offset : l->src_uv_offset) +
+              (size_t)l->src_uv_stride * k + pair];
 }
 
 
-int save_to_file(struct _instance *i) {
-    size_t n_write;
+static void ref_frame(const struct Conv_layout *l, int chroma,
+                      const uint8_t *in, uint8_t *out)
+{
+    unsigned int x, y, k;
+
+    for( y = 0; y < l->height; y++ )
+        for( x = 0; x < l->width; x++ )
+            out[(size_t)l->y_stride * y + x] = ref_luma(l, in, x, y);
+
+    for( k = 0; k < l->height / 2; k++ ) {
+        if( l->dst_fmt == CONV_FMT_I420 ) {
+            for( x = 0; x < l->width / 2; x++ ) {
+                out[l->uv_offset + (size_t)l->uv_stride * k + x] =
+                        ref_chroma(l, chroma, in, 2 * x, k);
+                out[l->v_offset + (size_t)l->uv_stride * k + x] =
+                        ref_chroma(l, chroma, in, 2 * x + 1, k);
+            }
+            continue;
+        }
 
-    if ( ! i->out_file.ptr ) {
-        i->out_file.ptr = fopen(i->out_file.name, "wb");
-        if (!i->out_file.ptr) {
-            err("Can not create file '%s'", i->out_file.name);
-            return -1;
+        for( x = 0; x < l->width; x++ )
+            out[l->uv_offset + (size_t)l->uv_stride * k + x] =
+                    ref_chroma(l, chroma, in, x, k);
+    }
+}
+
+
+#define CONFORM_LINES   6
+#define CONFORM_FILL    0xa5    // padding bytes must keep it
+
+#define CONFORM_SCALE_LINES  24
+
+/* Scaled frames of every source format, from 320 to 1920 wide in steps
+ * of 2: 2x and 4x box, bilinear at odd ratios down and up. Every backend
+ * on the pool threads is compared with the scalar one on a single thread.
+ * Returns the number of conversions, failed ones are added to 'fails' */
+static int conform_scaled(const uint8_t *in, size_t in_sz, int *fails)
+{
+    static const int formats[] = {
+        CONV_FMT_YUYV, CONV_FMT_UYVY, CONV_FMT_I420, CONV_FMT_NV12,
+    };
+    struct {
+        int             mode;
+        unsigned int    num, den;           // width ratio
+        unsigned int    height;
+    } cases[] = {
+        { CONV_SCALE_BOX,      1, 2, CONFORM_SCALE_LINES / 2 },
+        { CONV_SCALE_BOX,      1, 4, CONFORM_SCALE_LINES / 4 },
+        { CONV_SCALE_BILINEAR, 1, 2, CONFORM_SCALE_LINES / 2 },
+        { CONV_SCALE_BILINEAR, 2, 3, 14 },
+        { CONV_SCALE_BILINEAR, 5, 7, 10 },
+        { CONV_SCALE_BILINEAR, 5, 4, 30 },
+    };
+    struct Conv_layout l;
+    uint8_t *out, *ref;
+    size_t out_sz, n;
+    unsigned int width, pad, src_len, dst_w, dst_h;
+    int f, c, isa, chroma, ret;
+    int runs = 0;
+
+    out_sz = (size_t)(1920 * 5 / 4 + 64) * 30 * 2;
+    out = malloc(out_sz);
+    ref = malloc(out_sz);
+    if( !out || !ref ) {
+        err("malloc() failed");
+        free(out);
+        free(ref);
+        (*fails)++;
+        return 0;
+    }
+
+    for( width = 320; width <= 1920; width += 2 ) {
+        pad = (width / 2 % 4) * 8;
+
+        for( c = 0; c < (int)(sizeof(cases) / sizeof(cases[0])); c++ ) {
+            dst_w = width * cases[c].num / cases[c].den & ~1u;
+            dst_h = cases[c].height;
+            if( cases[c].mode == CONV_SCALE_BOX && dst_w * cases[c].den != width )
+                continue;
+
+            for( f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); f++ ) {
+                src_len = formats[f] == CONV_FMT_YUYV || formats[f] == CONV_FMT_UYVY ?
+                          width * 2 : width;
+
+                conv_layout_packed(&l, width, CONFORM_SCALE_LINES);
+                conv_layout_src(&l, formats[f], src_len + pad,
+                                (size_t)(src_len + pad) * CONFORM_SCALE_LINES);
+                conv_layout_dst(&l, CONV_FMT_NV12, dst_w + 2 * pad,
+                                (size_t)(dst_w + 2 * pad) * dst_h);
+                if( conv_layout_scale(&l, dst_w, dst_h, cases[c].mode) != 0 ) {
+                    (*fails)++;
+                    continue;
+                }
+
+                for( chroma = CONV_CHROMA_AVG; chroma <= CONV_CHROMA_DROP; chroma++ ) {
+                    memset(ref, CONFORM_FILL, out_sz);
+                    if( conv_frame(CONV_ISA_SCALAR, chroma, &l, in, in_sz,
+                                   ref, out_sz) != 0 ) {
+                        (*fails)++;
+                        continue;
+                    }
+
+                    for( isa = 0; isa < CONV_ISA_N; isa++ ) {
+                        if( !conv_isa_supported(isa) )
+                            continue;
+
+                        memset(out, CONFORM_FILL, out_sz);
+                        ret = conv_frame_mt(isa, chroma, &l, in, in_sz, out, out_sz);
+                        runs++;
+                        if( ret != 0 || memcmp(out, ref, out_sz) != 0 ) {
+                            for( n = 0; n < out_sz && out[n] == ref[n]; n++ )
+                                ;
+                            err("%s %s %ux%u to %s %ux%u, chroma %d: byte %zu differs",
+                                conv_isa_name(isa), conv_fmt_name(formats[f]),
+                                width, CONFORM_SCALE_LINES,
+                                conv_scale_name(cases[c].mode), dst_w, dst_h,
+                                chroma, n);
+                            (*fails)++;
+                        }
+                    }
+                }
+            }
         }
     }
 
+    free(out);
+    free(ref);
+    return runs;
+}
 
-    n_write = fwrite(i->out_buff_ptr, i->out_buff_sz, 1, i->out_file.ptr);
-    if (n_write != 1) {
-        err("Can not save data in file %s", i->out_file.name);
+
+/* Every backend, source format and width from 320 to 1920 in steps of 2
+ * against ref_frame(), then the scaled ones. Strides are padded by
+ * different amounts, so the tails of the lines and the bytes after them
+ * are checked too */
+int conform(int threads)
+{
+    static const int routes[][2] = {
+        { CONV_FMT_YUYV, CONV_FMT_NV12 }, { CONV_FMT_UYVY, CONV_FMT_NV12 },
+        { CONV_FMT_I420, CONV_FMT_NV12 }, { CONV_FMT_NV12, CONV_FMT_NV12 },
+        { CONV_FMT_I420, CONV_FMT_I420 },
+    };
+    struct Conv_layout l;
+    uint8_t *in, *out, *ref;
+    size_t in_sz, out_sz, n;
+    unsigned int width, pad, src_len;
+    int r, isa, chroma, ret;
+    int runs = 0, fails = 0;
+
+    in_sz = (size_t)(1920 * 2 + 64) * CONFORM_SCALE_LINES * 2;
+    out_sz = (size_t)(1920 + 64) * CONFORM_LINES * 2;
+    in = malloc(in_sz);
+    out = malloc(out_sz);
+    ref = malloc(out_sz);
+    if( !in || !out || !ref ) {
+        err("malloc() failed");
+        free(in);
+        free(out);
+        free(ref);
         return -1;
     }
-    dbg("Write to file: %ld bytes", i->out_buff_sz);
+    for( n = 0; n < in_sz; n++ )
+        in[n] = rand();
+
+    if( conv_pool_start(threads) != 0 )
+        goto out;
+
+    for( width = 320; width <= 1920; width += 2 ) {
+        pad = (width / 2 % 4) * 8;
+
+        for( r = 0; r < (int)(sizeof(routes) / sizeof(routes[0])); r++ ) {
+            src_len = routes[r][0] == CONV_FMT_YUYV || routes[r][0] == CONV_FMT_UYVY ?
+                      width * 2 : width;
+
+            conv_layout_packed(&l, width, CONFORM_LINES);
+            conv_layout_src(&l, routes[r][0], src_len + pad,
+                            (size_t)(src_len + pad) * CONFORM_LINES);
+            conv_layout_dst(&l, routes[r][1], width + 2 * pad,
+                            (size_t)(width + 2 * pad) * CONFORM_LINES);
+            // Every other width goes through the cache-line staging
+            l.write_mode = width / 2 % 2 ? CONV_WRITE_STAGED : CONV_WRITE_DIRECT;
+
+            for( isa = 0; isa < CONV_ISA_N; isa++ ) {
+                if( !conv_isa_supported(isa) )
+                    continue;
+
+                for( chroma = CONV_CHROMA_AVG; chroma <= CONV_CHROMA_DROP; chroma++ ) {
+                    memset(out, CONFORM_FILL, out_sz);
+                    memset(ref, CONFORM_FILL, out_sz);
+                    ref_frame(&l, chroma, in, ref);
+
+                    ret = conv_frame_mt(isa, chroma, &l, in, in_sz, out, out_sz);
+                    runs++;
+                    if( ret != 0 || memcmp(out, ref, out_sz) != 0 ) {
+                        for( n = 0; n < out_sz && out[n] == ref[n]; n++ )
+                            ;
+                        err("%s %s to %s, width %u, chroma %d: byte %zu differs",
+                            conv_isa_name(isa), conv_fmt_name(routes[r][0]),
+                            conv_fmt_name(routes[r][1]), width, chroma, n);
+                        fails++;
+                    }
+                }
+            }
+        }
+    }
 
-    return 0;
+    runs += conform_scaled(in, in_sz, &fails);
+
+    info("Conformance: %d conversions on %d thread(s), %d failed",
+         runs, conv_pool_threads(), fails);
+
+out:
+    conv_pool_stop();
+    free(in);
+    free(out);
+    free(ref);
+
+    return fails || !runs ? -1 : 0;
 }
 
 
 int main_loop(struct _instance *inst)
 {
+    struct Conv_layout layout;
+    struct timeval  tv;
+    double time_begin, time_end;
     int iter;
     int ret;
 
+    conv_layout_packed(&layout, inst->width, inst->height);
+    if( inst->src_fmt == CONV_FMT_UYVY )
+        conv_layout_src(&layout, inst->src_fmt, inst->width * 2, 0);
+    else if( inst->src_fmt != CONV_FMT_YUYV )
+        conv_layout_src(&layout, inst->src_fmt, inst->width,
+                        (size_t)inst->width * inst->height);
+    conv_layout_dst(&layout, CONV_FMT_NV12, inst->out_width,
+                    (size_t)inst->out_width * inst->out_height);
+    if( conv_layout_scale(&layout, inst->out_width, inst->out_height, inst->scale) )
+        return -1;
+
     for(iter = 0; iter < 1000; iter++) {
         ret = read_data(inst);
         if( ret == -1 ) return -1;  // -1 Common error of file reading
         if( ret ==  1 ) return  0;  //  1 Get End of File
 
-        ret = yuyv_to_nv12_neon(inst->in_buff_ptr, inst->in_buff_sz,
-                inst->out_buff_ptr,  inst->out_buff_sz,
-                inst->width, inst->height);
+        gettimeofday(&tv, NULL);
+        time_begin = ((double)tv.tv_sec) * 1000 + ((double)tv.tv_usec) / 1000;
+
+        ret = conv_frame_mt(conv_isa(), inst->chroma, &layout,
+                inst->in_buff_ptr, inst->in_buff_sz,
+                inst->out_buff_ptr,  inst->out_buff_sz);
         if( ret != 0 ) return -1;
 
+        gettimeofday(&tv, NULL);
+        time_end = ((double)tv.tv_sec) * 1000 + ((double)tv.tv_usec) / 1000;
+        dbg("Execute time 'conv_frame_mt()' = %f(ms)", time_end - time_begin);
+
         ret = save_to_file(inst);
         if( ret != 0 ) return -1;
     }
@@ -412,6 +999,116 @@ int main_loop(struct _instance *inst)
 }
 
 
+/* A recorded MJPEG stream is just JPEG pictures one after another,
+ * every one from SOI (ff d8) to EOI (ff d9) */
+static size_t next_jpeg(const uint8_t *p, size_t sz, size_t pos, size_t *len)
+{
+    size_t n, start;
+
+    for( n = pos; n + 1 < sz; n++ )
+        if( p[n] == 0xff && p[n + 1] == 0xd8 )
+            break;
+    if( n + 1 >= sz )
+        return sz;
+
+    start = n;
+    for( n = start + 2; n + 1 < sz; n++ )
+        if( p[n] == 0xff && p[n + 1] == 0xd9 ) {
+            *len = n + 2 - start;
+            return start;
+        }
+
+    return sz;
+}
+
+
+int mjpeg_loop(struct _instance *inst)
+{
+    struct Mjpeg_inst mjpeg;
+    struct Conv_layout layout;
+    struct timeval  tv;
+    double time_begin, time_end, time_sum = 0;
+    uint8_t *stream;
+    size_t sz, pos, len;
+    long file_sz;
+    int frames = 0;
+    int ret;
+
+    fseek(inst->in_file.ptr, 0, SEEK_END);
+    file_sz = ftell(inst->in_file.ptr);
+    rewind(inst->in_file.ptr);
+    if( file_sz <= 0 ) {
+        err("Empty MJPEG file '%s'", inst->in_file.name);
+        return -1;
+    }
+    sz = file_sz;
+
+    stream = malloc(sz);
+    if( !stream ) {
+        perror("malloc()");
+        return -1;
+    }
+    if( fread(stream, sz, 1, inst->in_file.ptr) != 1 ) {
+        err("Error read of file '%s'", inst->in_file.name);
+        free(stream);
+        return -1;
+    }
+
+    memzero(mjpeg);
+    mjpeg.efd = -1;
+    strcpy(mjpeg.dec_name, inst->mjpeg_dec);
+    conv_layout_packed(&layout, inst->width, inst->height);
+    conv_layout_dst(&layout, CONV_FMT_NV12, inst->out_width,
+                    (size_t)inst->out_width * inst->out_height);
+    ret = conv_layout_scale(&layout, inst->out_width, inst->out_height, inst->scale);
+    if( ret == 0 )
+        ret = mjpeg_open(&mjpeg, &layout);
+    if( ret != 0 )
+        goto out;
+
+    for( pos = 0; ; pos += len ) {
+        if( inst->n_frames_to_convert && frames == inst->n_frames_to_convert )
+            break;
+        pos = next_jpeg(stream, sz, pos, &len);
+        if( pos == sz )
+            break;
+
+        gettimeofday(&tv, NULL);
+        time_begin = ((double)tv.tv_sec) * 1000 + ((double)tv.tv_usec) / 1000;
+
+        ret = mjpeg_decode(&mjpeg, stream + pos, len,
+                           inst->out_buff_ptr, inst->out_buff_sz);
+
+        gettimeofday(&tv, NULL);
+        time_end = ((double)tv.tv_sec) * 1000 + ((double)tv.tv_usec) / 1000;
+
+        if( ret == MJPEG_DEC_FAILED ) {
+            err("Decoder '%s' is out of order", mjpeg.dec_name);
+            break;
+        }
+        if( ret != 0 ) {
+            err("Frame %d (%zu bytes) is broken", frames, len);
+            continue;
+        }
+        dbg("Execute time 'mjpeg_decode()' = %f(ms), %zu bytes", time_end - time_begin, len);
+        time_sum += time_end - time_begin;
+        frames++;
+
+        ret = save_to_file(inst);
+        if( ret != 0 )
+            goto out;
+    }
+
+    if( frames )
+        info("MJPEG frames: %d, average decode time %.3f(ms)", frames, time_sum / frames);
+    ret = frames ? 0 : -1;
+out:
+    mjpeg_close(&mjpeg);
+    free(stream);
+    return ret;
+}
+
+
 int main(int argc, char **argv)
 {
     struct _instance  inst;
@@ -428,12 +1125,35 @@ int main(int argc, char **argv)
 		print_usage(argv[0]);
 		return -1;
 	}
+    if( inst.bench ) {
+        if( inst.threads == 0 )
+            inst.threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if( inst.threads > CONV_THREADS_MAX )
+            inst.threads = CONV_THREADS_MAX;
+        return bench(inst.threads) ? -1 : 0;
+    }
+    if( inst.conform )
+        return conform(inst.threads) ? -1 : 0;
+    if( inst.mem_bench ) {
+        if( conv_init(inst.isa) != 0 )
+            return -1;
+        return mem_bench(inst.enc_dev, inst.threads) ? -1 : 0;
+    }
+
 	info("input file: %s, %dx%d, frames: %s",
          inst.in_file.name,
          inst.width, inst.height,
          inst.n_frames_to_convert == 0 ? "All" : inst.n_frames_to_conv_str );
     info("out_file.name = %s", inst.out_file.name);
 
+    ret = conv_init(inst.isa);
+    if( ret )
+        goto err;
+
+    ret = conv_pool_start(inst.threads);
+    if( ret )
+        goto err;
+
     ret = open_in_file(&inst);
     if( ret )
         goto err;
@@ -443,7 +1163,7 @@ int main(int argc, char **argv)
         goto err;
 
 
-    ret = main_loop(&inst);
+    ret = inst.mjpeg ? mjpeg_loop(&inst) : main_loop(&inst);
     if( ret )
         goto err;
 
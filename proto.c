@@ -2,20 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <endian.h>
 #include <arpa/inet.h>
+#include <linux/videodev2.h>
 
 #include "common.h"
 #include "log.h"
 #include "server.h"
 #include "webcam.h"
+#include "frame.h"
 #include "proto.h"
 
 
-int get_peer_msg(struct Srv_inst* i, struct Proto_inst* p)
+int get_peer_msg(int fd, struct Proto_inst* p)
 {
     int ret;
 
-    ret = srv_get_data_1(i, p->hdr, PROTO_HEADER_SZ);
+    ret = srv_get_data_1(fd, p->hdr, PROTO_HEADER_SZ);
     if (ret)
         return -1;
 
@@ -25,8 +28,22 @@ int get_peer_msg(struct Srv_inst* i, struct Proto_inst* p)
     if( p->cmd == PROTO_CMD_DATA ) {
         p->data_len= ntohl(*(uint32_t*)(p->hdr + 2));
 
+        if( p->version >= PROTO_VERSION_2 ) {
+            uint8_t *ext = (uint8_t *)p->hdr + PROTO_HEADER_SZ;
+
+            ret = srv_get_data_1(fd, ext, PROTO_FRAME_HDR_SZ - PROTO_HEADER_SZ);
+            if (ret)
+                return -1;
+
+            p->seq = ntohl(*(uint32_t *)ext);
+            p->ts_capture = be64toh(*(uint64_t *)(ext + 4));
+            p->ts_encoded = be64toh(*(uint64_t *)(ext + 12));
+            p->frame_type = ext[20];
+            p->frame_flags = ext[21];
+        }
+
         if( p->data_len > 0 ) {
-            ret = srv_get_data_1(i, p->data, p->data_len);
+            ret = srv_get_data_1(fd, p->data, p->data_len);
             if (ret)
                 return -1;
         }
@@ -34,7 +51,7 @@ int get_peer_msg(struct Srv_inst* i, struct Proto_inst* p)
         p->msg_len = ntohl(*(uint32_t *) (p->hdr + 2));
 
         if (p->msg_len > 0) {
-            ret = srv_get_data_1(i, p->msg, p->msg_len);
+            ret = srv_get_data_1(fd, p->msg, p->msg_len);
             if (ret)
                 return -1;
         }
@@ -71,41 +88,37 @@ static int get_h264_data(struct Srv_inst* i, struct Proto_inst* p) {
 }
 */
 
-int send_peer_msg(struct Srv_inst* i, struct Proto_inst* p) {
-    int ret;
+int send_peer_msg(int fd, struct Proto_inst* p) {
+    struct iovec iov[2];
+    int iov_n = 1;
 
     p->hdr[0] = p->cmd;
     p->hdr[1] = p->status;
 
-    // Send message if BINARY data present
+    iov[0].iov_base = p->hdr;
+    iov[0].iov_len = PROTO_HEADER_SZ;
+
+    // Header and BINARY or TEXT data go out with one syscall
     if( p->cmd == PROTO_CMD_DATA ) {
         *(uint32_t *)(p->hdr + 2) = htonl(p->data_len);
 
-        ret = srv_send_data(i, p->hdr, PROTO_HEADER_SZ);
-        if (ret)
-            return -1;
-
         if( p->data_len > 0 ) {
-            ret = srv_send_data(i, p->data, p->data_len);
-            if (ret)
-                return -1;
+            iov[1].iov_base = p->data;
+            iov[1].iov_len = p->data_len;
+            iov_n = 2;
         }
 
-    } else {    // Send message if TEXT data present
+    } else {
         *(uint32_t *)(p->hdr + 2) = htonl(p->msg_len);
 
-        ret = srv_send_data(i, p->hdr, PROTO_HEADER_SZ);
-        if (ret)
-            return -1;
-
         if( p->msg_len > 0 ) {
-            ret = srv_send_data(i, p->msg, p->msg_len);
-            if (ret)
-                return -1;
+            iov[1].iov_base = p->msg;
+            iov[1].iov_len = p->msg_len;
+            iov_n = 2;
         }
     }
 
-    return 0;
+    return srv_send_iov(fd, iov, iov_n);
 }
 
 
@@ -126,6 +139,8 @@ void print_peer_msg(char *label, struct Proto_inst* p){
         strcpy(cmd, "START");
     else if( p->cmd == PROTO_CMD_STOP )
         strcpy(cmd, "STOP");
+    else if( p->cmd == PROTO_CMD_CONNECT )
+        strcpy(cmd, "CONNECT");
     else
         strcpy(cmd, "Unknown Command");
 
@@ -144,7 +159,11 @@ void print_peer_msg(char *label, struct Proto_inst* p){
         strcpy(status, "Unknown Status");
 
 
-    if( p->cmd == PROTO_CMD_DATA ) {
+    if( p->cmd == PROTO_CMD_DATA && p->version >= PROTO_VERSION_2 ) {
+        log_debug("%s Cmd = %s, Status = %s, DataLen = %d, seq = %u, type = %d, "
+                "flags = 0x%02x", label, cmd, status, p->data_len, p->seq,
+                p->frame_type, p->frame_flags);
+    } else if( p->cmd == PROTO_CMD_DATA ) {
         log_debug("%s Cmd = %s, Status = %s, DataLen = %d, data = 'binary data'",
                 label, cmd, status, p->data_len);
     } else
@@ -155,125 +174,240 @@ void print_peer_msg(char *label, struct Proto_inst* p){
 
 
 
-int proto_handshake(struct Srv_inst* si, struct Proto_inst* pi,
-                    struct Webcam_inst* wi)
+/* Parse one message from the peer's receive buffer.
+ * Returns number of consumed bytes, 0 if the message is not complete yet
+ * or -1 if the message is malformed */
+int proto_parse_msg(const uint8_t *buff, size_t len, struct Proto_inst* p)
 {
-    int ret;
-
-    // Handler 'HELLO' msg
-    memset(pi, 0, sizeof(struct Proto_inst));
-    ret = get_peer_msg(si, pi);
-    if (ret)
-        return -1;
-
-    if( pi->cmd == PROTO_CMD_HELLO ) {
-        print_peer_msg("Peer <---", pi);
+    uint32_t msg_len;
 
-        memset(pi, 0, sizeof(struct Proto_inst));
-        pi->cmd = PROTO_CMD_HELLO;
-        pi->status = PROTO_STS_OK;
-        strcpy(pi->msg, "Hi, client -)");
-        pi->msg_len = strlen(pi->msg);
-        print_peer_msg("     --->", pi);
+    if( len < PROTO_HEADER_SZ )
+        return 0;
 
-        ret = send_peer_msg(si, pi);
-        if (ret)
-            return -1;
+    memset(p, 0, sizeof(struct Proto_inst));
+    p->cmd = buff[0];
+    p->status = buff[1];
+    msg_len = ntohl(*(uint32_t*)(buff + 2));
 
-    } else {
-        print_peer_msg("!!!!!", pi);
+    // Clients never send binary data to the server
+    if( p->cmd == PROTO_CMD_DATA || msg_len >= PROTO_MSG_SZ ) {
+        log_warn("Malformed message: cmd = %d, len = %u", p->cmd, msg_len);
         return -1;
     }
 
-    // Handler 'GET_PARAM' msg
-    memset(pi, 0, sizeof(struct Proto_inst));
-    ret = get_peer_msg(si, pi);
-    if (ret)
-        return -1;
+    if( len < PROTO_HEADER_SZ + msg_len )
+        return 0;
 
-    if( pi->cmd == PROTO_CMD_GET_PARAM ) {
-        print_peer_msg("Peer <---", pi);
+    memcpy(p->msg, buff + PROTO_HEADER_SZ, msg_len);
+    p->msg_len = msg_len;
 
-        memset(pi, 0, sizeof(struct Proto_inst));
-        pi->cmd = PROTO_CMD_GET_PARAM;
-        pi->status = PROTO_STS_OK;
-        strcpy(pi->msg, "-w XXX -h YYY -r ZZ");
-        pi->msg_len = strlen(pi->msg);
-        print_peer_msg("     --->", pi);
+    return PROTO_HEADER_SZ + msg_len;
+}
 
-        ret = send_peer_msg(si, pi);
-        if (ret)
-            return -1;
 
-    } else {
-        print_peer_msg("!!!!!", pi);
-        return -1;
-    }
+/* Queue a message to the peer without blocking */
+int proto_send_msg(struct Srv_inst* s, struct Srv_peer* peer,
+                   struct Proto_inst* p)
+{
+    struct Frame *frm = NULL;
+    int ret;
 
+    p->hdr[0] = p->cmd;
+    p->hdr[1] = p->status;
+    *(uint32_t *)(p->hdr + 2) = htonl(p->msg_len);
 
-    // Handler 'SET_PARAM' msg
-    memset(pi, 0, sizeof(struct Proto_inst));
-    ret = get_peer_msg(si, pi);
-    if (ret)
-        return -1;
+    if( p->msg_len > 0 ) {
+        frm = frame_new_copy(p->msg, p->msg_len, 0);
+        if( !frm )
+            return -1;
+    }
 
-    if( pi->cmd == PROTO_CMD_SET_PARAM ) {
-        print_peer_msg("Peer <---", pi);
+    ret = srv_peer_push(s, peer, (uint8_t *)p->hdr, PROTO_HEADER_SZ, frm);
+    if( frm )
+        frame_put(frm);
 
-        if( pi->msg_len > 0 ) {
+    return ret;
+}
 
-            int offset = sizeof(uint32_t);
-            wi->width = ntohl( *(uint32_t*)(pi->msg + offset) );
 
-            offset += sizeof(uint32_t);
-            wi->height = ntohl( *(uint32_t*)(pi->msg + offset) );
+/* Queue an encoded frame to the peer without blocking */
+int proto_send_frame(struct Srv_inst* s, struct Srv_peer* peer,
+                     struct Frame* frm)
+{
+    uint8_t hdr[PROTO_FRAME_HDR_SZ];
+    uint8_t type = PROTO_FRM_UNKNOWN;
+
+    hdr[0] = PROTO_CMD_DATA;
+    hdr[1] = PROTO_STS_OK;
+    *(uint32_t *)(hdr + 2) = htonl(frm->len);
+
+    if( peer->version < PROTO_VERSION_2 )
+        return srv_peer_push_frame(s, peer, hdr, PROTO_HEADER_SZ, frm);
+
+    if( frm->flags & V4L2_BUF_FLAG_KEYFRAME )
+        type = PROTO_FRM_I;
+    else if( frm->flags & V4L2_BUF_FLAG_PFRAME )
+        type = PROTO_FRM_P;
+    else if( frm->flags & V4L2_BUF_FLAG_BFRAME )
+        type = PROTO_FRM_B;
+
+    *(uint32_t *)(hdr + 6) = htonl(frm->seq);
+    *(uint64_t *)(hdr + 10) = htobe64(frm->ts_us);
+    *(uint64_t *)(hdr + 18) = htobe64(frm->enc_us);
+    hdr[26] = type;
+    hdr[27] = peer->drop_gop ? PROTO_FRM_FLAG_RESYNC : 0;
+    hdr[28] = 0;
+    hdr[29] = 0;
+
+    return srv_peer_push_frame(s, peer, hdr, PROTO_FRAME_HDR_SZ, frm);
+}
 
-            offset += sizeof(uint32_t);
-            wi->frame_rate = ntohl( *(uint32_t*)(pi->msg + offset) );
 
-            log_debug("Peer <--- msg = '-w=%d,  -h=%d,  -f=%d'",
-                 wi->width, wi->height, wi->frame_rate);
-        }
+/* HELLO message of a v2 peer, see PROTO_MAGIC */
+void proto_hello_v2(struct Proto_inst* p, int version)
+{
+    p->cmd = PROTO_CMD_HELLO;
+    *(uint32_t *)(p->msg) = htonl(PROTO_MAGIC);
+    *(uint32_t *)(p->msg + 4) = htonl(version);
+    p->msg_len = 2 * sizeof(uint32_t);
+}
 
-        memset(pi, 0, sizeof(struct Proto_inst));
-        pi->cmd = PROTO_CMD_SET_PARAM;
-        pi->status = PROTO_STS_OK;
-        print_peer_msg("     --->", pi);
 
-        ret = send_peer_msg(si, pi);
-        if (ret)
-            return -1;
+/* CONNECT message of a v2 peer */
+void proto_connect(struct Proto_inst* p, int version,
+                   int width, int height, int frame_rate)
+{
+    proto_hello_v2(p, version);
+    p->cmd = PROTO_CMD_CONNECT;
+    *(uint32_t *)(p->msg + 8) = htonl(width);
+    *(uint32_t *)(p->msg + 12) = htonl(height);
+    *(uint32_t *)(p->msg + 16) = htonl(frame_rate);
+    p->msg_len = PROTO_CONNECT_SZ;
+}
 
-    } else {
-        print_peer_msg("!!!!!", pi);
-        return -1;
-    }
 
-    // Handler 'START' msg
-    memset(pi, 0, sizeof(struct Proto_inst));
-    ret = get_peer_msg(si, pi);
-    if (ret)
-        return -1;
+/* Protocol version asked for by a HELLO message, v1 for a text one */
+int proto_hello_version(struct Proto_inst* p)
+{
+    int version;
 
-    if( pi->cmd == PROTO_CMD_START ) {
-        print_peer_msg("Peer <---", pi);
+    if( p->msg_len < 2 * sizeof(uint32_t) ||
+        ntohl(*(uint32_t *)(p->msg)) != PROTO_MAGIC )
+        return PROTO_VERSION_1;
 
-        // Do something here to start Webcam capture!!!
+    version = ntohl(*(uint32_t *)(p->msg + 4));
+    if( version < PROTO_VERSION_1 )
+        return PROTO_VERSION_1;
 
-        memset(pi, 0, sizeof(struct Proto_inst));
-        pi->cmd = PROTO_CMD_START;
-        pi->status = PROTO_STS_OK;
-        print_peer_msg("     --->", pi);
+    return version < PROTO_VERSION ? version : PROTO_VERSION;
+}
 
-        ret = send_peer_msg(si, pi);
-        if (ret)
-            return -1;
 
-    } else {
-        print_peer_msg("!!!!!", pi);
-        return -1;
+/* Handshake state machine, one call per message from the peer:
+ *   HELLO -> GET_PARAM -> SET_PARAM -> START -> streaming
+ * or for a v2 peer in one round trip:
+ *   CONNECT -> streaming
+ * Returns 0 if 'out' holds the answer, 1 if the peer asked to stop
+ * and -1 on unexpected message */
+int proto_peer_msg(struct Srv_peer* peer, struct Proto_inst* in,
+                   struct Proto_inst* out)
+{
+    memset(out, 0, sizeof(struct Proto_inst));
+
+    if( in->cmd == PROTO_CMD_STOP )
+        return 1;
+
+    switch( peer->state ) {
+        case PEER_HELLO:
+            if( in->cmd == PROTO_CMD_CONNECT ) {
+                peer->version = proto_hello_version(in);
+                if( peer->version < PROTO_VERSION_2 ||
+                    in->msg_len < PROTO_CONNECT_SZ )
+                    break;
+
+                peer->width = ntohl( *(uint32_t*)(in->msg + 8) );
+                peer->height = ntohl( *(uint32_t*)(in->msg + 12) );
+                peer->frame_rate = ntohl( *(uint32_t*)(in->msg + 16) );
+                log_debug("Peer <--- connect v%d '-w=%d,  -h=%d,  -f=%d'",
+                     peer->version, peer->width, peer->height, peer->frame_rate);
+
+                proto_hello_v2(out, peer->version);
+                out->cmd = PROTO_CMD_CONNECT;
+                out->status = PROTO_STS_OK;
+
+                peer->state = PEER_STREAMING;
+                return 0;
+            }
+
+            if( in->cmd != PROTO_CMD_HELLO )
+                break;
+
+            // A v2 client gets the agreed version, an old one the
+            // usual greeting
+            peer->version = proto_hello_version(in);
+            if( peer->version >= PROTO_VERSION_2 ) {
+                proto_hello_v2(out, peer->version);
+            } else {
+                out->cmd = PROTO_CMD_HELLO;
+                strcpy(out->msg, "Hi, client -)");
+                out->msg_len = strlen(out->msg);
+            }
+            out->status = PROTO_STS_OK;
+            log_debug("Peer [fd=%d] speaks protocol v%d", peer->fd, peer->version);
+
+            peer->state = PEER_GET_PARAM;
+            return 0;
+
+        case PEER_GET_PARAM:
+            if( in->cmd != PROTO_CMD_GET_PARAM )
+                break;
+
+            out->cmd = PROTO_CMD_GET_PARAM;
+            out->status = PROTO_STS_OK;
+            strcpy(out->msg, "-w XXX -h YYY -r ZZ");
+            out->msg_len = strlen(out->msg);
+
+            peer->state = PEER_SET_PARAM;
+            return 0;
+
+        case PEER_SET_PARAM:
+            if( in->cmd != PROTO_CMD_SET_PARAM )
+                break;
+
+            if( in->msg_len >= 4 * sizeof(uint32_t) ) {
+                int offset = sizeof(uint32_t);
+                peer->width = ntohl( *(uint32_t*)(in->msg + offset) );
+
+                offset += sizeof(uint32_t);
+                peer->height = ntohl( *(uint32_t*)(in->msg + offset) );
+
+                offset += sizeof(uint32_t);
+                peer->frame_rate = ntohl( *(uint32_t*)(in->msg + offset) );
+
+                log_debug("Peer <--- msg = '-w=%d,  -h=%d,  -f=%d'",
+                     peer->width, peer->height, peer->frame_rate);
+            }
+
+            out->cmd = PROTO_CMD_SET_PARAM;
+            out->status = PROTO_STS_OK;
+
+            peer->state = PEER_START;
+            return 0;
+
+        case PEER_START:
+            if( in->cmd != PROTO_CMD_START )
+                break;
+
+            out->cmd = PROTO_CMD_START;
+            out->status = PROTO_STS_OK;
+
+            peer->state = PEER_STREAMING;
+            return 0;
+
+        default:
+            break;
     }
 
-
-    return 0;
-}
\ No newline at end of file
+    print_peer_msg("!!!!!", in);
+    return -1;
+}
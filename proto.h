@@ -4,9 +4,48 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "server.h"
+#include "frame.h"
+
 #define PROTO_HEADER_SZ 6
 #define PROTO_MSG_SZ 1024
 
+/* Protocol versions. v1 is the original one. v2 adds per-frame metadata
+ * to DATA messages, see PROTO_FRAME_HDR_SZ. A v2 client says so in its
+ * HELLO message: PROTO_MAGIC and the version, both uint32 in network
+ * order. The server answers with the version it is going to use. Old
+ * clients send text in HELLO and keep getting v1 */
+#define PROTO_VERSION_1  1
+#define PROTO_VERSION_2  2
+#define PROTO_VERSION    PROTO_VERSION_2
+#define PROTO_MAGIC      0x57323634     // "W264"
+
+/* v2 DATA header, all fields in network order:
+ *   cmd, status, uint32 length of h264 data   (same as v1)
+ *   uint32 sequence number of the encoded frame
+ *   uint64 capture time, us
+ *   uint64 time the encoder finished the frame, us
+ *   uint8  frame type, PROTO_FRM_*
+ *   uint8  flags, PROTO_FRM_FLAG_*
+ *   uint16 reserved
+ * Both times are server CLOCK_MONOTONIC */
+#define PROTO_FRAME_HDR_SZ  (PROTO_HEADER_SZ + 24)
+
+#define PROTO_FRM_UNKNOWN   0
+#define PROTO_FRM_I         1
+#define PROTO_FRM_P         2
+#define PROTO_FRM_B         3
+
+/* v2 CONNECT message replaces the whole v1 handshake:
+ *   uint32 PROTO_MAGIC, uint32 version, uint32 width, height, frame rate
+ * The answer is CONNECT with PROTO_MAGIC and the agreed version, then
+ * DATA messages follow */
+#define PROTO_CONNECT_SZ    (5 * sizeof(uint32_t))
+
+// Frames before this one were dropped for the peer (a gap in sequence
+// numbers tells the same)
+#define PROTO_FRM_FLAG_RESYNC   0x01
+
 
 // Client-Server protocol commands
 #define PROTO_CMD_DATA       0
@@ -15,6 +54,7 @@
 #define PROTO_CMD_GET_PARAM  3
 #define PROTO_CMD_START      4
 #define PROTO_CMD_STOP       5
+#define PROTO_CMD_CONNECT    6      // v2: HELLO + SET_PARAM + START at once
 
 // Protocol command's status
 #define PROTO_STS_NONE   0
@@ -26,9 +66,17 @@
 
 
 struct Proto_inst {
-    char        hdr[PROTO_HEADER_SZ];
+    char        hdr[PROTO_FRAME_HDR_SZ];
     uint8_t     cmd;
     uint8_t     status;
+    int         version;        // PROTO_VERSION_*, set by the client side
+
+    // v2 frame metadata of a DATA message
+    uint32_t    seq;
+    uint64_t    ts_capture;
+    uint64_t    ts_encoded;
+    uint8_t     frame_type;
+    uint8_t     frame_flags;
 
     char        msg[PROTO_MSG_SZ];
     uint32_t    msg_len;
@@ -38,12 +86,23 @@ struct Proto_inst {
 };
 
 
-int get_peer_msg(struct Srv_inst* i, struct Proto_inst* p);
-int send_peer_msg(struct Srv_inst* i, struct Proto_inst* p);
+int get_peer_msg(int fd, struct Proto_inst* p);
+int send_peer_msg(int fd, struct Proto_inst* p);
 //int get_h264_data(struct Srv_inst* i, struct Proto_inst* p);
 
-int proto_handshake(struct Srv_inst* s, struct Proto_inst* p,
-                    struct Webcam_inst* w);
+int proto_parse_msg(const uint8_t *buff, size_t len, struct Proto_inst* p);
+int proto_peer_msg(struct Srv_peer* peer, struct Proto_inst* in,
+                   struct Proto_inst* out);
+
+int proto_send_msg(struct Srv_inst* s, struct Srv_peer* peer,
+                   struct Proto_inst* p);
+int proto_send_frame(struct Srv_inst* s, struct Srv_peer* peer,
+                     struct Frame* frm);
+
+void proto_hello_v2(struct Proto_inst* p, int version);
+void proto_connect(struct Proto_inst* p, int version,
+                   int width, int height, int frame_rate);
+int proto_hello_version(struct Proto_inst* p);
 
 void print_peer_msg(char *label, struct Proto_inst* p);
 
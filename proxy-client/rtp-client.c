@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../common.h"
+#include "../rtp.h"
+#include "../log.h"
+
+/* Loopback receiver for the RTP output of webcam_x264:
+ *   webcam_x264 --rtp 127.0.0.1:5004 ...
+ *   rtp-client -p 5004 > out.h264
+ * Depacketizes Single NAL unit and FU-A packets back to Annex-B on stdout
+ * and reports lost packets and frame delivery times */
+
+#define RX_BATCH        64
+#define RX_PKT_SZ       2048
+#define AU_BUFF_SZ      (2 * 1024 * 1024)
+
+#define NAL_TYPE_FU_A   28
+
+struct Rx_inst {
+    int         port;
+    int         fd;
+
+    int         have_seq;
+    uint16_t    seq;
+    uint32_t    ts;
+
+    uint8_t     au[AU_BUFF_SZ];
+    size_t      au_len;
+    int         au_broken;      // a packet of the access unit is lost
+
+    uint32_t    packets;
+    uint32_t    lost;
+    uint32_t    frames;
+    uint32_t    broken;
+};
+
+
+static const uint8_t start_code[4] = { 0, 0, 0, 1 };
+
+
+void usage(char **argv) {
+    fprintf(stderr, "Version %s \n", VERSION);
+    fprintf(stderr, "Usage: %s -p port [-D debug level] > out.h264\n", argv[0]);
+
+    fprintf(stderr,"Options: \n");
+    fprintf(stderr, "\t-p     UDP port to receive RTP on \n");
+    fprintf(stderr, "\t-D     Debug level [0..6] \n");
+}
+
+
+int pars_args(int argc, char **argv, struct Rx_inst *ri) {
+    int rez;
+    int loglevel;
+
+    log_set_level(LOG_INFO);
+
+    while ( (rez = getopt(argc,argv,"p:D:")) != -1){
+        switch (rez){
+            case 'p':
+                ri->port = strtol(optarg, NULL, 10);
+                if( ri->port <= 0 || ri->port > 65535 ) {
+                    log_fatal("A problem with parameter '-p'");
+                    return -1;
+                }
+                break;
+            case 'D':
+                loglevel = strtol(optarg, NULL, 10);
+                if( loglevel < LOG_TRACE || loglevel > LOG_FATAL ) {
+                    log_fatal("A problem with parameter '-D'");
+                    return -1;
+                }
+                log_set_level(loglevel);
+                break;
+            default:
+                usage(argv);
+                exit(0);
+        }
+    }
+
+    if( ri->port == 0 ) {
+        usage(argv);
+        exit(-1);
+    }
+
+    return 0;
+}
+
+
+static int au_append(struct Rx_inst *ri, const void *data, size_t len)
+{
+    if( ri->au_len + len > AU_BUFF_SZ ) {
+        ri->au_broken = 1;
+        return -1;
+    }
+
+    memcpy(ri->au + ri->au_len, data, len);
+    ri->au_len += len;
+    return 0;
+}
+
+
+static void au_finish(struct Rx_inst *ri)
+{
+    if( ri->au_len > 0 ) {
+        if( ri->au_broken ) {
+            ri->broken++;
+        } else {
+            write(STDOUT_FILENO, ri->au, ri->au_len);
+            ri->frames++;
+        }
+    }
+
+    ri->au_len = 0;
+    ri->au_broken = 0;
+}
+
+
+static void handle_packet(struct Rx_inst *ri, const uint8_t *pkt, size_t len)
+{
+    uint16_t seq;
+    uint32_t ts;
+    size_t hdr_len;
+    uint8_t nal_hdr;
+
+    if( len < RTP_HDR_SZ + 1 || (pkt[0] >> 6) != 2 ) {
+        log_warn("Not an RTP packet, %zu bytes", len);
+        return;
+    }
+    ri->packets++;
+
+    seq = (pkt[2] << 8) | pkt[3];
+    ts = ((uint32_t)pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+    hdr_len = RTP_HDR_SZ + (pkt[0] & 0x0f) * 4;
+    if( len <= hdr_len )
+        return;
+
+    if( ri->have_seq && seq != (uint16_t)(ri->seq + 1) ) {
+        ri->lost += (uint16_t)(seq - ri->seq - 1);
+        ri->au_broken = 1;
+    }
+    ri->have_seq = 1;
+    ri->seq = seq;
+
+    // A new timestamp means a new access unit even if the marker is lost
+    if( ts != ri->ts ) {
+        au_finish(ri);
+        ri->ts = ts;
+    }
+
+    pkt += hdr_len;
+    len -= hdr_len;
+
+    if( (pkt[0] & 0x1f) == NAL_TYPE_FU_A ) {
+        if( len < RTP_FU_HDR_SZ )
+            return;
+
+        if( pkt[1] & 0x80 ) {   // S bit: rebuild the NAL header
+            nal_hdr = (pkt[0] & 0xe0) | (pkt[1] & 0x1f);
+            au_append(ri, start_code, sizeof(start_code));
+            au_append(ri, &nal_hdr, 1);
+        }
+        au_append(ri, pkt + RTP_FU_HDR_SZ, len - RTP_FU_HDR_SZ);
+    } else {
+        au_append(ri, start_code, sizeof(start_code));
+        au_append(ri, pkt, len);
+    }
+}
+
+
+int main(int argc, char **argv)
+{
+    static struct Rx_inst rx_inst;
+    static uint8_t pkt_buff[RX_BATCH][RX_PKT_SZ];
+    struct mmsghdr msgs[RX_BATCH];
+    struct iovec iov[RX_BATCH];
+    struct sockaddr_in addr;
+    struct pollfd pfds;
+    uint64_t period_start, now;
+    int ret, n;
+
+    ret = pars_args(argc, argv, &rx_inst);
+    if( ret )
+        return -1;
+
+    rx_inst.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if( rx_inst.fd == -1 ) {
+        log_fatal("socket() [%m]");
+        return -1;
+    }
+
+    MEMZERO(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(rx_inst.port);
+    if( bind(rx_inst.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ) {
+        log_fatal("bind(%d) [%m]", rx_inst.port);
+        return -1;
+    }
+    log_info("Waiting for RTP on port %d", rx_inst.port);
+
+    for( n = 0; n < RX_BATCH; n++ ) {
+        iov[n].iov_base = pkt_buff[n];
+        iov[n].iov_len = RX_PKT_SZ;
+    }
+
+    pfds.fd = rx_inst.fd;
+    pfds.events = POLLIN;
+    period_start = time_now_us();
+
+    for(;;) {
+        ret = poll(&pfds, 1, 1000 * TIMEOUT_SEC);
+        if( ret == -1 ) {
+            if( errno == EINTR )
+                continue;
+            log_fatal("poll: [%m]");
+            break;
+        } else if( ret == 0 ) {
+            log_fatal("poll: Time out");
+            break;
+        }
+
+        MEMZERO(msgs);
+        for( n = 0; n < RX_BATCH; n++ ) {
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+
+        ret = recvmmsg(rx_inst.fd, msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+        if( ret == -1 ) {
+            if( errno == EAGAIN || errno == EINTR )
+                continue;
+            log_fatal("recvmmsg() [%m]");
+            break;
+        }
+
+        for( n = 0; n < ret; n++ ) {
+            handle_packet(&rx_inst, pkt_buff[n], msgs[n].msg_len);
+
+            // The marker closes the access unit
+            if( pkt_buff[n][1] & 0x80 )
+                au_finish(&rx_inst);
+        }
+
+        now = time_now_us();
+        if( now - period_start >= 5000000 ) {
+            log_info("RTP rx: %u packets, %u lost, %u frames, %u broken frames",
+                     rx_inst.packets, rx_inst.lost, rx_inst.frames,
+                     rx_inst.broken);
+            period_start = now;
+        }
+    }
+
+    close(rx_inst.fd);
+    return 0;
+}
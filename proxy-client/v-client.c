@@ -28,6 +28,7 @@ struct Args_inst {
     int     width;
     int     height;
     int     framerate;
+    int     version;
 
     char    binstr[1024];
     int     binstr_len;
@@ -73,6 +74,7 @@ void usage(char **argv) {
     fprintf(stderr, "\t-h     Frame height resolution [240..1080]\n");
     fprintf(stderr, "\t-f     Framerate [5..30] \n");
     fprintf(stderr, "\t-S     Server [ip:port] to connect to \n");
+    fprintf(stderr, "\t-V     Protocol version [1..%d] \n", PROTO_VERSION);
     fprintf(stderr, "\t-D     Debug level [0..6] \n");
 }
 
@@ -85,6 +87,7 @@ int pars_args(int argc, char **argv,
     ai->width = 0;
     ai->height = 0;
     ai->framerate = 0;
+    ai->version = PROTO_VERSION;
 
     if( argc == 1 ) {
         usage(argv);
@@ -92,7 +95,7 @@ int pars_args(int argc, char **argv,
     }
 
 //	opterr=0;
-    while ( (rez = getopt(argc,argv,"w:h:f:D:S:")) != -1){
+    while ( (rez = getopt(argc,argv,"w:h:f:D:S:V:")) != -1){
         switch (rez){
             case 'w':
                 ai->width = strtol(optarg, NULL, 10);
@@ -142,6 +145,14 @@ int pars_args(int argc, char **argv,
                 break;
             }
 
+            case 'V':
+                ai->version = strtol(optarg, NULL, 10);
+                if( ai->version < PROTO_VERSION_1 || ai->version > PROTO_VERSION ) {
+                    log_fatal("A problem with parameter '-V'");
+                    return -1;
+                }
+                break;
+
             case '?':
             default:
                 log_error("Error in arguments found!");
@@ -160,6 +171,50 @@ int pars_args(int argc, char **argv,
     return 0;
 }
 
+// Frame statistics of protocol v2
+struct Rx_stats {
+    uint64_t    period_start;
+    int         have_seq;
+    uint32_t    next_seq;
+
+    uint32_t    frames;
+    uint32_t    keyframes;
+    uint32_t    lost;
+    uint64_t    encode_us;
+};
+
+
+void rx_frame_stats(struct Rx_stats *st, struct Proto_inst *p) {
+    uint64_t now = time_now_us();
+
+    if( st->have_seq && p->seq != st->next_seq ) {
+        st->lost += p->seq - st->next_seq;
+        log_debug("Frames %u..%u were dropped by the server",
+                  st->next_seq, p->seq - 1);
+    }
+    st->have_seq = 1;
+    st->next_seq = p->seq + 1;
+
+    st->frames++;
+    if( p->frame_type == PROTO_FRM_I )
+        st->keyframes++;
+    if( p->ts_encoded > p->ts_capture )
+        st->encode_us += p->ts_encoded - p->ts_capture;
+
+    if( st->period_start == 0 )
+        st->period_start = now;
+    if( now - st->period_start < 5000000 )
+        return;
+
+    log_info("Rx: %u frames (%u keyframes), %u lost, avg capture->encoded %llu us",
+             st->frames, st->keyframes, st->lost,
+             (unsigned long long)(st->encode_us / st->frames));
+    st->period_start = now;
+    st->frames = st->keyframes = st->lost = 0;
+    st->encode_us = 0;
+}
+
+
 int serialize_args(struct Args_inst *ai) {
     ai->binstr_len = 0;
 
@@ -194,6 +249,11 @@ int main(int argc, char **argv)
 
     struct pollfd pfds;
     int ret;
+    int version = PROTO_VERSION_1;
+    uint64_t t_connect;
+    int first_frame = 1;
+    struct Rx_stats rx_stats;
+    MEMZERO(rx_stats);
 
     char h264_buf[H264_BUFF_SZ];
 
@@ -202,22 +262,59 @@ int main(int argc, char **argv)
         goto err;
 
 
+    t_connect = time_now_us();
     ret = make_srv_connect(&clnt_inst);
     if (ret)
         goto err;
 
+    // v2: all parameters in one message, one round trip
+    if( args_inst.version >= PROTO_VERSION_2 ) {
+        MEMZERO(proto_inst);
+        proto_connect(&proto_inst, args_inst.version, args_inst.width,
+                      args_inst.height, args_inst.framerate);
+        print_peer_msg("Srv <---", &proto_inst);
+        ret = send_peer_msg(clnt_inst.peer_fd, &proto_inst);
+        if (ret)
+            goto err;
+
+        ret = get_peer_msg(clnt_inst.peer_fd, &proto_inst);
+        if( ret == 0 ) {
+            print_peer_msg("    --->", &proto_inst);
+
+            if( proto_inst.cmd == PROTO_CMD_CONNECT &&
+                proto_inst.status == PROTO_STS_OK ) {
+                version = proto_hello_version(&proto_inst);
+                log_info("Protocol v%d, connected in %llu us", version,
+                         (unsigned long long)(time_now_us() - t_connect));
+                goto streaming;
+            }
+        }
+
+        // A server without CONNECT drops the connection or refuses it:
+        // start over with the HELLO handshake, which tells the version
+        log_warn("Server does not take 'CONNECT', falling back to 'HELLO'");
+        close(clnt_inst.peer_fd);
+        ret = make_srv_connect(&clnt_inst);
+        if (ret)
+            goto err;
+    }
+
     //Send HELLO and greating message
     {
         MEMZERO(proto_inst);
-        proto_inst.cmd = PROTO_CMD_HELLO;
-        strcpy(proto_inst.msg, "Hi, server!");
-        proto_inst.msg_len = strlen(proto_inst.msg);
+        if( args_inst.version >= PROTO_VERSION_2 ) {
+            proto_hello_v2(&proto_inst, args_inst.version);
+        } else {
+            proto_inst.cmd = PROTO_CMD_HELLO;
+            strcpy(proto_inst.msg, "Hi, server!");
+            proto_inst.msg_len = strlen(proto_inst.msg);
+        }
         print_peer_msg("Srv <---", &proto_inst);
-        ret = send_peer_msg(&clnt_inst, &proto_inst);
+        ret = send_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
 
-        ret = get_peer_msg(&clnt_inst, &proto_inst);
+        ret = get_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
         print_peer_msg("    --->", &proto_inst);
@@ -227,6 +324,10 @@ int main(int argc, char **argv)
             log_fatal("Get strange answer from server. 'HELLO' expected!");
             goto err;
         }
+
+        // An old server answers with text, that means v1
+        version = proto_hello_version(&proto_inst);
+        log_info("Protocol v%d", version);
     }
 
     //Send GET_PARAM message
@@ -234,11 +335,11 @@ int main(int argc, char **argv)
         MEMZERO(proto_inst);
         proto_inst.cmd = PROTO_CMD_GET_PARAM;
         print_peer_msg("Srv <---", &proto_inst);
-        ret = send_peer_msg(&clnt_inst, &proto_inst);
+        ret = send_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
 
-        ret = get_peer_msg(&clnt_inst, &proto_inst);
+        ret = get_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
         print_peer_msg("    --->", &proto_inst);
@@ -264,11 +365,11 @@ int main(int argc, char **argv)
         memcpy(proto_inst.msg, args_inst.binstr, proto_inst.msg_len);
 
         print_peer_msg("Srv <---", &proto_inst);
-        ret = send_peer_msg(&clnt_inst, &proto_inst);
+        ret = send_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
 
-        ret = get_peer_msg(&clnt_inst, &proto_inst);
+        ret = get_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
         print_peer_msg("    --->", &proto_inst);
@@ -281,17 +382,16 @@ int main(int argc, char **argv)
     }
 
 
-    sleep(1);
     //Send START message
     {
         MEMZERO(proto_inst);
         proto_inst.cmd = PROTO_CMD_START;
         print_peer_msg("Srv <---", &proto_inst);
-        ret = send_peer_msg(&clnt_inst, &proto_inst);
+        ret = send_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
 
-        ret = get_peer_msg(&clnt_inst, &proto_inst);
+        ret = get_peer_msg(clnt_inst.peer_fd, &proto_inst);
         if (ret)
             goto err;
         print_peer_msg("    --->", &proto_inst);
@@ -304,6 +404,7 @@ int main(int argc, char **argv)
     }
 
 
+streaming:
     log_info("......Get DATA loop here.....");
 
     pfds.fd = clnt_inst.peer_fd;
@@ -323,8 +424,9 @@ int main(int argc, char **argv)
         if (pfds.revents & POLLIN) {
             // Get DATA
             MEMZERO(proto_inst);
+            proto_inst.version = version;
             proto_inst.data = h264_buf;
-            ret = get_peer_msg(&clnt_inst, &proto_inst);
+            ret = get_peer_msg(clnt_inst.peer_fd, &proto_inst);
             if (ret)
                 goto err;
 
@@ -332,6 +434,13 @@ int main(int argc, char **argv)
             if (proto_inst.cmd == PROTO_CMD_DATA) {
                 print_peer_msg("Srv --->", &proto_inst);
                 write(STDOUT_FILENO, proto_inst.data, proto_inst.data_len);
+                if( first_frame ) {
+                    first_frame = 0;
+                    log_info("First frame %llu us after connect",
+                             (unsigned long long)(time_now_us() - t_connect));
+                }
+                if( version >= PROTO_VERSION_2 )
+                    rx_frame_stats(&rx_stats, &proto_inst);
 
             } else {
                 log_warn("Get strange answer from server. 'DATA' expected!");
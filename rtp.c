@@ -0,0 +1,281 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/videodev2.h>
+
+#include "common.h"
+#include "log.h"
+#include "rtp.h"
+
+#define NAL_TYPE_FU_A   28
+
+// One batch of packets. Headers are built here, payloads point straight
+// into the frame, so nothing is copied on the way to the socket
+struct Rtp_pkt {
+    uint8_t        hdr[RTP_HDR_SZ + RTP_FU_HDR_SZ];
+    struct iovec   iov[2];
+};
+
+static struct Rtp_pkt   pkts[RTP_BATCH_MAX];
+static struct mmsghdr   msgs[RTP_BATCH_MAX];
+static int              pkts_n;
+
+
+int rtp_open(struct Rtp_inst *i)
+{
+    int sndbuf = RTP_SNDBUF;
+
+    MEMZERO(i->addr);
+    i->addr.sin_family = AF_INET;
+    i->addr.sin_port = htons(i->port);
+    if( inet_pton(AF_INET, i->host, &i->addr.sin_addr) != 1 ) {
+        log_fatal("RTP: bad destination address '%s'", i->host);
+        return -1;
+    }
+
+    i->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if( i->fd == -1 ) {
+        log_fatal("RTP: socket() [%m]");
+        return -1;
+    }
+
+    // A whole I-frame has to fit into the socket buffer
+    if( setsockopt(i->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) < 0 )
+        log_warn("RTP: setsockopt(SO_SNDBUF) [%m]");
+
+    if( connect(i->fd, (struct sockaddr *)&i->addr, sizeof(i->addr)) == -1 ) {
+        log_fatal("RTP: connect(%s:%d) [%m]", i->host, i->port);
+        close(i->fd);
+        i->fd = -1;
+        return -1;
+    }
+
+    srandom(time_now_us() ^ getpid());
+    i->seq = random();
+    i->ssrc = random();
+    i->ts_base = random();
+
+    log_info("RTP: streaming to %s:%d, ssrc 0x%08x", i->host, i->port, i->ssrc);
+    return 0;
+}
+
+
+void rtp_close(struct Rtp_inst *i)
+{
+    if( i->fd < 0 )
+        return;
+
+    rtp_report(i);
+    close(i->fd);
+    i->fd = -1;
+}
+
+
+/* Send the collected packets. UDP does not wait for anybody: whatever
+ * does not fit into the socket buffer is dropped */
+static int rtp_flush(struct Rtp_inst *i)
+{
+    int sent = 0;
+    int ret;
+
+    while( sent < pkts_n ) {
+        ret = sendmmsg(i->fd, msgs + sent, pkts_n - sent, 0);
+        i->syscalls++;
+
+        if( ret == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == ECONNREFUSED ) {
+                // ECONNREFUSED: nobody listens at the moment, not fatal
+                i->drop_packets += pkts_n - sent;
+                break;
+            }
+
+            log_warn("RTP: sendmmsg() [%m]");
+            pkts_n = 0;
+            return -1;
+        }
+
+        for( ; ret > 0; ret--, sent++ )
+            i->bytes += msgs[sent].msg_len;
+    }
+
+    i->packets += sent;
+    pkts_n = 0;
+    return 0;
+}
+
+
+static int rtp_add_pkt(struct Rtp_inst *i, uint32_t ts,
+                       const uint8_t *fu, const uint8_t *data, size_t len)
+{
+    struct Rtp_pkt *pkt;
+    int hdr_len = RTP_HDR_SZ;
+
+    if( pkts_n == RTP_BATCH_MAX && rtp_flush(i) != 0 )
+        return -1;
+
+    pkt = &pkts[pkts_n];
+    pkt->hdr[0] = 0x80;             // V=2, P=0, X=0, CC=0
+    pkt->hdr[1] = RTP_PT_H264;      // marker is set by rtp_send_frame()
+    pkt->hdr[2] = i->seq >> 8;
+    pkt->hdr[3] = i->seq;
+    pkt->hdr[4] = ts >> 24;
+    pkt->hdr[5] = ts >> 16;
+    pkt->hdr[6] = ts >> 8;
+    pkt->hdr[7] = ts;
+    pkt->hdr[8] = i->ssrc >> 24;
+    pkt->hdr[9] = i->ssrc >> 16;
+    pkt->hdr[10] = i->ssrc >> 8;
+    pkt->hdr[11] = i->ssrc;
+    if( fu ) {
+        pkt->hdr[12] = fu[0];
+        pkt->hdr[13] = fu[1];
+        hdr_len += RTP_FU_HDR_SZ;
+    }
+    i->seq++;
+
+    pkt->iov[0].iov_base = pkt->hdr;
+    pkt->iov[0].iov_len = hdr_len;
+    pkt->iov[1].iov_base = (void *)data;
+    pkt->iov[1].iov_len = len;
+
+    MEMZERO(msgs[pkts_n]);
+    msgs[pkts_n].msg_hdr.msg_iov = pkt->iov;
+    msgs[pkts_n].msg_hdr.msg_iovlen = 2;
+    pkts_n++;
+
+    return 0;
+}
+
+
+/* Find the next Annex-B start code, returns its offset or 'len' */
+static size_t find_start_code(const uint8_t *p, size_t len, size_t *sc_len)
+{
+    size_t n;
+
+    for( n = 0; n + 3 <= len; n++ ) {
+        if( p[n] == 0 && p[n + 1] == 0 && p[n + 2] == 1 ) {
+            *sc_len = 3;
+            if( n > 0 && p[n - 1] == 0 ) {
+                *sc_len = 4;
+                return n - 1;
+            }
+            return n;
+        }
+    }
+
+    *sc_len = 0;
+    return len;
+}
+
+
+static int rtp_add_nal(struct Rtp_inst *i, uint32_t ts,
+                       const uint8_t *nal, size_t len)
+{
+    uint8_t fu[RTP_FU_HDR_SZ];
+    size_t chunk;
+
+    // Single NAL unit packet
+    if( len <= RTP_PAYLOAD_MAX )
+        return rtp_add_pkt(i, ts, NULL, nal, len);
+
+    // FU-A: the NAL header goes to FU indicator and FU header,
+    // the rest of the NAL is cut into pieces
+    fu[0] = (nal[0] & 0xe0) | NAL_TYPE_FU_A;
+    fu[1] = 0x80 | (nal[0] & 0x1f);     // S bit
+    nal++;
+    len--;
+
+    while( len > 0 ) {
+        chunk = len;
+        if( chunk > RTP_PAYLOAD_MAX - RTP_FU_HDR_SZ )
+            chunk = RTP_PAYLOAD_MAX - RTP_FU_HDR_SZ;
+        else
+            fu[1] |= 0x40;              // E bit
+
+        if( rtp_add_pkt(i, ts, fu, nal, chunk) != 0 )
+            return -1;
+
+        fu[1] &= ~0x80;
+        nal += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+
+/* Packetize one access unit and send it with as few syscalls as
+ * possible, a frame smaller than RTP_BATCH_MAX packets costs one */
+int rtp_send_frame(struct Rtp_inst *i, struct Frame *frm)
+{
+    const uint8_t *p = frm->data;
+    size_t left = frm->len;
+    size_t off, sc_len, nal_len;
+    uint64_t ts_us;
+    uint32_t ts;
+
+    if( i->fd < 0 )
+        return 0;
+
+    // 90 kHz clock from the capture time of the frame
+    ts_us = frm->ts_us ? frm->ts_us : time_now_us();
+    ts = i->ts_base + (uint32_t)(ts_us * (RTP_CLOCK_HZ / 1000) / 1000);
+
+    off = find_start_code(p, left, &sc_len);
+    if( sc_len == 0 ) {
+        log_warn("RTP: no Annex-B start code in the frame, skip it");
+        return 0;
+    }
+    p += off + sc_len;
+    left -= off + sc_len;
+
+    while( left > 0 ) {
+        nal_len = find_start_code(p, left, &sc_len);
+        if( nal_len > 0 && rtp_add_nal(i, ts, p, nal_len) != 0 )
+            return -1;
+
+        p += nal_len + sc_len;
+        left -= nal_len + sc_len;
+    }
+
+    // The last packet of the access unit carries the marker bit
+    if( pkts_n > 0 )
+        pkts[pkts_n - 1].hdr[1] |= 0x80;
+
+    if( rtp_flush(i) != 0 )
+        return -1;
+
+    i->frames++;
+    return 0;
+}
+
+
+void rtp_report(struct Rtp_inst *i)
+{
+    uint32_t frames = i->frames - i->frames_rep;
+    uint32_t packets = i->packets - i->packets_rep;
+    uint32_t calls = i->syscalls - i->syscalls_rep;
+
+    if( frames == 0 )
+        return;
+
+    log_info("RTP tx: %u frames, %.1f packets/frame, %.2f syscalls/frame, "
+             "%u packets dropped so far", frames, (double)packets / frames,
+             (double)calls / frames, i->drop_packets);
+
+    i->frames_rep = i->frames;
+    i->packets_rep = i->packets;
+    i->syscalls_rep = i->syscalls;
+}
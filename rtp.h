@@ -0,0 +1,48 @@
+#ifndef INCLUDE_RTP_H
+#define INCLUDE_RTP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "frame.h"
+
+#define RTP_HDR_SZ      12
+#define RTP_FU_HDR_SZ   2       // FU indicator + FU header (RFC 6184 5.8)
+#define RTP_PAYLOAD_MAX 1400    // fits 1500 MTU with IP/UDP/RTP headers
+#define RTP_PT_H264     96      // dynamic payload type
+#define RTP_CLOCK_HZ    90000
+#define RTP_BATCH_MAX   256     // packets sent by one sendmmsg()
+#define RTP_SNDBUF      (1024 * 1024)
+
+/* RTP/UDP sink for the encoded stream.
+ * Annex-B access units from Coda are packetized according to RFC 6184
+ * (Single NAL unit and FU-A packets) and sent without any handshake */
+struct Rtp_inst {
+    char       host[128];
+    int        port;
+    int        fd;
+    struct sockaddr_in  addr;
+
+    uint16_t   seq;
+    uint32_t   ssrc;
+    uint32_t   ts_base;
+
+    // Statistics, '_rep' values are taken at the last report
+    uint32_t   frames;
+    uint32_t   packets;
+    uint32_t   syscalls;
+    uint32_t   drop_packets;
+    uint64_t   bytes;
+    uint32_t   frames_rep;
+    uint32_t   packets_rep;
+    uint32_t   syscalls_rep;
+};
+
+
+int rtp_open(struct Rtp_inst *i);
+void rtp_close(struct Rtp_inst *i);
+int rtp_send_frame(struct Rtp_inst *i, struct Frame *frm);
+void rtp_report(struct Rtp_inst *i);
+
+#endif /* INCLUDE_RTP_H */
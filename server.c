@@ -1,15 +1,34 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <poll.h>
 
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/tcp.h>
+#include <linux/errqueue.h>
+#include <linux/videodev2.h>
 
 #include "common.h"
 #include "log.h"
 #include "server.h"
 
+// Older libc headers do not know MSG_ZEROCOPY (Linux 4.14)
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY     60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY    0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY       5
+#define SO_EE_CODE_ZEROCOPY_COPIED  1
+#endif
+
 
 int srv_srv_start(struct Srv_inst* i)
 {
@@ -42,52 +61,709 @@ int srv_srv_start(struct Srv_inst* i)
     }
 
     // Now server is ready to listen and verification
-    if( listen(i->srv_fd, 1) != 0 ) {
+    if( listen(i->srv_fd, SRV_MAX_PEERS) != 0 ) {
         log_fatal("Server listen failed... [%m]");
         return -1;
     }
 
+    // One epoll instance serves listening socket, peers and devices
+    i->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if( i->epoll_fd == -1 ) {
+        log_fatal("epoll_create1() failed... [%m]");
+        return -1;
+    }
+
+    if( srv_poll_add(i, i->srv_fd, EPOLLIN) != 0 )
+        return -1;
+
+    log_info("Server waiting for clients on %s:%d...", i->string, i->port);
+    return 0;
+}
+
+
+int srv_poll_add(struct Srv_inst* i, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    MEMZERO(ev);
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if( epoll_ctl(i->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1 ) {
+        log_fatal("epoll_ctl(ADD, fd=%d) [%m]", fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int srv_poll_mod(struct Srv_inst* i, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    MEMZERO(ev);
+    ev.events = events;
+    ev.data.fd = fd;
+
+    if( epoll_ctl(i->epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1 ) {
+        log_fatal("epoll_ctl(MOD, fd=%d) [%m]", fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int srv_poll_del(struct Srv_inst* i, int fd)
+{
+    if( epoll_ctl(i->epoll_fd, EPOLL_CTL_DEL, fd, NULL) == -1 ) {
+        log_error("epoll_ctl(DEL, fd=%d) [%m]", fd);
+        return -1;
+    }
+
     return 0;
 }
 
-int srv_peer_accept(struct Srv_inst* i) {
-    log_info("Server waiting for a client on %s:%d...", i->string, i->port);
+/* Accept a new client and add it to the list of peers.
+ * Returns NULL if accept() failed or there is no room for one more peer */
+struct Srv_peer* srv_peer_accept(struct Srv_inst* i) {
+    struct Srv_peer *p;
+    int fd;
 
     // Accept the data packet from client and verification
-    i->peer_fd = accept(i->srv_fd, (struct sockaddr*)NULL, NULL);
-    if( i->srv_fd < 0 ) {
+    fd = accept4(i->srv_fd, (struct sockaddr*)NULL, NULL, SOCK_NONBLOCK);
+    if( fd < 0 ) {
         log_fatal("Client acccept failed... [%m]");
+        return NULL;
+    }
+
+    if( i->peers_n >= SRV_MAX_PEERS ) {
+        log_warn("Too many clients (max %d), reject a new one", SRV_MAX_PEERS);
+        close(fd);
+        return NULL;
+    }
+
+    // Every message goes out with a single syscall, so Nagle
+    // would only add latency
+    int enable = 1;
+    if( setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int)) < 0 )
+        log_warn("setsockopt(TCP_NODELAY) failed [%m]");
+
+    if( i->zerocopy &&
+        setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(int)) < 0 ) {
+        log_warn("setsockopt(SO_ZEROCOPY) failed [%m], zero-copy is off");
+        i->zerocopy = 0;
+    }
+
+    if( srv_poll_add(i, fd, EPOLLIN | EPOLLRDHUP) != 0 ) {
+        close(fd);
+        return NULL;
+    }
+
+    p = &i->peers[i->peers_n++];
+    MEMZERO(*p);
+    p->fd = fd;
+    p->state = PEER_HELLO;
+    p->wait_idr = 1;
+    p->zerocopy = i->zerocopy;
+    p->t_accept = time_now_us();
+
+    log_info("Server acccept the client [fd=%d], %d client(s) now",
+             fd, i->peers_n);
+
+    return p;
+}
+
+
+struct Srv_peer* srv_peer_find(struct Srv_inst* i, int fd) {
+    int n;
+
+    for( n = 0; n < i->peers_n; n++ )
+        if( i->peers[n].fd == fd )
+            return &i->peers[n];
+
+    return NULL;
+}
+
+
+static int peer_enqueue(struct Srv_peer* p, const uint8_t *hdr,
+                        size_t hdr_len, struct Frame *frm, int is_data)
+{
+    struct Srv_txitem *item;
+
+    if( p->txq_n >= SRV_TXQ_LEN ) {
+        log_warn("Peer [fd=%d] is too slow, %d messages are not sent",
+                 p->fd, p->txq_n);
         return -1;
     }
 
-    log_info("Server acccept the client...");
+    item = &p->txq[(p->txq_head + p->txq_n) % SRV_TXQ_LEN];
+    memcpy(item->hdr, hdr, hdr_len);
+    item->hdr_len = hdr_len;
+    item->is_data = is_data;
+    item->frm = frm ? frame_get(frm) : NULL;
+    item->sent = 0;
+    p->txq_n++;
+    p->txq_bytes += hdr_len + (frm ? frm->len : 0);
 
     return 0;
+}
+
+
+/* Put a message into the peer's send queue and try to send it at once.
+ * The queue takes its own reference to 'frm' (may be NULL).
+ * Returns -1 if the peer has to be disconnected */
+int srv_peer_push(struct Srv_inst* i, struct Srv_peer* p,
+                  const uint8_t *hdr, size_t hdr_len, struct Frame *frm)
+{
+    if( peer_enqueue(p, hdr, hdr_len, frm, 0) != 0 )
+        return -1;
+
+    return srv_peer_flush(i, p);
+}
+
+
+static void peer_drop_count(struct Srv_inst* i, struct Srv_peer* p,
+                            size_t n_bytes)
+{
+    p->drop_frames++;
+    p->drop_bytes += n_bytes;
+    i->drop_frames++;
+    i->drop_bytes += n_bytes;
+}
+
+
+/* Drop every h264 frame the peer has not started to receive yet.
+ * A frame which is partially sent has to go out to keep the stream framing */
+static void peer_drop_queued(struct Srv_inst* i, struct Srv_peer* p)
+{
+    struct Srv_txitem *item;
+    int n, keep = 0;
+
+    for( n = 0; n < p->txq_n; n++ ) {
+        item = &p->txq[(p->txq_head + n) % SRV_TXQ_LEN];
+
+        if( item->is_data && item->sent == 0 ) {
+            peer_drop_count(i, p, item->frm->len);
+            p->txq_bytes -= item->hdr_len + item->frm->len;
+            frame_put(item->frm);
+            continue;
+        }
+
+        if( keep != n )
+            p->txq[(p->txq_head + keep) % SRV_TXQ_LEN] = *item;
+        keep++;
+    }
+
+    p->txq_n = keep;
+}
+
+
+/* Queue an h264 frame with GOP aware overflow handling.
+ * If the frame does not fit into the peer's caps, the rest of the
+ * current GOP is discarded and the peer resumes at the next keyframe.
+ * Returns -1 if the peer has to be disconnected */
+int srv_peer_push_frame(struct Srv_inst* i, struct Srv_peer* p,
+                        const uint8_t *hdr, size_t hdr_len, struct Frame *frm)
+{
+    int keyframe = frm->flags & V4L2_BUF_FLAG_KEYFRAME;
+    size_t len = hdr_len + frm->len;
+
+    if( p->drop_gop && !keyframe ) {
+        peer_drop_count(i, p, frm->len);
+        return 0;
+    }
+
+    if( p->txq_n + 1 > i->txq_max_frames ||
+        p->txq_bytes + len > i->txq_max_bytes ) {
+        if( !p->drop_gop )
+            log_warn("Peer [fd=%d] is too slow (%d frames, %zu bytes queued), "
+                     "drop frames up to the next keyframe",
+                     p->fd, p->txq_n, p->txq_bytes);
+
+        peer_drop_queued(i, p);
+        p->drop_gop = 1;
+
+        // Resume right away if the keyframe fits into the emptied queue
+        if( !keyframe || p->txq_n + 1 > i->txq_max_frames ||
+            p->txq_bytes + len > i->txq_max_bytes ) {
+            peer_drop_count(i, p, frm->len);
+            return 0;
+        }
+    }
+
+    if( p->drop_gop ) {
+        log_info("Peer [fd=%d] resumes at keyframe, %u frames dropped so far",
+                 p->fd, p->drop_frames);
+        p->drop_gop = 0;
+    }
+
+    if( peer_enqueue(p, hdr, hdr_len, frm, 1) != 0 )
+        return -1;
+
+    return srv_peer_flush(i, p);
+}
+
+
+/* A frame has left completely for a peer or the RTP socket */
+void srv_sent_frame(struct Srv_inst* i, const struct Frame *frm)
+{
+    uint64_t now = time_now_us();
 
+    if( frm->enc_us )
+        stats_add(&i->lat_send, now - frm->enc_us);
+    if( frm->ts_us )
+        stats_add(&i->lat_total, now - frm->ts_us);
+}
+
+
+/* Send as much of the queue as the socket takes without blocking.
+ * Header and payload of several queued messages go out with one
+ * sendmsg(). EPOLLOUT is armed while something is left in the queue */
+int srv_peer_flush(struct Srv_inst* i, struct Srv_peer* p)
+{
+    struct Srv_txitem *item;
+    struct iovec iov[SRV_IOV_MAX];
+    struct Frame *frm[SRV_IOV_MAX];
+    struct msghdr msg;
+    size_t frm_len, left, total;
+    ssize_t n_bytes;
+    int iov_n, frm_n, n;
+    int zc;
+
+    while( p->txq_n > 0 ) {
+        // Gather unsent parts of the queued messages
+        iov_n = 0;
+        frm_n = 0;
+        total = 0;
+        for( n = 0; n < p->txq_n && iov_n + 2 <= SRV_IOV_MAX; n++ ) {
+            item = &p->txq[(p->txq_head + n) % SRV_TXQ_LEN];
+            frm_len = item->frm ? item->frm->len : 0;
+            if( item->frm && item->sent < item->hdr_len + frm_len )
+                frm[frm_n++] = item->frm;
+
+            if( item->sent < item->hdr_len ) {
+                iov[iov_n].iov_base = item->hdr + item->sent;
+                iov[iov_n].iov_len = item->hdr_len - item->sent;
+                iov_n++;
+                if( frm_len > 0 ) {
+                    iov[iov_n].iov_base = item->frm->data;
+                    iov[iov_n].iov_len = frm_len;
+                    iov_n++;
+                }
+            } else {
+                iov[iov_n].iov_base = item->frm->data + item->sent - item->hdr_len;
+                iov[iov_n].iov_len = frm_len - (item->sent - item->hdr_len);
+                iov_n++;
+            }
+        }
+
+        // Old style framing, one send() per header and per payload
+        if( i->tx_split ) {
+            iov_n = 1;
+            frm_n = (frm_n > 0) ? 1 : 0;
+        }
+
+        for( n = 0; n < iov_n; n++ )
+            total += iov[n].iov_len;
+
+        // The kernel takes pages of the frames instead of copying them.
+        // Not worth for small sends, and needs room to track completion
+        zc = p->zerocopy && total >= SRV_ZC_MIN_SZ &&
+             p->zc_n < SRV_ZC_PENDING;
+
+        MEMZERO(msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_n;
+
+        n_bytes = sendmsg(p->fd, &msg, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+        p->tx_syscalls++;
+
+        if( n_bytes == -1 ) {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            if( errno == EINTR )
+                continue;
+            if( zc && errno == ENOBUFS ) {
+                // Out of optmem for notifications, copy this time
+                n_bytes = sendmsg(p->fd, &msg, MSG_NOSIGNAL);
+                zc = 0;
+            } else if( zc && errno == EFAULT ) {
+                // Buffer pages can not be pinned (e.g. PFN mapped DMA memory)
+                log_warn("Peer [fd=%d] zero-copy is not possible for "
+                         "these buffers, zero-copy is off", p->fd);
+                p->zerocopy = 0;
+                i->zerocopy = 0;
+                continue;
+            }
+        }
+
+        if( n_bytes == -1 ) {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            if( errno == EINTR )
+                continue;
+
+            log_warn("Peer [fd=%d] send failed [%m]", p->fd);
+            return -1;
+        }
+
+        if( zc && n_bytes > 0 ) {
+            struct Srv_zcsend *zs;
+
+            zs = &p->zc[(p->zc_head + p->zc_n) % SRV_ZC_PENDING];
+            zs->id = p->zc_next_id++;
+            zs->done = 0;
+            zs->frm_n = frm_n;
+            for( n = 0; n < frm_n; n++ )
+                zs->frm[n] = frame_get(frm[n]);
+            p->zc_n++;
+            p->zc_sends++;
+        }
+
+        // Retire completely sent messages
+        p->txq_bytes -= n_bytes;
+        while( n_bytes > 0 ) {
+            item = &p->txq[p->txq_head];
+            frm_len = item->frm ? item->frm->len : 0;
+
+            left = item->hdr_len + frm_len - item->sent;
+            if( (size_t)n_bytes < left ) {
+                item->sent += n_bytes;
+                break;
+            }
+            n_bytes -= left;
+
+            if( item->is_data ) {
+                p->tx_frames++;
+                if( item->frm )
+                    srv_sent_frame(i, item->frm);
+            }
+            if( item->frm )
+                frame_put(item->frm);
+            p->txq_head = (p->txq_head + 1) % SRV_TXQ_LEN;
+            p->txq_n--;
+        }
+    }
+
+    if( p->txq_n > 0 && !p->want_out ) {
+        if( srv_poll_mod(i, p->fd, EPOLLIN | EPOLLRDHUP | EPOLLOUT) != 0 )
+            return -1;
+        p->want_out = 1;
+    } else if( p->txq_n == 0 && p->want_out ) {
+        if( srv_poll_mod(i, p->fd, EPOLLIN | EPOLLRDHUP) != 0 )
+            return -1;
+        p->want_out = 0;
+    }
+
+    return 0;
+}
+
+
+/* Log send syscalls and TCP segments per frame since the last report */
+void srv_peer_tx_report(struct Srv_peer* p)
+{
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    uint32_t segs = 0;
+    uint32_t frames = p->tx_frames - p->tx_frames_rep;
+    uint32_t calls = p->tx_syscalls - p->tx_syscalls_rep;
+
+    if( frames == 0 )
+        return;
+
+    MEMZERO(info);
+    if( getsockopt(p->fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0 )
+        segs = info.tcpi_segs_out - p->tx_segs_rep;
+
+    log_info("Peer [fd=%d] tx: %u frames, %.2f syscalls/frame, "
+             "%.2f TCP segments/frame", p->fd, frames,
+             (double)calls / frames, (double)segs / frames);
+    if( p->zc_sends )
+        log_info("Peer [fd=%d] tx: %u zero-copy sends, %u copied by kernel, "
+                 "%d pending", p->fd, p->zc_sends, p->zc_copied, p->zc_n);
+
+    p->tx_frames_rep = p->tx_frames;
+    p->tx_syscalls_rep = p->tx_syscalls;
+    p->tx_segs_rep = info.tcpi_segs_out;
+}
+
+
+/* Release frames of the zero-copy sends in [lo, hi] range */
+static void peer_zc_done(struct Srv_peer* p, uint32_t lo, uint32_t hi)
+{
+    struct Srv_zcsend *zs;
+    int n;
+
+    for( n = 0; n < p->zc_n; n++ ) {
+        zs = &p->zc[(p->zc_head + n) % SRV_ZC_PENDING];
+        if( (int32_t)(zs->id - lo) >= 0 && (int32_t)(hi - zs->id) >= 0 )
+            zs->done = 1;
+    }
+
+    // Completions may come out of order, keep the ring in send order
+    while( p->zc_n > 0 && p->zc[p->zc_head].done ) {
+        zs = &p->zc[p->zc_head];
+        while( zs->frm_n > 0 )
+            frame_put(zs->frm[--zs->frm_n]);
+        p->zc_head = (p->zc_head + 1) % SRV_ZC_PENDING;
+        p->zc_n--;
+    }
+}
+
+
+/* EPOLLERR on a peer socket: read zero-copy completions from the
+ * error queue. Returns -1 on a real socket error */
+int srv_peer_error(struct Srv_peer* p)
+{
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    char control[128];
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    while( p->zc_n > 0 ) {
+        MEMZERO(msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if( recvmsg(p->fd, &msg, MSG_ERRQUEUE) == -1 ) {
+            if( errno == EINTR )
+                continue;
+            break;
+        }
+
+        for( cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm) ) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if( serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno )
+                continue;
+
+            if( serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED )
+                p->zc_copied += serr->ee_data - serr->ee_info + 1;
+
+            peer_zc_done(p, serr->ee_info, serr->ee_data);
+        }
+    }
+
+    if( getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1 || err ) {
+        log_warn("Peer [fd=%d] socket error [%s]", p->fd, strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* Read whatever the peer has sent into its receive buffer.
+ * Returns -1 if the peer has closed connection or failed */
+int srv_peer_recv(struct Srv_peer* p)
+{
+    ssize_t n_bytes;
+
+    for(;;) {
+        if( p->rx_len == sizeof(p->rx_buff) ) {
+            log_warn("Peer [fd=%d] receive buffer overflow", p->fd);
+            return -1;
+        }
+
+        n_bytes = recv(p->fd, p->rx_buff + p->rx_len,
+                       sizeof(p->rx_buff) - p->rx_len, 0);
+        if( n_bytes == -1 ) {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                return 0;
+            if( errno == EINTR )
+                continue;
+
+            log_warn("Peer [fd=%d] recv failed [%m]", p->fd);
+            return -1;
+        }
+        if( n_bytes == 0 ) {
+            log_info("Peer [fd=%d] closed connection", p->fd);
+            return -1;
+        }
+
+        p->rx_len += n_bytes;
+    }
 }
 
 
 void srv_srv_stop(struct Srv_inst* i) {
+    srv_closing_sweep(i, UINT64_MAX);
+
+    if( i->epoll_fd > 0 )
+        close(i->epoll_fd);
+
     if( close(i->srv_fd) == -1 )
         log_fatal("'Srv: server close()");
 
     log_info("Server finished successful");
 }
 
-void srv_peer_stop(struct Srv_inst* i) {
-    if( close(i->peer_fd) == -1 )
+/* Close the socket, then release the frames of zero-copy sends. 'reset'
+ * aborts the connection first: the kernel drops the data still queued
+ * instead of sending it from pages that go back to Coda */
+static void peer_close(struct Srv_inst* i, struct Srv_peer* p, int reset)
+{
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+
+    if( reset && setsockopt(p->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) == -1 )
+        log_warn("Peer [fd=%d] SO_LINGER [%m]", p->fd);
+
+    srv_poll_del(i, p->fd);
+    if( close(p->fd) == -1 )
         log_fatal("'Srv: peer close()");
 
-    log_info("Peer closed successful");
+    while( p->zc_n > 0 ) {
+        struct Srv_zcsend *zs = &p->zc[p->zc_head];
+        while( zs->frm_n > 0 )
+            frame_put(zs->frm[--zs->frm_n]);
+        p->zc_head = (p->zc_head + 1) % SRV_ZC_PENDING;
+        p->zc_n--;
+    }
+}
+
+
+static void closing_remove(struct Srv_inst* i, struct Srv_peer* c)
+{
+    i->closing_n--;
+    if( c != &i->closing[i->closing_n] )
+        *c = i->closing[i->closing_n];
+}
+
+
+/* Error queue of a closing peer: completions of its zero-copy sends.
+ * Returns 1 if 'fd' is one of the closing peers */
+int srv_closing_event(struct Srv_inst* i, int fd)
+{
+    struct Srv_peer *c;
+    int n, ret;
+
+    for( n = 0; n < i->closing_n; n++ ) {
+        c = &i->closing[n];
+        if( c->fd != fd )
+            continue;
+
+        ret = srv_peer_error(c);
+        if( ret != 0 || c->zc_n == 0 ) {
+            log_debug("Peer [fd=%d] zero-copy sends complete, closed", fd);
+            peer_close(i, c, ret != 0);
+            closing_remove(i, c);
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Closing peers that have waited too long for completions, e.g. a dead
+ * client that acks nothing, are reset */
+void srv_closing_sweep(struct Srv_inst* i, uint64_t now)
+{
+    struct Srv_peer *c;
+    int n;
+
+    for( n = i->closing_n - 1; n >= 0; n-- ) {
+        c = &i->closing[n];
+        if( now - c->t_close < SRV_ZC_LINGER_US )
+            continue;
+
+        log_warn("Peer [fd=%d] %d zero-copy send(s) not complete, reset",
+                 c->fd, c->zc_n);
+        peer_close(i, c, 1);
+        closing_remove(i, c);
+    }
+}
+
+
+/* Close peer connection and remove it from the list.
+ * The last peer takes the freed slot, so iterate peers backwards
+ * when stopping them from a loop */
+void srv_peer_stop(struct Srv_inst* i, struct Srv_peer* p) {
+    int fd = p->fd;
+
+    // Drop the frames this peer has not received
+    while( p->txq_n > 0 ) {
+        if( p->txq[p->txq_head].frm )
+            frame_put(p->txq[p->txq_head].frm);
+        p->txq_head = (p->txq_head + 1) % SRV_TXQ_LEN;
+        p->txq_n--;
+    }
+
+    if( p->drop_frames )
+        log_info("Peer [fd=%d] dropped %u frames (%llu bytes)", fd,
+                 p->drop_frames, (unsigned long long)p->drop_bytes);
+    srv_peer_tx_report(p);
+
+    // The kernel may still send from frame pages (h264 buffers of Coda).
+    // The socket is shut down but stays open for the completions, only
+    // error queue events (edge triggered, HUP is there for good) are left
+    if( p->zc_n > 0 && i->closing_n < SRV_MAX_PEERS &&
+        shutdown(fd, SHUT_RDWR) == 0 && srv_poll_mod(i, fd, EPOLLET) == 0 ) {
+        p->t_close = time_now_us();
+        i->closing[i->closing_n++] = *p;
+        log_info("Peer [fd=%d] waits for %d zero-copy send(s)", fd, p->zc_n);
+    } else {
+        peer_close(i, p, p->zc_n > 0);
+    }
+
+    i->peers_n--;
+    if( p != &i->peers[i->peers_n] )
+        *p = i->peers[i->peers_n];
+
+    log_info("Peer [fd=%d] closed successful, %d client(s) left",
+             fd, i->peers_n);
+}
+
+void srv_peer_stop_all(struct Srv_inst* i) {
+    while( i->peers_n > 0 )
+        srv_peer_stop(i, &i->peers[i->peers_n - 1]);
+}
+
+/* Blocking send of a scatter-gather list with a single syscall
+ * in the common case */
+int srv_send_iov(int fd, struct iovec *iov, int iov_n) {
+    struct msghdr msg;
+    ssize_t n_bytes;
+
+    while( iov_n > 0 ) {
+        MEMZERO(msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov_n;
+
+        n_bytes = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if( n_bytes == -1 ) {
+            if( errno == EINTR )
+                continue;
+
+            log_fatal("Client was not able to receive data [%m]");
+            return -1;
+        }
+
+        // Skip what is sent already
+        while( iov_n > 0 && (size_t)n_bytes >= iov->iov_len ) {
+            n_bytes -= iov->iov_len;
+            iov++;
+            iov_n--;
+        }
+        if( iov_n > 0 ) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n_bytes;
+            iov->iov_len -= n_bytes;
+        }
+    }
+
+    return 0;
 }
 
-int srv_send_data(struct Srv_inst* i, void* buff_ptr, size_t buff_len) {
+int srv_send_data(int fd, void* buff_ptr, size_t buff_len) {
     // send the buffer to 'stdout'
     //if (file_ptr)
     //    fwrite(buff_ptr, buff_size, 1, file_ptr);
 
     // send the buffer to client
-    int n_bytes = send(i->peer_fd, buff_ptr, buff_len, MSG_NOSIGNAL);
+    int n_bytes = send(fd, buff_ptr, buff_len, MSG_NOSIGNAL);
     if( n_bytes != buff_len ) {
         log_fatal("Client was not able to receive %d bytes", buff_len);
         return -1;
@@ -112,14 +788,14 @@ int srv_get_data(struct Srv_inst* i) {
 }
 */
 
-int srv_get_data_1(struct Srv_inst* i, void *buffer, size_t count) {
+int srv_get_data_1(int fd, void *buffer, size_t count) {
 
     struct pollfd pfds;
     int ret;
     size_t n_bytes;
     size_t offset = 0;
 
-    pfds.fd = i->peer_fd;
+    pfds.fd = fd;
     pfds.events = POLLIN;
 
     while (1) {
@@ -140,7 +816,7 @@ int srv_get_data_1(struct Srv_inst* i, void *buffer, size_t count) {
                (pfds.revents & POLLERR) ? "POLLERR " : "");
 */
         if (pfds.revents & POLLIN) {
-            n_bytes = recv(i->peer_fd, buffer + offset, count, 0);
+            n_bytes = recv(fd, buffer + offset, count, 0);
             if( n_bytes == -1 ) {
                 log_fatal("recv: [%m]");
                 return -1;
@@ -4,15 +4,133 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <getopt.h>
+#include <sys/uio.h>
+
+#include "frame.h"
+#include "rtp.h"
+#include "stats.h"
+
+#define SRV_MAX_PEERS   8
+#define SRV_TXQ_LEN     64      // frames queued for one peer
+#define SRV_TXQ_FRAMES  32      // default caps of one peer's queue
+#define SRV_TXQ_KBYTES  1024
+#define SRV_HDR_MAX     32      // protocol header of a queued message
+#define SRV_RX_BUFF_SZ  2048
+#define SRV_IOV_MAX     16      // iovecs gathered by one sendmsg()
+#define SRV_ZC_PENDING  64      // zero-copy sends waiting for completion
+#define SRV_ZC_MIN_SZ   10240   // smaller sends are cheaper to copy
+#define SRV_ZC_LINGER_US 2000000 // a closed peer waits so long for completions
+
+// Peer session state, follows the protocol handshake
+enum {
+    PEER_HELLO = 0,
+    PEER_GET_PARAM,
+    PEER_SET_PARAM,
+    PEER_START,
+    PEER_STREAMING
+};
+
+// Message waiting in the peer's send queue: header plus optional payload
+struct Srv_txitem {
+    uint8_t        hdr[SRV_HDR_MAX];
+    uint8_t        hdr_len;
+    uint8_t        is_data;     // h264 frame, may be dropped
+    struct Frame  *frm;
+    size_t         sent;        // bytes of header + payload already sent
+};
+
+// Zero-copy send: frames stay referenced until the kernel reports
+// that it does not need their pages any more
+struct Srv_zcsend {
+    uint32_t       id;
+    int            done;
+    struct Frame  *frm[SRV_IOV_MAX];
+    int            frm_n;
+};
+
+struct Srv_peer {
+    int        fd;
+    int        state;
+    int        version;      // protocol version, PROTO_VERSION_*
+    int        wait_idr;     // skip h264 frames until the next keyframe
+    uint32_t   frames_sent;
+    uint64_t   t_accept;     // for time-to-first-frame
+    uint64_t   t_close;      // stopped with zero-copy sends pending
+
+    // Stream parameters requested by the peer
+    int        width;
+    int        height;
+    int        frame_rate;
+
+    uint8_t    rx_buff[SRV_RX_BUFF_SZ];
+    size_t     rx_len;
+
+    struct Srv_txitem  txq[SRV_TXQ_LEN];
+    int        txq_head;
+    int        txq_n;
+    size_t     txq_bytes;    // queued bytes not sent yet
+    int        want_out;     // EPOLLOUT is armed
+
+    // MSG_ZEROCOPY state
+    int        zerocopy;
+    uint32_t   zc_next_id;
+    struct Srv_zcsend  zc[SRV_ZC_PENDING];
+    int        zc_head;
+    int        zc_n;
+    uint32_t   zc_sends;
+    uint32_t   zc_copied;    // the kernel had to copy anyway
+
+    // Send statistics, '_rep' values are taken at the last report
+    uint32_t   tx_frames;
+    uint32_t   tx_syscalls;
+    uint32_t   tx_frames_rep;
+    uint32_t   tx_syscalls_rep;
+    uint32_t   tx_segs_rep;
+
+    // Queue overflow: frames are dropped up to the next keyframe
+    int        drop_gop;
+    uint32_t   drop_frames;
+    uint64_t   drop_bytes;
+};
 
 struct Srv_inst {
     char       string[128];
     uint32_t   addr;
     int        port;
     int        srv_fd;
-    int        peer_fd;
+    int        peer_fd;      // client side connection (v-client)
+    int        epoll_fd;
 
     int        run_mode;
+    int        tx_split;     // header and payload in separate syscalls
+    int        zerocopy;     // send h264 frames with MSG_ZEROCOPY
+    int        persistent;   // keep devices streaming without clients
+
+    struct Srv_peer  peers[SRV_MAX_PEERS];
+    int        peers_n;
+
+    // Stopped peers whose zero-copy sends are not complete yet: the
+    // socket stays open, so the frames are released only when the kernel
+    // is done with their pages
+    struct Srv_peer  closing[SRV_MAX_PEERS];
+    int        closing_n;
+
+    // Caps of every peer's send queue
+    int        txq_max_frames;
+    size_t     txq_max_bytes;
+
+    // Optional RTP/UDP output, streams without any client request
+    int        rtp_on;
+    struct Rtp_inst  rtp;
+
+    // Frames dropped for all peers, see Srv_peer
+    uint32_t   drop_frames;
+    uint64_t   drop_bytes;
+
+    // Latency of the frames put on the wire (TCP peers and RTP): since
+    // the end of encoding and since capture
+    struct Stats_hist  lat_send;
+    struct Stats_hist  lat_total;
 
     uint8_t    read_buff[128];
 };
@@ -20,14 +138,32 @@ struct Srv_inst {
 
 
 int srv_srv_start(struct Srv_inst* srv_i);
-int srv_peer_accept(struct Srv_inst* i);
+struct Srv_peer* srv_peer_accept(struct Srv_inst* i);
+struct Srv_peer* srv_peer_find(struct Srv_inst* i, int fd);
+
+int srv_poll_add(struct Srv_inst* i, int fd, uint32_t events);
+int srv_poll_del(struct Srv_inst* i, int fd);
+
+int srv_peer_push(struct Srv_inst* i, struct Srv_peer* p,
+                  const uint8_t *hdr, size_t hdr_len, struct Frame *frm);
+int srv_peer_push_frame(struct Srv_inst* i, struct Srv_peer* p,
+                        const uint8_t *hdr, size_t hdr_len, struct Frame *frm);
+int srv_peer_flush(struct Srv_inst* i, struct Srv_peer* p);
+void srv_sent_frame(struct Srv_inst* i, const struct Frame *frm);
+int srv_peer_recv(struct Srv_peer* p);
+int srv_peer_error(struct Srv_peer* p);
+void srv_peer_tx_report(struct Srv_peer* p);
 
-int srv_send_data(struct Srv_inst* srv_i, void* buff_ptr, size_t buff_len);
+int srv_send_iov(int fd, struct iovec *iov, int iov_n);
+int srv_send_data(int fd, void* buff_ptr, size_t buff_len);
 int srv_get_data(struct Srv_inst* i);
 
 void srv_srv_stop(struct Srv_inst* i);
-void srv_peer_stop(struct Srv_inst* i);
+void srv_peer_stop(struct Srv_inst* i, struct Srv_peer* p);
+void srv_peer_stop_all(struct Srv_inst* i);
+int srv_closing_event(struct Srv_inst* i, int fd);
+void srv_closing_sweep(struct Srv_inst* i, uint64_t now);
 
-int srv_get_data_1(struct Srv_inst* i, void *buffer, size_t count);
+int srv_get_data_1(int fd, void *buffer, size_t count);
 
-#endif
\ No newline at end of file
+#endif
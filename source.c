@@ -0,0 +1,337 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <linux/videodev2.h>
+
+#include "source.h"
+#include "log.h"
+
+// The bars of fill_yuv_planar() in pre-v4l2-encode/gentest.c: 128 pixels
+// red, 128 pixels blue
+#define PATTERN_PERIOD  256
+#define PATTERN_BAR     128
+
+#define YUV_601_Y(r, g, b)  ((( 66 * (r) + 129 * (g) +  25 * (b) + 128) >> 8) + 16)
+#define YUV_601_U(r, g, b)  (((-38 * (r) -  74 * (g) + 112 * (b) + 128) >> 8) + 128)
+#define YUV_601_V(r, g, b)  (((112 * (r) -  94 * (g) -  18 * (b) + 128) >> 8) + 128)
+
+
+/* "file:path" or "pattern" */
+int source_parse(struct Webcam_inst *i, const char *spec)
+{
+    if( strlen(spec) >= sizeof(i->wcam_name) )
+        return -1;
+
+    if( strcmp(spec, "pattern") == 0 ) {
+        i->source = WCAM_SRC_PATTERN;
+    } else if( strncmp(spec, "file:", 5) == 0 && spec[5] != '\0' ) {
+        i->source = WCAM_SRC_FILE;
+        strcpy(i->src_path, spec + 5);
+    } else {
+        return -1;
+    }
+
+    strcpy(i->wcam_name, spec);
+    return 0;
+}
+
+
+int source_open(struct Webcam_inst *i)
+{
+    struct stat st;
+    void *map;
+    int fd;
+
+    if( i->source == WCAM_SRC_FILE ) {
+        fd = open(i->src_path, O_RDONLY | O_CLOEXEC);
+        if( fd < 0 ) {
+            log_fatal("Can not open '%s' [%m]", i->src_path);
+            return -1;
+        }
+
+        if( fstat(fd, &st) != 0 || st.st_size == 0 ) {
+            log_fatal("'%s' is empty or can not be read [%m]", i->src_path);
+            close(fd);
+            return -1;
+        }
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if( map == MAP_FAILED ) {
+            log_fatal("mmap('%s') [%m]", i->src_path);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_WILLNEED);
+
+        i->src_map = map;
+        i->src_size = st.st_size;
+    }
+
+    // Paced frames come with the timer ticks, unpaced ones are always there
+    if( i->src_unpaced )
+        i->wcam_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    else
+        i->wcam_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if( i->wcam_fd < 0 ) {
+        log_fatal("'%s': can not create the frame timer [%m]", i->wcam_name);
+        source_close(i);
+        return -1;
+    }
+
+    log_info("Source '%s' opened successfull (%s)", i->wcam_name,
+             i->src_unpaced ? "unpaced" : "paced");
+    return 0;
+}
+
+
+int source_enum_formats(struct Webcam_inst *i, uint32_t *fmts, int max)
+{
+    if( max < 1 )
+        return 0;
+
+    fmts[0] = V4L2_PIX_FMT_YUYV;
+    log_debug("'%s' offers YUYV", i->wcam_name);
+    return 1;
+}
+
+
+/* One line of bars and one more period, every frame line is a copy of a
+ * part of it */
+static int pattern_init(struct Webcam_inst *i)
+{
+    const unsigned int n = i->width + PATTERN_PERIOD;
+    uint8_t y[2], u[2], v[2];
+    unsigned int x, bar;
+    uint8_t *p;
+
+    y[0] = YUV_601_Y(192, 0, 0);
+    u[0] = YUV_601_U(192, 0, 0);
+    v[0] = YUV_601_V(192, 0, 0);
+    y[1] = YUV_601_Y(0, 0, 192);
+    u[1] = YUV_601_U(0, 0, 192);
+    v[1] = YUV_601_V(0, 0, 192);
+
+    i->src_line = malloc(n * 2);
+    if( !i->src_line ) {
+        log_fatal("malloc(pattern line) [%m]");
+        return -1;
+    }
+
+    for( x = 0, p = i->src_line; x < n; x += 2, p += 4 ) {
+        bar = x / PATTERN_BAR % 2;
+        p[0] = y[bar];
+        p[1] = u[bar];
+        p[2] = y[bar];
+        p[3] = v[bar];
+    }
+
+    return 0;
+}
+
+
+/* Bars move right by 2 pixels a frame and lean by 1 pixel a line. The
+ * lines are memcpy()'ed, which streams them with the widest vector
+ * stores the CPU has */
+static void pattern_fill(struct Webcam_inst *i, uint8_t *dst)
+{
+    const size_t bpl = i->bytesperline;
+    unsigned int y, shift;
+
+    for( y = 0; y < (unsigned int)i->height; y++ ) {
+        shift = (unsigned int)(2 * i->src_frame + y) % PATTERN_PERIOD & ~1u;
+        memcpy(dst + y * bpl, i->src_line + PATTERN_PERIOD * 2 - shift * 2, bpl);
+    }
+}
+
+
+int source_init(struct Webcam_inst *i)
+{
+    size_t frame;
+    int n;
+
+    if( i->pixelformat && i->pixelformat != V4L2_PIX_FMT_YUYV ) {
+        log_fatal("'%s' gives YUYV frames only", i->wcam_name);
+        return -1;
+    }
+    i->pixelformat = V4L2_PIX_FMT_YUYV;
+    i->bytesperline = i->width * 2;
+    frame = (size_t)i->bytesperline * i->height;
+    i->sizeimage = frame;
+
+    if( i->source == WCAM_SRC_FILE && i->src_size % frame != 0 ) {
+        log_fatal("'%s': %zu bytes are no %dx%d YUYV frames", i->src_path,
+                  i->src_size, i->width, i->height);
+        return -1;
+    }
+
+    if( i->req_buffers < 2 || i->req_buffers > WCAM_MAX_BUFF )
+        i->req_buffers = REQ_BUFF;
+    i->buffers_n = i->req_buffers;
+    for( n = 0; n < i->buffers_n; n++ ) {
+        i->buffers[n].start = NULL;
+        i->buffers[n].length = frame;
+        i->buffers[n].bytesused = frame;
+        i->buffers[n].dmabuf_fd = -1;
+
+        if( i->source == WCAM_SRC_PATTERN &&
+            posix_memalign(&i->buffers[n].start, 64, frame) != 0 ) {
+            log_fatal("'%s': no memory for %zu byte frames", i->wcam_name, frame);
+            return -1;
+        }
+    }
+
+    if( i->source == WCAM_SRC_PATTERN && pattern_init(i) != 0 )
+        return -1;
+
+    if( i->source == WCAM_SRC_FILE )
+        log_info("Source '%s' gives YUYV %dx%d, %zu frame(s) in a loop", i->wcam_name,
+                 i->width, i->height, i->src_size / frame);
+    else
+        log_info("Source '%s' gives YUYV %dx%d", i->wcam_name, i->width, i->height);
+    return 0;
+}
+
+
+int source_start(struct Webcam_inst *i)
+{
+    struct itimerspec its;
+    long period_ns;
+
+    // All buffers are queued, like after QBUF of every one
+    i->src_queued = (1u << i->buffers_n) - 1;
+    i->src_next = 0;
+    i->src_frame = 0;
+
+    if( i->src_unpaced )
+        return 0;
+
+    period_ns = 1000000000L / (i->frame_rate > 0 ? i->frame_rate : 1);
+    MEMZERO(its);
+    its.it_interval.tv_sec = period_ns / 1000000000L;
+    its.it_interval.tv_nsec = period_ns % 1000000000L;
+    its.it_value = its.it_interval;
+
+    if( timerfd_settime(i->wcam_fd, 0, &its, NULL) != 0 ) {
+        log_fatal("'%s': timerfd_settime() [%m]", i->wcam_name);
+        return -1;
+    }
+
+    log_debug("Source '%s' started, %d fps", i->wcam_name, i->frame_rate);
+    return 0;
+}
+
+
+void source_stop(struct Webcam_inst *i)
+{
+    struct itimerspec its;
+
+    i->src_queued = 0;
+    if( i->src_unpaced )
+        return;
+
+    MEMZERO(its);
+    if( timerfd_settime(i->wcam_fd, 0, &its, NULL) != 0 )
+        log_fatal("'%s': timerfd_settime() [%m]", i->wcam_name);
+
+    log_info("Source '%s' stopped", i->wcam_name);
+}
+
+
+/* Returns 1 if no frame is due yet. Ticks missed by a late reader are
+ * frames lost, the file skips them too */
+int source_dequeue(struct Webcam_inst *i, unsigned int *index, uint64_t *ts_us)
+{
+    size_t frame = i->buffers[0].length;
+    uint64_t ticks;
+    unsigned int n;
+
+    if( !i->src_unpaced ) {
+        if( read(i->wcam_fd, &ticks, sizeof(ticks)) != sizeof(ticks) ) {
+            if( errno == EAGAIN )
+                return 1;
+
+            log_fatal("'%s': timerfd read [%m]", i->wcam_name);
+            return -1;
+        }
+        i->src_frame += ticks - 1;
+        i->lost_frames += ticks - 1;
+    }
+
+    for( n = 0; n < i->buffers_n; n++ )
+        if( i->src_queued & (1u << ((i->src_next + n) % i->buffers_n)) )
+            break;
+    if( n == i->buffers_n ) {
+        i->src_frame++;
+        i->lost_frames++;
+        log_debug("'%s': all buffers are taken, frame lost", i->wcam_name);
+        return 1;
+    }
+    n = (i->src_next + n) % i->buffers_n;
+    i->src_next = (n + 1) % i->buffers_n;
+    i->src_queued &= ~(1u << n);
+
+    if( i->source == WCAM_SRC_FILE )
+        i->buffers[n].start = (void *)(i->src_map +
+                                       i->src_frame % (i->src_size / frame) * frame);
+    else
+        pattern_fill(i, i->buffers[n].start);
+
+    i->src_frame++;
+    *index = n;
+    *ts_us = time_now_us();
+
+    return 0;
+}
+
+
+int source_queue(struct Webcam_inst *i, unsigned int index)
+{
+    if( index >= i->buffers_n || (i->src_queued & (1u << index)) ) {
+        log_fatal("'%s': bad buffer %u queued", i->wcam_name, index);
+        return -1;
+    }
+
+    i->src_queued |= 1u << index;
+    return 0;
+}
+
+
+void source_uninit(struct Webcam_inst *i)
+{
+    int n;
+
+    for( n = 0; n < i->buffers_n; n++ ) {
+        if( i->source == WCAM_SRC_PATTERN )
+            free(i->buffers[n].start);
+        i->buffers[n].start = NULL;
+    }
+    i->buffers_n = 0;
+
+    free(i->src_line);
+    i->src_line = NULL;
+}
+
+
+void source_close(struct Webcam_inst *i)
+{
+    if( i->wcam_fd < 0 && !i->src_map )
+        return;
+
+    if( i->wcam_fd >= 0 && close(i->wcam_fd) == -1 )
+        log_fatal("'%s': timer close [%m]", i->wcam_name);
+    i->wcam_fd = -1;
+
+    if( i->src_map )
+        munmap((void *)i->src_map, i->src_size);
+    i->src_map = NULL;
+    i->src_size = 0;
+
+    log_info("Source '%s' closed", i->wcam_name);
+}
@@ -0,0 +1,31 @@
+#ifndef INCLUDE_SOURCE_H
+#define INCLUDE_SOURCE_H
+
+#include <stdint.h>
+
+#include "webcam.h"
+
+/* Frames without a camera, behind the wcam_* calls: raw YUYV frames of a
+ * file played in a loop, or a moving test pattern. The frames come at
+ * frame_rate from a timerfd, which is wcam_fd for mainloop(). Unpaced,
+ * wcam_fd is always readable and a frame is there whenever one is asked
+ * for.
+ *
+ * File frames are not copied, the buffers point into the mapped file */
+
+
+int source_parse(struct Webcam_inst *i, const char *spec);
+
+int source_open(struct Webcam_inst *i);
+int source_enum_formats(struct Webcam_inst *i, uint32_t *fmts, int max);
+int source_init(struct Webcam_inst *i);
+int source_start(struct Webcam_inst *i);
+void source_stop(struct Webcam_inst *i);
+
+int source_dequeue(struct Webcam_inst *i, unsigned int *index, uint64_t *ts_us);
+int source_queue(struct Webcam_inst *i, unsigned int index);
+
+void source_uninit(struct Webcam_inst *i);
+void source_close(struct Webcam_inst *i);
+
+#endif /* INCLUDE_SOURCE_H */
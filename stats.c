@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "log.h"
+#include "stats.h"
+
+
+static unsigned int bucket_of(uint32_t v)
+{
+    unsigned int msb;
+
+    if( v < (1u << STATS_SUB_BITS) )
+        return v;
+
+    msb = 31 - __builtin_clz(v);
+    return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+           ((v >> (msb - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1));
+}
+
+
+// Largest value of the bucket
+static uint32_t bucket_top(unsigned int b)
+{
+    unsigned int shift, sub;
+
+    if( b < (1u << STATS_SUB_BITS) )
+        return b;
+
+    shift = (b >> STATS_SUB_BITS) - 1;
+    sub = b & ((1u << STATS_SUB_BITS) - 1);
+    return (((1u << STATS_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+
+void stats_add(struct Stats_hist *h, uint64_t us)
+{
+    uint32_t v = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+
+    h->bucket[bucket_of(v)]++;
+    h->count++;
+    h->sum += v;
+    if( v > h->max )
+        h->max = v;
+}
+
+
+/* Value 'pct' percent of the samples do not exceed */
+uint32_t stats_pct(const struct Stats_hist *h, unsigned int pct)
+{
+    uint64_t rank, seen = 0;
+    unsigned int b;
+    uint32_t top;
+
+    if( h->count == 0 )
+        return 0;
+
+    rank = ((uint64_t)h->count * pct + 99) / 100;
+    for( b = 0; b < STATS_BUCKETS; b++ ) {
+        seen += h->bucket[b];
+        if( seen >= rank && seen > 0 )
+            break;
+    }
+
+    top = bucket_top(b);
+    return top < h->max ? top : h->max;
+}
+
+
+void stats_log(const char *name, const struct Stats_hist *h)
+{
+    if( h->count == 0 )
+        return;
+
+    log_info("Latency %-17s p50 %6u, p95 %6u, p99 %6u, max %6u us (%u frames)",
+             name, stats_pct(h, 50), stats_pct(h, 95), stats_pct(h, 99),
+             h->max, h->count);
+}
+
+
+void stats_reset(struct Stats_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+
+/* Load since the previous call: 'sys_pct' of all cores together, 'self_pct'
+ * of one core like top shows it (above 100 with several threads).
+ * Returns 1 on the first call, there is nothing to compare with yet */
+int stats_cpu_load(struct Stats_cpu *c, unsigned int *sys_pct, unsigned int *self_pct)
+{
+    unsigned long long user, nice, sys, idle, iowait, irq, softirq, steal;
+    struct Stats_cpu now;
+    struct rusage ru;
+    FILE *f;
+    int n;
+
+    f = fopen("/proc/stat", "r");
+    if( !f ) {
+        log_warn("Can't read CPU load, /proc/stat [%m]");
+        return -1;
+    }
+    n = fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+               &user, &nice, &sys, &idle, &iowait, &irq, &softirq, &steal);
+    fclose(f);
+    if( n != 8 || getrusage(RUSAGE_SELF, &ru) != 0 )
+        return -1;
+
+    now.total = user + nice + sys + idle + iowait + irq + softirq + steal;
+    now.busy = now.total - idle - iowait;
+    now.self_us = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+                  ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+    now.wall_us = time_now_us();
+
+    *sys_pct = *self_pct = 0;
+    if( c->wall_us == 0 ) {
+        *c = now;
+        return 1;
+    }
+
+    if( now.total > c->total )
+        *sys_pct = (now.busy - c->busy) * 100 / (now.total - c->total);
+    if( now.wall_us > c->wall_us )
+        *self_pct = (now.self_us - c->self_us) * 100 / (now.wall_us - c->wall_us);
+
+    *c = now;
+    return 0;
+}
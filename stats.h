@@ -0,0 +1,39 @@
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+#include <stdint.h>
+
+/* Latency histogram in microseconds. Values below 8 have a bucket each,
+ * every power of two above is split into 8 buckets, so a percentile is
+ * off by 12.5% at most. Adding a value costs a few instructions and no
+ * memory, the histograms are read and reset with every stats report */
+#define STATS_SUB_BITS  3
+#define STATS_BUCKETS   ((32 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+
+struct Stats_hist {
+    uint32_t    count;
+    uint32_t    max;
+    uint64_t    sum;
+    uint32_t    bucket[STATS_BUCKETS];
+};
+
+
+void stats_add(struct Stats_hist *h, uint64_t us);
+uint32_t stats_pct(const struct Stats_hist *h, unsigned int pct);
+void stats_log(const char *name, const struct Stats_hist *h);
+void stats_reset(struct Stats_hist *h);
+
+
+/* CPU time of all cores (/proc/stat) and of this process, sampled with
+ * every stats report to tell drops under load from the others */
+struct Stats_cpu {
+    uint64_t    busy;       // clock ticks, all cores
+    uint64_t    total;
+    uint64_t    self_us;    // user + system time of the process
+    uint64_t    wall_us;
+};
+
+int stats_cpu_load(struct Stats_cpu *c, unsigned int *sys_pct, unsigned int *self_pct);
+
+#endif /* INCLUDE_STATS_H */
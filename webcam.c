@@ -5,7 +5,6 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
-#include <arm_neon.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -13,6 +12,9 @@
 #include <linux/videodev2.h>
 
 #include "webcam.h"
+#include "convert.h"
+#include "dmabuf.h"
+#include "source.h"
 #include "log.h"
 
 static int xioctl(int fh, int request, void *arg)
@@ -26,118 +28,51 @@ static int xioctl(int fh, int request, void *arg)
     return r;
 }
 
-int yuyv_to_nv12_neon(char *in_buff_ptr, size_t in_buff_sz,
-                      char *out_buff_ptr, size_t out_buff_sz,
-                      uint16_t width, uint16_t height)
+static int process_image(struct Webcam_inst* i, uint32_t indx)
 {
-    // Sanity checks first
-    {
-        if (width % 4 != 0) {
-            log_fatal("Frame width must be a multiple of 4!");
-            return -1;
-        }
-        if (height % 2 != 0) {
-            log_fatal("Frame height must be a multiple of 2!");
-            return -1;
-        }
-
-        u_int8_t macropix = 8;
-        uint32_t n_macro_pix = width * height / macropix;
-
-        uint8_t mpix422_sz = 16;
-        uint32_t YCrCb_422_sz = n_macro_pix * mpix422_sz;
-        if (in_buff_sz != YCrCb_422_sz) {
-            log_fatal("Input buffer size must be exactly %d bytes", YCrCb_422_sz);
-            return -1;
-        }
-
-        uint8_t mpix420_sz = 12;
-        uint32_t YCrCb_420_sz = n_macro_pix * mpix420_sz;
-        if (out_buff_sz < YCrCb_420_sz) {
-            log_fatal("Output buffer size must be at least %d bytes", YCrCb_420_sz);
-            return -1;
-        }
-    }
-
-    // Main converter body
-    int line_n, chunk_n;
-
-    uint8_t *Y_plane_start = (uint8_t*)out_buff_ptr;
-    size_t Y_offset = 0;
-    uint8_t *CbCr_plane_start = (uint8_t*)(out_buff_ptr + width * height);
-    size_t CbCr_offset = 0;
-
-    size_t in_buff_offset = 0;
-
-    int yuyv_line_len = (width / 2) * 4;
-    uint8x16x2_t chunk_128x2;
-
-
-    for( line_n = 0; line_n < height; line_n++ ) {
-        for( chunk_n = 0; chunk_n < yuyv_line_len / 32 ; chunk_n++)
-        {
-            in_buff_offset = yuyv_line_len * line_n + 32 * chunk_n;
-            chunk_128x2 = vld2q_u8( (uint8_t*)in_buff_ptr + in_buff_offset);
-
-            vst1q_u8(Y_plane_start + Y_offset, chunk_128x2.val[0]);
-            Y_offset += 16;
-
-            if( line_n % 2 == 0 ) {
-                vst1q_u8(CbCr_plane_start + CbCr_offset, chunk_128x2.val[1]);
-                CbCr_offset += 16;
-            }
-
-        }
-
-        if( yuyv_line_len % 32 != 0 ) {
-            uint8_t bytes_left = yuyv_line_len % 32;
-            in_buff_offset += 32;
-
-            for( uint8_t iter = 0; iter < bytes_left; iter += 4 ) {
-
-                Y_plane_start[Y_offset] = in_buff_ptr[in_buff_offset + 0];
-                Y_offset++;
+    struct Conv_layout layout;
+    int ret;
 
-                Y_plane_start[Y_offset] = in_buff_ptr[in_buff_offset + 2];
-                Y_offset++;
+    conv_layout_packed(&layout, i->width, i->height);
+    layout.src_stride = i->bytesperline;
 
-                if (line_n % 2 == 0) {
-                    CbCr_plane_start[CbCr_offset] = in_buff_ptr[in_buff_offset + 1];
-                    CbCr_offset++;
-                    CbCr_plane_start[CbCr_offset] = in_buff_ptr[in_buff_offset + 3];
-                    CbCr_offset++;
-                }
+    ret = conv_frame(conv_isa(), CONV_CHROMA_AVG, &layout,
+            i->buffers[indx].start, i->buffers[indx].length,
+            i->nv12_buff.start, i->nv12_buff.length);
+    if( ret != 0 )
+        return -1;
 
-                in_buff_offset += 4;
-            }
-        }
+    fflush(stderr);
+    fprintf(stderr, ".");
+    fflush(stdout);
 
-    }
-/*
-    dbg("Total lines in picture = %d", line_n);
-    dbg("Y' plane start pos: 0, end pos: %d [0x%x]", Y_offset - 1, Y_offset - 1);
-    dbg("CbCr plane start pos: %d, end pos: %d [0x%x]",
-        width * height, width * height + CbCr_offset - 1,
-        width * height + CbCr_offset - 1);
-*/
     return 0;
 }
 
 
-static int process_image(struct Webcam_inst* i, uint32_t indx)
+/* Gaps in buf.sequence are frames the driver has dropped. A frame
+ * shorter than sizeimage or flagged as corrupted would be encoded torn:
+ * returns 1, the caller gives the buffer back instead */
+static int check_frame(struct Webcam_inst *i, const struct v4l2_buffer *buf)
 {
-    int ret;
-
-    ret = yuyv_to_nv12_neon(i->buffers[indx].start,
-            i->buffers[indx].length,
-            i->nv12_buff.start, i->nv12_buff.length,
-            i->width, i->height);
-    if( ret != 0 )
-        return -1;
+    unsigned int min = i->pixelformat == V4L2_PIX_FMT_MJPEG ? 1 : i->sizeimage;
 
-    fflush(stderr);
-    fprintf(stderr, ".");
-    fflush(stdout);
+    // A sequence going back is a restarted driver counter, not a gap
+    if( i->seq_valid && (int32_t)(buf->sequence - i->seq_next) > 0 ) {
+        i->lost_frames += buf->sequence - i->seq_next;
+        log_debug("'%s': %u frame(s) lost before #%u", i->wcam_name,
+                  buf->sequence - i->seq_next, buf->sequence);
+    }
+    i->seq_next = buf->sequence + 1;
+    i->seq_valid = 1;
+
+    if( (buf->flags & V4L2_BUF_FLAG_ERROR) || buf->bytesused < min ) {
+        i->short_frames++;
+        log_debug("'%s': frame #%u has %u of %u bytes%s, dropped", i->wcam_name,
+                  buf->sequence, buf->bytesused, i->sizeimage,
+                  buf->flags & V4L2_BUF_FLAG_ERROR ? " (error)" : "");
+        return 1;
+    }
 
     return 0;
 }
@@ -171,14 +106,17 @@ int wcam_process_new_frame(struct Webcam_inst* i)
 
     assert(buf.index < i->buffers_n);
 
-    // По идее, buf.bytesused должно быть равно i->buffers[buf.index].length
+    // По идее, buf.bytesused должно быть равно sizeimage
     // если же buf.bytesused меньше , то это говорит о том, что вебкамера не смогла
-    // заполнить весь буфер целиком и картинка начнет "рваться"
-    //i->buffers[buf.index].bytesused = buf.bytesused;
+    // заполнить весь буфер целиком и картинка начнет "рваться". Такие кадры
+    // пропускаются
+    i->buffers[buf.index].bytesused = buf.bytesused;
 
-    ret = process_image(i, buf.index);
-    if( ret == -1 )
-        return -1;
+    if( check_frame(i, &buf) == 0 ) {
+        ret = process_image(i, buf.index);
+        if( ret == -1 )
+            return -1;
+    }
 
     if( xioctl(i->wcam_fd, VIDIOC_QBUF, &buf) == -1 ){
         log_fatal("ioctl(VIDIOC_QBUF)");
@@ -188,8 +126,11 @@ int wcam_process_new_frame(struct Webcam_inst* i)
     return 0;
 }
 
-int wcam_dequeue_buf(struct Webcam_inst *i, unsigned int *index){
-    int ret;
+/* Returns 1 if no frame is ready yet (EAGAIN), 2 if the frame was torn
+ * and went back to the camera */
+static int dequeue_one(struct Webcam_inst *i, unsigned int *index, uint64_t *ts_us){
+    if( i->source != WCAM_SRC_DEVICE )
+        return source_dequeue(i, index, ts_us);
 
     struct v4l2_buffer buf;
     MEMZERO(buf);
@@ -200,7 +141,7 @@ int wcam_dequeue_buf(struct Webcam_inst *i, unsigned int *index){
     if( xioctl(i->wcam_fd, VIDIOC_DQBUF, &buf) == -1 ) {
         switch (errno) {
             case EAGAIN:
-                return 0;
+                return 1;
 
             case EIO:
                 /* Could ignore EIO, see spec. */
@@ -215,6 +156,60 @@ int wcam_dequeue_buf(struct Webcam_inst *i, unsigned int *index){
 
     assert(buf.index < i->buffers_n);
     *index = buf.index;
+    i->buffers[buf.index].bytesused = buf.bytesused;
+
+    if( check_frame(i, &buf) != 0 ) {
+        if( xioctl(i->wcam_fd, VIDIOC_QBUF, &buf) == -1 ) {
+            log_fatal("ioctl(VIDIOC_QBUF) [%m]");
+            return -1;
+        }
+        return 2;
+    }
+
+    // Drivers stamp frames with CLOCK_MONOTONIC, otherwise take our own time
+    if( (buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC )
+        *ts_us = (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    else
+        *ts_us = time_now_us();
+
+    return 0;
+}
+
+/* With 'latest' every frame that is ready is taken, the older ones go
+ * back to the camera at once and only the newest is given out. A late
+ * reader catches up with the camera instead of working off its ring.
+ * Unpaced sources always have a frame, the first one is the newest */
+int wcam_dequeue_buf(struct Webcam_inst *i, unsigned int *index, uint64_t *ts_us){
+    unsigned int next, n;
+    uint64_t next_ts;
+    int ret = 1;
+
+    // A torn frame is already back in the ring, a newer one may be ready
+    for( n = 0; n < i->buffers_n; n++ ) {
+        ret = dequeue_one(i, index, ts_us);
+        if( ret != 2 )
+            break;
+    }
+    if( ret == 2 )
+        return 1;
+    if( ret != 0 || !i->latest || i->src_unpaced )
+        return ret;
+
+    for( n = 1; n < i->buffers_n; n++ ) {
+        ret = dequeue_one(i, &next, &next_ts);
+        if( ret == -1 )
+            return -1;
+        if( ret == 1 )
+            break;
+        if( ret == 2 )
+            continue;
+
+        if( wcam_queue_buf(i, *index) != 0 )
+            return -1;
+        *index = next;
+        *ts_us = next_ts;
+        i->stale_frames++;
+    }
 
     return 0;
 }
@@ -222,6 +217,9 @@ int wcam_dequeue_buf(struct Webcam_inst *i, unsigned int *index){
 int wcam_queue_buf(struct Webcam_inst *i, unsigned int index){
     int ret;
 
+    if( i->source != WCAM_SRC_DEVICE )
+        return source_queue(i, index);
+
     struct v4l2_buffer buf;
     MEMZERO(buf);
 
@@ -286,6 +284,10 @@ int wcam_start_capturing(struct Webcam_inst* i)
     int iter;
     enum v4l2_buf_type type;
 
+    i->seq_valid = 0;
+    if( i->source != WCAM_SRC_DEVICE )
+        return source_start(i);
+
     for( iter = 0; iter < i->buffers_n; iter++ ) {
         struct v4l2_buffer buf;
 
@@ -312,18 +314,18 @@ int wcam_start_capturing(struct Webcam_inst* i)
 
 
 static int init_nv12_buff(struct Webcam_inst* i) {
-    // Размер картинки по ширине должен быть кратен 4
-    // Размер картинки по высоте должен быть кратен 2
+    // Размер картинки по ширине и по высоте должен быть кратен 2,
+    // значит width * height кратно 4, но не всегда кратно MACROPIX
 
-    uint32_t n_macro_pix = i->width * i->height / MACROPIX;
+    uint32_t n_pix = i->width * i->height;
 
-    uint32_t YCrCb_444 = n_macro_pix * MPIX444_SZ;
+    uint32_t YCrCb_444 = n_pix * MPIX444_SZ / MACROPIX;
     //info("YCrCb 4:4:4 picture size = %d bytes", YCrCb_444);
 
-    //uint32_t YCrCb_422 = n_macro_pix * MPIX422_SZ;
+    //uint32_t YCrCb_422 = n_pix * MPIX422_SZ / MACROPIX;
     //info("YCrCb 4:2:2 picture size = %d bytes", YCrCb_422);
 
-    uint32_t YCrCb_420_sz = n_macro_pix * MPIX420_SZ;
+    uint32_t YCrCb_420_sz = n_pix * MPIX420_SZ / MACROPIX;
     log_info("YCrCb 4:2:0 picture size = %d bytes", YCrCb_420_sz);
 
 
@@ -344,7 +346,10 @@ static int init_mmap(struct Webcam_inst* i) {
 
     MEMZERO(reqbuf);
 
-    reqbuf.count = REQ_BUFF;
+    if( i->req_buffers < 2 || i->req_buffers > WCAM_MAX_BUFF )
+        i->req_buffers = REQ_BUFF;
+
+    reqbuf.count = i->req_buffers;
     reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     reqbuf.memory = V4L2_MEMORY_MMAP;
 
@@ -371,7 +376,11 @@ static int init_mmap(struct Webcam_inst* i) {
     }
     */
 
+    if( reqbuf.count > WCAM_MAX_BUFF )
+        reqbuf.count = WCAM_MAX_BUFF;
     i->buffers_n = reqbuf.count;
+    log_info("'%s' has %d buffers (requested %d)", i->wcam_name,
+             i->buffers_n, i->req_buffers);
     int iter;
 
     struct v4l2_buffer buff;
@@ -399,6 +408,11 @@ static int init_mmap(struct Webcam_inst* i) {
             log_fatal("mmap()");
             return -1;
         }
+
+        i->buffers[iter].dmabuf_fd = -1;
+        if( i->dma_sync )
+            i->buffers[iter].dmabuf_fd = dmabuf_export(i->wcam_fd,
+                                                       V4L2_BUF_TYPE_VIDEO_CAPTURE, iter);
         //info("Webcam buffers[%d].length = %d", iter, buff.length);
     }
     log_debug("Webcam device '%s' buffers mmap() successfull", i->wcam_name);
@@ -411,6 +425,33 @@ static int init_mmap(struct Webcam_inst* i) {
 }
 
 
+/* Pixel formats the camera offers, in the driver's order of preference.
+ * Returns their number */
+int wcam_enum_formats(struct Webcam_inst* i, uint32_t *fmts, int max)
+{
+    struct v4l2_fmtdesc desc;
+    int n;
+
+    if( i->source != WCAM_SRC_DEVICE )
+        return source_enum_formats(i, fmts, max);
+
+    for( n = 0; n < max; n++ ) {
+        MEMZERO(desc);
+        desc.index = n;
+        desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+        if( xioctl(i->wcam_fd, VIDIOC_ENUM_FMT, &desc) != 0 )
+            break;
+
+        fmts[n] = desc.pixelformat;
+        log_debug("'%s' offers %.4s (%s)", i->wcam_name,
+                  (char *)&desc.pixelformat, desc.description);
+    }
+
+    return n;
+}
+
+
 int wcam_init(struct Webcam_inst* i)
 {
     struct v4l2_capability cap;
@@ -419,8 +460,15 @@ int wcam_init(struct Webcam_inst* i)
     struct v4l2_format fmt;
     struct v4l2_streamparm streamparm;
     unsigned int min;
+    int planar;
     int ret;
 
+    if( i->source != WCAM_SRC_DEVICE )
+        return source_init(i);
+
+    if( !i->pixelformat )
+        i->pixelformat = V4L2_PIX_FMT_YUYV;
+
     if( xioctl(i->wcam_fd, VIDIOC_QUERYCAP, &cap) != 0 ) {
         log_fatal("'%s' is not V4L2 device", i->wcam_name);
         return -1;
@@ -472,7 +520,7 @@ int wcam_init(struct Webcam_inst* i)
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     fmt.fmt.pix.width       = i->width;
     fmt.fmt.pix.height      = i->height;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+    fmt.fmt.pix.pixelformat = i->pixelformat;
     fmt.fmt.pix.field       = V4L2_FIELD_INTERLACED;
 
     if( xioctl(i->wcam_fd, VIDIOC_S_FMT, &fmt) != 0 ) {
@@ -480,15 +528,38 @@ int wcam_init(struct Webcam_inst* i)
                 i->wcam_name, i->width, i->height);
         return -1;
     }
+    if( fmt.fmt.pix.pixelformat != i->pixelformat ) {
+        log_fatal("'%s' can not capture %.4s", i->wcam_name,
+                  (char *)&i->pixelformat);
+        return -1;
+    }
 
 
-    /* Buggy driver paranoia. */
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min)
-        fmt.fmt.pix.bytesperline = min;
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min)
-        fmt.fmt.pix.sizeimage = min;
+    /* Buggy driver paranoia. Compressed frames have no lines */
+    planar = i->pixelformat == V4L2_PIX_FMT_NV12 ||
+             i->pixelformat == V4L2_PIX_FMT_YUV420;
+    if( i->pixelformat != V4L2_PIX_FMT_MJPEG ) {
+        min = planar ? fmt.fmt.pix.width : fmt.fmt.pix.width * 2;
+        if (fmt.fmt.pix.bytesperline < min)
+            fmt.fmt.pix.bytesperline = min;
+        min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
+        if( planar )
+            min += min / 2;
+        if (fmt.fmt.pix.sizeimage < min)
+            fmt.fmt.pix.sizeimage = min;
+    }
+
+    if( fmt.fmt.pix.width != (unsigned int)i->width ||
+        fmt.fmt.pix.height != (unsigned int)i->height ) {
+        log_fatal("'%s' offers %ux%u instead of %dx%d", i->wcam_name,
+                  fmt.fmt.pix.width, fmt.fmt.pix.height, i->width, i->height);
+        return -1;
+    }
+    i->bytesperline = fmt.fmt.pix.bytesperline;
+    i->sizeimage = fmt.fmt.pix.sizeimage;
+    log_info("'%s' format %.4s %ux%u, bpl %u, sizeimage %u", i->wcam_name,
+             (char *)&fmt.fmt.pix.pixelformat, fmt.fmt.pix.width, fmt.fmt.pix.height,
+             fmt.fmt.pix.bytesperline, fmt.fmt.pix.sizeimage);
 
 
     // Set framerate
@@ -520,6 +591,9 @@ int wcam_init(struct Webcam_inst* i)
 int wcam_open(struct Webcam_inst* i) {
     struct stat st;
 
+    if( i->source != WCAM_SRC_DEVICE )
+        return source_open(i);
+
     i->wcam_fd = open(i->wcam_name, O_RDWR | O_NONBLOCK, 0);
     if( i->wcam_fd < 0 ) {
         log_fatal("Can not open Webcam device'%s'", i->wcam_name);
@@ -544,6 +618,11 @@ void wcam_stop_capturing(struct Webcam_inst* i)
 {
     enum v4l2_buf_type type;
 
+    if( i->source != WCAM_SRC_DEVICE ) {
+        source_stop(i);
+        return;
+    }
+
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if( xioctl(i->wcam_fd, VIDIOC_STREAMOFF, &type) == -1 ) {
         log_fatal("'%s': ioctl(VIDIOC_STREAMOFF)", i->wcam_name);
@@ -555,18 +634,36 @@ void wcam_stop_capturing(struct Webcam_inst* i)
 void wcam_uninit(struct Webcam_inst* i) {
     int iter;
 
+    if( i->source != WCAM_SRC_DEVICE ) {
+        source_uninit(i);
+        return;
+    }
+
     for (iter = 0; iter < i->buffers_n; iter++ ) {
+        dmabuf_close(&i->buffers[iter].dmabuf_fd);
         if( munmap(i->buffers[iter].start, i->buffers[iter].length) == -1 )
             log_fatal("'%s': munmap", i->wcam_name);
     }
 
+    i->buffers_n = 0;
+
     free(i->nv12_buff.start);
+    i->nv12_buff.start = NULL;
 }
 
 void wcam_close(struct Webcam_inst* i)
 {
+    if( i->source != WCAM_SRC_DEVICE ) {
+        source_close(i);
+        return;
+    }
+
+    if( i->wcam_fd < 0 )
+        return;
+
     if( close(i->wcam_fd) == -1 )
         log_fatal("'%s': webcam close", i->wcam_name);
+    i->wcam_fd = -1;
 
     log_info("Webcam closed successful");
 }
\ No newline at end of file
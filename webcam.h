@@ -7,20 +7,28 @@
 
 #include "common.h"
 
-#define REQ_BUFF  2
+#define REQ_BUFF       2       // camera buffers by default
+#define WCAM_MAX_BUFF  10
 
 #define MACROPIX       8
 #define MPIX444_SZ    24
 #define MPIX422_SZ    16
 #define MPIX420_SZ    12
 
+// Where the frames come from, see source.h
+#define WCAM_SRC_DEVICE   0   // V4L2 capture device wcam_name
+#define WCAM_SRC_FILE     1   // YUYV frames of src_path, in a loop
+#define WCAM_SRC_PATTERN  2   // moving test pattern
+
 
 struct Webcam_inst {
     char             wcam_name[128];
     int              wcam_fd;
     int              get_info;
-    struct Buffer    buffers[10];
+    struct Buffer    buffers[WCAM_MAX_BUFF];
     uint8_t          buffers_n;
+    int              req_buffers;    // camera buffers asked for, REQ_BUFF by default
+    int              latest;         // drain ready frames, give out the newest only
 
     struct Buffer    nv12_buff;
 
@@ -28,10 +36,37 @@ struct Webcam_inst {
     int              height;
     int              frame_rate;
     int              frame_count;
+    uint32_t         pixelformat;    // V4L2_PIX_FMT_*, 0 - YUYV
+    char             mjpeg_dec[128]; // capture MJPEG with this decoder, see mjpeg.h
+    unsigned int     bytesperline;   // line (luma line) stride set by the driver
+    unsigned int     sizeimage;      // bytes of a whole frame, shorter ones are torn
+    int              conv_isa;       // CONV_ISA_*, see convert.h
+    int              conv_threads;   // conversion threads, 0 - one per core
+    int              conv_scale;     // CONV_SCALE_*, when Coda encodes another size
+    int              conv_staged;    // CONV_WRITE_STAGED into Coda's buffers
+    int              dma_sync;       // export the buffers, sync CPU reads, see dmabuf.h
+
+    int              source;         // WCAM_SRC_*
+    char             src_path[128];  // WCAM_SRC_FILE frames
+    int              src_unpaced;    // no frame_rate, a frame whenever one is taken
+    const uint8_t   *src_map;        // the whole file, mapped
+    size_t           src_size;
+    uint8_t         *src_line;       // WCAM_SRC_PATTERN line the frames are cut from
+    uint32_t         src_queued;     // bit per buffer given back by wcam_queue_buf()
+    unsigned int     src_next;       // buffer to give out next
+    uint64_t         src_frame;      // frames given out and lost since start
+
+    // Frame checks, counted up to the next stats report
+    uint32_t         seq_next;       // buf.sequence expected next
+    int              seq_valid;
+    uint32_t         lost_frames;    // sequence gaps, frames the camera has dropped
+    uint32_t         short_frames;   // partly filled or corrupted, not encoded
+    uint32_t         stale_frames;   // older ready frames skipped for a newer one
 };
 
 
 int wcam_open(struct Webcam_inst* wcam_i);
+int wcam_enum_formats(struct Webcam_inst* wcam_i, uint32_t *fmts, int max);
 int wcam_init(struct Webcam_inst* wcam_i);
 
 int wcam_process_new_frame(struct Webcam_inst* i);
@@ -40,13 +75,9 @@ int wcam_start_capturing(struct Webcam_inst* i);
 void wcam_stop_capturing(struct Webcam_inst* i);
 
 int wcam_queue_buf(struct Webcam_inst *i, unsigned int index);
-int wcam_dequeue_buf(struct Webcam_inst *i, unsigned int *index);
+int wcam_dequeue_buf(struct Webcam_inst *i, unsigned int *index, uint64_t *ts_us);
 
 void wcam_uninit(struct Webcam_inst* i);
 void wcam_close(struct Webcam_inst* i);
 
-int yuyv_to_nv12_neon(char *in_buff_ptr, size_t in_buff_sz,
-                      char *out_buff_ptr, size_t out_buff_sz,
-                      uint16_t width, uint16_t height);
-
 #endif /* INCLUDE_WEBCAM_H */
\ No newline at end of file